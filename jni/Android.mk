@@ -10,20 +10,37 @@ PKG_CONFIG ?= pkg-config
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := suinput
-LOCAL_SRC_FILES := suinput.c
+LOCAL_SRC_FILES := suinput.c \
+				   suinput_sink.c
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := platform
 LOCAL_STATIC_LIBRARIES := libsuinput
-LOCAL_SRC_FILES := android.c
+LOCAL_SRC_FILES := android.c \
+				   transport.c \
+				   capture.c \
+				   ioengine.c
+# TLS transport, needs prebuilt OpenSSL modules named ssl and crypto
+ifeq ($(USYNERGY_TLS),1)
+LOCAL_CFLAGS += -DUSYNERGY_WITH_TLS
+LOCAL_SRC_FILES += tls.c
+LOCAL_STATIC_LIBRARIES += ssl crypto
+endif
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := micro
 LOCAL_EXPORT_LDLIBS := -llog# -lpthread
 LOCAL_STATIC_LIBRARIES := libplatform
-LOCAL_SRC_FILES := uSynergy.c
+LOCAL_SRC_FILES := uSynergy.c \
+				   cliptext.c \
+				   bmp.c \
+				   histogram.c \
+				   stats.c
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_ARM_NEON := true
+endif
 include $(BUILD_STATIC_LIBRARY)
 
 
@@ -33,6 +50,68 @@ LOCAL_STATIC_LIBRARIES := libmicro
 LOCAL_SRC_FILES := uSynergyUnix.c
 include $(BUILD_EXECUTABLE)
 
+# Clipboard text kernel benchmark, scalar against SIMD
+include $(CLEAR_VARS)
+LOCAL_MODULE := cliptextbench
+LOCAL_STATIC_LIBRARIES := libmicro
+LOCAL_SRC_FILES := bench/cliptext_bench.c
+include $(BUILD_EXECUTABLE)
+
+# Allocation guard, fails when the client uses the heap between enter and
+# leave; the wrapped allocator is what it counts
+include $(CLEAR_VARS)
+LOCAL_MODULE := allocguard
+LOCAL_STATIC_LIBRARIES := libmicro
+LOCAL_SRC_FILES := bench/alloc_guard.c
+LOCAL_LDFLAGS := -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := stopbench
+LOCAL_STATIC_LIBRARIES := libmicro
+LOCAL_SRC_FILES := bench/stop_bench.c
+include $(BUILD_EXECUTABLE)
+
+# Capture replay throughput, fails when the replies differ from the capture
+include $(CLEAR_VARS)
+LOCAL_MODULE := replaybench
+LOCAL_STATIC_LIBRARIES := libmicro
+LOCAL_SRC_FILES := bench/replay_bench.c
+include $(BUILD_EXECUTABLE)
+
+# Stand-in server driving workloads and timing the replies, needs only the
+# histograms from libmicro
+include $(CLEAR_VARS)
+LOCAL_MODULE := fakeserver
+LOCAL_STATIC_LIBRARIES := libmicro
+LOCAL_SRC_FILES := bench/fake_server.c
+include $(BUILD_EXECUTABLE)
+
+# Device writes per event with batching and io_uring, devices go to the
+# recording sink and the events are checked against evdev semantics
+include $(CLEAR_VARS)
+LOCAL_MODULE := injectbench
+LOCAL_STATIC_LIBRARIES := libmicro
+LOCAL_SRC_FILES := bench/inject_bench.c
+include $(BUILD_EXECUTABLE)
+
+# Microbenchmarks of framing, dispatch, decoding, replies and injection. The
+# source compiles uSynergy.c in itself for its statics, so the archive's copy
+# is never pulled in
+include $(CLEAR_VARS)
+LOCAL_MODULE := microbench
+LOCAL_STATIC_LIBRARIES := libmicro
+LOCAL_SRC_FILES := bench/micro_bench.c
+LOCAL_LDLIBS += -lm
+include $(BUILD_EXECUTABLE)
+
+# Time to first event and the startup phases, against the stand-in server
+include $(CLEAR_VARS)
+LOCAL_MODULE := startupbench
+LOCAL_STATIC_LIBRARIES := libmicro
+LOCAL_SRC_FILES := bench/startup_bench.c
+include $(BUILD_EXECUTABLE)
+
 include $(CLEAR_VARS)
 LOCAL_MODULE := usynercore
 LOCAL_STATIC_LIBRARIES := libmicro
@@ -1,11 +1,13 @@
 #include <jni.h>
 #include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #include "uSynergy.h"
+#include "android.h"
+#include "cliptext.h"
 #include "log.h"
 
-extern uSynergyContext uSynergyLinuxContext;
-
 
 char* jstringTostring(JNIEnv* env, jstring jstr){
 	char* rtn = NULL;
@@ -34,6 +36,39 @@ jstring stoJstring(JNIEnv* env, const char* pat){
 	return (jstring)(*env)->NewObject(env,strClass, ctorID, bytes, encoding);
 }
 
+/*
+ * Clipboard buffers lent to Java, mapped back to their clipboard handle
+ * when Java releases them
+ */
+typedef struct ClipboardLoan {
+	const void *address;
+	void *handle;
+	struct ClipboardLoan *next;
+} ClipboardLoan;
+
+static ClipboardLoan *clipboardLoans = NULL;
+static pthread_mutex_t clipboardLoanMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Every service object owns one context, kept in its nativeHandle field
+ */
+static jfieldID getHandleField(JNIEnv *env, jobject thiz)
+{
+	jclass cls = (*env)->GetObjectClass(env, thiz);
+	return (*env)->GetFieldID(env, cls, "nativeHandle", "J");
+}
+
+static uSynergyContext *getContext(JNIEnv *env, jobject thiz)
+{
+	return (uSynergyContext *)(intptr_t)(*env)->GetLongField(env, thiz,
+		getHandleField(env, thiz));
+}
+
+static void setContext(JNIEnv *env, jobject thiz, uSynergyContext *context)
+{
+	(*env)->SetLongField(env, thiz, getHandleField(env, thiz),
+		(jlong)(intptr_t)context);
+}
 
 /*
  * init() Initialization
@@ -44,17 +79,140 @@ jint Java_io_brotherhood_usynergy_service_UsynergyService_init(JNIEnv *env, jobj
     int m_Width = width;
 	int m_Height = hight;
 	char* name = jstringTostring(env,screenName);
+	uSynergyContext *context;
+	if (name == NULL)
+		return 1;
 	LOGI("init = %s:%d*%d",name, m_Height, m_Width);
 
-	uSynergyInit(&uSynergyLinuxContext,name , m_Height, m_Width);
+	/* A running context is in use by start(), shutdown() it first */
+	context = getContext(env, thiz);
+	if (context != NULL && uSynergyIsRunning(context)) {
+		LOGW("init: client is running, call shutdown() first");
+		free(name);
+		return 1;
+	}
+	uSynergyDestroy(context);
+	context = uSynergyCreate(&uSynergyAndroidPlatform, name, m_Height, m_Width,
+		NULL);
+	free(name);
+	setContext(env, thiz, context);
+	return context == NULL;
 }
 /**
  * getclipBoard Text
  * jstring clipboard Text
  */
 jstring Java_io_brotherhood_usynergy_service_UsynergyService_getClipBoardText(JNIEnv *env,jobject thiz){
+	uint32_t size;
+	void *handle;
+	const uint8_t *text;
+	jchar *utf16;
+	jstring result = NULL;
+
+	uSynergyContext *context = getContext(env, thiz);
+
+	if (context == NULL)
+		return NULL;
+	text = uSynergyAcquireClipboard(context,
+		USYNERGY_CLIPBOARD_FORMAT_TEXT, &size, &handle);
+	if (text == NULL)
+		return NULL;
+	/* A UTF-16 string never has more units than the UTF-8 has bytes */
+	utf16 = malloc(size * sizeof(jchar) + 1);
+	if (utf16 != NULL) {
+		result = (*env)->NewString(env, utf16,
+			uSynergyText->m_utf8ToUtf16(text, size, utf16));
+		free(utf16);
+	}
+	uSynergyReleaseClipboard(handle);
+	return result;
+}
+
+/*
+ * nativeGetClipboard() Clipboard format as a direct ByteBuffer over native
+ * memory. getClipboard() hands Java a read-only view of it, which must be
+ * given back through releaseClipboard() and not touched afterwards.
+ * jobject ByteBuffer, null if the format is not on the clipboard
+ */
+jobject Java_io_brotherhood_usynergy_service_UsynergyService_nativeGetClipboard(JNIEnv *env,jobject thiz,jint format)
+{
+	uint32_t size;
+	void *handle;
+	const uint8_t *data;
+	ClipboardLoan *loan;
+	jobject buffer;
 
-//	return null;
+	uSynergyContext *context = getContext(env, thiz);
+
+	if (context == NULL)
+		return NULL;
+	data = uSynergyAcquireClipboard(context, format, &size, &handle);
+	if (data == NULL)
+		return NULL;
+	loan = malloc(sizeof(ClipboardLoan));
+	buffer = loan ? (*env)->NewDirectByteBuffer(env, (void *)data, size) : NULL;
+	if (buffer == NULL) {
+		free(loan);
+		uSynergyReleaseClipboard(handle);
+		return NULL;
+	}
+
+	loan->address = data;
+	loan->handle = handle;
+	pthread_mutex_lock(&clipboardLoanMutex);
+	loan->next = clipboardLoans;
+	clipboardLoans = loan;
+	pthread_mutex_unlock(&clipboardLoanMutex);
+	return buffer;
+}
+
+/*
+ * releaseClipboard() Return a buffer obtained from getClipboard()
+ */
+void Java_io_brotherhood_usynergy_service_UsynergyService_releaseClipboard(JNIEnv *env,jobject thiz,jobject buffer)
+{
+	const void *address;
+	ClipboardLoan **link, *loan = NULL;
+
+	if (buffer == NULL)
+		return;
+	address = (*env)->GetDirectBufferAddress(env, buffer);
+	pthread_mutex_lock(&clipboardLoanMutex);
+	for (link = &clipboardLoans; *link; link = &(*link)->next) {
+		if ((*link)->address == address) {
+			loan = *link;
+			*link = loan->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&clipboardLoanMutex);
+	if (loan == NULL) {
+		LOGW("releaseClipboard: unknown buffer");
+		return;
+	}
+	uSynergyReleaseClipboard(loan->handle);
+	free(loan);
+}
+
+/*
+ * sendClipboard() Put the first length bytes of a direct ByteBuffer on the
+ * server clipboard
+ * jint  0:success 1:faild
+ */
+jint Java_io_brotherhood_usynergy_service_UsynergyService_sendClipboard(JNIEnv *env,jobject thiz,jobject buffer,jint length,jint format)
+{
+	const uint8_t *data = NULL;
+	uSynergyContext *context = getContext(env, thiz);
+
+	if (context == NULL)
+		return 1;
+	if (buffer != NULL)
+		data = (*env)->GetDirectBufferAddress(env, buffer);
+	if (data == NULL || length < 0
+		|| length > (*env)->GetDirectBufferCapacity(env, buffer))
+		return 1;
+	uSynergySendClipboardData(context, format, data, length);
+	return 0;
 }
 
 /*
@@ -64,12 +222,103 @@ jstring Java_io_brotherhood_usynergy_service_UsynergyService_getClipBoardText(JN
 jint Java_io_brotherhood_usynergy_service_UsynergyService_start(JNIEnv *env, jobject thiz,jstring ip,jint port)
 {
 	char* ipStr;
-	ipStr = malloc(strlen(jstringTostring(env,ip)) + 1);
+	char* addr;
+	uSynergyContext *context = getContext(env, thiz);
+
+	if (context == NULL || uSynergyIsRunning(context))
+		return 1;
+	addr = jstringTostring(env,ip);
+	if (addr == NULL)
+		return 1;
+	/* Reuse the cookie's buffer, restarts must not grow the arena */
+	ipStr = context->m_cookie->addr_buffer;
+	if (strlen(addr) >= USYNERGY_ADDRESS_SIZE) {
+		LOGE("start: address too long");
+		free(addr);
+		return 1;
+	}
+	strcpy(ipStr, addr);
+	free(addr);
 
-	uSynergyLinuxContext.m_cookie->ipAddr = strcpy(ipStr, jstringTostring(env,ip));
-	uSynergyLinuxContext.m_cookie->port = port;
+	context->m_cookie->ipAddr = ipStr;
+	context->m_cookie->port = port;
 	LOGI("start = %s:%d", ipStr, port);
-	uSynergyStart(&uSynergyLinuxContext);
+	uSynergyStart(context);
+	return 0;
+}
+
+/*
+ * setThreadPolicy() Scheduling of the receive and dispatch threads,
+ * applied by the next start()
+ * jint  0:success 1:faild
+ */
+jint Java_io_brotherhood_usynergy_service_UsynergyService_setThreadPolicy(JNIEnv *env, jobject thiz, jint policy, jint priority, jint nice, jlong cpuMask)
+{
+	uSynergyContext *context = getContext(env, thiz);
+	uSynergyThreadConfig *configs[2];
+	int i;
+
+	if (context == NULL)
+		return 1;
+	configs[0] = &context->m_receiveThreadConfig;
+	configs[1] = &context->m_dispatchThreadConfig;
+	for (i = 0; i < 2; i++) {
+		configs[i]->m_policy = policy;
+		configs[i]->m_priority = priority;
+		configs[i]->m_nice = nice;
+		configs[i]->m_cpuMask = (uint64_t)cpuMask;
+	}
+	return 0;
+}
+
+/*
+ * getLatency() Latency percentile of a message type and stage
+ * jlong  nanoseconds, -1:faild
+ */
+jlong Java_io_brotherhood_usynergy_service_UsynergyService_getLatency(JNIEnv *env, jobject thiz, jint type, jint stage, jdouble percentile)
+{
+	uSynergyContext *context = getContext(env, thiz);
+	uSynergyLatencyStats *stats;
+	jlong ret;
+
+	if (context == NULL || type < 0 || type >= USYNERGY_NUM_LATENCY_TYPES
+		|| stage < 0 || stage >= USYNERGY_NUM_LATENCY_STAGES)
+		return -1;
+	stats = malloc(sizeof(uSynergyLatencyStats));
+	if (stats == NULL)
+		return -1;
+	uSynergyGetLatencyStats(context, stats);
+	ret = (jlong)uSynergyHistogramPercentile(&stats->m_histograms[type][stage],
+		percentile);
+	free(stats);
+	return ret;
+}
+
+/*
+ * resetLatency() Clear the latency histograms
+ */
+void Java_io_brotherhood_usynergy_service_UsynergyService_resetLatency(JNIEnv *env, jobject thiz)
+{
+	uSynergyContext *context = getContext(env, thiz);
+
+	if (context != NULL)
+		uSynergyResetLatencyStats(context);
+}
+
+static void logTraceLine(uSynergyCookie cookie, const char *line)
+{
+	LOGI("%s\n", line);
+}
+
+/*
+ * dumpTrace() Log the trace ring, for bug reports of stuck keys and the like
+ */
+void Java_io_brotherhood_usynergy_service_UsynergyService_dumpTrace(JNIEnv *env, jobject thiz)
+{
+	uSynergyContext *context = getContext(env, thiz);
+
+	if (context != NULL)
+		uSynergyDumpTrace(context, logTraceLine);
 }
 
 /*
@@ -78,7 +327,12 @@ jint Java_io_brotherhood_usynergy_service_UsynergyService_start(JNIEnv *env, job
  */
 jint Java_io_brotherhood_usynergy_service_UsynergyService_shutdown(JNIEnv *env,jobject thiz)
 {
-	uSynergyStop(&uSynergyLinuxContext);
+	uSynergyContext *context = getContext(env, thiz);
+
+	if (context == NULL)
+		return 1;
+	uSynergyStop(context);
+	return 0;
 }
 
 /*
@@ -87,14 +341,23 @@ jint Java_io_brotherhood_usynergy_service_UsynergyService_shutdown(JNIEnv *env,j
  */
 jint Java_io_brotherhood_usynergy_service_UsynergyService_setClientName(JNIEnv *env,jobject thiz, jstring clientName,jint height,jint width)
 {
-	uSynergCleanUP(&uSynergyLinuxContext);
-//	uSynergyInit(&uSynergyLinuxContext, clientName, 1024, 600);
-	uSynergyInit(&uSynergyLinuxContext, clientName, height, width);
+	/* Only this service's context is replaced, others keep running. Fails
+	 * while it is running, the name goes out in the hello of a connection */
+	return Java_io_brotherhood_usynergy_service_UsynergyService_init(env,
+		thiz, clientName, height, width);
 }
 
 jint Java_io_brotherhood_usynergy_service_UsynergyService_exit(JNIEnv *env,jobject thiz)
 {
-	uSynergCleanUP(&uSynergyLinuxContext);
+	uSynergyContext *context = getContext(env, thiz);
+
+	if (context == NULL)
+		return 0;
+	/* Returns once start() is out of uSynergyStart() */
+	uSynergyStop(context);
+	setContext(env, thiz, NULL);
+	uSynergyDestroy(context);
+	return 0;
 }
 
 jint Java_io_brotherhood_usynergy_service_getX(JNIEnv *env,jobject thiz){
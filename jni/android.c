@@ -1,70 +1,43 @@
 #include <log.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "platform.h"
+#include "android.h"
 #include "suinput.h"
+#include "transport.h"
+#include "ioengine.h"
 
-static void uSynergyUpdateServer(uSynergyCookie cookie)
-{
-	memset(&(cookie->server_addr), 0, sizeof(struct sockaddr));
-	cookie->server_addr.sin_family = AF_INET;
-	cookie->server_addr.sin_port = htons(cookie->port);
-	cookie->server_addr.sin_addr.s_addr = inet_addr(cookie->ipAddr);
-}
-
-static uSynergyBool uSynergyConnectFunc(uSynergyCookie cookie)
-{
-	cookie->sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-	if (connect(cookie->sockfd, (struct sockaddr *)& cookie->server_addr,
-		sizeof(struct sockaddr)) == 0) {
-		return USYNERGY_TRUE;
-	} else {
-		perror("connect error");
-		return USYNERGY_FALSE;
-	}
-}
-
-static uSynergyBool uSynergyReceiveFunc(uSynergyCookie cookie, uint8_t *buffer,
-	int maxLength, int* outLength)
-{
-	int ret;
-
-	while (1) {
-		ret = recv(cookie->sockfd, buffer, maxLength, 0);
-		if (ret > 0) {
-			*outLength = ret;
-			return USYNERGY_TRUE;
-		} else if ((ret < 0) && (errno == EAGAIN || errno == EWOULDBLOCK
-			|| errno == EINTR)) {
-			continue;
-		}
-		perror("receive error");
-		break;
-	}
-	return USYNERGY_FALSE;
-}
-
-static uSynergyBool uSynergySendFunc(uSynergyCookie cookie,
-	const uint8_t *buffer, int length)
+static uint32_t uSynergyGetTimeFunc()
 {
-	int ret;
-	ret = send(cookie->sockfd, buffer, length, 0);
-	if (ret < 0 || ret != length)
-		return USYNERGY_FALSE;
+	struct timespec now;
 
-	return USYNERGY_TRUE;
+	/* Monotonic with millisecond resolution, uSynergyProcess() returns
+	 * deadlines derived from it */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)now.tv_sec * 1000 + (uint32_t)(now.tv_nsec / 1000000);
 }
 
-static uint32_t uSynergyGetTimeFunc()
+/*
+ * @brief Queue uinput events with the replies of the current burst
+ */
+static int uSynergyDeviceWrite(void *arg, int uinput_fd, const void *buffer,
+	size_t length)
 {
-	uint32_t ret = 0;
-	time_t now;
-
-	ret = time(&now);
-
-	return ret * 1000;
+	uSynergyCookie cookie = arg;
+	int ret = 0;
+
+	if (cookie->tx_io != NULL)
+		ret = uSynergyIoQueueWrite(cookie->tx_io, uinput_fd, buffer, length);
+	else if (write(uinput_fd, buffer, length) != (ssize_t)length)
+		ret = -1;
+
+	uSynergyCount(&cookie->counters->m_deviceWrites, 1);
+	if (ret != 0)
+		uSynergyCount(&cookie->counters->m_deviceErrors, 1);
+	return ret;
 }
 
 #define BUS_VIRTUAL 0x06
@@ -76,21 +49,42 @@ static uSynergyBool uSynergyConnectDevice(uSynergyCookie cookie)
 	device_id.product = 1;
 	device_id.version = 0x0100;
 
-	cookie->uinput_keyboard = suinput_open("usynergy-keyboard", &(cookie->device_id),
-		keyboard);
-	cookie->uinput_mouse = suinput_open("usynergy-mouse", &(cookie->device_id),
-		mouse);
+	cookie->uinput_keyboard = suinput_open_backend(cookie->injection,
+		"usynergy-keyboard", &(cookie->device_id), keyboard);
+	cookie->uinput_mouse = suinput_open_backend(cookie->injection,
+		"usynergy-mouse", &(cookie->device_id), mouse);
 
 	if (cookie->uinput_mouse < 0 || cookie->uinput_keyboard < 0)
 		return USYNERGY_FALSE;
-
+	cookie->mouse_buttons = 0;
 	return USYNERGY_TRUE;
 }
 
+static void uSynergyAttachDevice(uSynergyCookie cookie)
+{
+	/* Device callbacks run on this (the dispatch) thread */
+	suinput_set_writer(uSynergyDeviceWrite, cookie);
+}
+
+/* Time readers get to consume the last events before the devices go */
+#define USYNERGY_DEVICE_DRAIN_MS	50
+
 static void uSynergyDisconnectDevice(uSynergyCookie cookie)
 {
-	suinput_close(cookie->uinput_mouse);
-	suinput_close(cookie->uinput_keyboard);
+	if (cookie->uinput_mouse < 0 && cookie->uinput_keyboard < 0)
+		return;
+
+	/* The last events were flushed synchronously, one grace period for both */
+	suinput_set_writer(NULL, NULL);
+	usleep(USYNERGY_DEVICE_DRAIN_MS * 1000);
+
+	/* Devices of this cookie only, other contexts keep theirs */
+	if (cookie->uinput_mouse >= 0)
+		suinput_destroy_backend(cookie->injection, cookie->uinput_mouse);
+	if (cookie->uinput_keyboard >= 0)
+		suinput_destroy_backend(cookie->injection, cookie->uinput_keyboard);
+	cookie->uinput_mouse = -1;
+	cookie->uinput_keyboard = -1;
 }
 
 static void uSynergyScreenActiveCallback(uSynergyCookie cookie,
@@ -109,35 +103,43 @@ static uSynergyBool uSynergyMouseMoveCallback(uSynergyCookie cookie,
 	return suinput_move_pointer(cookie->uinput_mouse, x, y);
 }
 
-static uSynergyBool uSynergyMouseUpCallback(uSynergyCookie cookie,
+/*
+ * @brief Press and release what changed since the last button callback
+
+ * The callbacks get the state of all three buttons, sending it whole would
+ * release buttons that are up and press buttons that are already down.
+ */
+static void uSynergyMouseButtons(uSynergyCookie cookie,
 	uSynergyBool buttonLeft, uSynergyBool buttonRight, uSynergyBool buttonMiddle)
 {
-	int ret;
-	if (!buttonLeft)
-		ret = suinput_release(cookie->uinput_mouse, BTN_LEFT);
-
-	if (!buttonRight)
-		ret = suinput_release(cookie->uinput_mouse, BTN_RIGHT);
-
-	if (!buttonMiddle)
-		ret = suinput_release(cookie->uinput_mouse, BTN_MIDDLE);
+	static const uint16_t codes[3] = { BTN_LEFT, BTN_RIGHT, BTN_MIDDLE };
+	int buttons = (buttonLeft ? 1 : 0) | (buttonRight ? 2 : 0)
+		| (buttonMiddle ? 4 : 0);
+	int changed = buttons ^ cookie->mouse_buttons;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (!(changed & (1 << i)))
+			continue;
+		if (buttons & (1 << i))
+			suinput_press(cookie->uinput_mouse, codes[i]);
+		else
+			suinput_release(cookie->uinput_mouse, codes[i]);
+	}
+	cookie->mouse_buttons = buttons;
+}
 
+static uSynergyBool uSynergyMouseUpCallback(uSynergyCookie cookie,
+	uSynergyBool buttonLeft, uSynergyBool buttonRight, uSynergyBool buttonMiddle)
+{
+	uSynergyMouseButtons(cookie, buttonLeft, buttonRight, buttonMiddle);
 	return USYNERGY_TRUE;
 }
 
 static uSynergyBool uSynergyMouseDownCallback(uSynergyCookie cookie,
 	uSynergyBool buttonLeft, uSynergyBool buttonRight, uSynergyBool buttonMiddle)
 {
-	int ret;
-	if (buttonLeft)
-		ret = suinput_press(cookie->uinput_mouse, BTN_LEFT);
-
-	if (buttonRight)
-		ret = suinput_press(cookie->uinput_mouse, BTN_RIGHT);
-
-	if (buttonMiddle)
-		ret = suinput_press(cookie->uinput_mouse, BTN_MIDDLE);
-
+	uSynergyMouseButtons(cookie, buttonLeft, buttonRight, buttonMiddle);
 	return USYNERGY_TRUE;
 }
 
@@ -169,14 +171,12 @@ static void uSynergyClipboard(uSynergyCookie cookie,
 
 }
 
-uSynergyContext uSynergyLinuxContext = {
-	.m_updateServerAddr	= uSynergyUpdateServer,
-	.m_connectFunc      = uSynergyConnectFunc,
-	.m_receiveFunc      = uSynergyReceiveFunc,
-	.m_sendFunc         = uSynergySendFunc,
+const uSynergyContext uSynergyAndroidPlatform = {
+	.m_transport        = &uSynergyTcpTransport,
 	.m_getTimeFunc      = uSynergyGetTimeFunc,
 	.m_connectDevice    = uSynergyConnectDevice,
 	.m_disconnectDevice	= uSynergyDisconnectDevice,
+	.m_attachDevice     = uSynergyAttachDevice,
 	.m_screenActiveCallback = uSynergyScreenActiveCallback,
 	.m_mouseMoveCallback    = uSynergyMouseMoveCallback,
 	.m_mouseUpCallback  = uSynergyMouseUpCallback,
@@ -0,0 +1,134 @@
+/*
+ * uSynergy client -- Per-context memory arena
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#ifndef USYNERGY_ARENA_H
+#define USYNERGY_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A context takes one block of memory when it is created and carves
+ * everything it needs per connection out of it, so a running client never
+ * goes back to the heap. Allocation is a pointer bump. Memory is only given
+ * back in bulk, by releasing everything allocated after a mark.
+
+ * An arena is not thread safe, only the thread that owns the context
+ * allocates from it.
+ */
+
+/* Alignment of every allocation, a cache line so no two share one */
+#define USYNERGY_ARENA_ALIGN	64
+
+/* Round @a size up to a multiple of @a align, a power of two */
+#define USYNERGY_ALIGN(size, align) \
+	(((size) + (align) - 1) & ~(size_t)((align) - 1))
+
+typedef struct uSynergyArena {
+	uint8_t *m_base;
+	size_t m_size;
+	size_t m_used;
+} uSynergyArena;
+
+/*
+ * @brief Create an arena of @a size bytes with a single allocation, the
+ * first allocation starts on a cache line
+ * @returns Arena or NULL when out of memory
+ */
+static inline uSynergyArena *uSynergyArenaCreate(size_t size)
+{
+	uSynergyArena *arena = malloc(sizeof(uSynergyArena)
+		+ USYNERGY_ARENA_ALIGN + size);
+
+	if (arena == NULL)
+		return NULL;
+	arena->m_base = (uint8_t *)USYNERGY_ALIGN((uintptr_t)(arena + 1),
+		USYNERGY_ARENA_ALIGN);
+	arena->m_size = size;
+	arena->m_used = 0;
+	return arena;
+}
+
+static inline void uSynergyArenaDestroy(uSynergyArena *arena)
+{
+	free(arena);
+}
+
+/*
+ * @brief Allocate zeroed memory
+ * @returns Memory or NULL when the arena is full
+ */
+static inline void *uSynergyArenaAlloc(uSynergyArena *arena, size_t size)
+{
+	size_t used = USYNERGY_ALIGN(arena->m_used, USYNERGY_ARENA_ALIGN);
+	void *ptr;
+
+	if (used > arena->m_size || size > arena->m_size - used)
+		return NULL;
+	ptr = arena->m_base + used;
+	arena->m_used = used + size;
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+/*
+ * @brief Copy a string into the arena
+ */
+static inline char *uSynergyArenaStrdup(uSynergyArena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy = uSynergyArenaAlloc(arena, len);
+
+	if (copy != NULL)
+		memcpy(copy, str, len);
+	return copy;
+}
+
+/*
+ * @brief Current fill level, to be handed to uSynergyArenaRelease()
+ */
+static inline size_t uSynergyArenaMark(const uSynergyArena *arena)
+{
+	return arena->m_used;
+}
+
+/*
+ * @brief Free everything allocated after @a mark
+ */
+static inline void uSynergyArenaRelease(uSynergyArena *arena, size_t mark)
+{
+	if (mark < arena->m_used)
+		arena->m_used = mark;
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* USYNERGY_ARENA_H */
@@ -0,0 +1,354 @@
+/*
+ * uSynergy client -- Allocation guard for the event path
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+/*
+ * Drives a client over the socketpair transport and fails if it touches
+ * the heap while processing input. The guard is armed when the server
+ * enters the screen (CINN) and disarmed when it leaves (COUT), so the
+ * handshake and the connection setup are not counted.
+
+ * Must be linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,
+ * --wrap=free (see Android.mk) so every heap call made by the client goes
+ * through the counters below.
+
+ * Usage: allocguard [events | stream-file]
+ *	events		number of generated input events (default 100000)
+ *	stream-file	raw server to client byte stream, handshake included
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "uSynergy.h"
+#include "transport.h"
+#include "android.h"
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t count, size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+extern void __real_free(void *ptr);
+
+static volatile int sArmed = 0;
+static volatile int sEntered = 0, sLeft = 0;
+static int sAllocs = 0, sFrees = 0;
+static void *sFirstCaller = NULL;
+static int sEvents = 0;
+
+static void sCount(int *counter, void *caller)
+{
+	if (!sArmed)
+		return;
+	if (__sync_fetch_and_add(counter, 1) == 0 && sFirstCaller == NULL)
+		sFirstCaller = caller;
+}
+
+void *__wrap_malloc(size_t size)
+{
+	sCount(&sAllocs, __builtin_return_address(0));
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+	sCount(&sAllocs, __builtin_return_address(0));
+	return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	sCount(&sAllocs, __builtin_return_address(0));
+	return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+	if (ptr != NULL)
+		sCount(&sFrees, __builtin_return_address(0));
+	__real_free(ptr);
+}
+
+//-----------------------------------------------------------------------------
+//	Client side
+//-----------------------------------------------------------------------------
+
+static int sPeer = -1;
+
+static void sPeerReady(void *arg, int peer_fd)
+{
+	sPeer = peer_fd;
+}
+
+static uSynergyBool sConnectDevice(uSynergyCookie cookie)
+{
+	return USYNERGY_TRUE;
+}
+
+static void sScreenActive(uSynergyCookie cookie, uSynergyBool active)
+{
+	if (active) {
+		sArmed = 1;
+		sEntered = 1;
+	} else if (sEntered) {
+		sArmed = 0;
+		sLeft = 1;
+	}
+}
+
+static uSynergyBool sMouseMove(uSynergyCookie cookie, int32_t x, int32_t y)
+{
+	sEvents++;
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sMouseButtons(uSynergyCookie cookie, uSynergyBool left,
+	uSynergyBool right, uSynergyBool middle)
+{
+	sEvents++;
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sMouseWheel(uSynergyCookie cookie, int16_t x, int16_t y)
+{
+	sEvents++;
+	return USYNERGY_TRUE;
+}
+
+static void sKeyboard(uSynergyCookie cookie, uint16_t key,
+	uint16_t modifiers, uSynergyBool down, uSynergyBool repeat)
+{
+	sEvents++;
+}
+
+static void *sRunClient(void *arg)
+{
+	uSynergyStart(arg);
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+//	Server side
+//-----------------------------------------------------------------------------
+
+static uint8_t *sPut16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static uint8_t *sPut32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+/*
+ * @brief Start a message at @a p, returns where its fields go
+ */
+static uint8_t *sBegin(uint8_t *p, const char *id)
+{
+	size_t len = strlen(id);
+
+	memcpy(p + 4, id, len);
+	return p + 4 + len;
+}
+
+/*
+ * @brief Finish the message started at @a start, returns its end
+ */
+static uint8_t *sEnd(uint8_t *start, uint8_t *end)
+{
+	sPut32(start, (uint32_t)(end - start - 4));
+	return end;
+}
+
+/*
+ * @brief Generate a session: handshake, enter, @a events input events in a
+ * typical mix (mostly moves, some clicks, keys and wheel), leave
+ */
+static uint8_t *sGenerate(int events, size_t *size)
+{
+	uint8_t *stream = malloc((size_t)events * 16 + 256);
+	uint8_t *p = stream, *m;
+	int i;
+
+	if (stream == NULL)
+		return NULL;
+
+	p = sPut16(sBegin(m = p, "Synergy"), 1);
+	p = sEnd(m, sPut16(p, 6));
+	p = sEnd(m = p, sBegin(p, "QINF"));
+	p = sEnd(m = p, sBegin(p, "CIAK"));
+	p = sPut16(sPut16(sBegin(m = p, "CINN"), 100), 100);
+	p = sEnd(m, sPut16(sPut32(p, 1), 0));
+
+	for (i = 0; i < events; i++) {
+		m = p;
+		switch (i % 16) {
+		case 3:
+			p = sBegin(p, "DMDN");
+			*p++ = 1;
+			break;
+		case 4:
+			p = sBegin(p, "DMUP");
+			*p++ = 1;
+			break;
+		case 7:
+			p = sPut16(sPut16(sBegin(p, "DKDN"), 'a' + i % 26), 0);
+			p = sPut16(p, 30);
+			break;
+		case 8:
+			p = sPut16(sPut16(sBegin(p, "DKUP"), 'a' + i % 26), 0);
+			p = sPut16(p, 30);
+			break;
+		case 11:
+			p = sPut16(sPut16(sBegin(p, "DMWM"), 0), 120);
+			break;
+		case 15:
+			p = sBegin(p, "CALV");
+			break;
+		default:
+			p = sPut16(sBegin(p, "DMMV"), (uint16_t)(i % 1000));
+			p = sPut16(p, (uint16_t)(i % 500));
+			break;
+		}
+		p = sEnd(m, p);
+	}
+	p = sEnd(m = p, sBegin(p, "COUT"));
+	*size = (size_t)(p - stream);
+	return stream;
+}
+
+static uint8_t *sLoad(const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	uint8_t *stream = NULL;
+	long length;
+
+	if (file == NULL)
+		return NULL;
+	if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0) {
+		stream = malloc(length);
+		rewind(file);
+		if (stream != NULL && fread(stream, 1, length, file) != (size_t)length) {
+			free(stream);
+			stream = NULL;
+		}
+		*size = (size_t)length;
+	}
+	fclose(file);
+	return stream;
+}
+
+/*
+ * @brief Swallow the client's replies so it never blocks on a full socket
+ */
+static void *sDrain(void *arg)
+{
+	uint8_t buffer[4096];
+
+	while (read(sPeer, buffer, sizeof(buffer)) > 0)
+		;
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	uSynergyContext *context;
+	pthread_t client, drain;
+	uint8_t *stream;
+	size_t size = 0, ofs;
+	int events = 100000;
+	int wait;
+
+	if (argc > 1 && atoi(argv[1]) <= 0) {
+		stream = sLoad(argv[1], &size);
+	} else {
+		if (argc > 1)
+			events = atoi(argv[1]);
+		stream = sGenerate(events, &size);
+	}
+	if (stream == NULL) {
+		fprintf(stderr, "no input stream\n");
+		return 2;
+	}
+
+	context = uSynergyCreate(&uSynergyAndroidPlatform, "allocguard", 1024, 600,
+		NULL);
+	if (context == NULL)
+		return 2;
+	context->m_transport = &uSynergySocketpairTransport;
+	context->m_cookie->peer_ready = sPeerReady;
+	context->m_connectDevice = sConnectDevice;
+	context->m_disconnectDevice = NULL;
+	context->m_screenActiveCallback = sScreenActive;
+	context->m_mouseMoveCallback = sMouseMove;
+	context->m_mouseDownCallback = sMouseButtons;
+	context->m_mouseUpCallback = sMouseButtons;
+	context->m_mouseWheelCallback = sMouseWheel;
+	context->m_keyboardCallback = sKeyboard;
+	context->m_clipboardCallback = NULL;
+
+	pthread_create(&client, NULL, sRunClient, context);
+	while (sPeer < 0)
+		usleep(1000);
+	pthread_create(&drain, NULL, sDrain, NULL);
+
+	/* Uneven writes so frames straddle reads */
+	for (ofs = 0; ofs < size; ) {
+		size_t n = size - ofs < 1500 ? size - ofs : 1500;
+		ssize_t ret = write(sPeer, stream + ofs, n);
+		if (ret <= 0)
+			break;
+		ofs += (size_t)ret;
+	}
+	for (wait = 0; !sLeft && wait < 10000; wait++)
+		usleep(1000);
+
+	/* Hang up, the client sees the disconnect and returns */
+	shutdown(sPeer, SHUT_RDWR);
+	pthread_join(client, NULL);
+	pthread_join(drain, NULL);
+	uSynergyDestroy(context);
+	free(stream);
+
+	printf("events %d, allocations %d, frees %d while entered\n",
+		sEvents, sAllocs, sFrees);
+	if (!sEntered || !sLeft) {
+		printf("FAIL: stream did not enter and leave the screen\n");
+		return 1;
+	}
+	if (sAllocs || sFrees) {
+		printf("FAIL: heap used in the event path, first call from %p\n",
+			sFirstCaller);
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
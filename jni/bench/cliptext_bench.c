@@ -0,0 +1,165 @@
+/*
+ * uSynergy client -- Clipboard text kernel benchmark
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+/*
+ * Compares the scalar and SIMD clipboard text kernels on generated
+ * documents and checks that both produce the same output.
+
+ * Usage: cliptextbench [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cliptext.h"
+
+static double sNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * @brief Fill @a buf with lines of text, one line in @a mixEvery has
+ * accented and CJK characters (0 for pure ASCII)
+ */
+static void sGenerate(uint8_t *buf, uint32_t size, int mixEvery)
+{
+	static const char ascii[] =
+		"The quick brown fox jumps over the lazy dog 0123456789 ";
+	static const char mixed[] = "na\xc3\xafve caf\xc3\xa9 \xe6\x97\xa5\xe6\x9c\xac "
+		"\xf0\x9f\x98\x80 ";
+	uint32_t ofs = 0;
+	int line = 0;
+
+	while (ofs < size) {
+		const char *src = (mixEvery && line % mixEvery == 0) ? mixed : ascii;
+		uint32_t len = (uint32_t)strlen(src);
+		if (len > size - ofs - 1) {
+			/* Never cut a multi byte character at the end */
+			src = ascii;
+			len = size - ofs - 1;
+		}
+		memcpy(buf + ofs, src, len);
+		ofs += len;
+		if (ofs < size)
+			buf[ofs++] = '\n';
+		line++;
+	}
+}
+
+typedef struct {
+	double validate, toCrlf, toLf, toUtf16;
+	uint32_t crlfSize, lfSize, utf16Size;
+} sResult;
+
+static void sRun(const uSynergyTextKernels *k, const uint8_t *in,
+	uint32_t size, int rounds, uint8_t *crlf, uint8_t *lf, uint16_t *utf16,
+	sResult *r)
+{
+	double t;
+	int i, valid = 1;
+
+	t = sNow();
+	for (i = 0; i < rounds; i++)
+		valid &= k->m_validUtf8(in, size);
+	r->validate = sNow() - t;
+	if (!valid)
+		printf("%s: generated text rejected\n", k->m_name);
+
+	t = sNow();
+	for (i = 0; i < rounds; i++)
+		r->crlfSize = k->m_lfToCrlf(in, size, crlf);
+	r->toCrlf = sNow() - t;
+
+	t = sNow();
+	for (i = 0; i < rounds; i++)
+		r->lfSize = k->m_crlfToLf(crlf, r->crlfSize, lf);
+	r->toLf = sNow() - t;
+
+	t = sNow();
+	for (i = 0; i < rounds; i++)
+		r->utf16Size = k->m_utf8ToUtf16(in, size, utf16);
+	r->toUtf16 = sNow() - t;
+}
+
+static void sReport(const char *name, double mb, const sResult *r)
+{
+	printf("  %-8s validate %7.0f MB/s  lf->crlf %7.0f MB/s  "
+		"crlf->lf %7.0f MB/s  utf8->utf16 %7.0f MB/s\n", name,
+		mb / r->validate, mb / r->toCrlf, mb / r->toLf, mb / r->toUtf16);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t size = (argc > 1 ? atoi(argv[1]) : 16) * 1024 * 1024;
+	static const int mixes[] = { 0, 20, 2 };
+	static const char *mixNames[] = { "ascii", "mostly ascii", "mixed" };
+	uint8_t *in = malloc(size);
+	uint8_t *crlf[2] = { malloc(size * 2), malloc(size * 2) };
+	uint8_t *lf[2] = { malloc(size * 2), malloc(size * 2) };
+	uint16_t *utf16[2] = { malloc(size * 2), malloc(size * 2) };
+	int rounds = 10, m;
+
+	if (!in || !crlf[0] || !crlf[1] || !lf[0] || !lf[1] || !utf16[0]
+		|| !utf16[1]) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	if (uSynergyTextSimd == NULL)
+		printf("No SIMD kernels in this build, timing scalar only\n");
+
+	for (m = 0; m < 3; m++) {
+		double mb = (double)size * rounds / (1024 * 1024);
+		sResult scalar, simd;
+
+		sGenerate(in, size, mixes[m]);
+		printf("%s, %u MB x %d\n", mixNames[m], size >> 20, rounds);
+		sRun(&uSynergyTextScalar, in, size, rounds, crlf[0], lf[0], utf16[0],
+			&scalar);
+		sReport(uSynergyTextScalar.m_name, mb, &scalar);
+		if (uSynergyTextSimd == NULL)
+			continue;
+
+		sRun(uSynergyTextSimd, in, size, rounds, crlf[1], lf[1], utf16[1],
+			&simd);
+		sReport(uSynergyTextSimd->m_name, mb, &simd);
+		if (scalar.crlfSize != simd.crlfSize
+			|| memcmp(crlf[0], crlf[1], scalar.crlfSize)
+			|| scalar.lfSize != simd.lfSize || memcmp(lf[0], lf[1], scalar.lfSize)
+			|| scalar.utf16Size != simd.utf16Size
+			|| memcmp(utf16[0], utf16[1], scalar.utf16Size * 2)) {
+			printf("  MISMATCH between scalar and %s output\n",
+				uSynergyTextSimd->m_name);
+			return 1;
+		}
+		if (scalar.lfSize != size || memcmp(lf[0], in, size)) {
+			printf("  MISMATCH: crlf->lf does not restore the input\n");
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,887 @@
+/*
+ * uSynergy client -- Stand-in Synergy server for benchmarks and soak tests
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+
+/*
+ * Plays the server side of the Synergy protocol well enough to drive a
+ * client without a real server: it does the hello, QINF/DINF and enter
+ * handshake, then feeds configurable workloads and times the client's
+ * replies. Every input message is answered with CNOP (QINF with DINF,
+ * CALV with CALV and CNOP), in order, so each reply is matched to the
+ * message it answers and its round trip goes into a histogram per kind.
+ * Screen info the client sends on its own, to time its round trips, is
+ * acknowledged with CIAK as the real server does.
+
+ * The socket is non-blocking and output is queued, so a large clipboard
+ * never stops the replies from being read. When more than
+ * FAKESERVER_BACKLOG bytes are queued, generated events are dropped and
+ * counted instead, as the client is not keeping up.
+
+ * Usage: fakeserver [options] [port | unix:path]
+ *	port or unix:path to listen on, default 24800 on all addresses;
+ *	"unix:@name" listens in the abstract namespace
+ *	-t seconds	workload length of a session (default 10)
+ *	-s count	sessions to serve one after the other, 0 for no end
+ *	-m hz		mouse moves per second, sweeping the screen
+ *	-k hz		keystrokes (down and up) per second, typed in bursts
+ *	-b count	keystrokes per burst (default 10)
+ *	-w hz		wheel steps per second
+ *	-j hz		joystick updates per second, sticks and buttons in turn
+ *	-a ms		keepalive (CALV) interval (default 3000, 0 for none)
+ *	-c bytes	clipboard size, sent when the screen is entered
+ *	-C seconds	send the clipboard again at this interval
+ *	-d seconds	drop the connection this long after the enter, halfway
+ *			through a message and with a reset instead of a leave
+ */
+
+/* accept4() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "histogram.h"
+
+/* Queued output above which generated events are dropped */
+#define FAKESERVER_BACKLOG		(1024 * 1024)
+/* Largest message accepted from the client */
+#define FAKESERVER_MAX_MESSAGE	(4 * 1024 * 1024)
+/* Clipboard chunk size, as the real server uses */
+#define FAKESERVER_CHUNK		(32 * 1024)
+/* How long the final replies may take */
+#define FAKESERVER_WAIT_NS		2000000000ull
+/* How long the hello and screen info may take, clients bring up their
+ * devices first and uinput devices take seconds each */
+#define FAKESERVER_HELLO_WAIT_NS	10000000000ull
+
+enum {
+	kHandshake,
+	kMove,
+	kKey,
+	kWheel,
+	kJoystick,
+	kKeepAlive,
+	kClipboard,
+	kNumKinds
+};
+
+static const char *sKindNames[kNumKinds] = {
+	"handshake", "move", "key", "wheel", "joystick", "keepalive", "clipboard"
+};
+
+/*
+ * @brief A message waiting for its replies
+ */
+typedef struct {
+	/* Stream offset of its end and when that was written */
+	uint64_t end;
+	int64_t sent;
+	uint8_t kind;
+	/* Replies still to come, the round trip is timed at the first */
+	uint8_t replies;
+	uint8_t timed;
+} Pending;
+
+/*
+ * @brief Workload, from the command line
+ */
+typedef struct {
+	double seconds;
+	int sessions;
+	double moveHz;
+	double keyHz;
+	int keyBurst;
+	double wheelHz;
+	double joystickHz;
+	int keepAliveMs;
+	uint32_t clipboardSize;
+	double clipboardInterval;
+	double dropAfter;
+} Workload;
+
+/*
+ * @brief One connection
+ */
+typedef struct {
+	int fd;
+	uSynergyHistogram *rtt;
+
+	/* Queued output, out[0..outSize) with out[0..outHead) written */
+	uint8_t *out;
+	size_t outHead, outSize, outCapacity;
+	/* Bytes written before out[0] */
+	uint64_t outBase;
+
+	/* Messages whose replies are expected, oldest first, of which the
+	 * first pendingWritten went out completely */
+	Pending *pending;
+	size_t pendingHead, pendingCount, pendingCapacity;
+	size_t pendingWritten;
+
+	/* Partial input */
+	uint8_t *in;
+	size_t inSize, inCapacity;
+
+	/* Client name and screen, from its hello and DINF */
+	char name[64];
+	int width, height;
+	int hello, info;
+	/* Screen info the client sent on its own, round trip probes */
+	uint64_t infos;
+
+	uint64_t sent[kNumKinds];
+	uint64_t dropped;
+	uint64_t replies;
+	uint64_t unexpected;
+	uint64_t clipboardBytes;
+	int closed;
+} Session;
+
+static int64_t sNowNs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint8_t *sPut16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static uint8_t *sPut32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+static uint32_t sGet32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+		| ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+ * @brief Make room for @a size more bytes in a growing buffer
+ */
+static int sReserve(uint8_t **buffer, size_t used, size_t *capacity,
+	size_t size)
+{
+	size_t want = *capacity ? *capacity : 4096;
+	uint8_t *grown;
+
+	if (used + size <= *capacity)
+		return 1;
+	while (want < used + size)
+		want *= 2;
+	grown = realloc(*buffer, want);
+	if (grown == NULL)
+		return 0;
+	*buffer = grown;
+	*capacity = want;
+	return 1;
+}
+
+//-----------------------------------------------------------------------------
+//	Output
+//-----------------------------------------------------------------------------
+
+static size_t sBacklog(const Session *session)
+{
+	return session->outSize - session->outHead;
+}
+
+/*
+ * @brief Queue a message of @a size body bytes after the 4 byte id, a test
+ * tool out of memory just exits
+
+ * @returns Where the body goes
+ */
+static uint8_t *sQueue(Session *session, const char *id, size_t size,
+	int kind, int replies)
+{
+	uint8_t *message;
+	Pending *pending;
+
+	if (session->outHead > 0 && session->outHead == session->outSize) {
+		session->outBase += session->outSize;
+		session->outHead = session->outSize = 0;
+	}
+	if (!sReserve(&session->out, session->outSize, &session->outCapacity,
+		8 + size)) {
+		fprintf(stderr, "out of memory\n");
+		exit(2);
+	}
+	message = session->out + session->outSize;
+	sPut32(message, (uint32_t)(strlen(id) + size));
+	memcpy(message + 4, id, strlen(id));
+	session->outSize += 4 + strlen(id) + size;
+
+	if (replies > 0) {
+		if (session->pendingCount == session->pendingCapacity) {
+			size_t capacity = session->pendingCapacity
+				? session->pendingCapacity * 2 : 1024;
+			Pending *grown = malloc(capacity * sizeof(Pending));
+			size_t i;
+
+			if (grown == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(2);
+			}
+			for (i = 0; i < session->pendingCount; i++)
+				grown[i] = session->pending[(session->pendingHead + i)
+					% session->pendingCapacity];
+			free(session->pending);
+			session->pending = grown;
+			session->pendingHead = 0;
+			session->pendingCapacity = capacity;
+		}
+		pending = &session->pending[(session->pendingHead
+			+ session->pendingCount) % session->pendingCapacity];
+		pending->end = session->outBase + session->outSize;
+		pending->sent = 0;
+		pending->kind = (uint8_t)kind;
+		pending->replies = (uint8_t)replies;
+		pending->timed = 0;
+		session->pendingCount++;
+	}
+	session->sent[kind]++;
+	return message + 4 + strlen(id);
+}
+
+/*
+ * @brief Write what the socket takes and stamp the messages it completed
+ */
+static int sFlush(Session *session)
+{
+	int64_t now;
+	ssize_t ret;
+
+	while (session->outHead < session->outSize) {
+		ret = send(session->fd, session->out + session->outHead,
+			session->outSize - session->outHead, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return 0;
+		}
+		session->outHead += (size_t)ret;
+	}
+
+	now = sNowNs();
+	while (session->pendingWritten < session->pendingCount) {
+		Pending *pending = &session->pending[(session->pendingHead
+			+ session->pendingWritten) % session->pendingCapacity];
+
+		if (pending->end > session->outBase + session->outHead)
+			break;
+		pending->sent = now;
+		session->pendingWritten++;
+	}
+	return 1;
+}
+
+//-----------------------------------------------------------------------------
+//	Input
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Match a reply to the oldest message still waiting for one
+ */
+static void sReply(Session *session, int64_t now)
+{
+	Pending *pending;
+
+	session->replies++;
+	if (session->pendingCount == 0) {
+		session->unexpected++;
+		return;
+	}
+	pending = &session->pending[session->pendingHead];
+	if (!pending->timed && session->pendingWritten > 0) {
+		uSynergyHistogramRecord(&session->rtt[pending->kind],
+			(uint64_t)(now - pending->sent));
+		pending->timed = 1;
+	}
+	if (--pending->replies == 0) {
+		session->pendingHead = (session->pendingHead + 1)
+			% session->pendingCapacity;
+		session->pendingCount--;
+		if (session->pendingWritten > 0)
+			session->pendingWritten--;
+	}
+}
+
+static void sMessage(Session *session, const uint8_t *message,
+	uint32_t length, int64_t now)
+{
+	if (length >= 7 && memcmp(message, "Synergy", 7) == 0) {
+		uint32_t size;
+
+		if (length >= 15) {
+			size = sGet32(message + 11);
+			if (size > length - 15)
+				size = length - 15;
+			if (size >= sizeof(session->name))
+				size = sizeof(session->name) - 1;
+			memcpy(session->name, message + 15, size);
+			session->name[size] = '\0';
+		}
+		session->hello = 1;
+		sReply(session, now);
+	} else if (length < 4) {
+		return;
+	} else if (memcmp(message, "DINF", 4) == 0) {
+		if (length >= 12) {
+			session->width = (message[8] << 8) | message[9];
+			session->height = (message[10] << 8) | message[11];
+		}
+		/* Later screen info is the client's own, acknowledged like the
+		 * real server does */
+		if (session->info) {
+			session->infos++;
+			sQueue(session, "CIAK", 0, kHandshake, 0);
+			return;
+		}
+		session->info = 1;
+		sReply(session, now);
+	} else if (memcmp(message, "CNOP", 4) == 0
+		|| memcmp(message, "CALV", 4) == 0) {
+		sReply(session, now);
+	}
+	/* Clipboards the client sends and anything else are not replies */
+}
+
+/*
+ * @brief Read what arrived and handle the complete messages
+
+ * @returns 0 once the client hung up or sent garbage
+ */
+static int sReceive(Session *session)
+{
+	size_t ofs = 0;
+	uint32_t length;
+	ssize_t ret;
+	int64_t now;
+
+	for (;;) {
+		if (!sReserve(&session->in, session->inSize, &session->inCapacity,
+			65536))
+			return 0;
+		ret = recv(session->fd, session->in + session->inSize, 65536, 0);
+		if (ret == 0)
+			return 0;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return 0;
+		}
+		session->inSize += (size_t)ret;
+	}
+
+	now = sNowNs();
+	while (session->inSize - ofs >= 4) {
+		length = sGet32(session->in + ofs);
+		if (length > FAKESERVER_MAX_MESSAGE)
+			return 0;
+		if (session->inSize - ofs - 4 < length)
+			break;
+		sMessage(session, session->in + ofs + 4, length, now);
+		ofs += 4 + length;
+	}
+	memmove(session->in, session->in + ofs, session->inSize - ofs);
+	session->inSize -= ofs;
+	return 1;
+}
+
+/*
+ * @brief Wait up to @a timeoutNs for the socket, then read and write
+ */
+static int sPump(Session *session, int64_t timeoutNs)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = session->fd;
+	pfd.events = POLLIN | (sBacklog(session) > 0 ? POLLOUT : 0);
+	ret = poll(&pfd, 1, timeoutNs > 0 ? (int)((timeoutNs + 999999) / 1000000)
+		: 0);
+	if (ret < 0 && errno != EINTR)
+		return 0;
+	if (ret > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+		&& !sReceive(session))
+		return 0;
+	return sFlush(session);
+}
+
+//-----------------------------------------------------------------------------
+//	Workload
+//-----------------------------------------------------------------------------
+
+static void sClipboard(Session *session, uint32_t size)
+{
+	char header[16];
+	uint32_t ofs, chunk;
+	uint8_t *p;
+	int len;
+
+	/* Start chunk with the total size, data chunks, end chunk */
+	len = snprintf(header, sizeof(header), "%u", 12 + size);
+	p = sQueue(session, "DCLP", 10 + len, kClipboard, 1);
+	*p++ = 0;
+	p = sPut32(p, 0);
+	*p++ = 1;
+	memcpy(sPut32(p, len), header, len);
+
+	for (ofs = 0; ofs < 12 + size; ofs += chunk) {
+		chunk = 12 + size - ofs;
+		if (chunk > FAKESERVER_CHUNK)
+			chunk = FAKESERVER_CHUNK;
+		p = sQueue(session, "DCLP", 10 + chunk, kClipboard, 1);
+		*p++ = 0;
+		p = sPut32(p, 0);
+		*p++ = 2;
+		p = sPut32(p, chunk);
+		if (ofs == 0) {
+			/* One text format, then the text */
+			p = sPut32(sPut32(sPut32(p, 1), 0), size);
+			chunk -= 12;
+			ofs += 12;
+		}
+		memset(p, 'a' + (session->sent[kClipboard] % 26), chunk);
+	}
+
+	p = sQueue(session, "DCLP", 10, kClipboard, 1);
+	*p++ = 0;
+	p = sPut32(p, 0);
+	*p++ = 3;
+	sPut32(p, 0);
+	session->clipboardBytes += size;
+}
+
+/*
+ * @brief Number of events of a @a hz stream due by @a now, moving @a next
+ */
+static int sDue(double hz, int64_t *next, int64_t now)
+{
+	int64_t period;
+	int count = 0;
+
+	if (hz <= 0)
+		return 0;
+	period = (int64_t)(1e9 / hz);
+	if (period < 1)
+		period = 1;
+	while (*next <= now && count < 100000) {
+		*next += period;
+		count++;
+	}
+	return count;
+}
+
+static int64_t sEarliest(int64_t a, int64_t b)
+{
+	return b < a ? b : a;
+}
+
+/*
+ * @brief Drive one connected client
+
+ * @returns 0 if the connection broke before the workload was done
+ */
+static int sRunSession(Session *session, const Workload *workload)
+{
+	int64_t start, end, now, wait;
+	int64_t nextMove, nextKey, nextWheel, nextJoystick;
+	int64_t nextKeepAlive, nextClipboard, drop;
+	int64_t never = INT64_MAX;
+	uint32_t n = 0;
+	uint8_t *p;
+	int i, count;
+
+	/* Hello and screen info, wait for both answers */
+	p = sQueue(session, "Synergy", 4, kHandshake, 1);
+	sPut16(sPut16(p, 1), 6);
+	sQueue(session, "QINF", 0, kHandshake, 1);
+	start = sNowNs();
+	while (!(session->hello && session->info)) {
+		if (sNowNs() - start > (int64_t)FAKESERVER_HELLO_WAIT_NS) {
+			fprintf(stderr, "no hello and screen info from the client\n");
+			return 0;
+		}
+		if (!sPump(session, 10000000))
+			return 0;
+	}
+
+	/* Reset options, no options, enter at the centre */
+	sQueue(session, "CIAK", 0, kHandshake, 0);
+	sQueue(session, "CROP", 0, kHandshake, 0);
+	sPut32(sQueue(session, "DSOP", 4, kHandshake, 1), 0);
+	p = sQueue(session, "CINN", 10, kHandshake, 1);
+	p = sPut16(sPut16(p, session->width / 2), session->height / 2);
+	sPut16(sPut32(p, 1), 0);
+	if (workload->clipboardSize > 0)
+		sClipboard(session, workload->clipboardSize);
+
+	start = now = sNowNs();
+	end = start + (int64_t)(workload->seconds * 1e9);
+	nextMove = nextKey = nextWheel = nextJoystick = start;
+	nextKeepAlive = workload->keepAliveMs > 0
+		? start + (int64_t)workload->keepAliveMs * 1000000 : never;
+	nextClipboard = workload->clipboardInterval > 0
+		? start + (int64_t)(workload->clipboardInterval * 1e9) : never;
+	drop = workload->dropAfter > 0
+		? start + (int64_t)(workload->dropAfter * 1e9) : never;
+
+	while (now < end) {
+		if (now >= drop) {
+			struct linger linger = { 1, 0 };
+
+			/* Half a move, then a reset */
+			uint8_t half[6] = { 0, 0, 0, 8, 'D', 'M' };
+			send(session->fd, half, sizeof(half), MSG_NOSIGNAL);
+			setsockopt(session->fd, SOL_SOCKET, SO_LINGER, &linger,
+				sizeof(linger));
+			session->closed = 1;
+			return 1;
+		}
+
+		count = sDue(workload->moveHz, &nextMove, now);
+		for (i = 0; i < count; i++, n++) {
+			if (sBacklog(session) > FAKESERVER_BACKLOG) {
+				session->dropped++;
+				continue;
+			}
+			p = sQueue(session, "DMMV", 4, kMove, 1);
+			sPut16(sPut16(p, (n * 7) % (session->width ? session->width : 1)),
+				(n * 3) % (session->height ? session->height : 1));
+		}
+
+		/* Keystrokes come in bursts of keyBurst at the average rate */
+		count = sDue(workload->keyHz / workload->keyBurst, &nextKey, now)
+			* workload->keyBurst;
+		for (i = 0; i < count; i++, n++) {
+			uint16_t key = 'a' + n % 26;
+
+			if (sBacklog(session) > FAKESERVER_BACKLOG) {
+				session->dropped++;
+				continue;
+			}
+			sPut16(sPut16(sPut16(sQueue(session, "DKDN", 6, kKey, 1), key), 0),
+				30);
+			sPut16(sPut16(sPut16(sQueue(session, "DKUP", 6, kKey, 1), key), 0),
+				30);
+		}
+
+		count = sDue(workload->wheelHz, &nextWheel, now);
+		for (i = 0; i < count; i++) {
+			if (sBacklog(session) > FAKESERVER_BACKLOG) {
+				session->dropped++;
+				continue;
+			}
+			sPut16(sPut16(sQueue(session, "DMWM", 4, kWheel, 1), 0),
+				(uint16_t)((n++ & 1) ? 120 : -120));
+		}
+
+		count = sDue(workload->joystickHz, &nextJoystick, now);
+		for (i = 0; i < count; i++, n++) {
+			if (sBacklog(session) > FAKESERVER_BACKLOG) {
+				session->dropped++;
+				continue;
+			}
+			if (n & 1) {
+				p = sQueue(session, "DGBT", 3, kJoystick, 1);
+				*p++ = 0;
+				sPut16(p, (uint16_t)(1 << (n % 16)));
+			} else {
+				p = sQueue(session, "DGST", 5, kJoystick, 1);
+				*p++ = 0;
+				*p++ = (uint8_t)n;
+				*p++ = (uint8_t)(n >> 1);
+				*p++ = (uint8_t)(n >> 2);
+				*p = (uint8_t)(n >> 3);
+			}
+		}
+
+		if (now >= nextKeepAlive) {
+			sQueue(session, "CALV", 0, kKeepAlive, 2);
+			nextKeepAlive += (int64_t)workload->keepAliveMs * 1000000;
+		}
+		if (now >= nextClipboard) {
+			sClipboard(session, workload->clipboardSize);
+			nextClipboard += (int64_t)(workload->clipboardInterval * 1e9);
+		}
+
+		wait = sEarliest(end, sEarliest(drop,
+			sEarliest(nextKeepAlive, nextClipboard)));
+		if (workload->moveHz > 0)
+			wait = sEarliest(wait, nextMove);
+		if (workload->keyHz > 0)
+			wait = sEarliest(wait, nextKey);
+		if (workload->wheelHz > 0)
+			wait = sEarliest(wait, nextWheel);
+		if (workload->joystickHz > 0)
+			wait = sEarliest(wait, nextJoystick);
+		if (!sPump(session, wait - sNowNs()))
+			return 0;
+		now = sNowNs();
+	}
+
+	/* Leave, then collect the replies still due */
+	sQueue(session, "COUT", 0, kHandshake, 1);
+	end = sNowNs() + (int64_t)FAKESERVER_WAIT_NS;
+	while (session->pendingCount > 0 && sNowNs() < end) {
+		if (!sPump(session, 10000000))
+			return 0;
+	}
+	return 1;
+}
+
+//-----------------------------------------------------------------------------
+//	Report
+//-----------------------------------------------------------------------------
+
+static void sReport(int number, const Session *session, double seconds,
+	int ok)
+{
+	uint64_t sent = 0;
+	int i;
+
+	for (i = 0; i < kNumKinds; i++)
+		sent += session->sent[i];
+	printf("session %d: client \"%s\" %dx%d, %.1f s, %s\n", number,
+		session->name, session->width, session->height, seconds,
+		session->closed ? "dropped" : ok ? "left" : "connection lost");
+	printf("  sent %llu messages (%llu moves, %llu keys, %llu wheel, "
+		"%llu joystick, %llu keepalives, %llu clipboard bytes), "
+		"%llu events dropped\n",
+		(unsigned long long)sent,
+		(unsigned long long)session->sent[kMove],
+		(unsigned long long)session->sent[kKey],
+		(unsigned long long)session->sent[kWheel],
+		(unsigned long long)session->sent[kJoystick],
+		(unsigned long long)session->sent[kKeepAlive],
+		(unsigned long long)session->clipboardBytes,
+		(unsigned long long)session->dropped);
+	printf("  %llu replies, %llu unanswered, %llu unexpected, "
+		"%llu screen info probes\n",
+		(unsigned long long)session->replies,
+		(unsigned long long)session->pendingCount,
+		(unsigned long long)session->unexpected,
+		(unsigned long long)session->infos);
+	printf("  %-10s %8s %10s %10s %10s %10s\n", "rtt", "count", "p50 us",
+		"p99 us", "p99.9 us", "max us");
+	for (i = 0; i < kNumKinds; i++) {
+		const uSynergyHistogram *rtt = &session->rtt[i];
+
+		if (rtt->m_count == 0)
+			continue;
+		printf("  %-10s %8llu %10.1f %10.1f %10.1f %10.1f\n", sKindNames[i],
+			(unsigned long long)rtt->m_count,
+			uSynergyHistogramPercentile(rtt, 50) / 1e3,
+			uSynergyHistogramPercentile(rtt, 99) / 1e3,
+			uSynergyHistogramPercentile(rtt, 99.9) / 1e3,
+			rtt->m_max / 1e3);
+	}
+	fflush(stdout);
+}
+
+//-----------------------------------------------------------------------------
+//	Main
+//-----------------------------------------------------------------------------
+
+static int sListen(const char *address)
+{
+	int fd, one = 1;
+
+	if (strncmp(address, "unix:", 5) == 0) {
+		struct sockaddr_un addr;
+		size_t len = strlen(address + 5);
+		socklen_t addr_len = sizeof(addr);
+
+		if (len == 0 || len >= sizeof(addr.sun_path))
+			return -1;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		memcpy(addr.sun_path, address + 5, len);
+		if (addr.sun_path[0] == '@') {
+			addr.sun_path[0] = '\0';
+			addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+		} else {
+			unlink(addr.sun_path);
+		}
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *)&addr, addr_len) != 0)
+			goto fail;
+	} else {
+		struct sockaddr_in addr;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons((uint16_t)atoi(address));
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+			goto fail;
+	}
+	if (listen(fd, 4) != 0)
+		goto fail;
+	return fd;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *address = "24800";
+	uSynergyHistogram *total;
+	Workload workload;
+	Session session;
+	int64_t start;
+	int listener, number, ok, failed = 0, i;
+
+	memset(&workload, 0, sizeof(workload));
+	workload.seconds = 10;
+	workload.sessions = 1;
+	workload.keyBurst = 10;
+	workload.keepAliveMs = 3000;
+	while (argc > 1 && argv[1][0] == '-') {
+		const char *option = argv[1];
+
+		if (argc < 3 || option[1] == '\0' || option[2] != '\0')
+			break;
+		switch (option[1]) {
+		case 't': workload.seconds = atof(argv[2]); break;
+		case 's': workload.sessions = atoi(argv[2]); break;
+		case 'm': workload.moveHz = atof(argv[2]); break;
+		case 'k': workload.keyHz = atof(argv[2]); break;
+		case 'b': workload.keyBurst = atoi(argv[2]); break;
+		case 'w': workload.wheelHz = atof(argv[2]); break;
+		case 'j': workload.joystickHz = atof(argv[2]); break;
+		case 'a': workload.keepAliveMs = atoi(argv[2]); break;
+		case 'c': workload.clipboardSize = (uint32_t)atol(argv[2]); break;
+		case 'C': workload.clipboardInterval = atof(argv[2]); break;
+		case 'd': workload.dropAfter = atof(argv[2]); break;
+		default:
+			fprintf(stderr, "unknown option %s\n", option);
+			return 2;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc > 1)
+		address = argv[1];
+	if (workload.keyBurst < 1)
+		workload.keyBurst = 1;
+	if (workload.clipboardSize == 0)
+		workload.clipboardInterval = 0;
+
+	listener = sListen(address);
+	if (listener < 0) {
+		perror("listen error");
+		return 2;
+	}
+	total = calloc(kNumKinds, sizeof(uSynergyHistogram));
+	if (total == NULL)
+		return 2;
+	signal(SIGPIPE, SIG_IGN);
+	printf("listening on %s\n", address);
+	fflush(stdout);
+
+	for (number = 1; workload.sessions == 0 || number <= workload.sessions;
+		number++) {
+		int one = 1;
+
+		memset(&session, 0, sizeof(session));
+		session.rtt = calloc(kNumKinds, sizeof(uSynergyHistogram));
+		session.fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK
+			| SOCK_CLOEXEC);
+		if (session.rtt == NULL || session.fd < 0) {
+			perror("accept error");
+			free(session.rtt);
+			break;
+		}
+		setsockopt(session.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		start = sNowNs();
+		ok = sRunSession(&session, &workload);
+		sReport(number, &session, (sNowNs() - start) / 1e9, ok);
+		if (!ok)
+			failed++;
+		for (i = 0; i < kNumKinds; i++)
+			uSynergyHistogramMerge(&total[i], &session.rtt[i]);
+
+		close(session.fd);
+		free(session.rtt);
+		free(session.out);
+		free(session.pending);
+		free(session.in);
+	}
+
+	if (number > 2) {
+		printf("all sessions: %d lost\n", failed);
+		printf("  %-10s %8s %10s %10s %10s %10s\n", "rtt", "count", "p50 us",
+			"p99 us", "p99.9 us", "max us");
+		for (i = 0; i < kNumKinds; i++) {
+			if (total[i].m_count == 0)
+				continue;
+			printf("  %-10s %8llu %10.1f %10.1f %10.1f %10.1f\n",
+				sKindNames[i], (unsigned long long)total[i].m_count,
+				uSynergyHistogramPercentile(&total[i], 50) / 1e3,
+				uSynergyHistogramPercentile(&total[i], 99) / 1e3,
+				uSynergyHistogramPercentile(&total[i], 99.9) / 1e3,
+				total[i].m_max / 1e3);
+		}
+	}
+	free(total);
+	close(listener);
+	return failed ? 1 : 0;
+}
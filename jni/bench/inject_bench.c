@@ -0,0 +1,270 @@
+/*
+ * uSynergy client -- Injection benchmark and evdev verifier
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+
+/*
+ * Drives a client with the Android device callbacks over the socketpair
+ * transport, with its devices in a recording sink instead of uinput. The
+ * same generated session runs with plain batched writes and with io_uring,
+ * and for each the write operations that reached the devices are set
+ * against the events injected. The recorded events are then checked
+ * against evdev semantics (see suinput_sink_verify()); a violation fails
+ * the run.
+
+ * Usage: injectbench [-d] [events]
+ *	-d	print the recorded events of the last run
+ *	events	number of generated input events (default 100000)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "uSynergy.h"
+#include "transport.h"
+#include "android.h"
+#include "suinput_sink.h"
+
+static volatile int sPeer = -1;
+static volatile int sLeft = 0;
+
+static double sNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sPeerReady(void *arg, int peer_fd)
+{
+	sPeer = peer_fd;
+}
+
+static void sScreenActive(uSynergyCookie cookie, uSynergyBool active)
+{
+	if (!active)
+		sLeft = 1;
+}
+
+static void *sRunClient(void *arg)
+{
+	uSynergyStart(arg);
+	return NULL;
+}
+
+static uint8_t *sPut16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static uint8_t *sPut32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+static uint8_t *sBegin(uint8_t *p, const char *id)
+{
+	size_t len = strlen(id);
+
+	memcpy(p + 4, id, len);
+	return p + 4 + len;
+}
+
+static uint8_t *sEnd(uint8_t *start, uint8_t *end)
+{
+	sPut32(start, (uint32_t)(end - start - 4));
+	return end;
+}
+
+/*
+ * @brief Generate a session: handshake, enter, @a events input events in a
+ * typical mix (mostly moves, some clicks and keys), leave
+ */
+static uint8_t *sGenerate(int events, size_t *size)
+{
+	uint8_t *stream = malloc((size_t)events * 16 + 256);
+	uint8_t *p = stream, *m;
+	int i;
+
+	if (stream == NULL)
+		return NULL;
+
+	p = sPut16(sBegin(m = p, "Synergy"), 1);
+	p = sEnd(m, sPut16(p, 6));
+	p = sEnd(m = p, sBegin(p, "QINF"));
+	p = sEnd(m = p, sBegin(p, "CIAK"));
+	p = sPut16(sPut16(sBegin(m = p, "CINN"), 100), 100);
+	p = sEnd(m, sPut16(sPut32(p, 1), 0));
+
+	for (i = 0; i < events; i++) {
+		m = p;
+		switch (i % 16) {
+		case 3:
+			p = sBegin(p, "DMDN");
+			*p++ = 1 + (i / 16) % 3;
+			break;
+		case 4:
+			p = sBegin(p, "DMUP");
+			*p++ = 1 + (i / 16) % 3;
+			break;
+		case 7:
+			p = sPut16(sPut16(sBegin(p, "DKDN"), 'a' + i % 26), 0);
+			p = sPut16(p, 30);
+			break;
+		case 8:
+			/* Same key as the DKDN before */
+			p = sPut16(sPut16(sBegin(p, "DKUP"), 'a' + (i - 1) % 26), 0);
+			p = sPut16(p, 30);
+			break;
+		default:
+			p = sPut16(sBegin(p, "DMMV"), (uint16_t)(i % 1000));
+			p = sPut16(p, (uint16_t)(i % 500));
+			break;
+		}
+		p = sEnd(m, p);
+	}
+	p = sEnd(m = p, sBegin(p, "COUT"));
+	*size = (size_t)(p - stream);
+	return stream;
+}
+
+static void *sDrain(void *arg)
+{
+	uint8_t buffer[4096];
+
+	while (read(sPeer, buffer, sizeof(buffer)) > 0)
+		;
+	return NULL;
+}
+
+/*
+ * @brief Run the session once, @returns 0 if it did not get through
+ */
+static int sRun(suinput_sink *sink, int useRing, const uint8_t *stream,
+	size_t size, int events)
+{
+	uSynergyContext *context;
+	suinput_sink_stats stats;
+	uSynergyCounters counters;
+	pthread_t client, drain;
+	char error[256];
+	double start, elapsed;
+	size_t ofs;
+	int wait, violations;
+
+	suinput_sink_reset(sink);
+	context = uSynergyCreate(&uSynergyAndroidPlatform, "injectbench", 1024,
+		600, NULL);
+	if (context == NULL)
+		return 0;
+	context->m_transport = &uSynergySocketpairTransport;
+	context->m_cookie->peer_ready = sPeerReady;
+	context->m_cookie->io_uring = useRing;
+	context->m_cookie->injection = suinput_sink_backend(sink);
+	context->m_screenActiveCallback = sScreenActive;
+
+	sPeer = -1;
+	sLeft = 0;
+	pthread_create(&client, NULL, sRunClient, context);
+	while (sPeer < 0)
+		usleep(1000);
+	pthread_create(&drain, NULL, sDrain, NULL);
+
+	start = sNow();
+	for (ofs = 0; ofs < size; ) {
+		ssize_t ret = write(sPeer, stream + ofs, size - ofs);
+		if (ret <= 0)
+			break;
+		ofs += (size_t)ret;
+	}
+	for (wait = 0; !sLeft && wait < 10000; wait++)
+		usleep(100);
+	elapsed = sNow() - start;
+
+	shutdown(sPeer, SHUT_RDWR);
+	pthread_join(client, NULL);
+	pthread_join(drain, NULL);
+	uSynergyGetCounters(context, &counters);
+	uSynergyDestroy(context);
+
+	suinput_sink_sync(sink);
+	suinput_sink_get_stats(sink, &stats);
+	violations = suinput_sink_verify(sink, error, sizeof(error));
+
+	printf("%-8s %d input events in %.3f s: %llu evdev events, %llu writer "
+		"calls, %llu device writes (%.1f events per write)\n",
+		useRing ? "io_uring" : "batched", events, elapsed,
+		(unsigned long long)stats.events,
+		(unsigned long long)counters.m_deviceWrites,
+		(unsigned long long)stats.writes,
+		stats.writes ? (double)stats.events / stats.writes : 0.0);
+	if (!sLeft) {
+		printf("FAIL: the session did not get to the leave\n");
+		return 0;
+	}
+	if (violations > 0) {
+		printf("FAIL: %d evdev violations, first: %s\n", violations, error);
+		return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int events = 100000, dump = 0, ok;
+	suinput_sink *sink;
+	uint8_t *stream;
+	size_t size;
+
+	if (argc > 1 && strcmp(argv[1], "-d") == 0) {
+		dump = 1;
+		argc--;
+		argv++;
+	}
+	if (argc > 1)
+		events = atoi(argv[1]);
+	stream = sGenerate(events, &size);
+	sink = suinput_sink_create();
+	if (stream == NULL || sink == NULL)
+		return 2;
+
+	ok = sRun(sink, 0, stream, size, events);
+	ok = sRun(sink, 1, stream, size, events) && ok;
+	if (dump)
+		suinput_sink_dump(sink, stdout);
+
+	suinput_sink_destroy(sink);
+	free(stream);
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 1;
+}
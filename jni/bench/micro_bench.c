@@ -0,0 +1,672 @@
+/*
+ * uSynergy client -- Microbenchmarks of the protocol and injection paths
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+
+/*
+ * Times the pieces of the input path one by one: the frame parser of the
+ * receive thread, message dispatch per message type, the byte order
+ * helpers, the key table, reply assembly, and uinput writes into the
+ * recording sink (suinput_sink.h) unbatched, coalesced and through
+ * io_uring.
+
+ * uSynergy.c is compiled into this file so its static helpers can be
+ * called directly. Every benchmark is warmed up while its batch size is
+ * calibrated to about USYNERGY_MICRO_SAMPLE_NS, then timed in
+ * USYNERGY_MICRO_SAMPLES batches. It reports the median time per item with
+ * the spread of the batches, and where it applies the system calls per
+ * item: transport sends for replies, device writes reaching the sink for
+ * injection (with io_uring these are write operations, several of which
+ * go out with one io_uring_enter()).
+
+ * Host build, from jni/:
+ *	gcc -O2 -std=gnu99 -D_GNU_SOURCE -I. bench/micro_bench.c android.c \
+ *		transport.c capture.c ioengine.c suinput.c suinput_sink.c \
+ *		cliptext.c bmp.c histogram.c stats.c -lpthread -lm -o microbench
+
+ * Usage: microbench [-c] [filter]
+ *	-c	comma separated output (name, median, min, max, stddev ns per
+ *		item, calls per item) for tracking across commits
+ *	filter	only run benchmarks whose name contains it
+ */
+
+#include "uSynergy.c"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "transport.h"
+#include "android.h"
+#include "ioengine.h"
+#include "suinput.h"
+#include "suinput_sink.h"
+
+/* Time of one timed batch, and batches per benchmark */
+#define USYNERGY_MICRO_SAMPLE_NS	20000000ull
+#define USYNERGY_MICRO_SAMPLES		15
+
+/*
+ * @brief A benchmark: @a run processes @a count items and returns the
+ * nanoseconds spent on them, @a calls (if set) the system calls made since
+ * the last @a reset
+ */
+typedef struct {
+	const char *name;
+	uint64_t (*run)(void *arg, uint64_t count);
+	void *arg;
+	void (*reset)(void *arg);
+	uint64_t (*calls)(void *arg);
+} sMicroBench;
+
+static volatile uint64_t sMicroSink;
+static uint64_t sMicroSends;
+
+static uint64_t sMicroNow(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+//-----------------------------------------------------------------------------
+//	Client under test
+//-----------------------------------------------------------------------------
+
+static uSynergyBool sMicroConnect(uSynergyCookie cookie)
+{
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sMicroSend(uSynergyCookie cookie, const uint8_t *buffer,
+	int length)
+{
+	sMicroSends++;
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sMicroReceive(uSynergyCookie cookie, uint8_t *buffer,
+	int maxLength, int *outLength)
+{
+	return USYNERGY_FALSE;
+}
+
+static void sMicroClose(uSynergyCookie cookie)
+{
+}
+
+/* Replies are counted, one transport send stands for one send() */
+static const uSynergyTransport sMicroTransport = {
+	.m_name             = "micro",
+	.m_connectFunc      = sMicroConnect,
+	.m_sendFunc         = sMicroSend,
+	.m_receiveFunc      = sMicroReceive,
+	.m_closeFunc        = sMicroClose,
+};
+
+static uSynergyBool sMicroMouseMove(uSynergyCookie cookie, int32_t x,
+	int32_t y)
+{
+	sMicroSink += (uint32_t)x;
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sMicroMouseButtons(uSynergyCookie cookie,
+	uSynergyBool left, uSynergyBool right, uSynergyBool middle)
+{
+	sMicroSink += left;
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sMicroMouseWheel(uSynergyCookie cookie, int16_t x,
+	int16_t y)
+{
+	sMicroSink += (uint16_t)y;
+	return USYNERGY_TRUE;
+}
+
+static void sMicroKeyboard(uSynergyCookie cookie, uint16_t key,
+	uint16_t modifiers, uSynergyBool down, uSynergyBool repeat)
+{
+	sMicroSink += key;
+}
+
+/*
+ * @brief A context in the state of an entered session, with counting
+ * callbacks and transport
+ */
+static uSynergyContext *sMicroContext(void)
+{
+	uSynergyContext *context = uSynergyCreate(&uSynergyAndroidPlatform,
+		"microbench", 1024, 600, NULL);
+
+	if (context == NULL)
+		return NULL;
+	context->m_transport = &sMicroTransport;
+	context->m_mouseMoveCallback = sMicroMouseMove;
+	context->m_mouseDownCallback = sMicroMouseButtons;
+	context->m_mouseUpCallback = sMicroMouseButtons;
+	context->m_mouseWheelCallback = sMicroMouseWheel;
+	context->m_keyboardCallback = sMicroKeyboard;
+	context->m_clipboardCallback = NULL;
+	context->m_connected = USYNERGY_TRUE;
+	context->m_hasReceivedHello = USYNERGY_TRUE;
+	context->m_isCaptured = USYNERGY_TRUE;
+	return context;
+}
+
+static uint8_t *sMicroPut16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+/*
+ * @brief Append a message with @a size body bytes, @returns the body
+ */
+static uint8_t *sMicroMessage(uint8_t **p, const char *id, uint32_t size)
+{
+	uint8_t *m = *p;
+	uint32_t length = 4 + size;
+
+	m[0] = length >> 24;
+	m[1] = length >> 16;
+	m[2] = length >> 8;
+	m[3] = length;
+	memcpy(m + 4, id, 4);
+	*p = m + 8 + size;
+	return m + 8;
+}
+
+//-----------------------------------------------------------------------------
+//	Decoding and key table
+//-----------------------------------------------------------------------------
+
+static uint8_t sMicroBytes[4096];
+
+static uint64_t sMicroDecode16(void *arg, uint64_t count)
+{
+	uint64_t start = sMicroNow(), i, sum = 0;
+
+	for (i = 0; i < count; i++)
+		sum += (uint16_t)sNetToNative16(sMicroBytes + (i & 4093));
+	sMicroSink = sum;
+	return sMicroNow() - start;
+}
+
+static uint64_t sMicroDecode32(void *arg, uint64_t count)
+{
+	uint64_t start = sMicroNow(), i, sum = 0;
+
+	for (i = 0; i < count; i++)
+		sum += (uint32_t)sNetToNative32(sMicroBytes + (i & 4091));
+	sMicroSink = sum;
+	return sMicroNow() - start;
+}
+
+static uint64_t sMicroKeyLookup(void *arg, uint64_t count)
+{
+	uint64_t start = sMicroNow(), i, sum = 0;
+
+	/* Key ids as a server sends them, letters and the 0xefxx specials */
+	for (i = 0; i < count; i++)
+		sum += (uint32_t)keyTranslation[(i & 1) ? 'a' + i % 26
+			: 0xef00 + (i & 0xff)];
+	sMicroSink = sum;
+	return sMicroNow() - start;
+}
+
+//-----------------------------------------------------------------------------
+//	Replies and dispatch
+//-----------------------------------------------------------------------------
+
+static uint64_t sMicroReply(void *arg, uint64_t count)
+{
+	uSynergyContext *context = arg;
+	uint64_t start = sMicroNow(), i;
+
+	for (i = 0; i < count; i++) {
+		sAddString(context, "CNOP");
+		sSendReply(context);
+	}
+	return sMicroNow() - start;
+}
+
+static uint64_t sMicroReplyInfo(void *arg, uint64_t count)
+{
+	uSynergyContext *context = arg;
+	uint64_t start = sMicroNow(), i;
+
+	/* The DINF answer to QINF, the largest fixed reply */
+	for (i = 0; i < count; i++) {
+		sAddString(context, "DINF");
+		sAddUInt16(context, 0);
+		sAddUInt16(context, 0);
+		sAddUInt16(context, context->m_clientWidth);
+		sAddUInt16(context, context->m_clientHeight);
+		sAddUInt16(context, 0);
+		sAddUInt16(context, (uint16_t)i);
+		sAddUInt16(context, (uint16_t)(i >> 16));
+		sSendReply(context);
+	}
+	return sMicroNow() - start;
+}
+
+/*
+ * @brief Messages of one type cycled through by a dispatch benchmark
+ */
+typedef struct {
+	uSynergyContext *context;
+	const char *id;
+	uint8_t stream[64 * 16];
+	uint32_t offsets[64];
+	uint32_t lengths[64];
+	int count;
+} sMicroMessages;
+
+static void sMicroBuild(sMicroMessages *messages, uSynergyContext *context,
+	const char *id)
+{
+	uint8_t *p = messages->stream, *body;
+	int i;
+
+	messages->context = context;
+	messages->id = id;
+	messages->count = 64;
+	for (i = 0; i < 64; i++) {
+		uint8_t *m = p;
+
+		if (strcmp(id, "DMMV") == 0) {
+			body = sMicroMessage(&p, id, 4);
+			sMicroPut16(sMicroPut16(body, (uint16_t)(i * 13)), (uint16_t)(i * 7));
+		} else if (strcmp(id, "DMDN") == 0) {
+			/* Down and up in turn, so the button state goes back and forth */
+			body = sMicroMessage(&p, (i & 1) ? "DMUP" : "DMDN", 1);
+			*body = 1;
+		} else if (strcmp(id, "DMWM") == 0) {
+			body = sMicroMessage(&p, id, 4);
+			sMicroPut16(sMicroPut16(body, 0), (i & 1) ? 120 : (uint16_t)-120);
+		} else if (strcmp(id, "DKDN") == 0) {
+			body = sMicroMessage(&p, (i & 1) ? "DKUP" : "DKDN", 6);
+			sMicroPut16(sMicroPut16(sMicroPut16(body, 'a' + i / 2 % 26), 0), 30);
+		} else {
+			sMicroMessage(&p, id, 0);
+		}
+		messages->offsets[i] = (uint32_t)(m - messages->stream);
+		messages->lengths[i] = (uint32_t)(p - m);
+	}
+}
+
+static uint64_t sMicroProcess(void *arg, uint64_t count)
+{
+	sMicroMessages *messages = arg;
+	uSynergyContext *context = messages->context;
+	uint64_t start = sMicroNow(), i;
+
+	for (i = 0; i < count; i++) {
+		int n = (int)(i & 63);
+
+		sProcessMessage(context, messages->stream + messages->offsets[n],
+			messages->lengths[n]);
+	}
+	return sMicroNow() - start;
+}
+
+/*
+ * @brief The whole dispatch of a message: counters, latency, trace ring
+ */
+static uint64_t sMicroDispatch(void *arg, uint64_t count)
+{
+	sMicroMessages *messages = arg;
+	uSynergyContext *context = messages->context;
+	uint64_t start = sMicroNow(), now = start, i;
+
+	for (i = 0; i < count; i++) {
+		int n = (int)(i & 63);
+
+		sDispatch(context, messages->stream + messages->offsets[n],
+			messages->lengths[n], now);
+	}
+	sFlushInput(context);
+	return sMicroNow() - start;
+}
+
+static void sMicroResetSends(void *arg)
+{
+	sMicroSends = 0;
+}
+
+static uint64_t sMicroCountSends(void *arg)
+{
+	return sMicroSends;
+}
+
+//-----------------------------------------------------------------------------
+//	Framer
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief A read worth of mouse moves and how the parser gets it
+ */
+typedef struct {
+	uSynergyContext *context;
+	uint8_t *stream;
+	int size;
+	int frames;
+	/* Bytes per parser call, 0 for the whole read at once */
+	int chunk;
+} sMicroFramer;
+
+static uint64_t sMicroParse(void *arg, uint64_t count)
+{
+	sMicroFramer *framer = arg;
+	uSynergyContext *context = framer->context;
+	uint64_t elapsed = 0, done, start;
+	int ofs, n;
+
+	for (done = 0; done < count; done += (uint64_t)framer->frames) {
+		start = sMicroNow();
+		for (ofs = 0; ofs < framer->size; ofs += n) {
+			n = framer->chunk ? framer->chunk : framer->size;
+			if (n > framer->size - ofs)
+				n = framer->size - ofs;
+			sParseStream(context, framer->stream + ofs, n);
+		}
+		elapsed += sMicroNow() - start;
+
+		/* Play the dispatcher: empty the queue, outside the timing */
+		context->m_receiveOfs = 0;
+		context->m_receiveReadOfs = 0;
+		context->m_frameStampRead = context->m_frameStampWrite;
+		while (sem_trywait(&context->reciveOfsSem) == 0)
+			;
+	}
+	return elapsed;
+}
+
+static void sMicroBuildFramer(sMicroFramer *framer, uSynergyContext *context,
+	int chunk)
+{
+	uint8_t *p, *body;
+	int i;
+
+	/* As many 12 byte moves as one read of the receive thread takes */
+	framer->context = context;
+	framer->frames = (int)(context->m_sizes.m_readSize / 12);
+	if (framer->frames * 12 > (int)context->m_sizes.m_receiveSize)
+		framer->frames = (int)(context->m_sizes.m_receiveSize / 12);
+	framer->size = framer->frames * 12;
+	framer->stream = p = malloc((size_t)framer->size);
+	framer->chunk = chunk;
+	for (i = 0; framer->stream != NULL && i < framer->frames; i++) {
+		body = sMicroMessage(&p, "DMMV", 4);
+		sMicroPut16(sMicroPut16(body, (uint16_t)i), (uint16_t)(i * 3));
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	Injection
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Mouse moves through the Android callbacks into the sink
+ */
+typedef struct {
+	uSynergyContext *context;
+	suinput_sink *sink;
+	/* No engine: one write() per event. Otherwise flushed per burst */
+	uSynergyIoEngine *engine;
+} sMicroInject;
+
+static uint64_t sMicroInjectMoves(void *arg, uint64_t count)
+{
+	sMicroInject *inject = arg;
+	uSynergyCookie cookie = inject->context->m_cookie;
+	uint64_t start = sMicroNow(), i;
+
+	for (i = 0; i < count; i++) {
+		uSynergyAndroidPlatform.m_mouseMoveCallback(cookie, 1 + (int32_t)(i & 7),
+			-1);
+		if (inject->engine != NULL && (i + 1) % USYNERGY_LATENCY_BATCH == 0)
+			uSynergyIoFlush(inject->engine);
+	}
+	if (inject->engine != NULL)
+		uSynergyIoFlush(inject->engine);
+	return sMicroNow() - start;
+}
+
+static void sMicroInjectReset(void *arg)
+{
+	sMicroInject *inject = arg;
+
+	suinput_sink_sync(inject->sink);
+	suinput_sink_reset(inject->sink);
+}
+
+static uint64_t sMicroInjectCalls(void *arg)
+{
+	sMicroInject *inject = arg;
+	suinput_sink_stats stats;
+
+	suinput_sink_sync(inject->sink);
+	suinput_sink_get_stats(inject->sink, &stats);
+	return stats.writes;
+}
+
+/*
+ * @brief Open the devices of @a inject in the sink, @a ring selects the
+ * engine: -1 none, 0 coalescing, 1 io_uring
+ */
+static int sMicroBuildInject(sMicroInject *inject, suinput_sink *sink,
+	int ring)
+{
+	uSynergyCookie cookie;
+
+	inject->sink = sink;
+	inject->context = sMicroContext();
+	if (inject->context == NULL)
+		return 0;
+	cookie = inject->context->m_cookie;
+	cookie->injection = suinput_sink_backend(sink);
+	inject->engine = ring >= 0 ? uSynergyIoCreate(ring, NULL) : NULL;
+	if (ring > 0 && inject->engine != NULL
+		&& !uSynergyIoUsingRing(inject->engine)) {
+		uSynergyIoDestroy(inject->engine);
+		inject->engine = NULL;
+		return 0;
+	}
+	cookie->tx_io = inject->engine;
+	if (!uSynergyAndroidPlatform.m_connectDevice(cookie))
+		return 0;
+	uSynergyAndroidPlatform.m_attachDevice(cookie);
+	return 1;
+}
+
+static void sMicroFreeInject(sMicroInject *inject)
+{
+	if (inject->context == NULL)
+		return;
+	uSynergyAndroidPlatform.m_disconnectDevice(inject->context->m_cookie);
+	inject->context->m_cookie->tx_io = NULL;
+	uSynergyIoDestroy(inject->engine);
+	uSynergyDestroy(inject->context);
+}
+
+//-----------------------------------------------------------------------------
+//	Harness
+//-----------------------------------------------------------------------------
+
+static int sMicroCompare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void sMicroRun(const sMicroBench *bench, int csv)
+{
+	double samples[USYNERGY_MICRO_SAMPLES], mean = 0, variance = 0;
+	uint64_t count = 64, elapsed, calls = 0, items = 0;
+	double perCall = -1;
+	int i;
+
+	/* Warm up while finding a batch that takes about a sample's time */
+	while ((elapsed = bench->run(bench->arg, count))
+		< USYNERGY_MICRO_SAMPLE_NS / 4 && count < ((uint64_t)1 << 40))
+		count *= 2;
+	if (elapsed > 0)
+		count = count * USYNERGY_MICRO_SAMPLE_NS / elapsed + 1;
+	bench->run(bench->arg, count);
+
+	for (i = 0; i < USYNERGY_MICRO_SAMPLES; i++) {
+		if (bench->reset != NULL)
+			bench->reset(bench->arg);
+		samples[i] = (double)bench->run(bench->arg, count) / count;
+		if (bench->calls != NULL) {
+			calls += bench->calls(bench->arg);
+			items += count;
+		}
+		mean += samples[i];
+	}
+	mean /= USYNERGY_MICRO_SAMPLES;
+	for (i = 0; i < USYNERGY_MICRO_SAMPLES; i++)
+		variance += (samples[i] - mean) * (samples[i] - mean);
+	variance /= USYNERGY_MICRO_SAMPLES - 1;
+	qsort(samples, USYNERGY_MICRO_SAMPLES, sizeof(double), sMicroCompare);
+	if (items > 0)
+		perCall = (double)calls / items;
+
+	if (csv) {
+		printf("%s,%.2f,%.2f,%.2f,%.2f,", bench->name,
+			samples[USYNERGY_MICRO_SAMPLES / 2], samples[0],
+			samples[USYNERGY_MICRO_SAMPLES - 1], sqrt(variance));
+		if (perCall >= 0)
+			printf("%.4f", perCall);
+		printf("\n");
+	} else {
+		printf("%-22s %9.2f ns  (min %9.2f  max %9.2f  sd %7.2f)", bench->name,
+			samples[USYNERGY_MICRO_SAMPLES / 2], samples[0],
+			samples[USYNERGY_MICRO_SAMPLES - 1], sqrt(variance));
+		if (perCall >= 0)
+			printf("  %.4f calls", perCall);
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *types[] = { "DMMV", "DMDN", "DMWM", "DKDN", "CALV",
+		"QINF" };
+	static const char *typeNames[] = { "dispatch/move", "dispatch/button",
+		"dispatch/wheel", "dispatch/key", "dispatch/keepalive",
+		"dispatch/info" };
+	sMicroMessages messages[6], mix;
+	sMicroFramer whole, split;
+	sMicroInject inject[3];
+	sMicroBench benches[32];
+	uSynergyContext *context;
+	suinput_sink *sink;
+	const char *filter = NULL;
+	int csv = 0, count = 0, i;
+
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		csv = 1;
+		argc--;
+		argv++;
+	}
+	if (argc > 1)
+		filter = argv[1];
+
+	context = sMicroContext();
+	sink = suinput_sink_create();
+	if (context == NULL || sink == NULL)
+		return 2;
+	for (i = 0; i < (int)sizeof(sMicroBytes); i++)
+		sMicroBytes[i] = (uint8_t)(i * 31 + 7);
+
+	benches[count++] = (sMicroBench){ "decode/net16", sMicroDecode16 };
+	benches[count++] = (sMicroBench){ "decode/net32", sMicroDecode32 };
+	benches[count++] = (sMicroBench){ "keymap/lookup", sMicroKeyLookup };
+	benches[count++] = (sMicroBench){ "reply/cnop", sMicroReply, context,
+		sMicroResetSends, sMicroCountSends };
+	benches[count++] = (sMicroBench){ "reply/dinf", sMicroReplyInfo, context,
+		sMicroResetSends, sMicroCountSends };
+
+	for (i = 0; i < 6; i++) {
+		sMicroBuild(&messages[i], context, types[i]);
+		benches[count++] = (sMicroBench){ typeNames[i], sMicroProcess,
+			&messages[i], sMicroResetSends, sMicroCountSends };
+	}
+	sMicroBuild(&mix, context, "DMMV");
+	benches[count++] = (sMicroBench){ "dispatch/full-move", sMicroDispatch,
+		&mix, sMicroResetSends, sMicroCountSends };
+
+	sMicroBuildFramer(&whole, context, 0);
+	sMicroBuildFramer(&split, context, 7);
+	if (whole.stream == NULL || split.stream == NULL)
+		return 2;
+	benches[count++] = (sMicroBench){ "framer/whole-reads", sMicroParse,
+		&whole };
+	benches[count++] = (sMicroBench){ "framer/7-byte-reads", sMicroParse,
+		&split };
+
+	/* One thread writes to all devices, so one writer at a time */
+	memset(inject, 0, sizeof(inject));
+	if (sMicroBuildInject(&inject[0], sink, -1))
+		benches[count++] = (sMicroBench){ "inject/move-direct",
+			sMicroInjectMoves, &inject[0], sMicroInjectReset,
+			sMicroInjectCalls };
+	for (i = 0; i < count; i++) {
+		if (filter == NULL || strstr(benches[i].name, filter) != NULL)
+			sMicroRun(&benches[i], csv);
+	}
+	sMicroFreeInject(&inject[0]);
+
+	count = 0;
+	if (sMicroBuildInject(&inject[1], sink, 0))
+		benches[count++] = (sMicroBench){ "inject/move-batched",
+			sMicroInjectMoves, &inject[1], sMicroInjectReset,
+			sMicroInjectCalls };
+	for (i = 0; i < count; i++) {
+		if (filter == NULL || strstr(benches[i].name, filter) != NULL)
+			sMicroRun(&benches[i], csv);
+	}
+	sMicroFreeInject(&inject[1]);
+
+	count = 0;
+	if (sMicroBuildInject(&inject[2], sink, 1))
+		benches[count++] = (sMicroBench){ "inject/move-io_uring",
+			sMicroInjectMoves, &inject[2], sMicroInjectReset,
+			sMicroInjectCalls };
+	for (i = 0; i < count; i++) {
+		if (filter == NULL || strstr(benches[i].name, filter) != NULL)
+			sMicroRun(&benches[i], csv);
+	}
+	sMicroFreeInject(&inject[2]);
+
+	uSynergyDestroy(context);
+	suinput_sink_destroy(sink);
+	free(whole.stream);
+	free(split.stream);
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * uSynergy client -- Capture replay throughput benchmark
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+
+/*
+ * Replays a capture file (see uSynergyCaptureTransport, "usynergy -w")
+ * through a client as fast as it takes the data, with the replies checked
+ * against the recorded ones, and reports the throughput. Input callbacks
+ * only count, so the numbers are the cost of the protocol path. A reply
+ * that differs from the capture fails the run, which makes a set of
+ * captured sessions a regression test as well.
+
+ * Usage: replaybench <capture-file> [iterations] [client-name]
+ *	client-name must be the one the capture was made with, as it goes into
+ *	the hello reply (default "android", the name usynergy gives a single
+ *	client)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "uSynergy.h"
+#include "transport.h"
+#include "android.h"
+
+static uint64_t sEvents = 0;
+
+static double sNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * @brief Skip the back-off after the end of a session, it is not data time
+ */
+static void sSleep(uSynergyCookie cookie, int timeMs)
+{
+}
+
+static uSynergyBool sConnectDevice(uSynergyCookie cookie)
+{
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sMouseMove(uSynergyCookie cookie, int32_t x, int32_t y)
+{
+	sEvents++;
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sMouseButtons(uSynergyCookie cookie, uSynergyBool left,
+	uSynergyBool right, uSynergyBool middle)
+{
+	sEvents++;
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sMouseWheel(uSynergyCookie cookie, int16_t x, int16_t y)
+{
+	sEvents++;
+	return USYNERGY_TRUE;
+}
+
+static void sKeyboard(uSynergyCookie cookie, uint16_t key,
+	uint16_t modifiers, uSynergyBool down, uSynergyBool repeat)
+{
+	sEvents++;
+}
+
+static void sClipboard(uSynergyCookie cookie,
+	enum uSynergyClipboardFormat format, const uint8_t *data, uint32_t size)
+{
+	sEvents++;
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = argc > 2 ? atoi(argv[2]) : 20;
+	const char *name = argc > 3 ? argv[3] : "android";
+	uSynergyReplayStats replay;
+	uSynergyCounters counters;
+	uSynergyContext *context;
+	double start, elapsed;
+	uint64_t messages = 0;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: replaybench <capture-file> [iterations] "
+			"[client-name]\n");
+		return 2;
+	}
+	if (iterations < 1)
+		iterations = 1;
+	context = uSynergyCreate(&uSynergyAndroidPlatform, name, 1024, 600,
+		NULL);
+	if (context == NULL)
+		return 2;
+	context->m_transport = &uSynergyReplayTransport;
+	context->m_cookie->replay_path = argv[1];
+	context->m_cookie->replay_verify = 1;
+	context->m_rttProbeInterval = 0;
+	context->m_sleepFunc = sSleep;
+	context->m_connectDevice = sConnectDevice;
+	context->m_disconnectDevice = NULL;
+	context->m_mouseMoveCallback = sMouseMove;
+	context->m_mouseDownCallback = sMouseButtons;
+	context->m_mouseUpCallback = sMouseButtons;
+	context->m_mouseWheelCallback = sMouseWheel;
+	context->m_keyboardCallback = sKeyboard;
+	context->m_clipboardCallback = sClipboard;
+
+	start = sNow();
+	for (i = 0; i < iterations; i++) {
+		uSynergyReplayRewind(context->m_cookie);
+		do {
+			uSynergyStart(context);
+			uSynergyReplayGetStats(context->m_cookie, &replay);
+		} while (replay.m_sessions > 0 && !replay.m_done);
+		if (replay.m_sessions == 0) {
+			fprintf(stderr, "cannot replay %s\n", argv[1]);
+			uSynergyDestroy(context);
+			return 2;
+		}
+	}
+	elapsed = sNow() - start;
+
+	uSynergyGetCounters(context, &counters);
+	for (i = 0; i < USYNERGY_NUM_LATENCY_TYPES; i++)
+		messages += counters.m_messages[i];
+	printf("%d iterations, %u sessions in %.3f s\n", iterations,
+		replay.m_sessions, elapsed);
+	printf("%llu messages  %.0f messages/s  %.1f MB/s  %llu events\n",
+		(unsigned long long)messages, messages / elapsed,
+		replay.m_bytesReplayed / elapsed / 1e6,
+		(unsigned long long)sEvents);
+	printf("%llu reply bytes verified, %llu mismatches\n",
+		(unsigned long long)replay.m_bytesVerified,
+		(unsigned long long)replay.m_mismatches);
+	uSynergyDestroy(context);
+
+	if (replay.m_mismatches > 0) {
+		printf("FAIL: first difference at reply byte %lld of its session\n",
+			(long long)replay.m_firstMismatch);
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
@@ -0,0 +1,326 @@
+/*
+ * uSynergy client -- Time to first event benchmark
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+
+/*
+ * Starts a client against the stand-in server (fake_server.c) again and
+ * again and reports, from the startup phase times the client records (see
+ * uSynergyGetStartupTimes()), how long each step of the startup takes and
+ * when the first event reaches the devices. By default every cycle creates
+ * a new context, as when the service starts, and times are counted from
+ * uSynergyCreate(); with -r one context is reused, as on a reconnect, and
+ * times are counted from uSynergyStart(). The step of a phase is the time
+ * since the last phase reached before it, as the devices come up alongside
+ * resolve and connect.
+
+ * The devices go to the recording sink (suinput_sink.h) unless -u is
+ * given. The sink creates devices at once, -d adds the settle time the
+ * uinput backend sleeps after creating each device, to see its share
+ * without root.
+
+ * Usage: startupbench [-r] [-u] [-d ms] [-S fakeserver] [cycles]
+ *	-r		reuse one context (reconnect) instead of a new one per cycle
+ *	-u		open real uinput devices (needs /dev/uinput)
+ *	-d ms		settle time after creating each sink device
+ *	-S path		stand-in server binary, default fakeserver next to this one
+ *	cycles		number of startups (default 20)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "uSynergy.h"
+#include "transport.h"
+#include "android.h"
+#include "suinput_sink.h"
+
+/* How long a cycle may take to its first event */
+#define STARTUPBENCH_TIMEOUT_NS		30000000000ull
+
+/* Rows of the report: context ready, run started, then the phases */
+#define STARTUPBENCH_ROWS			(USYNERGY_NUM_STARTUP_PHASES + 1)
+
+static volatile int sDone = 0;
+static int sSettleMs = 0;
+
+static uint64_t sNow(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * @brief Sink device creation followed by the settle time of -d
+ */
+static int sSettleOpen(void *arg, const char *device_name,
+	const struct input_id *id, device_type type)
+{
+	const suinput_backend *sink = arg;
+	int fd = sink->open(sink->arg, device_name, id, type);
+
+	if (fd >= 0 && sSettleMs > 0)
+		usleep((useconds_t)sSettleMs * 1000);
+	return fd;
+}
+
+static int sSettleDestroy(void *arg, int uinput_fd)
+{
+	const suinput_backend *sink = arg;
+
+	return sink->destroy(sink->arg, uinput_fd);
+}
+
+static void *sRunClient(void *arg)
+{
+	uSynergyStart(arg);
+	sDone = 1;
+	return NULL;
+}
+
+/*
+ * @brief Start the stand-in server on @a address, sending moves at 1 kHz
+ * once the screen is entered
+
+ * @returns Its pid once it listens, -1 on failure
+ */
+static pid_t sSpawnServer(const char *path, const char *address)
+{
+	char line[256];
+	int fds[2];
+	FILE *out;
+	pid_t pid;
+
+	if (pipe(fds) < 0)
+		return -1;
+	pid = fork();
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl(path, path, "-s", "0", "-t", "3600", "-m", "1000", "-a", "0",
+			address, (char *)NULL);
+		perror(path);
+		_exit(127);
+	}
+	close(fds[1]);
+	if (pid < 0) {
+		close(fds[0]);
+		return -1;
+	}
+
+	/* The first line says it listens, its session reports are not needed */
+	out = fdopen(fds[0], "r");
+	if (out == NULL || fgets(line, sizeof(line), out) == NULL
+		|| strncmp(line, "listening", 9) != 0) {
+		if (out != NULL)
+			fclose(out);
+		else
+			close(fds[0]);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	fclose(out);
+	return pid;
+}
+
+static int sCompare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double sMedian(double *samples, int count)
+{
+	qsort(samples, count, sizeof(double), sCompare);
+	return samples[count / 2];
+}
+
+int main(int argc, char **argv)
+{
+	const char *server = NULL;
+	char serverPath[1024], address[64], *slash;
+	suinput_backend settle;
+	suinput_sink *sink = NULL;
+	uSynergyContext *context = NULL;
+	double *at[STARTUPBENCH_ROWS], *step[STARTUPBENCH_ROWS], *column;
+	int reuse = 0, uinput = 0, cycles = 20, done = 0, failed = 0;
+	int row, i;
+	pid_t pid;
+
+	while (argc > 1 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-r") == 0) {
+			reuse = 1;
+		} else if (strcmp(argv[1], "-u") == 0) {
+			uinput = 1;
+		} else if (argc > 2 && strcmp(argv[1], "-d") == 0) {
+			sSettleMs = atoi(argv[2]);
+			argc--;
+			argv++;
+		} else if (argc > 2 && strcmp(argv[1], "-S") == 0) {
+			server = argv[2];
+			argc--;
+			argv++;
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[1]);
+			return 2;
+		}
+		argc--;
+		argv++;
+	}
+	if (argc > 1)
+		cycles = atoi(argv[1]);
+	if (cycles < 1)
+		cycles = 1;
+	if (server == NULL) {
+		snprintf(serverPath, sizeof(serverPath), "%s", argv[0]);
+		slash = strrchr(serverPath, '/');
+		snprintf(slash != NULL ? slash + 1 : serverPath,
+			sizeof(serverPath) - (slash != NULL ? slash + 1 - serverPath : 0),
+			"fakeserver");
+		server = serverPath;
+	}
+
+	for (row = 0; row < STARTUPBENCH_ROWS; row++) {
+		at[row] = calloc((size_t)cycles, sizeof(double));
+		step[row] = calloc((size_t)cycles, sizeof(double));
+		if (at[row] == NULL || step[row] == NULL)
+			return 2;
+	}
+	if (!uinput) {
+		sink = suinput_sink_create();
+		if (sink == NULL)
+			return 2;
+		settle.name = "settle";
+		settle.open = sSettleOpen;
+		settle.destroy = sSettleDestroy;
+		settle.arg = (void *)suinput_sink_backend(sink);
+	}
+
+	snprintf(address, sizeof(address), "unix:@usynergy-startupbench-%d",
+		(int)getpid());
+	pid = sSpawnServer(server, address);
+	if (pid < 0) {
+		fprintf(stderr, "could not start %s\n", server);
+		return 2;
+	}
+
+	for (i = 0; i < cycles; i++) {
+		uSynergyStartupTimes times;
+		uint64_t base, previous, deadline, reached[STARTUPBENCH_ROWS];
+		pthread_t client;
+
+		if (context == NULL) {
+			context = uSynergyCreate(&uSynergyAndroidPlatform, "startupbench",
+				1024, 600, NULL);
+			if (context == NULL)
+				return 2;
+			context->m_transport = &uSynergyUnixTransport;
+			context->m_cookie->unix_path = address + 5;
+			context->m_cookie->injection = uinput ? NULL : &settle;
+		}
+
+		sDone = 0;
+		pthread_create(&client, NULL, sRunClient, context);
+		deadline = sNow() + STARTUPBENCH_TIMEOUT_NS;
+		do {
+			usleep(200);
+			uSynergyGetStartupTimes(context, &times);
+		} while (times.m_phases[USYNERGY_STARTUP_FIRST_EVENT] == 0 && !sDone
+			&& sNow() < deadline);
+		uSynergyStop(context);
+		pthread_join(client, NULL);
+
+		if (times.m_phases[USYNERGY_STARTUP_FIRST_EVENT] == 0) {
+			failed++;
+		} else {
+			/* Cold starts count from the context's creation */
+			base = reuse ? times.m_phases[USYNERGY_STARTUP_RUN]
+				: times.m_created;
+			for (row = 0; row < STARTUPBENCH_ROWS; row++) {
+				uint64_t t = row == 0 ? times.m_initialized
+					: times.m_phases[row - 1];
+				int earlier;
+
+				if (reuse && row < 2)
+					t = base;
+				/* Phases overlap, a step starts at the last one before */
+				previous = base;
+				for (earlier = 0; earlier < row; earlier++) {
+					if (reached[earlier] <= t && reached[earlier] > previous)
+						previous = reached[earlier];
+				}
+				reached[row] = t;
+				at[row][done] = (t - base) / 1e6;
+				step[row][done] = (t - previous) / 1e6;
+			}
+			done++;
+		}
+
+		if (!reuse) {
+			uSynergyDestroy(context);
+			context = NULL;
+		}
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	printf("%d startups (%s, %s devices", done,
+		reuse ? "reconnect, from uSynergyStart()"
+		: "cold, from uSynergyCreate()", uinput ? "uinput" : "sink");
+	if (!uinput && sSettleMs > 0)
+		printf(" settling %d ms", sSettleMs);
+	printf("), %d without a first event\n", failed);
+	if (done > 0) {
+		printf("  %-12s %10s %10s %10s %10s\n", "phase", "p50 ms", "min ms",
+			"max ms", "step ms");
+		for (row = reuse ? 2 : 0; row < STARTUPBENCH_ROWS; row++) {
+			double median;
+
+			column = at[row];
+			median = sMedian(column, done);
+			printf("  %-12s %10.3f %10.3f %10.3f %10.3f\n",
+				row == 0 ? "init" : uSynergyStartupPhaseName(row - 1), median,
+				column[0], column[done - 1], sMedian(step[row], done));
+		}
+	}
+
+	if (context != NULL)
+		uSynergyDestroy(context);
+	if (sink != NULL)
+		suinput_sink_destroy(sink);
+	for (row = 0; row < STARTUPBENCH_ROWS; row++) {
+		free(at[row]);
+		free(step[row]);
+	}
+	return failed > 0 ? 1 : 0;
+}
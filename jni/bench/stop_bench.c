@@ -0,0 +1,251 @@
+/*
+ * uSynergy client -- Stop and restart latency benchmark
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+/*
+ * Starts and stops one client over the socketpair transport again and
+ * again, and reports how long uSynergyStop() takes to bring the session
+ * down (threads joined, devices released) and how long a restart takes
+ * until the screen is entered again. Half of the stops hit an idle client
+ * blocked in recv(), the other half a client busy with a mouse stream.
+ * Every cycle must leave the context's arena exactly as full as the first
+ * one did, and the counters must start on a cache line of their own; FAIL
+ * is printed and 1 returned otherwise.
+
+ * Usage: stopbench [cycles]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "uSynergy.h"
+#include "transport.h"
+#include "android.h"
+
+static volatile int sPeer = -1;
+static volatile int sEntered = 0;
+static volatile int sStreaming = 0;
+
+static double sNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sPeerReady(void *arg, int peer_fd)
+{
+	sPeer = peer_fd;
+}
+
+static uSynergyBool sConnectDevice(uSynergyCookie cookie)
+{
+	return USYNERGY_TRUE;
+}
+
+static void sScreenActive(uSynergyCookie cookie, uSynergyBool active)
+{
+	if (active)
+		sEntered = 1;
+}
+
+static uSynergyBool sMouseMove(uSynergyCookie cookie, int32_t x, int32_t y)
+{
+	return USYNERGY_TRUE;
+}
+
+static void *sRunClient(void *arg)
+{
+	uSynergyStart(arg);
+	return NULL;
+}
+
+static uint8_t *sPut16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static uint8_t *sPut32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+/*
+ * @brief Send hello, info query and enter
+ */
+static void sHandshake(int fd)
+{
+	uint8_t buffer[128], *p = buffer;
+
+	p = sPut32(p, 11);
+	memcpy(p, "Synergy", 7);
+	p = sPut16(sPut16(p + 7, 1), 6);
+	p = sPut32(p, 4);
+	memcpy(p, "QINF", 4);
+	p += 4;
+	p = sPut32(p, 14);
+	memcpy(p, "CINN", 4);
+	p = sPut16(sPut32(sPut16(sPut16(p + 4, 100), 100), 1), 0);
+	send(fd, buffer, p - buffer, MSG_NOSIGNAL);
+}
+
+/*
+ * @brief Feed mouse moves until the client hangs up
+ */
+static void *sStream(void *arg)
+{
+	uint8_t buffer[12 * 256], *p;
+	int i, n = 0;
+
+	while (sStreaming) {
+		for (i = 0, p = buffer; i < 256; i++, n++) {
+			p = sPut32(p, 8);
+			memcpy(p, "DMMV", 4);
+			p = sPut16(sPut16(p + 4, n % 1000), n % 700);
+		}
+		if (send(sPeer, buffer, p - buffer, MSG_NOSIGNAL) < 0)
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * @brief Swallow the client's replies
+ */
+static void *sDrain(void *arg)
+{
+	uint8_t buffer[4096];
+
+	while (recv(sPeer, buffer, sizeof(buffer), 0) > 0)
+		;
+	return NULL;
+}
+
+static int sCompare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void sReport(const char *name, double *samples, int count)
+{
+	qsort(samples, count, sizeof(double), sCompare);
+	printf("%-12s n=%-4d min %8.1f us  p50 %8.1f us  p99 %8.1f us  max %8.1f us\n",
+		name, count, samples[0] * 1e6, samples[count / 2] * 1e6,
+		samples[(count * 99) / 100] * 1e6, samples[count - 1] * 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	int cycles = argc > 1 ? atoi(argv[1]) : 200;
+	double *idle, *busy, *restart;
+	int numIdle = 0, numBusy = 0, drift = 0, misaligned, i;
+	size_t used = 0;
+	uSynergyContext *context;
+
+	if (cycles < 2)
+		cycles = 2;
+	idle = malloc(cycles * sizeof(double));
+	busy = malloc(cycles * sizeof(double));
+	restart = malloc(cycles * sizeof(double));
+	context = uSynergyCreate(&uSynergyAndroidPlatform, "stopbench", 1024, 600,
+		NULL);
+	if (idle == NULL || busy == NULL || restart == NULL || context == NULL)
+		return 1;
+	context->m_transport = &uSynergySocketpairTransport;
+	context->m_cookie->peer_ready = sPeerReady;
+	context->m_connectDevice = sConnectDevice;
+	context->m_disconnectDevice = NULL;
+	context->m_screenActiveCallback = sScreenActive;
+	context->m_mouseMoveCallback = sMouseMove;
+	misaligned = (uintptr_t)&context->m_counters % USYNERGY_CACHE_LINE;
+
+	for (i = 0; i < cycles; i++) {
+		pthread_t client, drain, stream;
+		int isBusy = i & 1;
+		double start, stop;
+
+		sPeer = -1;
+		sEntered = 0;
+		start = sNow();
+		pthread_create(&client, NULL, sRunClient, context);
+		while (sPeer < 0)
+			usleep(100);
+		pthread_create(&drain, NULL, sDrain, NULL);
+		sHandshake(sPeer);
+		while (!sEntered)
+			usleep(10);
+		restart[i] = sNow() - start;
+
+		sStreaming = isBusy;
+		if (isBusy)
+			pthread_create(&stream, NULL, sStream, NULL);
+		usleep(2000);
+
+		stop = sNow();
+		uSynergyStop(context);
+		stop = sNow() - stop;
+		if (isBusy)
+			busy[numBusy++] = stop;
+		else
+			idle[numIdle++] = stop;
+
+		sStreaming = 0;
+		pthread_join(client, NULL);
+		if (isBusy)
+			pthread_join(stream, NULL);
+		shutdown(sPeer, SHUT_RDWR);
+		pthread_join(drain, NULL);
+		close(sPeer);
+
+		/* A restart reuses the previous connection's memory */
+		if (i == 0)
+			used = uSynergyArenaMark(context->m_arena);
+		else if (uSynergyArenaMark(context->m_arena) != used)
+			drift++;
+	}
+
+	sReport("stop idle", idle, numIdle);
+	sReport("stop busy", busy, numBusy);
+	sReport("restart", restart, cycles);
+	printf("arena        %zu bytes after the first cycle, %d cycles differ: %s\n",
+		used, drift, drift ? "FAIL" : "PASS");
+	printf("counters     at %d mod %d: %s\n", misaligned, USYNERGY_CACHE_LINE,
+		misaligned ? "FAIL" : "PASS");
+
+	uSynergyDestroy(context);
+	free(idle);
+	free(busy);
+	free(restart);
+	return drift || misaligned ? 1 : 0;
+}
@@ -0,0 +1,312 @@
+/*
+ * uSynergy client -- Streaming BMP codec for clipboard bitmaps
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bmp.h"
+
+/* Largest accepted width or height */
+#define USYNERGY_BMP_MAX_DIMENSION	32768
+
+/* BITMAPINFOHEADER compression values */
+#define USYNERGY_BMP_RGB			0
+#define USYNERGY_BMP_BITFIELDS		3
+
+enum {
+	USYNERGY_BMP_STAGE_SNIFF,
+	USYNERGY_BMP_STAGE_INFO_SIZE,
+	USYNERGY_BMP_STAGE_INFO,
+	USYNERGY_BMP_STAGE_MASKS,
+	USYNERGY_BMP_STAGE_PIXELS,
+	USYNERGY_BMP_STAGE_ERROR,
+};
+
+static uint32_t sLe32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t sLe16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static void sPutLe32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16);
+	p[3] = (uint8_t)(v >> 24);
+}
+
+/*
+ * @brief Check the masks of a BI_BITFIELDS bitmap
+ * Only the BGRA byte order Windows produces is supported.
+ */
+static int sCheckMasks(uSynergyBmpDecoder *decoder, const uint8_t *masks,
+	int haveAlpha)
+{
+	if (sLe32(masks) != 0x00ff0000 || sLe32(masks + 4) != 0x0000ff00
+		|| sLe32(masks + 8) != 0x000000ff)
+		return -1;
+	decoder->m_hasAlpha = haveAlpha && sLe32(masks + 12) == 0xff000000;
+	return 0;
+}
+
+/*
+ * @brief Act on a completed header stage, returns -1 on error
+ */
+static int sHeaderStep(uSynergyBmpDecoder *decoder)
+{
+	const uint8_t *info = decoder->m_header + decoder->m_fileHeaderSize;
+	uint32_t infoSize, compression, colors, pixelOffset;
+	int32_t width, height;
+	uint16_t bpp;
+	uint64_t bytes;
+
+	switch (decoder->m_stage) {
+	case USYNERGY_BMP_STAGE_SNIFF:
+		if (decoder->m_header[0] == 'B' && decoder->m_header[1] == 'M')
+			decoder->m_fileHeaderSize = 14;
+		decoder->m_stage = USYNERGY_BMP_STAGE_INFO_SIZE;
+		decoder->m_headerNeed = decoder->m_fileHeaderSize + 4;
+		return 0;
+
+	case USYNERGY_BMP_STAGE_INFO_SIZE:
+		infoSize = sLe32(info);
+		if (infoSize < 40 || infoSize > 124)
+			return -1;
+		decoder->m_stage = USYNERGY_BMP_STAGE_INFO;
+		decoder->m_headerNeed = decoder->m_fileHeaderSize + infoSize;
+		return 0;
+
+	case USYNERGY_BMP_STAGE_INFO:
+		infoSize	= sLe32(info);
+		compression	= sLe32(info + 16);
+		if (compression == USYNERGY_BMP_BITFIELDS && infoSize == 40) {
+			/* Masks follow a plain BITMAPINFOHEADER */
+			decoder->m_stage = USYNERGY_BMP_STAGE_MASKS;
+			decoder->m_headerNeed += 12;
+			return 0;
+		}
+		/* fall through */
+	case USYNERGY_BMP_STAGE_MASKS:
+		infoSize	= sLe32(info);
+		width		= (int32_t)sLe32(info + 4);
+		height		= (int32_t)sLe32(info + 8);
+		bpp			= sLe16(info + 14);
+		compression	= sLe32(info + 16);
+		colors		= sLe32(info + 32);
+
+		if (width <= 0 || height == 0 || height == INT32_MIN
+			|| width > USYNERGY_BMP_MAX_DIMENSION
+			|| (height > 0 ? height : -height) > USYNERGY_BMP_MAX_DIMENSION)
+			return -1;
+		if (bpp != 24 && bpp != 32)
+			return -1;
+		decoder->m_hasAlpha = 0;
+		if (compression == USYNERGY_BMP_BITFIELDS) {
+			if (bpp != 32)
+				return -1;
+			if (infoSize == 40 ? sCheckMasks(decoder, info + 40, 0)
+				: sCheckMasks(decoder, info + 40, infoSize >= 56))
+				return -1;
+		} else if (compression != USYNERGY_BMP_RGB) {
+			return -1;
+		}
+
+		decoder->m_width			= (uint32_t)width;
+		decoder->m_height			= (uint32_t)(height > 0 ? height : -height);
+		decoder->m_topDown			= height < 0;
+		decoder->m_bytesPerPixel	= bpp / 8;
+		bytes = (uint64_t)decoder->m_width * decoder->m_bytesPerPixel;
+		decoder->m_stride			= (uint32_t)((bytes + 3) & ~3);
+
+		/* Find the first pixel */
+		if (decoder->m_fileHeaderSize) {
+			pixelOffset = sLe32(decoder->m_header + 10);
+			if (pixelOffset < decoder->m_headerNeed)
+				return -1;
+			decoder->m_skip = pixelOffset - decoder->m_headerNeed;
+		} else {
+			/* Palettes are optional for 24/32 bpp, but may be present */
+			if (colors > 256)
+				return -1;
+			decoder->m_skip = colors * 4;
+		}
+
+		decoder->m_rowBuffer = malloc(decoder->m_stride);
+		if (decoder->m_rowBuffer == NULL)
+			return -1;
+		decoder->m_pixels = decoder->m_allocFunc(decoder->m_allocArg,
+			decoder->m_width, decoder->m_height);
+		if (decoder->m_pixels == NULL)
+			return -1;
+		decoder->m_stage = USYNERGY_BMP_STAGE_PIXELS;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * @brief Convert one stored row to RGBA
+ */
+static void sConvertRow(uSynergyBmpDecoder *decoder, const uint8_t *src)
+{
+	uint32_t y = decoder->m_topDown ? decoder->m_row
+		: decoder->m_height - 1 - decoder->m_row;
+	uint8_t *dst = decoder->m_pixels + (size_t)y * decoder->m_width * 4;
+	uint32_t x;
+
+	if (decoder->m_bytesPerPixel == 3) {
+		for (x = 0; x < decoder->m_width; x++, src += 3, dst += 4) {
+			dst[0] = src[2];
+			dst[1] = src[1];
+			dst[2] = src[0];
+			dst[3] = 0xff;
+		}
+	} else {
+		for (x = 0; x < decoder->m_width; x++, src += 4, dst += 4) {
+			dst[0] = src[2];
+			dst[1] = src[1];
+			dst[2] = src[0];
+			dst[3] = decoder->m_hasAlpha ? src[3] : 0xff;
+		}
+	}
+	decoder->m_row++;
+}
+
+void uSynergyBmpBegin(uSynergyBmpDecoder *decoder,
+	uSynergyBmpAllocFunc allocFunc, void *allocArg)
+{
+	memset(decoder, 0, sizeof(*decoder));
+	decoder->m_allocFunc	= allocFunc;
+	decoder->m_allocArg		= allocArg;
+	decoder->m_stage		= USYNERGY_BMP_STAGE_SNIFF;
+	decoder->m_headerNeed	= 2;
+}
+
+int uSynergyBmpFeed(uSynergyBmpDecoder *decoder, const uint8_t *data,
+	uint32_t size)
+{
+	uint32_t n;
+
+	while (size > 0) {
+		if (decoder->m_stage == USYNERGY_BMP_STAGE_ERROR)
+			return -1;
+
+		if (decoder->m_stage != USYNERGY_BMP_STAGE_PIXELS) {
+			n = decoder->m_headerNeed - decoder->m_headerLen;
+			if (n > size)
+				n = size;
+			memcpy(decoder->m_header + decoder->m_headerLen, data, n);
+			decoder->m_headerLen += n;
+			data += n;
+			size -= n;
+			if (decoder->m_headerLen == decoder->m_headerNeed
+				&& sHeaderStep(decoder) != 0) {
+				decoder->m_stage = USYNERGY_BMP_STAGE_ERROR;
+				return -1;
+			}
+			continue;
+		}
+
+		if (decoder->m_skip > 0) {
+			n = decoder->m_skip < size ? decoder->m_skip : size;
+			decoder->m_skip -= n;
+			data += n;
+			size -= n;
+			continue;
+		}
+
+		/* Trailing bytes after the last row are ignored */
+		if (decoder->m_row >= decoder->m_height)
+			return 0;
+
+		/* Whole rows are converted straight from the input */
+		if (decoder->m_rowLen == 0 && size >= decoder->m_stride) {
+			sConvertRow(decoder, data);
+			data += decoder->m_stride;
+			size -= decoder->m_stride;
+			continue;
+		}
+
+		n = decoder->m_stride - decoder->m_rowLen;
+		if (n > size)
+			n = size;
+		memcpy(decoder->m_rowBuffer + decoder->m_rowLen, data, n);
+		decoder->m_rowLen += n;
+		data += n;
+		size -= n;
+		if (decoder->m_rowLen == decoder->m_stride) {
+			sConvertRow(decoder, decoder->m_rowBuffer);
+			decoder->m_rowLen = 0;
+		}
+	}
+	return decoder->m_stage == USYNERGY_BMP_STAGE_ERROR ? -1 : 0;
+}
+
+int uSynergyBmpEnd(uSynergyBmpDecoder *decoder)
+{
+	int complete = decoder->m_stage == USYNERGY_BMP_STAGE_PIXELS
+		&& decoder->m_row == decoder->m_height;
+
+	free(decoder->m_rowBuffer);
+	decoder->m_rowBuffer = NULL;
+	return complete ? 0 : -1;
+}
+
+uint32_t uSynergyBmpEncodedSize(uint32_t width, uint32_t height)
+{
+	return 40 + width * height * 4;
+}
+
+uint32_t uSynergyBmpEncode(const uint8_t *rgba, uint32_t width,
+	uint32_t height, uint8_t *out)
+{
+	uint32_t x, y;
+
+	/* BITMAPINFOHEADER, 32 bpp BI_RGB, bottom up */
+	memset(out, 0, 40);
+	sPutLe32(out, 40);
+	sPutLe32(out + 4, width);
+	sPutLe32(out + 8, height);
+	out[12] = 1;
+	out[14] = 32;
+	sPutLe32(out + 20, width * height * 4);
+	sPutLe32(out + 24, 2835);	/* 72 dpi */
+	sPutLe32(out + 28, 2835);
+
+	out += 40;
+	for (y = height; y-- > 0;) {
+		const uint8_t *src = rgba + (size_t)y * width * 4;
+		for (x = 0; x < width; x++, src += 4, out += 4) {
+			out[0] = src[2];
+			out[1] = src[1];
+			out[2] = src[0];
+			out[3] = src[3];
+		}
+	}
+	return uSynergyBmpEncodedSize(width, height);
+}
@@ -0,0 +1,114 @@
+/*
+ * uSynergy client -- Streaming BMP codec for clipboard bitmaps
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#ifndef USYNERGY_BMP_H
+#define USYNERGY_BMP_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Clipboard bitmaps travel as a device independent bitmap: a
+ * BITMAPINFOHEADER (or V4/V5 header) followed by the pixel rows, 24 or
+ * 32 bits per pixel, uncompressed. A leading BITMAPFILEHEADER is tolerated.
+
+ * The decoder is fed the bytes as they arrive and converts each row into an
+ * RGBA buffer as soon as the row is complete, so only the RGBA image and
+ * one row are ever held in memory.
+ */
+
+/*
+ * @brief Provide the RGBA output, width * height * 4 bytes, top row first
+ * Called once the header is known. Returning NULL fails the decode.
+ */
+typedef uint8_t *(*uSynergyBmpAllocFunc)(void *arg, uint32_t width,
+	uint32_t height);
+
+typedef struct {
+	uSynergyBmpAllocFunc m_allocFunc;
+	void *m_allocArg;
+
+	/* Header collection */
+	int m_stage;
+	uint8_t m_header[14+124+12];
+	uint32_t m_headerLen;
+	uint32_t m_headerNeed;
+	uint32_t m_fileHeaderSize;
+	uint32_t m_skip;
+
+	/* Image layout */
+	uint32_t m_width;
+	uint32_t m_height;
+	int m_topDown;
+	int m_bytesPerPixel;
+	int m_hasAlpha;
+	uint32_t m_stride;
+
+	/* Row staging, used when a row straddles two chunks */
+	uint32_t m_row;
+	uint8_t *m_rowBuffer;
+	uint32_t m_rowLen;
+
+	uint8_t *m_pixels;
+} uSynergyBmpDecoder;
+
+/*
+ * @brief Start decoding a new bitmap
+ */
+extern void uSynergyBmpBegin(uSynergyBmpDecoder *decoder,
+	uSynergyBmpAllocFunc allocFunc, void *allocArg);
+
+/*
+ * @brief Feed the next bytes of the bitmap
+ * @returns 0 on success, -1 if the bitmap is malformed or unsupported.
+ *	After an error further data is ignored.
+ */
+extern int uSynergyBmpFeed(uSynergyBmpDecoder *decoder, const uint8_t *data,
+	uint32_t size);
+
+/*
+ * @brief Finish decoding and release the row buffer
+ * @returns 0 if every row was decoded, -1 otherwise
+ */
+extern int uSynergyBmpEnd(uSynergyBmpDecoder *decoder);
+
+/*
+ * @brief Size of the encoded form of a width x height image
+ */
+extern uint32_t uSynergyBmpEncodedSize(uint32_t width, uint32_t height);
+
+/*
+ * @brief Encode RGBA pixels, top row first, as a 32 bit bottom up DIB
+ * @a out needs uSynergyBmpEncodedSize() bytes. Returns the bytes written.
+ */
+extern uint32_t uSynergyBmpEncode(const uint8_t *rgba, uint32_t width,
+	uint32_t height, uint8_t *out);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* USYNERGY_BMP_H */
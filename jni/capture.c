@@ -0,0 +1,561 @@
+/*
+ * uSynergy client -- Session capture and replay transports
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "transport.h"
+
+static uint64_t sNowNs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void sPut32(uint8_t *p, uint32_t value)
+{
+	p[0] = (uint8_t)(value >> 24);
+	p[1] = (uint8_t)(value >> 16);
+	p[2] = (uint8_t)(value >> 8);
+	p[3] = (uint8_t)value;
+}
+
+static uint32_t sGet32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+		| ((uint32_t)p[2] << 8) | p[3];
+}
+
+//-----------------------------------------------------------------------------
+//	Capture
+//-----------------------------------------------------------------------------
+
+struct uSynergyCaptureState {
+	int fd;
+	/* When the file was created, record times count from here */
+	uint64_t start;
+	/* The receive thread and the senders write records */
+	pthread_mutex_t mutex;
+};
+
+/*
+ * @brief Create the capture file on the first connect
+ */
+static struct uSynergyCaptureState *sCaptureState(uSynergyCookie cookie)
+{
+	struct uSynergyCaptureState *state = cookie->capture;
+
+	if (state != NULL)
+		return state;
+	if (cookie->capture_path == NULL)
+		return NULL;
+
+	state = calloc(1, sizeof(struct uSynergyCaptureState));
+	if (state == NULL)
+		return NULL;
+	state->fd = open(cookie->capture_path,
+		O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (state->fd < 0 || write(state->fd, USYNERGY_CAPTURE_MAGIC, 8) != 8) {
+		perror("capture error");
+		if (state->fd >= 0)
+			close(state->fd);
+		free(state);
+		return NULL;
+	}
+	state->start = sNowNs();
+	pthread_mutex_init(&state->mutex, NULL);
+	cookie->capture = state;
+	return state;
+}
+
+/*
+ * @brief Append one record, a failed write stops the capture
+ */
+static void sCaptureRecord(uSynergyCookie cookie, uint8_t kind,
+	const uint8_t *data, int length)
+{
+	struct uSynergyCaptureState *state = cookie->capture;
+	uint8_t header[USYNERGY_CAPTURE_HEADER];
+	struct iovec iov[2];
+	uint64_t time;
+	ssize_t ret;
+
+	if (state == NULL || state->fd < 0)
+		return;
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = (size_t)length;
+
+	pthread_mutex_lock(&state->mutex);
+	time = sNowNs() - state->start;
+	sPut32(header, (uint32_t)(time >> 32));
+	sPut32(header + 4, (uint32_t)time);
+	header[8] = kind;
+	sPut32(header + 9, (uint32_t)length);
+	ret = writev(state->fd, iov, length > 0 ? 2 : 1);
+	if (ret != (ssize_t)(sizeof(header) + (size_t)length)) {
+		perror("capture error");
+		close(state->fd);
+		state->fd = -1;
+	}
+	pthread_mutex_unlock(&state->mutex);
+}
+
+static void sCaptureUpdateServer(uSynergyCookie cookie)
+{
+	if (cookie->capture_transport->m_updateServerAddr != NULL)
+		cookie->capture_transport->m_updateServerAddr(cookie);
+}
+
+static uSynergyBool sCaptureConnect(uSynergyCookie cookie)
+{
+	if (!cookie->capture_transport->m_connectFunc(cookie))
+		return USYNERGY_FALSE;
+	if (sCaptureState(cookie) != NULL)
+		sCaptureRecord(cookie, USYNERGY_CAPTURE_CONNECT, NULL, 0);
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sCaptureSend(uSynergyCookie cookie,
+	const uint8_t *buffer, int length)
+{
+	if (!cookie->capture_transport->m_sendFunc(cookie, buffer, length))
+		return USYNERGY_FALSE;
+	sCaptureRecord(cookie, USYNERGY_CAPTURE_SENT, buffer, length);
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sCaptureReceive(uSynergyCookie cookie, uint8_t *buffer,
+	int maxLength, int* outLength)
+{
+	if (!cookie->capture_transport->m_receiveFunc(cookie, buffer, maxLength,
+		outLength))
+		return USYNERGY_FALSE;
+	sCaptureRecord(cookie, USYNERGY_CAPTURE_RECEIVED, buffer, *outLength);
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sCaptureReceiveNow(uSynergyCookie cookie,
+	uint8_t *buffer, int maxLength, int* outLength)
+{
+	const uSynergyTransport *inner = cookie->capture_transport;
+
+	*outLength = 0;
+	if (inner->m_receiveNowFunc == NULL
+		|| !inner->m_receiveNowFunc(cookie, buffer, maxLength, outLength))
+		return USYNERGY_FALSE;
+	if (*outLength > 0)
+		sCaptureRecord(cookie, USYNERGY_CAPTURE_RECEIVED, buffer, *outLength);
+	return USYNERGY_TRUE;
+}
+
+static void sCaptureClose(uSynergyCookie cookie)
+{
+	struct uSynergyCaptureState *state = cookie->capture;
+
+	cookie->capture_transport->m_closeFunc(cookie);
+	if (state == NULL)
+		return;
+	if (state->fd >= 0)
+		close(state->fd);
+	pthread_mutex_destroy(&state->mutex);
+	free(state);
+	cookie->capture = NULL;
+}
+
+static void sCaptureShutdown(uSynergyCookie cookie)
+{
+	if (cookie->capture_transport->m_shutdownFunc != NULL)
+		cookie->capture_transport->m_shutdownFunc(cookie);
+}
+
+static uSynergyBool sCaptureFlush(uSynergyCookie cookie)
+{
+	if (cookie->capture_transport->m_flushFunc == NULL)
+		return USYNERGY_TRUE;
+	return cookie->capture_transport->m_flushFunc(cookie);
+}
+
+static int sCapturePollFd(uSynergyCookie cookie)
+{
+	if (cookie->capture_transport->m_pollFdFunc == NULL)
+		return -1;
+	return cookie->capture_transport->m_pollFdFunc(cookie);
+}
+
+const uSynergyTransport uSynergyCaptureTransport = {
+	.m_name             = "capture",
+	.m_updateServerAddr = sCaptureUpdateServer,
+	.m_connectFunc      = sCaptureConnect,
+	.m_sendFunc         = sCaptureSend,
+	.m_receiveFunc      = sCaptureReceive,
+	.m_closeFunc        = sCaptureClose,
+	.m_shutdownFunc     = sCaptureShutdown,
+	.m_flushFunc        = sCaptureFlush,
+	.m_pollFdFunc       = sCapturePollFd,
+	.m_receiveNowFunc   = sCaptureReceiveNow,
+};
+
+//-----------------------------------------------------------------------------
+//	Replay
+//-----------------------------------------------------------------------------
+
+/* How long the end of a session waits for the client's last replies */
+#define USYNERGY_REPLAY_DRAIN_NS	1000000000ull
+
+struct uSynergyReplayState {
+	/* The whole capture file */
+	uint8_t *data;
+	size_t size;
+
+	/* Next record to receive and how much of it was returned already */
+	size_t receiveOfs;
+	uint32_t receiveUsed;
+
+	/* Next recorded reply, the send side moves it */
+	size_t sendOfs;
+	/* Reply bytes of the current session so far */
+	uint64_t sendTotal;
+
+	/* Capture time of the session's connect and when it was replayed */
+	uint64_t sessionTime;
+	uint64_t sessionStart;
+
+	/* Set by the shutdown function to end a blocked receive */
+	volatile int shutdown;
+
+	uSynergyReplayStats stats;
+};
+
+/*
+ * @brief Load the capture file on the first connect
+ */
+static struct uSynergyReplayState *sReplayState(uSynergyCookie cookie)
+{
+	struct uSynergyReplayState *state = cookie->replay;
+	struct stat st;
+	size_t ofs = 0;
+	ssize_t ret;
+	int fd;
+
+	if (state != NULL)
+		return state;
+	if (cookie->replay_path == NULL)
+		return NULL;
+
+	state = calloc(1, sizeof(struct uSynergyReplayState));
+	fd = open(cookie->replay_path, O_RDONLY | O_CLOEXEC);
+	if (state == NULL || fd < 0 || fstat(fd, &st) != 0 || st.st_size < 8) {
+		perror("replay error");
+		goto fail;
+	}
+	state->size = (size_t)st.st_size;
+	state->data = malloc(state->size);
+	if (state->data == NULL)
+		goto fail;
+	while (ofs < state->size) {
+		ret = read(fd, state->data + ofs, state->size - ofs);
+		if (ret <= 0) {
+			perror("replay error");
+			goto fail;
+		}
+		ofs += (size_t)ret;
+	}
+	close(fd);
+	if (memcmp(state->data, USYNERGY_CAPTURE_MAGIC, 8) != 0) {
+		fprintf(stderr, "replay error: %s is not a capture\n",
+			cookie->replay_path);
+		free(state->data);
+		free(state);
+		return NULL;
+	}
+
+	state->receiveOfs = 8;
+	state->stats.m_firstMismatch = -1;
+	cookie->replay = state;
+	return state;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	if (state != NULL)
+		free(state->data);
+	free(state);
+	return NULL;
+}
+
+/*
+ * @brief Header of the record at @a ofs, NULL past the end of the file or
+ * if the record is cut short
+ */
+static const uint8_t *sReplayRecord(struct uSynergyReplayState *state,
+	size_t ofs, uint32_t *length)
+{
+	const uint8_t *header = state->data + ofs;
+
+	if (ofs + USYNERGY_CAPTURE_HEADER > state->size)
+		return NULL;
+	*length = sGet32(header + 9);
+	if (*length > state->size - ofs - USYNERGY_CAPTURE_HEADER)
+		return NULL;
+	return header;
+}
+
+static uint64_t sReplayTime(const uint8_t *header)
+{
+	return ((uint64_t)sGet32(header) << 32) | sGet32(header + 4);
+}
+
+/*
+ * @brief Next record of @a kind in the session, starting at @a ofs
+
+ * @returns Its header, NULL at the end of the session
+ */
+static const uint8_t *sReplayNext(struct uSynergyReplayState *state,
+	size_t *ofs, uint8_t kind, uint32_t *length)
+{
+	const uint8_t *header;
+
+	while ((header = sReplayRecord(state, *ofs, length)) != NULL) {
+		if (header[8] == USYNERGY_CAPTURE_CONNECT)
+			return NULL;
+		if (header[8] == kind)
+			return header;
+		*ofs += USYNERGY_CAPTURE_HEADER + *length;
+	}
+	return NULL;
+}
+
+/*
+ * @brief Hold the record recorded at @a time back until it is due
+
+ * @returns USYNERGY_FALSE if the transport was shut down meanwhile
+ */
+static uSynergyBool sReplayWait(struct uSynergyReplayState *state,
+	uint64_t time)
+{
+	uint64_t due = state->sessionStart + (time - state->sessionTime);
+	uint64_t now;
+
+	/* Short naps so a shutdown is noticed soon */
+	while (!state->shutdown && (now = sNowNs()) < due) {
+		uint64_t nap = due - now < 20000000 ? due - now : 20000000;
+		struct timespec ts = { 0, (long)nap };
+		nanosleep(&ts, NULL);
+	}
+	return !state->shutdown;
+}
+
+/*
+ * @brief At the end of a session, give the client time to answer what it
+ * was fed before the replay hangs up on it
+
+ * Replies still missing when the wait ends count as mismatches.
+ */
+static void sReplayDrain(uSynergyCookie cookie,
+	struct uSynergyReplayState *state)
+{
+	uint64_t deadline = sNowNs() + USYNERGY_REPLAY_DRAIN_NS;
+	struct timespec ts = { 0, 100000 };
+	uint32_t length;
+	size_t ofs;
+
+	for (;;) {
+		ofs = __atomic_load_n(&state->sendOfs, __ATOMIC_ACQUIRE);
+		if (sReplayNext(state, &ofs, USYNERGY_CAPTURE_SENT, &length) == NULL)
+			return;
+		if (state->shutdown || sNowNs() >= deadline)
+			break;
+		nanosleep(&ts, NULL);
+	}
+	if (!cookie->replay_verify)
+		return;
+	if (state->stats.m_firstMismatch < 0)
+		state->stats.m_firstMismatch = (int64_t)state->sendTotal;
+	while (sReplayNext(state, &ofs, USYNERGY_CAPTURE_SENT, &length) != NULL) {
+		__atomic_fetch_add(&state->stats.m_mismatches, 1, __ATOMIC_RELAXED);
+		ofs += USYNERGY_CAPTURE_HEADER + length;
+	}
+}
+
+static uSynergyBool sReplayConnect(uSynergyCookie cookie)
+{
+	struct uSynergyReplayState *state = sReplayState(cookie);
+	const uint8_t *header;
+	uint32_t length;
+
+	if (state == NULL)
+		return USYNERGY_FALSE;
+
+	/* Skip what the previous session left unread */
+	while ((header = sReplayRecord(state, state->receiveOfs, &length))
+		!= NULL && header[8] != USYNERGY_CAPTURE_CONNECT)
+		state->receiveOfs += USYNERGY_CAPTURE_HEADER + length;
+	if (header == NULL) {
+		state->stats.m_done = 1;
+		return USYNERGY_FALSE;
+	}
+
+	state->receiveOfs += USYNERGY_CAPTURE_HEADER + length;
+	state->receiveUsed = 0;
+	state->sendOfs = state->receiveOfs;
+	state->sendTotal = 0;
+	state->sessionTime = sReplayTime(header);
+	state->sessionStart = sNowNs();
+	state->shutdown = 0;
+	state->stats.m_sessions++;
+	return USYNERGY_TRUE;
+}
+
+static uSynergyBool sReplayReceive(uSynergyCookie cookie, uint8_t *buffer,
+	int maxLength, int* outLength)
+{
+	struct uSynergyReplayState *state = cookie->replay;
+	const uint8_t *header;
+	uint32_t length, n;
+
+	if (state == NULL || state->shutdown)
+		return USYNERGY_FALSE;
+	header = sReplayNext(state, &state->receiveOfs, USYNERGY_CAPTURE_RECEIVED,
+		&length);
+	if (header == NULL) {
+		/* Session over, the server hung up here */
+		sReplayDrain(cookie, state);
+		if (sReplayRecord(state, state->receiveOfs, &length) == NULL)
+			state->stats.m_done = 1;
+		return USYNERGY_FALSE;
+	}
+	if (cookie->replay_timing && state->receiveUsed == 0
+		&& !sReplayWait(state, sReplayTime(header)))
+		return USYNERGY_FALSE;
+
+	n = length - state->receiveUsed;
+	if (n > (uint32_t)maxLength)
+		n = (uint32_t)maxLength;
+	memcpy(buffer, header + USYNERGY_CAPTURE_HEADER + state->receiveUsed, n);
+	state->receiveUsed += n;
+	if (state->receiveUsed == length) {
+		state->receiveOfs += USYNERGY_CAPTURE_HEADER + length;
+		state->receiveUsed = 0;
+	}
+	state->stats.m_bytesReplayed += n;
+	*outLength = (int)n;
+	return USYNERGY_TRUE;
+}
+
+/*
+ * @brief Pass a reply, compared against the next recorded one
+
+ * Replies are matched send by send rather than as one byte stream, so a
+ * reply of a different length (another client name in the hello, say) is
+ * one mismatch and the ones after it still line up.
+ */
+static uSynergyBool sReplaySend(uSynergyCookie cookie,
+	const uint8_t *buffer, int length)
+{
+	struct uSynergyReplayState *state = cookie->replay;
+	const uint8_t *header;
+	uint32_t recorded;
+
+	size_t ofs;
+
+	if (state == NULL)
+		return USYNERGY_TRUE;
+
+	ofs = state->sendOfs;
+	header = sReplayNext(state, &ofs, USYNERGY_CAPTURE_SENT, &recorded);
+	if (cookie->replay_verify) {
+		if (header == NULL || recorded != (uint32_t)length
+			|| memcmp(buffer, header + USYNERGY_CAPTURE_HEADER, recorded) != 0) {
+			if (state->stats.m_firstMismatch < 0)
+				state->stats.m_firstMismatch = (int64_t)state->sendTotal;
+			__atomic_fetch_add(&state->stats.m_mismatches, 1, __ATOMIC_RELAXED);
+		}
+		state->stats.m_bytesVerified += (uint64_t)length;
+		state->sendTotal += (uint64_t)length;
+	}
+	/* Read by sReplayDrain() on the receive thread */
+	if (header != NULL)
+		__atomic_store_n(&state->sendOfs, ofs + USYNERGY_CAPTURE_HEADER
+			+ recorded, __ATOMIC_RELEASE);
+	return USYNERGY_TRUE;
+}
+
+static void sReplayShutdown(uSynergyCookie cookie)
+{
+	if (cookie->replay != NULL)
+		cookie->replay->shutdown = 1;
+}
+
+static void sReplayClose(uSynergyCookie cookie)
+{
+	if (cookie->replay == NULL)
+		return;
+	free(cookie->replay->data);
+	free(cookie->replay);
+	cookie->replay = NULL;
+}
+
+const uSynergyTransport uSynergyReplayTransport = {
+	.m_name             = "replay",
+	.m_updateServerAddr = NULL,
+	.m_connectFunc      = sReplayConnect,
+	.m_sendFunc         = sReplaySend,
+	.m_receiveFunc      = sReplayReceive,
+	.m_closeFunc        = sReplayClose,
+	.m_shutdownFunc     = sReplayShutdown,
+	.m_flushFunc        = NULL,
+	.m_pollFdFunc       = NULL,
+	.m_receiveNowFunc   = NULL,
+};
+
+void uSynergyReplayGetStats(uSynergyCookie cookie, uSynergyReplayStats *stats)
+{
+	if (cookie->replay != NULL) {
+		*stats = cookie->replay->stats;
+	} else {
+		memset(stats, 0, sizeof(*stats));
+		stats->m_firstMismatch = -1;
+	}
+}
+
+void uSynergyReplayRewind(uSynergyCookie cookie)
+{
+	if (cookie->replay == NULL)
+		return;
+	cookie->replay->receiveOfs = 8;
+	cookie->replay->receiveUsed = 0;
+	cookie->replay->stats.m_done = 0;
+}
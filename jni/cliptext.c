@@ -0,0 +1,390 @@
+/*
+ * uSynergy client -- Clipboard text conversion
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "cliptext.h"
+
+#if defined(__SSE2__) && !defined(USYNERGY_TEXT_SCALAR)
+	#include <emmintrin.h>
+	#define USYNERGY_TEXT_SSE2
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(USYNERGY_TEXT_SCALAR)
+	#include <arm_neon.h>
+	#define USYNERGY_TEXT_NEON
+#endif
+
+//-----------------------------------------------------------------------------
+//	Scalar kernels
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Decode one UTF-8 sequence starting at a non ASCII byte
+ * Returns its length and stores the code point, or 0 if it is malformed.
+ */
+static uint32_t sDecodeSequence(const uint8_t *p, const uint8_t *end,
+	uint32_t *codePoint)
+{
+	uint32_t c = p[0], min, len, i;
+
+	if (c >= 0xc2 && c < 0xe0) {
+		len = 2; min = 0x80; c &= 0x1f;
+	} else if (c >= 0xe0 && c < 0xf0) {
+		len = 3; min = 0x800; c &= 0x0f;
+	} else if (c >= 0xf0 && c < 0xf5) {
+		len = 4; min = 0x10000; c &= 0x07;
+	} else {
+		return 0;
+	}
+	if ((uint32_t)(end - p) < len)
+		return 0;
+	for (i = 1; i < len; i++) {
+		if ((p[i] & 0xc0) != 0x80)
+			return 0;
+		c = (c << 6) | (p[i] & 0x3f);
+	}
+	if (c < min || c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+		return 0;
+	*codePoint = c;
+	return len;
+}
+
+/*
+ * @brief Store a code point as UTF-16, returns the number of units
+ */
+static uint32_t sPutUtf16(uint16_t *out, uint32_t c)
+{
+	if (c < 0x10000) {
+		out[0] = (uint16_t)c;
+		return 1;
+	}
+	c -= 0x10000;
+	out[0] = (uint16_t)(0xd800 | (c >> 10));
+	out[1] = (uint16_t)(0xdc00 | (c & 0x3ff));
+	return 2;
+}
+
+static int sScalarValidUtf8(const uint8_t *data, uint32_t size)
+{
+	const uint8_t *end = data + size;
+	uint32_t c, len;
+
+	while (data < end) {
+		if (*data < 0x80) {
+			data++;
+			continue;
+		}
+		len = sDecodeSequence(data, end, &c);
+		if (len == 0)
+			return 0;
+		data += len;
+	}
+	return 1;
+}
+
+static uint32_t sScalarLfToCrlf(const uint8_t *in, uint32_t size, uint8_t *out)
+{
+	uint8_t *start = out;
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		if (in[i] == '\n' && (i == 0 || in[i-1] != '\r'))
+			*out++ = '\r';
+		*out++ = in[i];
+	}
+	return (uint32_t)(out - start);
+}
+
+static uint32_t sScalarCrlfToLf(const uint8_t *in, uint32_t size, uint8_t *out)
+{
+	uint8_t *start = out;
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		if (in[i] == '\r' && i + 1 < size && in[i+1] == '\n')
+			continue;
+		*out++ = in[i];
+	}
+	return (uint32_t)(out - start);
+}
+
+static uint32_t sScalarUtf8ToUtf16(const uint8_t *in, uint32_t size,
+	uint16_t *out)
+{
+	const uint8_t *end = in + size;
+	uint16_t *start = out;
+	uint32_t c, len;
+
+	while (in < end) {
+		if (*in < 0x80) {
+			*out++ = *in++;
+			continue;
+		}
+		len = sDecodeSequence(in, end, &c);
+		if (len == 0) {
+			*out++ = 0xfffd;
+			in++;
+		} else {
+			out += sPutUtf16(out, c);
+			in += len;
+		}
+	}
+	return (uint32_t)(out - start);
+}
+
+const uSynergyTextKernels uSynergyTextScalar = {
+	.m_name         = "scalar",
+	.m_validUtf8    = sScalarValidUtf8,
+	.m_lfToCrlf     = sScalarLfToCrlf,
+	.m_crlfToLf     = sScalarCrlfToLf,
+	.m_utf8ToUtf16  = sScalarUtf8ToUtf16,
+};
+
+//-----------------------------------------------------------------------------
+//	SIMD kernels
+//-----------------------------------------------------------------------------
+
+#if defined(USYNERGY_TEXT_SSE2) || defined(USYNERGY_TEXT_NEON)
+
+#ifdef USYNERGY_TEXT_SSE2
+typedef __m128i sVector;
+#define sLoad(p)		_mm_loadu_si128((const __m128i *)(p))
+#define sStore(p, v)	_mm_storeu_si128((__m128i *)(p), v)
+
+/* Bit i set if byte i of the block is not ASCII */
+static inline uint32_t sHighMask(sVector v)
+{
+	return (uint32_t)_mm_movemask_epi8(v);
+}
+
+/* Nonzero if any byte of the block equals @a c */
+static inline int sHasByte(sVector v, uint8_t c)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)c))) != 0;
+}
+
+/* Widen 16 ASCII bytes to 16 UTF-16 units */
+static inline void sWiden(sVector v, uint16_t *out)
+{
+	__m128i zero = _mm_setzero_si128();
+	_mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi8(v, zero));
+	_mm_storeu_si128((__m128i *)(out + 8), _mm_unpackhi_epi8(v, zero));
+}
+#else
+typedef uint8x16_t sVector;
+#define sLoad(p)		vld1q_u8(p)
+#define sStore(p, v)	vst1q_u8(p, v)
+
+/* Nonzero if any byte is not ASCII; NEON has no movemask, callers only
+ * need to know whether the block is clean */
+static inline uint32_t sHighMask(sVector v)
+{
+#ifdef __aarch64__
+	return vmaxvq_u8(v) >= 0x80;
+#else
+	uint8x8_t m = vpmax_u8(vget_low_u8(v), vget_high_u8(v));
+	m = vpmax_u8(m, m);
+	m = vpmax_u8(m, m);
+	m = vpmax_u8(m, m);
+	return vget_lane_u8(m, 0) >= 0x80;
+#endif
+}
+
+static inline int sHasByte(sVector v, uint8_t c)
+{
+	uint8x16_t eq = vceqq_u8(v, vdupq_n_u8(c));
+#ifdef __aarch64__
+	return vmaxvq_u8(eq) != 0;
+#else
+	uint8x8_t m = vorr_u8(vget_low_u8(eq), vget_high_u8(eq));
+	return vget_lane_u64(vreinterpret_u64_u8(m), 0) != 0;
+#endif
+}
+
+static inline void sWiden(sVector v, uint16_t *out)
+{
+	vst1q_u16(out, vmovl_u8(vget_low_u8(v)));
+	vst1q_u16(out + 8, vmovl_u8(vget_high_u8(v)));
+}
+#endif
+
+static int sSimdValidUtf8(const uint8_t *data, uint32_t size)
+{
+	const uint8_t *end = data + size;
+	uint32_t c, len;
+
+	while (data < end) {
+		if (end - data >= 16 && !sHighMask(sLoad(data))) {
+			data += 16;
+			continue;
+		}
+		if (*data < 0x80) {
+			data++;
+			continue;
+		}
+		len = sDecodeSequence(data, end, &c);
+		if (len == 0)
+			return 0;
+		data += len;
+	}
+	return 1;
+}
+
+static uint32_t sSimdLfToCrlf(const uint8_t *in, uint32_t size, uint8_t *out)
+{
+	uint8_t *start = out;
+	uint32_t i = 0, end;
+
+	while (i < size) {
+		if (size - i >= 16) {
+			sVector v = sLoad(in + i);
+			if (!sHasByte(v, '\n')) {
+				sStore(out, v);
+				out += 16;
+				i += 16;
+				continue;
+			}
+			end = i + 16;
+		} else {
+			end = size;
+		}
+		for (; i < end; i++) {
+			if (in[i] == '\n' && (i == 0 || in[i-1] != '\r'))
+				*out++ = '\r';
+			*out++ = in[i];
+		}
+	}
+	return (uint32_t)(out - start);
+}
+
+static uint32_t sSimdCrlfToLf(const uint8_t *in, uint32_t size, uint8_t *out)
+{
+	uint8_t *start = out;
+	uint32_t i = 0, end;
+
+	while (i < size) {
+		if (size - i >= 16) {
+			/* Loaded before the store, so running in place is fine */
+			sVector v = sLoad(in + i);
+			if (!sHasByte(v, '\r')) {
+				sStore(out, v);
+				out += 16;
+				i += 16;
+				continue;
+			}
+			end = i + 16;
+		} else {
+			end = size;
+		}
+		for (; i < end; i++) {
+			if (in[i] == '\r' && i + 1 < size && in[i+1] == '\n')
+				continue;
+			*out++ = in[i];
+		}
+	}
+	return (uint32_t)(out - start);
+}
+
+static uint32_t sSimdUtf8ToUtf16(const uint8_t *in, uint32_t size,
+	uint16_t *out)
+{
+	const uint8_t *end = in + size;
+	uint16_t *start = out;
+	uint32_t c, len;
+
+	while (in < end) {
+		if (end - in >= 16) {
+			sVector v = sLoad(in);
+			if (!sHighMask(v)) {
+				sWiden(v, out);
+				in += 16;
+				out += 16;
+				continue;
+			}
+		}
+		if (*in < 0x80) {
+			*out++ = *in++;
+			continue;
+		}
+		len = sDecodeSequence(in, end, &c);
+		if (len == 0) {
+			*out++ = 0xfffd;
+			in++;
+		} else {
+			out += sPutUtf16(out, c);
+			in += len;
+		}
+	}
+	return (uint32_t)(out - start);
+}
+
+static const uSynergyTextKernels sTextSimd = {
+#ifdef USYNERGY_TEXT_SSE2
+	.m_name         = "sse2",
+#else
+	.m_name         = "neon",
+#endif
+	.m_validUtf8    = sSimdValidUtf8,
+	.m_lfToCrlf     = sSimdLfToCrlf,
+	.m_crlfToLf     = sSimdCrlfToLf,
+	.m_utf8ToUtf16  = sSimdUtf8ToUtf16,
+};
+
+const uSynergyTextKernels *const uSynergyTextSimd = &sTextSimd;
+const uSynergyTextKernels *const uSynergyText = &sTextSimd;
+
+#else
+
+const uSynergyTextKernels *const uSynergyTextSimd = NULL;
+const uSynergyTextKernels *const uSynergyText = &uSynergyTextScalar;
+
+#endif
+
+//-----------------------------------------------------------------------------
+//	Helpers
+//-----------------------------------------------------------------------------
+
+uint32_t uSynergyTextSanitize(uint8_t *data, uint32_t size)
+{
+	const uint8_t *end = data + size;
+	uint32_t replaced = 0, c, len;
+
+	/* Almost always valid, the fast check is all it costs */
+	if (uSynergyText->m_validUtf8(data, size))
+		return 0;
+
+	while (data < end) {
+		if (*data < 0x80) {
+			data++;
+			continue;
+		}
+		len = sDecodeSequence(data, end, &c);
+		if (len == 0) {
+			*data++ = '?';
+			replaced++;
+		} else {
+			data += len;
+		}
+	}
+	return replaced;
+}
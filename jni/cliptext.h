@@ -0,0 +1,89 @@
+/*
+ * uSynergy client -- Clipboard text conversion
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#ifndef USYNERGY_CLIPTEXT_H
+#define USYNERGY_CLIPTEXT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Synergy clipboard text is UTF-8 with LF newlines. These kernels validate
+ * it, convert newlines and transcode to UTF-16 for Java. The SIMD versions
+ * (SSE2 or NEON) move runs of plain ASCII 16 bytes at a time and hand the
+ * rest to the scalar code, so ASCII heavy documents convert at close to
+ * memory bandwidth.
+ */
+typedef struct {
+	/* Name for traces and benchmarks */
+	const char *m_name;
+
+	/*
+	 * @brief Check that @a data is well formed UTF-8
+	 * Rejects overlong forms, surrogates and code points above U+10FFFF.
+	 */
+	int (*m_validUtf8)(const uint8_t *data, uint32_t size);
+
+	/*
+	 * @brief Convert bare LF to CRLF, existing CRLF pairs are kept
+	 * @a out needs room for 2 * @a size bytes. Returns the output size.
+	 */
+	uint32_t (*m_lfToCrlf)(const uint8_t *in, uint32_t size, uint8_t *out);
+
+	/*
+	 * @brief Convert CRLF to LF, may run in place (@a out == @a in)
+	 * Returns the output size, never larger than @a size.
+	 */
+	uint32_t (*m_crlfToLf)(const uint8_t *in, uint32_t size, uint8_t *out);
+
+	/*
+	 * @brief Transcode UTF-8 to UTF-16, invalid input becomes U+FFFD
+	 * @a out needs room for @a size units. Returns the number of units.
+	 */
+	uint32_t (*m_utf8ToUtf16)(const uint8_t *in, uint32_t size, uint16_t *out);
+} uSynergyTextKernels;
+
+/* Portable byte at a time kernels */
+extern const uSynergyTextKernels uSynergyTextScalar;
+
+/* SIMD kernels, NULL when built for a target without SSE2 or NEON */
+extern const uSynergyTextKernels *const uSynergyTextSimd;
+
+/* Best kernels for this build */
+extern const uSynergyTextKernels *const uSynergyText;
+
+/*
+ * @brief Make @a data valid UTF-8 in place
+ * Each byte that is not part of a well formed sequence is replaced by '?',
+ * so the size does not change. Returns the number of bytes replaced.
+ */
+extern uint32_t uSynergyTextSanitize(uint8_t *data, uint32_t size);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* USYNERGY_CLIPTEXT_H */
@@ -0,0 +1,84 @@
+/*
+ * uSynergy client -- Log-linear latency histograms
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#include "histogram.h"
+
+uint64_t uSynergyHistogramBucketMax(int index)
+{
+	int exponent, sub;
+
+	if (index < (1 << USYNERGY_HISTOGRAM_SUB_BITS))
+		return (uint64_t)index;
+	/* Bucket covers [sub << shift, (sub + 1) << shift) */
+	exponent = (index >> USYNERGY_HISTOGRAM_SUB_BITS) - 1;
+	sub = (index & ((1 << USYNERGY_HISTOGRAM_SUB_BITS) - 1))
+		+ (1 << USYNERGY_HISTOGRAM_SUB_BITS);
+	return ((uint64_t)(sub + 1) << exponent) - 1;
+}
+
+uint64_t uSynergyHistogramPercentile(const uSynergyHistogram *histogram,
+	double percentile)
+{
+	uint64_t rank, seen = 0, value;
+	int i;
+
+	if (histogram->m_count == 0)
+		return 0;
+	if (percentile <= 0)
+		return histogram->m_min;
+	if (percentile >= 100)
+		return histogram->m_max;
+
+	/* Smallest rank that covers the percentile, at least the first value */
+	rank = (uint64_t)(percentile / 100.0 * (double)histogram->m_count + 0.5);
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < USYNERGY_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->m_buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	value = uSynergyHistogramBucketMax(i);
+	if (value > histogram->m_max)
+		value = histogram->m_max;
+	if (value < histogram->m_min)
+		value = histogram->m_min;
+	return value;
+}
+
+void uSynergyHistogramMerge(uSynergyHistogram *to,
+	const uSynergyHistogram *from)
+{
+	int i;
+
+	if (from->m_count == 0)
+		return;
+	if (to->m_count == 0 || from->m_min < to->m_min)
+		to->m_min = from->m_min;
+	if (from->m_max > to->m_max)
+		to->m_max = from->m_max;
+	to->m_count += from->m_count;
+	to->m_sum += from->m_sum;
+	for (i = 0; i < USYNERGY_HISTOGRAM_BUCKETS; i++)
+		to->m_buckets[i] += from->m_buckets[i];
+}
@@ -0,0 +1,123 @@
+/*
+ * uSynergy client -- Log-linear latency histograms
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#ifndef USYNERGY_HISTOGRAM_H
+#define USYNERGY_HISTOGRAM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fixed size histograms in the style of HdrHistogram. Values below
+ * 2^USYNERGY_HISTOGRAM_SUB_BITS get a bucket each, above that every power
+ * of two is split into 2^USYNERGY_HISTOGRAM_SUB_BITS linear buckets, so a
+ * value is known to within 1/16 (6%) whatever its size. Recording is a few
+ * instructions and never allocates.
+
+ * Values are nanoseconds where the client uses them. Values of 2^36 ns
+ * (68 seconds) and more land in the last bucket.
+ */
+
+/* Linear buckets per power of two, as a power of two */
+#define USYNERGY_HISTOGRAM_SUB_BITS		4
+/* Values up to 2^USYNERGY_HISTOGRAM_MAX_BITS are told apart */
+#define USYNERGY_HISTOGRAM_MAX_BITS		36
+/* Number of buckets */
+#define USYNERGY_HISTOGRAM_BUCKETS \
+	((USYNERGY_HISTOGRAM_MAX_BITS - USYNERGY_HISTOGRAM_SUB_BITS + 1) \
+	<< USYNERGY_HISTOGRAM_SUB_BITS)
+
+typedef struct uSynergyHistogram {
+	/* Number of recorded values, their sum, smallest and largest */
+	uint64_t m_count;
+	uint64_t m_sum;
+	uint64_t m_min;
+	uint64_t m_max;
+
+	uint32_t m_buckets[USYNERGY_HISTOGRAM_BUCKETS];
+} uSynergyHistogram;
+
+/*
+ * @brief Bucket of @a value
+ */
+static inline int uSynergyHistogramIndex(uint64_t value)
+{
+	int msb, index;
+
+	if (value < ((uint64_t)1 << USYNERGY_HISTOGRAM_SUB_BITS))
+		return (int)value;
+	msb = 63 - __builtin_clzll(value);
+	index = ((msb - USYNERGY_HISTOGRAM_SUB_BITS + 1)
+		<< USYNERGY_HISTOGRAM_SUB_BITS)
+		+ (int)((value >> (msb - USYNERGY_HISTOGRAM_SUB_BITS))
+		& ((1 << USYNERGY_HISTOGRAM_SUB_BITS) - 1));
+	if (index >= USYNERGY_HISTOGRAM_BUCKETS)
+		index = USYNERGY_HISTOGRAM_BUCKETS - 1;
+	return index;
+}
+
+/*
+ * @brief Record one value
+ */
+static inline void uSynergyHistogramRecord(uSynergyHistogram *histogram,
+	uint64_t value)
+{
+	if (histogram->m_count == 0 || value < histogram->m_min)
+		histogram->m_min = value;
+	if (value > histogram->m_max)
+		histogram->m_max = value;
+	histogram->m_count++;
+	histogram->m_sum += value;
+	histogram->m_buckets[uSynergyHistogramIndex(value)]++;
+}
+
+/*
+ * @brief Largest value that falls into bucket @a index
+ */
+extern uint64_t uSynergyHistogramBucketMax(int index);
+
+/*
+ * @brief Value below which @a percentile percent of the recorded values lie
+
+ * Reported as the top of the bucket it falls into, capped at the largest
+ * recorded value. Returns 0 for an empty histogram.
+
+ * @param percentile	0 to 100, 50 gives the median
+ */
+extern uint64_t uSynergyHistogramPercentile(const uSynergyHistogram *histogram,
+	double percentile);
+
+/*
+ * @brief Add the values recorded in @a from to @a to
+ */
+extern void uSynergyHistogramMerge(uSynergyHistogram *to,
+	const uSynergyHistogram *from);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* USYNERGY_HISTOGRAM_H */
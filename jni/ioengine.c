@@ -0,0 +1,633 @@
+/*
+ * uSynergy client -- Batched socket and uinput I/O engine
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "ioengine.h"
+#include "arena.h"
+
+#if defined(__linux__) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#include <sys/syscall.h>
+		#include <linux/io_uring.h>
+		/* Provided buffers (5.7) are the oldest uapi the engine builds
+		 * against, older headers leave it on plain syscalls */
+		#if defined(IOSQE_BUFFER_SELECT) && defined(__NR_io_uring_register)
+			#define USYNERGY_HAVE_IO_URING
+		#endif
+	#endif
+#endif
+
+#ifdef USYNERGY_HAVE_IO_URING
+	#include <sys/mman.h>
+
+	/* Newer than the headers may be; kernels without them fail the recv
+	 * with -EINVAL, see uSynergyIoReceive() */
+	#ifndef IORING_CQE_F_MORE
+		#define IORING_CQE_F_MORE		(1U << 1)
+	#endif
+	#ifndef IORING_RECV_MULTISHOT
+		#define IORING_RECV_MULTISHOT	(1U << 1)
+	#endif
+#endif
+
+/* Bytes staged per target before an implicit flush */
+#define USYNERGY_IO_STAGE_SIZE		4096
+/* Distinct file descriptors staged at once (socket + uinput devices) */
+#define USYNERGY_IO_MAX_TARGETS		4
+/* Submission queue depth */
+#define USYNERGY_IO_RING_ENTRIES	16
+/* Provided receive buffers for the multishot recv */
+#define USYNERGY_IO_RX_BUFFERS		8
+#define USYNERGY_IO_RX_BUFFER_SIZE	4096
+#define USYNERGY_IO_RX_GROUP		1
+
+/* user_data tags, values below USYNERGY_IO_MAX_TARGETS are target indices */
+#define USYNERGY_IO_TAG_RECV		0x100
+#define USYNERGY_IO_TAG_PROVIDE		0x101
+
+typedef struct {
+	int fd;
+	int isSocket;
+	size_t length;
+	uint8_t data[USYNERGY_IO_STAGE_SIZE];
+} sIoTarget;
+
+#ifdef USYNERGY_HAVE_IO_URING
+typedef struct {
+	int fd;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqPtr, *cqPtr;
+	size_t sqSize, cqSize, sqesSize;
+	unsigned sqEntries;
+	/* Local tail, published on submit */
+	unsigned sqeTail;
+	unsigned toSubmit;
+} sRing;
+#endif
+
+struct uSynergyIoEngine {
+	pthread_mutex_t lock;
+
+	/* Owner of the engine's memory, NULL for the heap */
+	uSynergyArena *arena;
+
+	int numTargets;
+	sIoTarget targets[USYNERGY_IO_MAX_TARGETS];
+
+	int useRing;
+#ifdef USYNERGY_HAVE_IO_URING
+	sRing ring;
+
+	/* Receive state */
+	uint8_t *rxBuffers;
+	int rxArmed;
+	int rxMultishot;
+	int rxHave;
+	unsigned rxBid;
+	size_t rxLength;
+	size_t rxOfs;
+#endif
+};
+
+//-----------------------------------------------------------------------------
+//	Plain syscall helpers
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Send or write a whole buffer with blocking syscalls
+ */
+static int sWriteAll(int fd, int isSocket, const uint8_t *data, size_t length)
+{
+	while (length > 0) {
+		ssize_t ret = isSocket ? send(fd, data, length, MSG_NOSIGNAL)
+			: write(fd, data, length);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		data += ret;
+		length -= ret;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+//	io_uring
+//-----------------------------------------------------------------------------
+
+#ifdef USYNERGY_HAVE_IO_URING
+static int sRingSetup(sRing *ring, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqSize > ring->sqSize)
+			ring->sqSize = ring->cqSize;
+		ring->cqSize = 0;
+	}
+
+	ring->sqPtr = mmap(NULL, ring->sqSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sqPtr == MAP_FAILED)
+		goto err_close;
+
+	if (ring->cqSize) {
+		ring->cqPtr = mmap(NULL, ring->cqSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cqPtr == MAP_FAILED)
+			goto err_sq;
+	} else {
+		ring->cqPtr = ring->sqPtr;
+	}
+
+	ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_cq;
+
+	ring->sqHead  = (unsigned *)((uint8_t *)ring->sqPtr + p.sq_off.head);
+	ring->sqTail  = (unsigned *)((uint8_t *)ring->sqPtr + p.sq_off.tail);
+	ring->sqMask  = (unsigned *)((uint8_t *)ring->sqPtr + p.sq_off.ring_mask);
+	ring->sqArray = (unsigned *)((uint8_t *)ring->sqPtr + p.sq_off.array);
+	ring->cqHead  = (unsigned *)((uint8_t *)ring->cqPtr + p.cq_off.head);
+	ring->cqTail  = (unsigned *)((uint8_t *)ring->cqPtr + p.cq_off.tail);
+	ring->cqMask  = (unsigned *)((uint8_t *)ring->cqPtr + p.cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe *)((uint8_t *)ring->cqPtr
+		+ p.cq_off.cqes);
+	ring->sqEntries = p.sq_entries;
+	ring->sqeTail = *ring->sqTail;
+	return 0;
+
+err_cq:
+	if (ring->cqSize)
+		munmap(ring->cqPtr, ring->cqSize);
+err_sq:
+	munmap(ring->sqPtr, ring->sqSize);
+err_close:
+	close(ring->fd);
+	ring->fd = -1;
+	return -1;
+}
+
+static void sRingTeardown(sRing *ring)
+{
+	if (ring->fd < 0)
+		return;
+	munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqSize)
+		munmap(ring->cqPtr, ring->cqSize);
+	munmap(ring->sqPtr, ring->sqSize);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/*
+ * @brief Check that the kernel supports every op the engine submits
+
+ * io_uring_setup() alone succeeds on kernels from 5.1, while sends, writes
+ * and provided receive buffers came later (5.6 and 5.7). Kernels without
+ * IORING_REGISTER_PROBE (before 5.6) lack some of them anyway.
+ */
+static int sRingProbe(sRing *ring)
+{
+	static const uint8_t ops[] = {
+		IORING_OP_SEND, IORING_OP_WRITE, IORING_OP_RECV,
+		IORING_OP_PROVIDE_BUFFERS
+	};
+	struct {
+		struct io_uring_probe probe;
+		struct io_uring_probe_op ops[256];
+	} buffer;
+	size_t i;
+
+	memset(&buffer, 0, sizeof(buffer));
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+		&buffer.probe, 256) < 0)
+		return -1;
+	for (i = 0; i < sizeof(ops); i++) {
+		if (ops[i] > buffer.probe.last_op || ops[i] >= buffer.probe.ops_len
+			|| !(buffer.probe.ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * @brief Grab a zeroed submission entry, NULL if the queue is full
+ */
+static struct io_uring_sqe *sRingGetSqe(sRing *ring)
+{
+	unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	unsigned index;
+	struct io_uring_sqe *sqe;
+
+	if (ring->sqeTail - head >= ring->sqEntries)
+		return NULL;
+
+	index = ring->sqeTail & *ring->sqMask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqArray[index] = index;
+	ring->sqeTail++;
+	ring->toSubmit++;
+	return sqe;
+}
+
+/*
+ * @brief Publish queued entries and enter the kernel once
+ */
+static int sRingEnter(sRing *ring, unsigned waitNr)
+{
+	unsigned toSubmit = ring->toSubmit;
+	int ret;
+
+	__atomic_store_n(ring->sqTail, ring->sqeTail, __ATOMIC_RELEASE);
+	do {
+		ret = (int)syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitNr,
+			waitNr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret >= 0)
+		ring->toSubmit -= (unsigned)ret < toSubmit ? (unsigned)ret : toSubmit;
+	return ret;
+}
+
+/*
+ * @brief Pop the next completion, returns 0 if there is none
+ */
+static int sRingPopCqe(sRing *ring, struct io_uring_cqe *out)
+{
+	unsigned head = *ring->cqHead;
+	unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return 0;
+	*out = ring->cqes[head & *ring->cqMask];
+	__atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * @brief Hand a receive buffer (back) to the kernel
+
+ * @returns -1 if the queue stays full even after submitting it
+ */
+static int sRingProvide(uSynergyIoEngine *engine, unsigned bid, unsigned count)
+{
+	struct io_uring_sqe *sqe = sRingGetSqe(&engine->ring);
+
+	if (sqe == NULL) {
+		if (sRingEnter(&engine->ring, 0) < 0)
+			return -1;
+		sqe = sRingGetSqe(&engine->ring);
+		if (sqe == NULL)
+			return -1;
+	}
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = (int)count;
+	sqe->addr = (uint64_t)(uintptr_t)(engine->rxBuffers
+		+ bid * USYNERGY_IO_RX_BUFFER_SIZE);
+	sqe->len = USYNERGY_IO_RX_BUFFER_SIZE;
+	sqe->off = bid;
+	sqe->buf_group = USYNERGY_IO_RX_GROUP;
+	sqe->user_data = USYNERGY_IO_TAG_PROVIDE;
+	return 0;
+}
+
+/*
+ * @brief Submit all staged targets in one io_uring_enter() and reap them
+ */
+static int sRingFlush(uSynergyIoEngine *engine)
+{
+	struct io_uring_cqe cqe;
+	unsigned submitted = 0, reaped = 0;
+	int i, ret = 0;
+
+	for (i = 0; i < engine->numTargets; i++) {
+		sIoTarget *target = &engine->targets[i];
+		struct io_uring_sqe *sqe;
+
+		if (target->length == 0)
+			continue;
+		sqe = sRingGetSqe(&engine->ring);
+		if (sqe == NULL) {
+			/* Queue full, this target goes out the slow way */
+			if (sWriteAll(target->fd, target->isSocket, target->data,
+				target->length))
+				ret = -1;
+			continue;
+		}
+		if (target->isSocket) {
+			sqe->opcode = IORING_OP_SEND;
+			sqe->msg_flags = MSG_NOSIGNAL;
+		} else {
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->off = (uint64_t)-1;
+		}
+		sqe->fd = target->fd;
+		sqe->addr = (uint64_t)(uintptr_t)target->data;
+		sqe->len = (unsigned)target->length;
+		sqe->user_data = (uint64_t)i;
+		submitted++;
+	}
+	if (submitted == 0)
+		return ret;
+
+	if (sRingEnter(&engine->ring, submitted) < 0)
+		return -1;
+
+	while (reaped < submitted) {
+		if (!sRingPopCqe(&engine->ring, &cqe)) {
+			if (sRingEnter(&engine->ring, 1) < 0)
+				return -1;
+			continue;
+		}
+		if (cqe.user_data >= USYNERGY_IO_MAX_TARGETS)
+			continue;
+		reaped++;
+
+		sIoTarget *target = &engine->targets[cqe.user_data];
+		if (cqe.res < 0) {
+			ret = -1;
+		} else if ((size_t)cqe.res < target->length) {
+			/* Short write, finish the rest the slow way */
+			if (sWriteAll(target->fd, target->isSocket,
+				target->data + cqe.res, target->length - cqe.res))
+				ret = -1;
+		}
+	}
+	return ret;
+}
+#endif
+
+//-----------------------------------------------------------------------------
+//	Staging
+//-----------------------------------------------------------------------------
+
+static int sFlushLocked(uSynergyIoEngine *engine)
+{
+	int i, ret = 0;
+
+#ifdef USYNERGY_HAVE_IO_URING
+	if (engine->useRing)
+		ret = sRingFlush(engine);
+	else
+#endif
+	for (i = 0; i < engine->numTargets; i++) {
+		sIoTarget *target = &engine->targets[i];
+		if (target->length && sWriteAll(target->fd, target->isSocket,
+			target->data, target->length))
+			ret = -1;
+	}
+
+	engine->numTargets = 0;
+	return ret;
+}
+
+static int sQueue(uSynergyIoEngine *engine, int fd, int isSocket,
+	const void *buffer, size_t length)
+{
+	sIoTarget *target = NULL;
+	int i, ret = 0;
+
+	pthread_mutex_lock(&engine->lock);
+	for (i = 0; i < engine->numTargets; i++) {
+		if (engine->targets[i].fd == fd) {
+			target = &engine->targets[i];
+			break;
+		}
+	}
+
+	if (target != NULL && target->length + length > USYNERGY_IO_STAGE_SIZE) {
+		ret = sFlushLocked(engine);
+		target = NULL;
+	}
+
+	if (length > USYNERGY_IO_STAGE_SIZE) {
+		/* Too big to stage, keep ordering and write it through */
+		if (sFlushLocked(engine) || sWriteAll(fd, isSocket, buffer, length))
+			ret = -1;
+		pthread_mutex_unlock(&engine->lock);
+		return ret;
+	}
+
+	if (target == NULL) {
+		if (engine->numTargets == USYNERGY_IO_MAX_TARGETS)
+			ret |= sFlushLocked(engine);
+		target = &engine->targets[engine->numTargets++];
+		target->fd = fd;
+		target->isSocket = isSocket;
+		target->length = 0;
+	}
+
+	memcpy(target->data + target->length, buffer, length);
+	target->length += length;
+	pthread_mutex_unlock(&engine->lock);
+	return ret;
+}
+
+//-----------------------------------------------------------------------------
+//	Public interface
+//-----------------------------------------------------------------------------
+
+uSynergyIoEngine *uSynergyIoCreate(int useRing, uSynergyArena *arena)
+{
+	uSynergyIoEngine *engine;
+
+	if (arena != NULL)
+		engine = uSynergyArenaAlloc(arena, sizeof(uSynergyIoEngine));
+	else
+		engine = calloc(1, sizeof(uSynergyIoEngine));
+	if (engine == NULL)
+		return NULL;
+	engine->arena = arena;
+	pthread_mutex_init(&engine->lock, NULL);
+
+#ifdef USYNERGY_HAVE_IO_URING
+	engine->ring.fd = -1;
+	if (useRing && sRingSetup(&engine->ring, USYNERGY_IO_RING_ENTRIES) == 0) {
+		if (sRingProbe(&engine->ring) == 0) {
+			engine->useRing = 1;
+			engine->rxMultishot = 1;
+		} else {
+			/* Too old for the ops we need, stay on plain syscalls */
+			sRingTeardown(&engine->ring);
+		}
+	}
+#endif
+	return engine;
+}
+
+void uSynergyIoDestroy(uSynergyIoEngine *engine)
+{
+	if (engine == NULL)
+		return;
+#ifdef USYNERGY_HAVE_IO_URING
+	/* Closing the ring cancels an armed recv before its buffers go away */
+	sRingTeardown(&engine->ring);
+	if (engine->arena == NULL)
+		free(engine->rxBuffers);
+#endif
+	pthread_mutex_destroy(&engine->lock);
+	if (engine->arena == NULL)
+		free(engine);
+}
+
+int uSynergyIoUsingRing(const uSynergyIoEngine *engine)
+{
+	return engine->useRing;
+}
+
+int uSynergyIoQueueSend(uSynergyIoEngine *engine, int fd,
+	const void *buffer, size_t length)
+{
+	return sQueue(engine, fd, 1, buffer, length);
+}
+
+int uSynergyIoQueueWrite(uSynergyIoEngine *engine, int fd,
+	const void *buffer, size_t length)
+{
+	return sQueue(engine, fd, 0, buffer, length);
+}
+
+int uSynergyIoFlush(uSynergyIoEngine *engine)
+{
+	int ret;
+
+	pthread_mutex_lock(&engine->lock);
+	ret = sFlushLocked(engine);
+	pthread_mutex_unlock(&engine->lock);
+	return ret;
+}
+
+int uSynergyIoReceive(uSynergyIoEngine *engine, int fd,
+	void *buffer, size_t maxLength)
+{
+#ifdef USYNERGY_HAVE_IO_URING
+	struct io_uring_cqe cqe;
+
+	if (!engine->useRing)
+		return -1;
+
+	if (engine->rxBuffers == NULL) {
+		/* Only the receive thread allocates here, on the first receive */
+		if (engine->arena != NULL)
+			engine->rxBuffers = uSynergyArenaAlloc(engine->arena,
+				USYNERGY_IO_RX_BUFFERS * USYNERGY_IO_RX_BUFFER_SIZE);
+		else
+			engine->rxBuffers = malloc(USYNERGY_IO_RX_BUFFERS
+				* USYNERGY_IO_RX_BUFFER_SIZE);
+		if (engine->rxBuffers == NULL)
+			return -1;
+		if (sRingProvide(engine, 0, USYNERGY_IO_RX_BUFFERS) < 0)
+			return -1;
+	}
+
+	while (1) {
+		if (engine->rxHave) {
+			size_t n = engine->rxLength - engine->rxOfs;
+			if (n > maxLength)
+				n = maxLength;
+			memcpy(buffer, engine->rxBuffers
+				+ engine->rxBid * USYNERGY_IO_RX_BUFFER_SIZE
+				+ engine->rxOfs, n);
+			engine->rxOfs += n;
+			if (engine->rxOfs == engine->rxLength) {
+				/* Buffer drained, give it back on the next enter */
+				engine->rxHave = 0;
+				if (sRingProvide(engine, engine->rxBid, 1) < 0)
+					return -1;
+			}
+			return (int)n;
+		}
+
+		if (sRingPopCqe(&engine->ring, &cqe)) {
+			if (cqe.user_data != USYNERGY_IO_TAG_RECV)
+				continue;
+			if (!(cqe.flags & IORING_CQE_F_MORE))
+				engine->rxArmed = 0;
+
+			if (cqe.res > 0) {
+				engine->rxHave = 1;
+				engine->rxBid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+				engine->rxLength = cqe.res;
+				engine->rxOfs = 0;
+			} else if (cqe.res == 0) {
+				return 0;
+			} else if (cqe.res == -EINVAL && engine->rxMultishot) {
+				/* Kernel predates multishot recv, post one at a time */
+				engine->rxMultishot = 0;
+			} else if (cqe.res != -ENOBUFS && cqe.res != -EINTR
+				&& cqe.res != -EAGAIN) {
+				errno = -cqe.res;
+				return -1;
+			}
+			continue;
+		}
+
+		if (!engine->rxArmed) {
+			struct io_uring_sqe *sqe = sRingGetSqe(&engine->ring);
+			if (sqe == NULL) {
+				if (sRingEnter(&engine->ring, 0) < 0)
+					return -1;
+				continue;
+			}
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = fd;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = USYNERGY_IO_RX_GROUP;
+			if (engine->rxMultishot)
+				sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->user_data = USYNERGY_IO_TAG_RECV;
+			engine->rxArmed = 1;
+		}
+
+		/* Returns buffers, (re)arms recv and waits, all in one call */
+		if (sRingEnter(&engine->ring, 1) < 0)
+			return -1;
+	}
+#else
+	(void)engine; (void)fd; (void)buffer; (void)maxLength;
+	return -1;
+#endif
+}
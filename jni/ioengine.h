@@ -0,0 +1,106 @@
+/*
+ * uSynergy client -- Batched socket and uinput I/O engine
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#ifndef USYNERGY_IOENGINE_H
+#define USYNERGY_IOENGINE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The I/O engine collects the reply sends and uinput writes produced while
+ * dispatching a burst of messages and issues them together on flush: a
+ * single io_uring_enter() when io_uring is available, otherwise one send()
+ * and one write() per uinput device. Consecutive writes to the same file
+ * descriptor are coalesced, so a burst of mouse moves becomes one write.
+
+ * A receive engine keeps a multishot recv armed on the server socket and
+ * hands out the data of several completions per io_uring_enter().
+
+ * An engine is not thread safe for receiving; queueing and flushing are
+ * serialized by an internal mutex so other threads may send replies.
+ */
+typedef struct uSynergyIoEngine uSynergyIoEngine;
+
+struct uSynergyArena;
+
+/*
+ * @brief Create an engine
+
+ * @param useRing	Try to set up io_uring, fall back silently if the kernel
+ *	(or a seccomp policy) refuses it or lacks send, write, recv or provided
+ *	buffers
+ * @param arena		Memory for the engine and its receive buffers, which then
+ *	is never freed by uSynergyIoDestroy(). NULL uses the heap.
+ * @returns Engine or NULL on allocation failure
+ */
+extern uSynergyIoEngine *uSynergyIoCreate(int useRing,
+	struct uSynergyArena *arena);
+
+/*
+ * @brief Destroy an engine, dropping anything still queued
+ */
+extern void uSynergyIoDestroy(uSynergyIoEngine *engine);
+
+/*
+ * @brief Returns 1 if the engine is backed by io_uring
+ */
+extern int uSynergyIoUsingRing(const uSynergyIoEngine *engine);
+
+/*
+ * @brief Queue data to send() on a socket. Returns 0 on success.
+ */
+extern int uSynergyIoQueueSend(uSynergyIoEngine *engine, int fd,
+	const void *buffer, size_t length);
+
+/*
+ * @brief Queue data to write() to a file descriptor. Returns 0 on success.
+ */
+extern int uSynergyIoQueueWrite(uSynergyIoEngine *engine, int fd,
+	const void *buffer, size_t length);
+
+/*
+ * @brief Issue all queued operations and wait for them to complete
+
+ * @returns 0 on success, -1 if any operation failed or was short
+ */
+extern int uSynergyIoFlush(uSynergyIoEngine *engine);
+
+/*
+ * @brief Receive from a socket through the engine
+
+ * Blocks until data is available. Returns the number of bytes stored in
+ * @a buffer, 0 on orderly shutdown and -1 on error. Only valid for engines
+ * backed by io_uring.
+ */
+extern int uSynergyIoReceive(uSynergyIoEngine *engine, int fd,
+	void *buffer, size_t maxLength);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* USYNERGY_IOENGINE_H */
@@ -1,9 +1,20 @@
-#include <android/log.h>
 #include <stdio.h>
 
 #define LOG_TAG "uSynergyNativeService"
+#ifdef __ANDROID__
+#include <android/log.h>
+
 #define LOGV(...) __android_log_print(ANDROID_LOG_VERBOSE, LOG_TAG, __VA_ARGS__)
 #define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
 #define LOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#else
+/* Host builds of the jni/ sources (benchmarks, tools) log to stderr */
+#define LOG_HOST(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGV(...) LOG_HOST(__VA_ARGS__)
+#define LOGD(...) LOG_HOST(__VA_ARGS__)
+#define LOGI(...) LOG_HOST(__VA_ARGS__)
+#define LOGW(...) LOG_HOST(__VA_ARGS__)
+#define LOGE(...) LOG_HOST(__VA_ARGS__)
+#endif
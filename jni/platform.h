@@ -4,56 +4,6 @@
 //	Functions and Callbacks
 //-----------------------------------------------------------------------------
 
-/*
- * @brief Connect function
-
- * This function is called when uSynergy needs to connect to the host.
- * It doesn't imply a network implementation or destination address, that must
- * all be handled on the user side. The function should return USYNERGY_TRUE
- * if a connection was established or USYNERGY_FALSE if it could not connect.
-
- * When network errors occur (e.g. uSynergySend or uSynergyReceive fail) then
- * the connect call will be called again so the implementation of the function
- * must close any old connections and clean up resources before retrying.
-
- * @param cookie Cookie supplied in the Synergy context
- */
-static uSynergyBool uSynergyConnectFunc(uSynergyCookie cookie);
-
-/*
- * @brief Send function
-
- * This function is called when uSynergy needs to send something over the
- * default connection. It should return USYNERGY_TRUE if sending succeeded and
- * USYNERGY_FALSE otherwise. This function should block until the send
- * operation is completed.
-
- * @param cookie Cookie supplied in the Synergy context
- * @param buffer Address of buffer to send
- * @param length Length of buffer to send
- */
-static uSynergyBool uSynergySendFunc(uSynergyCookie cookie,
-	const uint8_t *buffer, int length);
-
-/*
- * @brief Receive function
-
- * This function is called when uSynergy needs to receive data from the default
- * connection. It should return USYNERGY_TRUE if receiving data succeeded and
- * USYNERGY_FALSE otherwise. This function should block until data has been
- * received and wait for data to become available. If @a outLength is set to 0
- * upon completion it is assumed that the connection is alive, but still in a
- * connecting state and needs time to settle.
-
- * @param cookie	Cookie supplied in the Synergy context
- * @param buffer	Address of buffer to receive data into
- * @param maxLength	Maximum amount of bytes to write into the receive buffer
- * @param outLength	Address of integer that receives the actual amount of bytes
- * written into @a buffer
- */
-static uSynergyBool uSynergyReceiveFunc(uSynergyCookie cookie, uint8_t *buffer,
-	int maxLength, int* outLength);
-
 /*
  * @brief Thread sleep function
 
@@ -80,6 +30,7 @@ static uint32_t	uSynergyGetTimeFunc();
 
 static uSynergyBool uSynergyConnectDevice(uSynergyCookie cookie);
 static void uSynergyDisconnectDevice(uSynergyCookie cookie);
+static void uSynergyAttachDevice(uSynergyCookie cookie);
 
 /*
  * @brief Trace function
@@ -0,0 +1,406 @@
+/*
+ * uSynergy client -- Runtime statistics endpoint
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "stats.h"
+
+/* Room for the dump of one context */
+#define USYNERGY_STATS_CONTEXT_SIZE		(32 * 1024)
+
+/* How long a scraper may take to read a dump before it is dropped */
+#define USYNERGY_STATS_SEND_TIMEOUT		1
+
+struct uSynergyStatsServer {
+	int fd;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	uSynergyContext **contexts;
+	int count;
+	pthread_t thread;
+};
+
+/* Label values of enum uSynergyLatencyType and enum uSynergyLatencyStage */
+static const char *const sTypeNames[USYNERGY_NUM_LATENCY_TYPES] = {
+	"mouse_move", "mouse_button", "mouse_wheel", "key", "clipboard",
+	"keepalive", "other",
+};
+static const char *const sStageNames[USYNERGY_NUM_LATENCY_STAGES] = {
+	"queue", "process", "total",
+};
+
+/* Quantiles reported for every latency histogram */
+static const double sQuantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+#define USYNERGY_COUNTER(field, name, help) \
+	{ offsetof(uSynergyCounters, field), name, help }
+
+static const struct {
+	size_t offset;
+	const char *name;
+	const char *help;
+} sCounters[] = {
+	USYNERGY_COUNTER(m_unknownMessages, "usynergy_unknown_messages_total",
+		"Messages the client does not handle"),
+	USYNERGY_COUNTER(m_skippedMessages, "usynergy_skipped_messages_total",
+		"Frames skipped as malformed, truncated or oversized"),
+	USYNERGY_COUNTER(m_reads, "usynergy_reads_total",
+		"Transport reads that returned data"),
+	USYNERGY_COUNTER(m_bytesReceived, "usynergy_received_bytes_total",
+		"Bytes read from the transport"),
+	USYNERGY_COUNTER(m_messagesSent, "usynergy_sent_messages_total",
+		"Replies and clipboard chunks sent"),
+	USYNERGY_COUNTER(m_bytesSent, "usynergy_sent_bytes_total",
+		"Bytes written to the transport"),
+	USYNERGY_COUNTER(m_sendErrors, "usynergy_send_errors_total",
+		"Sends and flushes that failed"),
+	USYNERGY_COUNTER(m_connects, "usynergy_connects_total",
+		"Sessions connected"),
+	USYNERGY_COUNTER(m_connectFailures, "usynergy_connect_failures_total",
+		"Connect attempts that failed"),
+	USYNERGY_COUNTER(m_deviceWrites, "usynergy_device_writes_total",
+		"Device writes issued by the injection layer"),
+	USYNERGY_COUNTER(m_deviceErrors, "usynergy_device_errors_total",
+		"Device writes that failed"),
+	USYNERGY_COUNTER(m_clipboardsReceived, "usynergy_clipboards_received_total",
+		"Clipboards received from the server"),
+	USYNERGY_COUNTER(m_clipboardBytesReceived,
+		"usynergy_clipboard_received_bytes_total",
+		"Bytes of the clipboards received"),
+	USYNERGY_COUNTER(m_clipboardsDropped, "usynergy_clipboards_dropped_total",
+		"Clipboards dropped for their size"),
+	USYNERGY_COUNTER(m_clipboardsSent, "usynergy_clipboards_sent_total",
+		"Clipboards sent to the server"),
+	USYNERGY_COUNTER(m_clipboardBytesSent, "usynergy_clipboard_sent_bytes_total",
+		"Bytes of the clipboards sent"),
+};
+
+#undef USYNERGY_COUNTER
+
+/*
+ * @brief Dump being written, never overruns its buffer
+ */
+typedef struct {
+	char *buffer;
+	size_t size;
+	size_t length;
+} uSynergyStatsOutput;
+
+static void sPrint(uSynergyStatsOutput *out, const char *format, ...)
+{
+	va_list args;
+	int ret;
+
+	if (out->length + 1 >= out->size)
+		return;
+	va_start(args, format);
+	ret = vsnprintf(out->buffer + out->length, out->size - out->length,
+		format, args);
+	va_end(args);
+	if (ret < 0)
+		return;
+	out->length += (size_t)ret;
+	if (out->length >= out->size)
+		out->length = out->size - 1;
+}
+
+/*
+ * @brief Client name usable as a label value
+ */
+static void sLabel(const uSynergyContext *context, char *label, size_t size)
+{
+	const char *name = context->m_clientName != NULL
+		? context->m_clientName : "";
+	size_t i;
+
+	for (i = 0; i + 1 < size && name[i] != '\0'; i++) {
+		char c = name[i];
+		label[i] = (c == '"' || c == '\\' || c == '\n') ? '_' : c;
+	}
+	label[i] = '\0';
+}
+
+size_t uSynergyFormatStats(uSynergyContext *const *contexts, int count,
+	char *buffer, size_t size)
+{
+	uSynergyStatsOutput out = { buffer, size, 0 };
+	uSynergyCounters *counters;
+	uSynergyLatencyStats *latency;
+	uSynergyStartupTimes *startup;
+	uSynergyRttStats *rtt;
+	char (*labels)[64];
+	int c, i, t, s;
+
+	if (size == 0)
+		return 0;
+	buffer[0] = '\0';
+	if (count <= 0)
+		return 0;
+
+	/* Take every snapshot first, the dump is then consistent per context */
+	counters = malloc((size_t)count * sizeof(uSynergyCounters));
+	latency = malloc((size_t)count * sizeof(uSynergyLatencyStats));
+	startup = malloc((size_t)count * sizeof(uSynergyStartupTimes));
+	rtt = malloc((size_t)count * sizeof(uSynergyRttStats));
+	labels = malloc((size_t)count * sizeof(*labels));
+	if (counters == NULL || latency == NULL || startup == NULL
+		|| rtt == NULL || labels == NULL) {
+		free(counters);
+		free(latency);
+		free(startup);
+		free(rtt);
+		free(labels);
+		return 0;
+	}
+	for (c = 0; c < count; c++) {
+		uSynergyGetCounters(contexts[c], &counters[c]);
+		uSynergyGetLatencyStats(contexts[c], &latency[c]);
+		uSynergyGetStartupTimes(contexts[c], &startup[c]);
+		uSynergyGetRttStats(contexts[c], &rtt[c]);
+		sLabel(contexts[c], labels[c], sizeof(labels[c]));
+	}
+
+	sPrint(&out, "# HELP usynergy_messages_total Messages dispatched\n"
+		"# TYPE usynergy_messages_total counter\n");
+	for (c = 0; c < count; c++) {
+		for (t = 0; t < USYNERGY_NUM_LATENCY_TYPES; t++)
+			sPrint(&out, "usynergy_messages_total{client=\"%s\",type=\"%s\"} "
+				"%llu\n", labels[c], sTypeNames[t],
+				(unsigned long long)counters[c].m_messages[t]);
+	}
+
+	for (i = 0; i < (int)(sizeof(sCounters) / sizeof(sCounters[0])); i++) {
+		sPrint(&out, "# HELP %s %s\n# TYPE %s counter\n", sCounters[i].name,
+			sCounters[i].help, sCounters[i].name);
+		for (c = 0; c < count; c++) {
+			const uint64_t *value = (const uint64_t *)
+				((const char *)&counters[c] + sCounters[i].offset);
+			sPrint(&out, "%s{client=\"%s\"} %llu\n", sCounters[i].name,
+				labels[c], (unsigned long long)*value);
+		}
+	}
+
+	sPrint(&out, "# HELP usynergy_latency_seconds Time from receipt to "
+		"injection and its stages\n"
+		"# TYPE usynergy_latency_seconds summary\n");
+	for (c = 0; c < count; c++) {
+		for (t = 0; t < USYNERGY_NUM_LATENCY_TYPES; t++) {
+			for (s = 0; s < USYNERGY_NUM_LATENCY_STAGES; s++) {
+				const uSynergyHistogram *histogram =
+					&latency[c].m_histograms[t][s];
+				char labelSet[160];
+
+				if (histogram->m_count == 0)
+					continue;
+				snprintf(labelSet, sizeof(labelSet),
+					"client=\"%s\",type=\"%s\",stage=\"%s\"", labels[c],
+					sTypeNames[t], sStageNames[s]);
+				for (i = 0; i < (int)(sizeof(sQuantiles)
+					/ sizeof(sQuantiles[0])); i++)
+					sPrint(&out, "usynergy_latency_seconds{%s,quantile=\"%g\"} "
+						"%.9f\n", labelSet, sQuantiles[i],
+						uSynergyHistogramPercentile(histogram,
+						sQuantiles[i] * 100) / 1e9);
+				sPrint(&out, "usynergy_latency_seconds_sum{%s} %.9f\n"
+					"usynergy_latency_seconds_count{%s} %llu\n", labelSet,
+					histogram->m_sum / 1e9, labelSet,
+					(unsigned long long)histogram->m_count);
+			}
+		}
+	}
+
+	sPrint(&out, "# HELP usynergy_startup_seconds Time from the start of the "
+		"latest run to each startup phase it reached\n"
+		"# TYPE usynergy_startup_seconds gauge\n");
+	for (c = 0; c < count; c++) {
+		const uint64_t *phases = startup[c].m_phases;
+
+		for (i = 1; i < USYNERGY_NUM_STARTUP_PHASES; i++) {
+			/* Unset, or left over from the run before */
+			if (phases[i] == 0 || phases[i] < phases[USYNERGY_STARTUP_RUN])
+				continue;
+			sPrint(&out, "usynergy_startup_seconds{client=\"%s\",phase=\"%s\"} "
+				"%.9f\n", labels[c], uSynergyStartupPhaseName(i),
+				(phases[i] - phases[USYNERGY_STARTUP_RUN]) / 1e9);
+		}
+	}
+
+	sPrint(&out, "# HELP usynergy_rtt_seconds Round trip time to the server\n"
+		"# TYPE usynergy_rtt_seconds summary\n");
+	for (c = 0; c < count; c++) {
+		if (rtt[c].m_samples == 0)
+			continue;
+		for (i = 0; i < (int)(sizeof(sQuantiles) / sizeof(sQuantiles[0]));
+			i++)
+			sPrint(&out, "usynergy_rtt_seconds{client=\"%s\",quantile=\"%g\"} "
+				"%.9f\n", labels[c], sQuantiles[i],
+				uSynergyHistogramPercentile(&rtt[c].m_histogram,
+				sQuantiles[i] * 100) / 1e9);
+		sPrint(&out, "usynergy_rtt_seconds_sum{client=\"%s\"} %.9f\n"
+			"usynergy_rtt_seconds_count{client=\"%s\"} %llu\n", labels[c],
+			rtt[c].m_histogram.m_sum / 1e9, labels[c],
+			(unsigned long long)rtt[c].m_histogram.m_count);
+	}
+	sPrint(&out, "# HELP usynergy_rtt_smoothed_seconds Smoothed round trip "
+		"time\n# TYPE usynergy_rtt_smoothed_seconds gauge\n");
+	for (c = 0; c < count; c++) {
+		if (rtt[c].m_samples > 0)
+			sPrint(&out, "usynergy_rtt_smoothed_seconds{client=\"%s\"} %.9f\n",
+				labels[c], rtt[c].m_smoothed / 1e9);
+	}
+	sPrint(&out, "# HELP usynergy_rtt_jitter_seconds Mean deviation of the "
+		"round trip time\n# TYPE usynergy_rtt_jitter_seconds gauge\n");
+	for (c = 0; c < count; c++) {
+		if (rtt[c].m_samples > 0)
+			sPrint(&out, "usynergy_rtt_jitter_seconds{client=\"%s\"} %.9f\n",
+				labels[c], rtt[c].m_variation / 1e9);
+	}
+	sPrint(&out, "# HELP usynergy_rtt_probes_lost_total Round trip probes the "
+		"server did not answer\n# TYPE usynergy_rtt_probes_lost_total counter\n");
+	for (c = 0; c < count; c++)
+		sPrint(&out, "usynergy_rtt_probes_lost_total{client=\"%s\"} %llu\n",
+			labels[c], (unsigned long long)rtt[c].m_lost);
+
+	free(counters);
+	free(latency);
+	free(startup);
+	free(rtt);
+	free(labels);
+	return out.length;
+}
+
+//-----------------------------------------------------------------------------
+//	Server
+//-----------------------------------------------------------------------------
+
+static void *sServe(void *arg)
+{
+	uSynergyStatsServer *server = arg;
+	size_t size = (size_t)server->count * USYNERGY_STATS_CONTEXT_SIZE;
+	struct timeval timeout = { USYNERGY_STATS_SEND_TIMEOUT, 0 };
+	char *buffer = malloc(size);
+	int fd;
+
+	pthread_setname_np(pthread_self(), "usynergy-stats");
+	if (buffer == NULL)
+		return NULL;
+
+	/* Ends when uSynergyStatsStop() shuts the listening socket down */
+	while ((fd = accept(server->fd, NULL, NULL)) >= 0
+		|| errno == EINTR || errno == ECONNABORTED) {
+		size_t length, ofs;
+		ssize_t ret;
+
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		length = uSynergyFormatStats(server->contexts, server->count,
+			buffer, size);
+		for (ofs = 0; ofs < length; ofs += (size_t)ret) {
+			ret = send(fd, buffer + ofs, length - ofs, MSG_NOSIGNAL);
+			if (ret <= 0)
+				break;
+		}
+		close(fd);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+uSynergyStatsServer *uSynergyStatsServe(const char *path,
+	uSynergyContext *const *contexts, int count)
+{
+	uSynergyStatsServer *server;
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	size_t len = strlen(path);
+
+	if (count <= 0 || len == 0 || len >= sizeof(addr.sun_path))
+		return NULL;
+	server = calloc(1, sizeof(uSynergyStatsServer));
+	if (server == NULL)
+		return NULL;
+	server->contexts = malloc((size_t)count * sizeof(uSynergyContext *));
+	if (server->contexts == NULL) {
+		free(server);
+		return NULL;
+	}
+	memcpy(server->contexts, contexts, (size_t)count * sizeof(uSynergyContext *));
+	server->count = count;
+	memcpy(server->path, path, len + 1);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, len);
+	if (path[0] == '@') {
+		/* Abstract namespace: leading NUL, no terminator */
+		addr.sun_path[0] = '\0';
+		addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+	} else {
+		unlink(path);
+		addr_len = sizeof(addr);
+	}
+
+	server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server->fd < 0) {
+		perror("stats socket error");
+	} else if (bind(server->fd, (struct sockaddr *)&addr, addr_len) < 0) {
+		perror("stats bind error");
+	} else if (listen(server->fd, 4) < 0) {
+		perror("stats listen error");
+	} else if (pthread_create(&server->thread, NULL, sServe, server) == 0) {
+		return server;
+	}
+
+	if (server->fd >= 0)
+		close(server->fd);
+	free(server->contexts);
+	free(server);
+	return NULL;
+}
+
+void uSynergyStatsStop(uSynergyStatsServer *server)
+{
+	if (server == NULL)
+		return;
+	shutdown(server->fd, SHUT_RDWR);
+	pthread_join(server->thread, NULL);
+	close(server->fd);
+	if (server->path[0] != '@')
+		unlink(server->path);
+	free(server->contexts);
+	free(server);
+}
@@ -0,0 +1,77 @@
+/*
+ * uSynergy client -- Runtime statistics endpoint
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#ifndef USYNERGY_STATS_H
+#define USYNERGY_STATS_H
+
+#include <stddef.h>
+
+#include "uSynergy.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Text dump of the counters and latency histograms of one or more contexts
+ * in the Prometheus exposition format, and a local Unix socket serving it.
+ * Every connection to the socket receives one dump and is closed, so
+ * "socat - UNIX-CONNECT:path" or a monitoring agent polling the socket
+ * scrape it without any request protocol.
+ */
+
+typedef struct uSynergyStatsServer uSynergyStatsServer;
+
+/*
+ * @brief Write the dump of @a count contexts to @a buffer
+
+ * Samples are labelled with the client name of their context. The dump is
+ * cut short if it does not fit, about 32 KiB per context always do.
+
+ * @returns Length of the dump, less than @a size
+ */
+extern size_t uSynergyFormatStats(uSynergyContext *const *contexts, int count,
+	char *buffer, size_t size);
+
+/*
+ * @brief Serve the dump on a Unix stream socket from a thread of its own
+
+ * A leading '@' in @a path selects the abstract namespace, otherwise a
+ * stale socket file at @a path is replaced. The contexts must outlive the
+ * server.
+
+ * @returns The server, or NULL if the socket could not be set up
+ */
+extern uSynergyStatsServer *uSynergyStatsServe(const char *path,
+	uSynergyContext *const *contexts, int count);
+
+/*
+ * @brief Stop serving, join the thread and remove the socket
+ */
+extern void uSynergyStatsStop(uSynergyStatsServer *server);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* USYNERGY_STATS_H */
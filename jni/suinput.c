@@ -34,6 +34,15 @@ char* UINPUT_FILEPATHS[] = {
 
 #define UINPUT_FILEPATHS_COUNT (sizeof(UINPUT_FILEPATHS) / sizeof(char*))
 
+static __thread suinput_writer suinput_current_writer;
+static __thread void *suinput_current_writer_arg;
+
+void suinput_set_writer(suinput_writer writer, void *arg)
+{
+	suinput_current_writer = writer;
+	suinput_current_writer_arg = arg;
+}
+
 static int suinput_write(int uinput_fd, uint16_t type,
 	uint16_t code, int32_t value)
 {
@@ -45,6 +54,10 @@ static int suinput_write(int uinput_fd, uint16_t type,
 	event.code = code;
 	event.value = value;
 
+	if (suinput_current_writer != NULL)
+		return suinput_current_writer(suinput_current_writer_arg, uinput_fd,
+			&event, sizeof(event));
+
 	if (write(uinput_fd, &event, sizeof(event)) != sizeof(event))
 		return -1;
 	return 0;
@@ -59,8 +72,8 @@ static int suinput_write_syn(int uinput_fd, uint16_t type,
 	return suinput_write(uinput_fd, EV_SYN, SYN_REPORT, 0);
 }
 
-int suinput_open(const char* device_name, const struct input_id* id,
-	device_type type)
+static int suinput_uinput_open(void *arg, const char* device_name,
+	const struct input_id* id, device_type type)
 {
 	int original_errno = 0;
 	int uinput_fd = -1;
@@ -156,6 +169,40 @@ err:
 	return -1;
 }
 
+static int suinput_uinput_destroy(void *arg, int uinput_fd)
+{
+	if (ioctl(uinput_fd, UI_DEV_DESTROY) == -1) {
+		close(uinput_fd);
+		return -1;
+	}
+
+	if (close(uinput_fd) == -1)
+		return -1;
+
+	return 0;
+}
+
+const suinput_backend suinput_uinput_backend = {
+	.name    = "uinput",
+	.open    = suinput_uinput_open,
+	.destroy = suinput_uinput_destroy,
+	.arg     = NULL,
+};
+
+int suinput_open(const char* device_name, const struct input_id* id,
+	device_type type)
+{
+	return suinput_open_backend(NULL, device_name, id, type);
+}
+
+int suinput_open_backend(const suinput_backend *backend,
+	const char* device_name, const struct input_id* id, device_type type)
+{
+	if (backend == NULL)
+		backend = &suinput_uinput_backend;
+	return backend->open(backend->arg, device_name, id, type);
+}
+
 int suinput_close(int uinput_fd)
 {
 	/*
@@ -166,15 +213,19 @@ int suinput_close(int uinput_fd)
 	 */
 	sleep(2);
 
-	if (ioctl(uinput_fd, UI_DEV_DESTROY) == -1) {
-		close(uinput_fd);
-		return -1;
-	}
+	return suinput_destroy(uinput_fd);
+}
 
-	if (close(uinput_fd) == -1)
-		return -1;
+int suinput_destroy(int uinput_fd)
+{
+	return suinput_destroy_backend(NULL, uinput_fd);
+}
 
-	return 0;
+int suinput_destroy_backend(const suinput_backend *backend, int uinput_fd)
+{
+	if (backend == NULL)
+		backend = &suinput_uinput_backend;
+	return backend->destroy(backend->arg, uinput_fd);
 }
 
 int suinput_move_pointer(int uinput_fd, int32_t x, int32_t y)
@@ -19,6 +19,7 @@
 
 #ifndef SUINPUT_H
 #define SUINPUT_H
+#include <stddef.h>
 #include <stdint.h>
 
 #include <linux/input.h>
@@ -29,6 +30,42 @@ typedef enum {
 	joystick
 } device_type;
 
+/*
+ * Event writer. Receives every event written by the calling thread and
+ * returns 0 on success or -1 on error, like write() of the whole buffer would.
+ */
+typedef int (*suinput_writer)(void *arg, int uinput_fd, const void *buffer,
+	size_t length);
+
+/*
+ * Routes the events written by the calling thread through `writer`, e.g. to
+ * batch them with other I/O. Passing NULL restores direct write() calls.
+ * The setting is per thread, so several dispatch threads can each batch into
+ * their own queue.
+ */
+void suinput_set_writer(suinput_writer writer, void *arg);
+
+/*
+ * Device backend, deciding what an opened device really is. The default
+ * backend creates kernel devices through uinput; a test backend may hand out
+ * any file descriptor that takes write() of struct input_event, so direct,
+ * batched and io_uring writers work the same with every backend.
+ */
+typedef struct suinput_backend {
+	/* Backend name, for logs */
+	const char *name;
+	/* Like suinput_open() and suinput_destroy(), `arg` is passed along */
+	int (*open)(void *arg, const char *device_name, const struct input_id *id,
+		device_type type);
+	int (*destroy)(void *arg, int uinput_fd);
+	void *arg;
+} suinput_backend;
+
+/*
+ * The kernel's uinput, what suinput_open() and suinput_destroy() use.
+ */
+extern const suinput_backend suinput_uinput_backend;
+
 /*
  * Creates and opens a connection to the event device. Returns an uinput file
  * descriptor on success. On error, -1 is returned, and errno is set
@@ -37,6 +74,13 @@ typedef enum {
 int suinput_open(const char* device_name, const struct input_id* id,
 	device_type type);
 
+/*
+ * Like suinput_open(), but the device comes from `backend`. NULL selects
+ * suinput_uinput_backend.
+ */
+int suinput_open_backend(const suinput_backend *backend,
+	const char* device_name, const struct input_id* id, device_type type);
+
 /*
  * Destroys and closes a connection to the event device. Returns 0 on success.
  * On error, -1 is returned, and errno is set appropriately.
@@ -46,6 +90,18 @@ int suinput_open(const char* device_name, const struct input_id* id,
  */
 int suinput_close(int uinput_fd);
 
+/*
+ * Like suinput_close(), but destroys the device right away. The caller is
+ * responsible for giving readers time to consume the last events, e.g. by
+ * waiting once before destroying several devices.
+ */
+int suinput_destroy(int uinput_fd);
+
+/*
+ * Like suinput_destroy(), for a device opened with suinput_open_backend().
+ */
+int suinput_destroy_backend(const suinput_backend *backend, int uinput_fd);
+
 /*
  * Sends a relative pointer motion event to the event device. Values increase
  * towards right-bottom. Returns 0 on success. On error, -1 is returned, and
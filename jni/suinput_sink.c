@@ -0,0 +1,477 @@
+/*
+ * uSynergy client -- Recording uinput sink and evdev stream verifier
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "uinput.h"
+#include "suinput_sink.h"
+
+/* Largest write taken whole, a coalesced burst is far smaller */
+#define SUINPUT_SINK_PACKET	(64 * 1024)
+/* Socket buffer of a device, so writers do not wait for the sink thread */
+#define SUINPUT_SINK_BUFFER	(4 * 1024 * 1024)
+/* epoll tag of the stop event, devices are tagged with their index */
+#define SUINPUT_SINK_STOP	UINT32_MAX
+
+typedef struct {
+	char name[UINPUT_MAX_NAME_SIZE];
+	device_type type;
+	/* Handed out as the device, closed by destroy */
+	int write_fd;
+	/* Drained by the sink, -1 once everything up to the close was read */
+	int read_fd;
+	int destroyed;
+} suinput_sink_device;
+
+typedef struct {
+	uint32_t device;
+	/* Write operation the event came with, counted over all devices */
+	uint32_t write;
+	struct input_event event;
+} suinput_sink_record;
+
+struct suinput_sink {
+	suinput_backend backend;
+
+	/* Everything below, the sink thread drains under it as well */
+	pthread_mutex_t mutex;
+	pthread_t thread;
+	int epoll_fd;
+	int stop_fd;
+
+	suinput_sink_device *devices;
+	uint32_t num_devices, max_devices;
+
+	suinput_sink_record *records;
+	size_t num_records, max_records;
+	suinput_sink_stats stats;
+
+	uint8_t packet[SUINPUT_SINK_PACKET];
+};
+
+/*
+ * Records what arrived on one device. Called with the mutex held.
+ */
+static void suinput_sink_drain(suinput_sink *sink, uint32_t index)
+{
+	suinput_sink_device *device = &sink->devices[index];
+	const size_t size = sizeof(struct input_event);
+	ssize_t ret;
+	size_t i;
+
+	while (device->read_fd >= 0) {
+		ret = recv(device->read_fd, sink->packet, sizeof(sink->packet),
+			MSG_DONTWAIT | MSG_TRUNC);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (ret == 0) {
+			/* Destroyed and drained */
+			close(device->read_fd);
+			device->read_fd = -1;
+			break;
+		}
+
+		sink->stats.writes++;
+		sink->stats.bytes += (uint64_t)ret;
+		if ((size_t)ret % size != 0 || (size_t)ret > sizeof(sink->packet)) {
+			sink->stats.torn_writes++;
+			if ((size_t)ret > sizeof(sink->packet))
+				ret = sizeof(sink->packet);
+		}
+
+		if (sink->num_records + (size_t)ret / size > sink->max_records) {
+			size_t max = sink->max_records ? sink->max_records : 4096;
+			suinput_sink_record *grown;
+
+			while (max < sink->num_records + (size_t)ret / size)
+				max *= 2;
+			grown = realloc(sink->records, max * sizeof(*grown));
+			if (grown == NULL)
+				continue;
+			sink->records = grown;
+			sink->max_records = max;
+		}
+		for (i = 0; i + size <= (size_t)ret; i += size) {
+			suinput_sink_record *record = &sink->records[sink->num_records++];
+
+			record->device = index;
+			record->write = (uint32_t)(sink->stats.writes - 1);
+			memcpy(&record->event, sink->packet + i, size);
+			sink->stats.events++;
+			if (record->event.type == EV_SYN
+				&& record->event.code == SYN_REPORT)
+				sink->stats.syn_reports++;
+			else if (record->event.type == EV_KEY)
+				sink->stats.keys++;
+			else if (record->event.type == EV_REL)
+				sink->stats.rels++;
+		}
+	}
+}
+
+static void *suinput_sink_thread(void *arg)
+{
+	suinput_sink *sink = arg;
+	struct epoll_event events[16];
+	int ready, i;
+
+	for (;;) {
+		ready = epoll_wait(sink->epoll_fd, events, 16, -1);
+		if (ready < 0 && errno != EINTR)
+			break;
+		for (i = 0; i < ready; i++) {
+			if (events[i].data.u32 == SUINPUT_SINK_STOP)
+				return NULL;
+			pthread_mutex_lock(&sink->mutex);
+			suinput_sink_drain(sink, events[i].data.u32);
+			pthread_mutex_unlock(&sink->mutex);
+		}
+	}
+	return NULL;
+}
+
+static int suinput_sink_open(void *arg, const char *device_name,
+	const struct input_id *id, device_type type)
+{
+	suinput_sink *sink = arg;
+	suinput_sink_device *device;
+	struct epoll_event event;
+	int buffer = SUINPUT_SINK_BUFFER;
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0)
+		return -1;
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+	pthread_mutex_lock(&sink->mutex);
+	if (sink->num_devices == sink->max_devices) {
+		uint32_t max = sink->max_devices ? sink->max_devices * 2 : 8;
+		suinput_sink_device *grown = realloc(sink->devices,
+			max * sizeof(*grown));
+
+		if (grown == NULL) {
+			pthread_mutex_unlock(&sink->mutex);
+			close(fds[0]);
+			close(fds[1]);
+			errno = ENOMEM;
+			return -1;
+		}
+		sink->devices = grown;
+		sink->max_devices = max;
+	}
+	device = &sink->devices[sink->num_devices];
+	memset(device, 0, sizeof(*device));
+	strncpy(device->name, device_name, sizeof(device->name) - 1);
+	device->type = type;
+	device->write_fd = fds[0];
+	device->read_fd = fds[1];
+
+	event.events = EPOLLIN;
+	event.data.u32 = sink->num_devices;
+	if (epoll_ctl(sink->epoll_fd, EPOLL_CTL_ADD, fds[1], &event) != 0) {
+		pthread_mutex_unlock(&sink->mutex);
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	sink->num_devices++;
+	sink->stats.opens++;
+	pthread_mutex_unlock(&sink->mutex);
+	return fds[0];
+}
+
+static int suinput_sink_close(void *arg, int uinput_fd)
+{
+	suinput_sink *sink = arg;
+	uint32_t i;
+	int ret = -1;
+
+	pthread_mutex_lock(&sink->mutex);
+	for (i = 0; i < sink->num_devices; i++) {
+		suinput_sink_device *device = &sink->devices[i];
+
+		/* Descriptors of destroyed devices may have been reused */
+		if (device->destroyed || device->write_fd != uinput_fd)
+			continue;
+		device->destroyed = 1;
+		sink->stats.destroys++;
+		ret = close(uinput_fd);
+		break;
+	}
+	if (i == sink->num_devices)
+		errno = EBADF;
+	pthread_mutex_unlock(&sink->mutex);
+	return ret;
+}
+
+suinput_sink *suinput_sink_create(void)
+{
+	suinput_sink *sink = calloc(1, sizeof(suinput_sink));
+	struct epoll_event event;
+
+	if (sink == NULL)
+		return NULL;
+	sink->backend.name = "sink";
+	sink->backend.open = suinput_sink_open;
+	sink->backend.destroy = suinput_sink_close;
+	sink->backend.arg = sink;
+	pthread_mutex_init(&sink->mutex, NULL);
+
+	sink->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	sink->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (sink->epoll_fd < 0 || sink->stop_fd < 0)
+		goto fail;
+	event.events = EPOLLIN;
+	event.data.u32 = SUINPUT_SINK_STOP;
+	if (epoll_ctl(sink->epoll_fd, EPOLL_CTL_ADD, sink->stop_fd, &event) != 0)
+		goto fail;
+	if (pthread_create(&sink->thread, NULL, suinput_sink_thread, sink) != 0)
+		goto fail;
+	return sink;
+
+fail:
+	if (sink->epoll_fd >= 0)
+		close(sink->epoll_fd);
+	if (sink->stop_fd >= 0)
+		close(sink->stop_fd);
+	pthread_mutex_destroy(&sink->mutex);
+	free(sink);
+	return NULL;
+}
+
+void suinput_sink_destroy(suinput_sink *sink)
+{
+	uint64_t one = 1;
+	uint32_t i;
+
+	if (sink == NULL)
+		return;
+	if (write(sink->stop_fd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(sink->thread, NULL);
+
+	for (i = 0; i < sink->num_devices; i++) {
+		if (!sink->devices[i].destroyed)
+			close(sink->devices[i].write_fd);
+		if (sink->devices[i].read_fd >= 0)
+			close(sink->devices[i].read_fd);
+	}
+	close(sink->epoll_fd);
+	close(sink->stop_fd);
+	pthread_mutex_destroy(&sink->mutex);
+	free(sink->devices);
+	free(sink->records);
+	free(sink);
+}
+
+const suinput_backend *suinput_sink_backend(suinput_sink *sink)
+{
+	return &sink->backend;
+}
+
+void suinput_sink_sync(suinput_sink *sink)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&sink->mutex);
+	for (i = 0; i < sink->num_devices; i++)
+		suinput_sink_drain(sink, i);
+	pthread_mutex_unlock(&sink->mutex);
+}
+
+void suinput_sink_get_stats(suinput_sink *sink, suinput_sink_stats *stats)
+{
+	pthread_mutex_lock(&sink->mutex);
+	*stats = sink->stats;
+	pthread_mutex_unlock(&sink->mutex);
+}
+
+void suinput_sink_reset(suinput_sink *sink)
+{
+	uint32_t opens, destroys;
+
+	pthread_mutex_lock(&sink->mutex);
+	opens = sink->stats.opens;
+	destroys = sink->stats.destroys;
+	memset(&sink->stats, 0, sizeof(sink->stats));
+	sink->stats.opens = opens;
+	sink->stats.destroys = destroys;
+	sink->num_records = 0;
+	pthread_mutex_unlock(&sink->mutex);
+}
+
+//-----------------------------------------------------------------------------
+//	Verifier
+//-----------------------------------------------------------------------------
+
+/* Per device state while verifying */
+typedef struct {
+	uint8_t pressed[KEY_CNT / 8 + 1];
+	/* Events since the last SYN_REPORT */
+	uint32_t frame_events;
+	struct timeval last_time;
+} suinput_sink_state;
+
+/*
+ * Returns the violation of `event` on a device in `state`, NULL if none.
+ */
+static const char *suinput_sink_check(const suinput_sink_device *device,
+	suinput_sink_state *state, const struct input_event *event)
+{
+	uint8_t *byte;
+	uint8_t bit;
+
+	if (event->time.tv_sec < state->last_time.tv_sec
+		|| (event->time.tv_sec == state->last_time.tv_sec
+		&& event->time.tv_usec < state->last_time.tv_usec))
+		return "timestamp goes backwards";
+	state->last_time = event->time;
+
+	switch (event->type) {
+	case EV_SYN:
+		if (event->code != SYN_REPORT)
+			return "SYN event other than SYN_REPORT";
+		if (state->frame_events == 0)
+			return "empty frame";
+		state->frame_events = 0;
+		return NULL;
+
+	case EV_KEY:
+		state->frame_events++;
+		if (device->type == keyboard ? event->code >= KEY_MAX
+			: event->code < BTN_MOUSE || event->code >= BTN_JOYSTICK)
+			return "key code the device does not declare";
+		byte = &state->pressed[event->code / 8];
+		bit = (uint8_t)(1 << (event->code % 8));
+		if (event->value == 1) {
+			if (*byte & bit)
+				return "key pressed while pressed";
+			*byte |= bit;
+		} else if (event->value == 0) {
+			if (!(*byte & bit))
+				return "key released while not pressed";
+			*byte &= (uint8_t)~bit;
+		} else if (event->value == 2) {
+			if (!(*byte & bit))
+				return "key repeated while not pressed";
+		} else {
+			return "key value other than 0, 1 or 2";
+		}
+		return NULL;
+
+	case EV_REL:
+		state->frame_events++;
+		if (device->type != mouse)
+			return "relative event on a device without axes";
+		if (event->code != REL_X && event->code != REL_Y
+			&& event->code != REL_WHEEL)
+			return "relative axis the device does not declare";
+		return NULL;
+
+	default:
+		state->frame_events++;
+		return "event type the device does not declare";
+	}
+}
+
+int suinput_sink_verify(suinput_sink *sink, char *error, size_t size)
+{
+	suinput_sink_state *states;
+	const char *violation;
+	int violations = 0;
+	size_t i;
+
+	if (error != NULL && size > 0)
+		error[0] = '\0';
+
+	pthread_mutex_lock(&sink->mutex);
+	states = calloc(sink->num_devices ? sink->num_devices : 1,
+		sizeof(suinput_sink_state));
+	if (states == NULL) {
+		pthread_mutex_unlock(&sink->mutex);
+		if (error != NULL && size > 0)
+			snprintf(error, size, "out of memory");
+		return 1;
+	}
+
+	if (sink->stats.torn_writes > 0) {
+		violations++;
+		if (error != NULL && size > 0)
+			snprintf(error, size, "%llu writes of partial events",
+				(unsigned long long)sink->stats.torn_writes);
+	}
+
+	for (i = 0; i < sink->num_records; i++) {
+		const suinput_sink_record *record = &sink->records[i];
+		const suinput_sink_device *device = &sink->devices[record->device];
+
+		violation = suinput_sink_check(device, &states[record->device],
+			&record->event);
+		if (violation == NULL)
+			continue;
+		if (violations++ == 0 && error != NULL && size > 0)
+			snprintf(error, size, "%s, event %zu (type %u code %u value %d): %s",
+				device->name, i, record->event.type, record->event.code,
+				record->event.value, violation);
+	}
+
+	/* Keys still down are fine, destroying a device releases them */
+	for (i = 0; i < sink->num_devices; i++) {
+		if (states[i].frame_events == 0)
+			continue;
+		if (violations++ == 0 && error != NULL && size > 0)
+			snprintf(error, size, "%s: frame not terminated by SYN_REPORT",
+				sink->devices[i].name);
+	}
+
+	pthread_mutex_unlock(&sink->mutex);
+	free(states);
+	return violations;
+}
+
+void suinput_sink_dump(suinput_sink *sink, FILE *file)
+{
+	size_t i;
+
+	pthread_mutex_lock(&sink->mutex);
+	for (i = 0; i < sink->num_records; i++) {
+		const suinput_sink_record *record = &sink->records[i];
+
+		fprintf(file, "%s write %u: time %ld.%06ld, type %u, code %u, "
+			"value %d\n", sink->devices[record->device].name, record->write,
+			(long)record->event.time.tv_sec, (long)record->event.time.tv_usec,
+			record->event.type, record->event.code, record->event.value);
+	}
+	pthread_mutex_unlock(&sink->mutex);
+}
@@ -0,0 +1,121 @@
+/*
+ * uSynergy client -- Recording uinput sink and evdev stream verifier
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+
+#ifndef SUINPUT_SINK_H
+#define SUINPUT_SINK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "suinput.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A device backend (see suinput_backend) that records instead of injecting,
+ * so the injection path can be benchmarked and checked without root or a
+ * kernel uinput device.
+
+ * Each device is one end of an AF_UNIX SOCK_SEQPACKET pair. The writers
+ * keep writing to a plain file descriptor, directly, coalesced or through
+ * io_uring, and the sink still sees every write as one packet: it counts
+ * write operations exactly, and the events of each. A sink thread drains
+ * the devices into memory as the events arrive.
+ */
+typedef struct suinput_sink suinput_sink;
+
+typedef struct {
+	/* Devices created and destroyed */
+	uint32_t opens;
+	uint32_t destroys;
+	/* Write operations that reached a device, and what they carried. With
+	 * io_uring several writes are issued by one system call. */
+	uint64_t writes;
+	uint64_t events;
+	uint64_t bytes;
+	/* Events of each kind */
+	uint64_t syn_reports;
+	uint64_t keys;
+	uint64_t rels;
+	/* Writes that were not a whole number of events */
+	uint64_t torn_writes;
+} suinput_sink_stats;
+
+/*
+ * Creates a sink. Returns NULL when out of memory or if the sink thread
+ * cannot be started.
+ */
+suinput_sink *suinput_sink_create(void);
+
+/*
+ * Destroys the sink and the recording. Devices still open are closed.
+ */
+void suinput_sink_destroy(suinput_sink *sink);
+
+/*
+ * The backend to hand to suinput_open_backend(), e.g. through
+ * CookieType::injection.
+ */
+const suinput_backend *suinput_sink_backend(suinput_sink *sink);
+
+/*
+ * Waits until everything written to the devices so far is recorded.
+ */
+void suinput_sink_sync(suinput_sink *sink);
+
+/*
+ * Copies the statistics, after a suinput_sink_sync() they are exact.
+ */
+void suinput_sink_get_stats(suinput_sink *sink, suinput_sink_stats *stats);
+
+/*
+ * Drops the recording and zeroes the statistics, open devices stay.
+ */
+void suinput_sink_reset(suinput_sink *sink);
+
+/*
+ * Checks the recorded events of every device against evdev semantics:
+ *	- writes carry whole events and every frame ends with SYN_REPORT,
+ *	  there are no empty frames and nothing is left unterminated
+ *	- event types and codes are ones the device type declares
+ *	- key values are 0, 1 or 2, a key is only released or repeated while
+ *	  pressed and only pressed while released
+ *	- timestamps do not go backwards
+ * Returns the number of violations. The first one is described in `error`
+ * (of `size` bytes) when that is not NULL.
+ */
+int suinput_sink_verify(suinput_sink *sink, char *error, size_t size);
+
+/*
+ * Prints the recording, one event per line in the style of evtest.
+ */
+void suinput_sink_dump(suinput_sink *sink, FILE *file);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* SUINPUT_SINK_H */
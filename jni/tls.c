@@ -0,0 +1,364 @@
+/*
+ * uSynergy client -- TLS transport for the platform layer
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#ifdef USYNERGY_WITH_TLS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <poll.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+
+#include "transport.h"
+#include "ioengine.h"
+
+/*
+ * The handshake runs in OpenSSL. Once it is done OpenSSL tries to hand the
+ * record layer to the kernel (kTLS, TCP_ULP "tls"). Directions that made it
+ * into the kernel use the plain socket path, including the batched I/O
+ * engine, so received data lands in the caller's buffer already decrypted.
+ * Directions that did not fall back to SSL_read()/SSL_write().
+ */
+struct uSynergyTlsState {
+	SSL_CTX *ctx;
+	SSL *ssl;
+
+	/* Latest session ticket, offered on the next connect */
+	SSL_SESSION *session;
+
+	int ktlsSend;
+	int ktlsRecv;
+};
+
+/*
+ * @brief Keep the newest session, called by OpenSSL whenever the server
+ * issues one (after the handshake for TLS 1.3)
+ */
+static int sTlsNewSession(SSL *ssl, SSL_SESSION *session)
+{
+	uSynergyCookie cookie = SSL_get_app_data(ssl);
+
+	if (cookie == NULL || cookie->tls == NULL)
+		return 0;
+	if (cookie->tls->session != NULL)
+		SSL_SESSION_free(cookie->tls->session);
+	cookie->tls->session = session;
+
+	/* We took the reference */
+	return 1;
+}
+
+static struct uSynergyTlsState *sTlsState(uSynergyCookie cookie)
+{
+	struct uSynergyTlsState *state = cookie->tls;
+
+	if (state != NULL)
+		return state;
+
+	state = calloc(1, sizeof(struct uSynergyTlsState));
+	if (state == NULL)
+		return NULL;
+
+	state->ctx = SSL_CTX_new(TLS_client_method());
+	if (state->ctx == NULL) {
+		free(state);
+		return NULL;
+	}
+	SSL_CTX_set_min_proto_version(state->ctx, TLS1_2_VERSION);
+	/* Synergy servers use self signed certificates, see tls_fingerprint */
+	SSL_CTX_set_verify(state->ctx, SSL_VERIFY_NONE, NULL);
+	SSL_CTX_set_session_cache_mode(state->ctx,
+		SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(state->ctx, sTlsNewSession);
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(state->ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	cookie->tls = state;
+	return state;
+}
+
+/*
+ * @brief Compare the server certificate against cookie->tls_fingerprint
+
+ * The fingerprint is the hex SHA-256 of the DER certificate, separators
+ * such as ':' are ignored. Always passes when no fingerprint is configured.
+ */
+static uSynergyBool sTlsCheckFingerprint(uSynergyCookie cookie, SSL *ssl)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdLen = 0, i = 0;
+	const char *pin = cookie->tls_fingerprint;
+	X509 *cert;
+	uSynergyBool ok;
+
+	if (pin == NULL || *pin == '\0')
+		return USYNERGY_TRUE;
+
+	cert = SSL_get1_peer_certificate(ssl);
+	if (cert == NULL)
+		return USYNERGY_FALSE;
+	ok = X509_digest(cert, EVP_sha256(), md, &mdLen) == 1;
+	X509_free(cert);
+
+	for (; ok && *pin; pin++) {
+		static const char hex[] = "0123456789abcdef";
+		if (!isxdigit((unsigned char)*pin))
+			continue;
+		if (i >= mdLen * 2 || tolower((unsigned char)*pin)
+			!= hex[(md[i / 2] >> ((i & 1) ? 0 : 4)) & 0xf])
+			ok = USYNERGY_FALSE;
+		i++;
+	}
+	return ok && i == mdLen * 2;
+}
+
+static void sTlsShutdown(uSynergyCookie cookie)
+{
+	struct uSynergyTlsState *state = cookie->tls;
+
+	if (state == NULL || state->ssl == NULL)
+		return;
+	/*
+	 * Mark the connection as cleanly shut down without touching the socket,
+	 * which may already be dead. Otherwise OpenSSL flags the session as not
+	 * resumable when it is freed.
+	 */
+	SSL_set_shutdown(state->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	SSL_free(state->ssl);
+	state->ssl = NULL;
+	state->ktlsSend = 0;
+	state->ktlsRecv = 0;
+}
+
+static uSynergyBool sTlsConnect(uSynergyCookie cookie)
+{
+	struct uSynergyTlsState *state = sTlsState(cookie);
+	int ret;
+
+	if (state == NULL)
+		return USYNERGY_FALSE;
+	sTlsShutdown(cookie);
+
+	if (!uSynergyTcpTransport.m_connectFunc(cookie))
+		return USYNERGY_FALSE;
+
+	state->ssl = SSL_new(state->ctx);
+	if (state->ssl == NULL)
+		goto err;
+	SSL_set_app_data(state->ssl, cookie);
+	SSL_set_fd(state->ssl, cookie->sockfd);
+	if (state->session != NULL && SSL_SESSION_is_resumable(state->session))
+		SSL_set_session(state->ssl, state->session);
+
+	do {
+		ret = SSL_connect(state->ssl);
+	} while (ret <= 0 && SSL_get_error(state->ssl, ret) == SSL_ERROR_SYSCALL
+		&& errno == EINTR);
+	if (ret != 1) {
+		ERR_print_errors_fp(stderr);
+		goto err;
+	}
+
+	if (!sTlsCheckFingerprint(cookie, state->ssl)) {
+		fprintf(stderr, "TLS server fingerprint mismatch\n");
+		goto err;
+	}
+
+	state->ktlsSend = BIO_get_ktls_send(SSL_get_wbio(state->ssl));
+	state->ktlsRecv = BIO_get_ktls_recv(SSL_get_rbio(state->ssl));
+
+	/* Only the kernel may see the socket in directions it does not encrypt */
+	if (!state->ktlsRecv) {
+		uSynergyIoDestroy(cookie->rx_io);
+		cookie->rx_io = NULL;
+	}
+
+	fprintf(stderr, "TLS %s established (%s, kTLS tx:%d rx:%d)\n",
+		SSL_get_version(state->ssl),
+		SSL_session_reused(state->ssl) ? "resumed" : "full handshake",
+		state->ktlsSend, state->ktlsRecv);
+	return USYNERGY_TRUE;
+
+err:
+	sTlsShutdown(cookie);
+	uSynergyTcpTransport.m_closeFunc(cookie);
+	return USYNERGY_FALSE;
+}
+
+/*
+ * @brief Read through OpenSSL, blocking until a record is complete
+ */
+static uSynergyBool sTlsRead(struct uSynergyTlsState *state, uint8_t *buffer,
+	int maxLength, int* outLength)
+{
+	int ret;
+
+	while (1) {
+		ret = SSL_read(state->ssl, buffer, maxLength);
+		if (ret > 0) {
+			*outLength = ret;
+			return USYNERGY_TRUE;
+		}
+		switch (SSL_get_error(state->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			continue;
+		case SSL_ERROR_SYSCALL:
+			if (errno == EINTR)
+				continue;
+			/* fall through */
+		default:
+			return USYNERGY_FALSE;
+		}
+	}
+}
+
+static uSynergyBool sTlsReceive(uSynergyCookie cookie, uint8_t *buffer,
+	int maxLength, int* outLength)
+{
+	struct uSynergyTlsState *state = cookie->tls;
+
+	/* Records OpenSSL already pulled in during the handshake come first */
+	if (state->ktlsRecv && SSL_pending(state->ssl) == 0) {
+		if (uSynergyTcpTransport.m_receiveFunc(cookie, buffer, maxLength,
+			outLength))
+			return USYNERGY_TRUE;
+		/* Non application record (alert, ticket): let OpenSSL handle it */
+		if (errno != EIO)
+			return USYNERGY_FALSE;
+	}
+	return sTlsRead(state, buffer, maxLength, outLength);
+}
+
+/*
+ * @brief Non-blocking receive function
+
+ * Without kTLS, SSL_read() is only entered once the socket is readable. It
+ * may then wait for the rest of a record the server is still sending.
+ */
+static uSynergyBool sTlsReceiveNow(uSynergyCookie cookie, uint8_t *buffer,
+	int maxLength, int* outLength)
+{
+	struct uSynergyTlsState *state = cookie->tls;
+	struct pollfd pfd;
+
+	*outLength = 0;
+	if (SSL_pending(state->ssl) == 0) {
+		if (state->ktlsRecv) {
+			if (uSynergyTcpTransport.m_receiveNowFunc(cookie, buffer,
+				maxLength, outLength))
+				return USYNERGY_TRUE;
+			if (errno != EIO)
+				return USYNERGY_FALSE;
+		} else {
+			pfd.fd = cookie->sockfd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 0) == 0)
+				return USYNERGY_TRUE;
+		}
+	}
+	return sTlsRead(state, buffer, maxLength, outLength);
+}
+
+static uSynergyBool sTlsSend(uSynergyCookie cookie,
+	const uint8_t *buffer, int length)
+{
+	struct uSynergyTlsState *state = cookie->tls;
+	int ret;
+
+	if (state->ktlsSend)
+		return uSynergyTcpTransport.m_sendFunc(cookie, buffer, length);
+
+	while (length > 0) {
+		ret = SSL_write(state->ssl, buffer, length);
+		if (ret <= 0) {
+			int err = SSL_get_error(state->ssl, ret);
+			if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ
+				|| (err == SSL_ERROR_SYSCALL && errno == EINTR))
+				continue;
+			return USYNERGY_FALSE;
+		}
+		buffer += ret;
+		length -= ret;
+	}
+	return USYNERGY_TRUE;
+}
+
+static void sTlsClose(uSynergyCookie cookie)
+{
+	struct uSynergyTlsState *state = cookie->tls;
+
+	sTlsShutdown(cookie);
+	uSynergyTcpTransport.m_closeFunc(cookie);
+	if (state == NULL)
+		return;
+
+	if (state->session != NULL)
+		SSL_SESSION_free(state->session);
+	SSL_CTX_free(state->ctx);
+	free(state);
+	cookie->tls = NULL;
+}
+
+static void sTlsUpdateServer(uSynergyCookie cookie)
+{
+	uSynergyTcpTransport.m_updateServerAddr(cookie);
+}
+
+static void sTlsShutdownSocket(uSynergyCookie cookie)
+{
+	/* SSL_read() sees the socket fail, OpenSSL state is left alone */
+	uSynergyTcpTransport.m_shutdownFunc(cookie);
+}
+
+static int sTlsPollFd(uSynergyCookie cookie)
+{
+	return uSynergyTcpTransport.m_pollFdFunc(cookie);
+}
+
+static uSynergyBool sTlsFlush(uSynergyCookie cookie)
+{
+	/* Device writes, plus replies when kTLS encrypts them */
+	return uSynergyTcpTransport.m_flushFunc(cookie);
+}
+
+const uSynergyTransport uSynergyTlsTransport = {
+	.m_name             = "tls",
+	.m_updateServerAddr = sTlsUpdateServer,
+	.m_connectFunc      = sTlsConnect,
+	.m_sendFunc         = sTlsSend,
+	.m_receiveFunc      = sTlsReceive,
+	.m_closeFunc        = sTlsClose,
+	.m_shutdownFunc     = sTlsShutdownSocket,
+	.m_flushFunc        = sTlsFlush,
+	.m_pollFdFunc       = sTlsPollFd,
+	.m_receiveNowFunc   = sTlsReceiveNow,
+};
+
+#endif /* USYNERGY_WITH_TLS */
@@ -0,0 +1,362 @@
+/*
+ * uSynergy client -- Transport backends for the platform layer
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "transport.h"
+#include "ioengine.h"
+
+//-----------------------------------------------------------------------------
+//	Stream socket helpers, shared by all backends
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Close the client socket, if any
+ */
+static void sSocketClose(uSynergyCookie cookie)
+{
+	uSynergyIoDestroy(cookie->rx_io);
+	uSynergyIoDestroy(cookie->tx_io);
+	cookie->rx_io = NULL;
+	cookie->tx_io = NULL;
+
+	if (cookie->sockfd >= 0)
+		close(cookie->sockfd);
+	cookie->sockfd = -1;
+}
+
+/*
+ * @brief Set up the I/O engines for a freshly connected socket
+
+ * Replies are always staged and flushed per dispatched burst. The receive
+ * side only goes through the engine when io_uring is available, plain
+ * recv() is just as good otherwise.
+ */
+static void sSocketAttachIo(uSynergyCookie cookie)
+{
+	cookie->tx_io = uSynergyIoCreate(cookie->io_uring, cookie->arena);
+	if (cookie->io_uring) {
+		cookie->rx_io = uSynergyIoCreate(1, cookie->arena);
+		if (cookie->rx_io != NULL && !uSynergyIoUsingRing(cookie->rx_io)) {
+			uSynergyIoDestroy(cookie->rx_io);
+			cookie->rx_io = NULL;
+		}
+	}
+}
+
+/*
+ * @brief Receive function
+
+ * Blocks until data is available. Returns USYNERGY_FALSE when the peer closed
+ * the connection or a hard error occured.
+ */
+static uSynergyBool sSocketReceive(uSynergyCookie cookie, uint8_t *buffer,
+	int maxLength, int* outLength)
+{
+	int ret;
+
+	if (cookie->rx_io != NULL) {
+		ret = uSynergyIoReceive(cookie->rx_io, cookie->sockfd, buffer,
+			maxLength);
+		if (ret > 0) {
+			*outLength = ret;
+			return USYNERGY_TRUE;
+		}
+		if (ret < 0)
+			perror("receive error");
+		return USYNERGY_FALSE;
+	}
+
+	while (1) {
+		ret = recv(cookie->sockfd, buffer, maxLength, 0);
+		if (ret > 0) {
+			*outLength = ret;
+			return USYNERGY_TRUE;
+		} else if ((ret < 0) && (errno == EAGAIN || errno == EWOULDBLOCK
+			|| errno == EINTR)) {
+			continue;
+		}
+		perror("receive error");
+		break;
+	}
+	return USYNERGY_FALSE;
+}
+
+/*
+ * @brief Non-blocking receive function
+
+ * Always a plain recv(), the caller's event loop does the waiting that the
+ * io_uring engine would otherwise do.
+ */
+static uSynergyBool sSocketReceiveNow(uSynergyCookie cookie, uint8_t *buffer,
+	int maxLength, int* outLength)
+{
+	int ret;
+
+	do {
+		ret = recv(cookie->sockfd, buffer, maxLength, MSG_DONTWAIT);
+	} while (ret < 0 && errno == EINTR);
+
+	*outLength = 0;
+	if (ret > 0) {
+		*outLength = ret;
+		return USYNERGY_TRUE;
+	} else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return USYNERGY_TRUE;
+	}
+	if (ret < 0)
+		perror("receive error");
+	return USYNERGY_FALSE;
+}
+
+/*
+ * @brief Descriptor to poll for input
+ */
+static int sSocketPollFd(uSynergyCookie cookie)
+{
+	return cookie->sockfd;
+}
+
+/*
+ * @brief Send function
+
+ * With an I/O engine attached the data is only queued, m_flushFunc pushes it
+ * out together with pending device writes.
+ */
+static uSynergyBool sSocketSend(uSynergyCookie cookie,
+	const uint8_t *buffer, int length)
+{
+	int ret;
+
+	if (cookie->tx_io != NULL)
+		return uSynergyIoQueueSend(cookie->tx_io, cookie->sockfd, buffer,
+			length) == 0;
+
+	ret = send(cookie->sockfd, buffer, length, MSG_NOSIGNAL);
+	if (ret < 0 || ret != length)
+		return USYNERGY_FALSE;
+
+	return USYNERGY_TRUE;
+}
+
+/*
+ * @brief Shutdown function
+
+ * Only shuts the socket down, the descriptor stays valid until the thread
+ * running the session closes it.
+ */
+static void sSocketShutdown(uSynergyCookie cookie)
+{
+	if (cookie->sockfd >= 0)
+		shutdown(cookie->sockfd, SHUT_RDWR);
+}
+
+/*
+ * @brief Flush function
+ */
+static uSynergyBool sSocketFlush(uSynergyCookie cookie)
+{
+	if (cookie->tx_io == NULL)
+		return USYNERGY_TRUE;
+	return uSynergyIoFlush(cookie->tx_io) == 0;
+}
+
+//-----------------------------------------------------------------------------
+//	TCP
+//-----------------------------------------------------------------------------
+
+static void sTcpUpdateServer(uSynergyCookie cookie)
+{
+	memset(&(cookie->server_addr), 0, sizeof(struct sockaddr_in));
+	cookie->server_addr.sin_family = AF_INET;
+	cookie->server_addr.sin_port = htons(cookie->port);
+	cookie->server_addr.sin_addr.s_addr = inet_addr(cookie->ipAddr);
+}
+
+static uSynergyBool sTcpConnect(uSynergyCookie cookie)
+{
+	sSocketClose(cookie);
+	cookie->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (cookie->sockfd < 0) {
+		perror("socket error");
+		return USYNERGY_FALSE;
+	}
+
+	if (connect(cookie->sockfd, (struct sockaddr *)& cookie->server_addr,
+		sizeof(struct sockaddr_in)) == 0) {
+		sSocketAttachIo(cookie);
+		return USYNERGY_TRUE;
+	} else {
+		perror("connect error");
+		sSocketClose(cookie);
+		return USYNERGY_FALSE;
+	}
+}
+
+const uSynergyTransport uSynergyTcpTransport = {
+	.m_name             = "tcp",
+	.m_updateServerAddr = sTcpUpdateServer,
+	.m_connectFunc      = sTcpConnect,
+	.m_sendFunc         = sSocketSend,
+	.m_receiveFunc      = sSocketReceive,
+	.m_closeFunc        = sSocketClose,
+	.m_shutdownFunc     = sSocketShutdown,
+	.m_flushFunc        = sSocketFlush,
+	.m_pollFdFunc       = sSocketPollFd,
+	.m_receiveNowFunc   = sSocketReceiveNow,
+};
+
+//-----------------------------------------------------------------------------
+//	Unix domain socket
+//-----------------------------------------------------------------------------
+
+static void sUnixUpdateServer(uSynergyCookie cookie)
+{
+	size_t len = 0;
+
+	memset(&(cookie->unix_addr), 0, sizeof(struct sockaddr_un));
+	cookie->unix_addr.sun_family = AF_UNIX;
+	if (cookie->unix_path != NULL) {
+		len = strlen(cookie->unix_path);
+		if (len > sizeof(cookie->unix_addr.sun_path) - 1)
+			len = sizeof(cookie->unix_addr.sun_path) - 1;
+		memcpy(cookie->unix_addr.sun_path, cookie->unix_path, len);
+	}
+
+	if (len > 0 && cookie->unix_addr.sun_path[0] == '@') {
+		/* Abstract namespace: leading NUL, no terminator */
+		cookie->unix_addr.sun_path[0] = '\0';
+		cookie->unix_addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+	} else {
+		cookie->unix_addr_len = sizeof(struct sockaddr_un);
+	}
+}
+
+static uSynergyBool sUnixConnect(uSynergyCookie cookie)
+{
+	sSocketClose(cookie);
+	cookie->sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (cookie->sockfd < 0) {
+		perror("socket error");
+		return USYNERGY_FALSE;
+	}
+
+	if (connect(cookie->sockfd, (struct sockaddr *)& cookie->unix_addr,
+		cookie->unix_addr_len) == 0) {
+		sSocketAttachIo(cookie);
+		return USYNERGY_TRUE;
+	} else {
+		perror("connect error");
+		sSocketClose(cookie);
+		return USYNERGY_FALSE;
+	}
+}
+
+const uSynergyTransport uSynergyUnixTransport = {
+	.m_name             = "unix",
+	.m_updateServerAddr = sUnixUpdateServer,
+	.m_connectFunc      = sUnixConnect,
+	.m_sendFunc         = sSocketSend,
+	.m_receiveFunc      = sSocketReceive,
+	.m_closeFunc        = sSocketClose,
+	.m_shutdownFunc     = sSocketShutdown,
+	.m_flushFunc        = sSocketFlush,
+	.m_pollFdFunc       = sSocketPollFd,
+	.m_receiveNowFunc   = sSocketReceiveNow,
+};
+
+//-----------------------------------------------------------------------------
+//	In-process socketpair
+//-----------------------------------------------------------------------------
+
+static void sSocketpairClose(uSynergyCookie cookie)
+{
+	sSocketClose(cookie);
+	if (cookie->peer_sockfd >= 0)
+		close(cookie->peer_sockfd);
+	cookie->peer_sockfd = -1;
+}
+
+static uSynergyBool sSocketpairConnect(uSynergyCookie cookie)
+{
+	int sv[2];
+
+	sSocketpairClose(cookie);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		perror("socketpair error");
+		return USYNERGY_FALSE;
+	}
+
+	cookie->sockfd = sv[0];
+	if (cookie->peer_ready != NULL) {
+		/* Server end now belongs to the peer */
+		cookie->peer_ready(cookie->peer_arg, sv[1]);
+	} else {
+		cookie->peer_sockfd = sv[1];
+	}
+	sSocketAttachIo(cookie);
+	return USYNERGY_TRUE;
+}
+
+const uSynergyTransport uSynergySocketpairTransport = {
+	.m_name             = "socketpair",
+	.m_updateServerAddr = NULL,
+	.m_connectFunc      = sSocketpairConnect,
+	.m_sendFunc         = sSocketSend,
+	.m_receiveFunc      = sSocketReceive,
+	.m_closeFunc        = sSocketpairClose,
+	.m_shutdownFunc     = sSocketShutdown,
+	.m_flushFunc        = sSocketFlush,
+	.m_pollFdFunc       = sSocketPollFd,
+	.m_receiveNowFunc   = sSocketReceiveNow,
+};
+
+//-----------------------------------------------------------------------------
+//	Selection
+//-----------------------------------------------------------------------------
+
+const uSynergyTransport *uSynergyTransportByName(const char *name)
+{
+	static const uSynergyTransport *transports[] = {
+		&uSynergyTcpTransport,
+		&uSynergyUnixTransport,
+		&uSynergySocketpairTransport,
+		&uSynergyCaptureTransport,
+		&uSynergyReplayTransport,
+#ifdef USYNERGY_WITH_TLS
+		&uSynergyTlsTransport,
+#endif
+	};
+	int i;
+
+	for (i = 0; i < (int)(sizeof(transports) / sizeof(transports[0])); i++) {
+		if (strcmp(transports[i]->m_name, name) == 0)
+			return transports[i];
+	}
+	return NULL;
+}
@@ -0,0 +1,149 @@
+/*
+ * uSynergy client -- Transport backends for the platform layer
+
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+
+ *  1. The origin of this software must not be misrepresented; you must not
+ *  claim that you wrote the original software. If you use this software
+ *  in a product, an acknowledgment in the product documentation would be
+ *  appreciated but is not required.
+
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *  misrepresented as being the original software.
+
+ *  3. This notice may not be removed or altered from any source
+ *  distribution.
+ */
+
+#ifndef USYNERGY_TRANSPORT_H
+#define USYNERGY_TRANSPORT_H
+
+#include "uSynergy.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * @brief TCP transport
+
+ * Connects to cookie->ipAddr:cookie->port over IPv4. This is the transport
+ * used to talk to a regular Synergy server on the network.
+ */
+extern const uSynergyTransport uSynergyTcpTransport;
+
+/*
+ * @brief Unix domain socket transport
+
+ * Connects to the stream socket at cookie->unix_path. A leading '@' selects
+ * the Linux abstract namespace, which is what a local port forwarding agent
+ * (e.g. "adb reverse localabstract:usynergy tcp:24800") listens on.
+ */
+extern const uSynergyTransport uSynergyUnixTransport;
+
+/*
+ * @brief In-process socketpair transport
+
+ * Creates an AF_UNIX socketpair on every connect. The client keeps one end,
+ * the other end is passed to cookie->peer_ready so a local stand-in server
+ * can drive the client at memory speed. Without a peer_ready handler the
+ * server end is left in cookie->peer_sockfd.
+ */
+extern const uSynergyTransport uSynergySocketpairTransport;
+
+#ifdef USYNERGY_WITH_TLS
+/*
+ * @brief TLS transport
+
+ * TCP plus a TLS handshake done in OpenSSL, with the record layer moved to
+ * kernel TLS where the kernel supports it. The last session ticket is kept
+ * in the cookie so reconnects resume instead of doing a full handshake.
+ * Set cookie->tls_fingerprint to pin the server certificate.
+ */
+extern const uSynergyTransport uSynergyTlsTransport;
+#endif
+
+/*
+ * @brief Capture transport
+
+ * Runs cookie->capture_transport and writes everything it receives and
+ * sends to cookie->capture_path, created on the first connect. The file
+ * starts with the 8 byte magic USYNERGY_CAPTURE_MAGIC, then one record per
+ * connect, read and send: a 13 byte header followed by the data.
+ *	8 bytes	nanoseconds since the file was created
+ *	1 byte	USYNERGY_CAPTURE_CONNECT, _RECEIVED or _SENT
+ *	4 bytes	length of the data
+ * Numbers are big endian. Reads are kept as the socket returned them, so a
+ * replay splits frames exactly where the network did.
+ */
+extern const uSynergyTransport uSynergyCaptureTransport;
+
+#define USYNERGY_CAPTURE_MAGIC		"USYNCAP1"
+#define USYNERGY_CAPTURE_HEADER		13
+#define USYNERGY_CAPTURE_CONNECT	'C'
+#define USYNERGY_CAPTURE_RECEIVED	'R'
+#define USYNERGY_CAPTURE_SENT		'S'
+
+/*
+ * @brief Replay transport
+
+ * Feeds a capture file (cookie->replay_path) back to the client, one
+ * recorded session per connect and one recorded read per receive. With
+ * cookie->replay_timing set each read is held back until it is due at the
+ * recorded pace, otherwise data comes as fast as the client takes it.
+ * Replies are dropped, or compared send by send against the recorded ones
+ * with cookie->replay_verify set. A session ends once the client answered
+ * everything it was fed, or after a second. Connecting fails once every
+ * session was replayed.
+ */
+extern const uSynergyTransport uSynergyReplayTransport;
+
+/*
+ * @brief Outcome of a replay
+ */
+typedef struct {
+	/* Sessions started and bytes fed to the client */
+	uint32_t m_sessions;
+	uint64_t m_bytesReplayed;
+	/* Reply bytes compared, and sends that differed from the capture or
+	 * were missing */
+	uint64_t m_bytesVerified;
+	uint64_t m_mismatches;
+	/* Offset into the replies of its session of the first difference,
+	 * -1 if there was none */
+	int64_t m_firstMismatch;
+	/* Every session in the file was replayed */
+	int m_done;
+} uSynergyReplayStats;
+
+/*
+ * @brief Progress of the replay transport, read it between sessions
+ */
+extern void uSynergyReplayGetStats(uSynergyCookie cookie,
+	uSynergyReplayStats *stats);
+
+/*
+ * @brief Start the replay over at the first session, the statistics are
+ * kept
+ */
+extern void uSynergyReplayRewind(uSynergyCookie cookie);
+
+/*
+ * @brief Look up a transport by name
+
+ * Accepts "tcp", "unix", "socketpair", "capture", "replay" and, when
+ * built with TLS support, "tls". Returns NULL for unknown names.
+ */
+extern const uSynergyTransport *uSynergyTransportByName(const char *name);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* USYNERGY_TRANSPORT_H */
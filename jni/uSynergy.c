@@ -24,10 +24,22 @@
  *  distribution.
  */
 
+/* Thread names and CPU affinity */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "uSynergy.h"
+#include "cliptext.h"
 #include "keymap.h"
 #include "log.h"
 
@@ -71,22 +83,125 @@ static void sTrace(uSynergyContext *context, const char* text)
 		context->m_traceFunc(context->m_cookie, text);
 }
 
+static uint64_t sNowNs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
 /*
- * @brief Add string to reply packet
+ * @brief Note the first time the current run reached @a phase
  */
-static void sAddString(uSynergyContext *context, const char *string)
+static void sStartupPhase(uSynergyContext *context, int phase)
 {
-	size_t len = strlen(string);
-	memcpy(context->m_replyCur, string, len);
-	context->m_replyCur += len;
+	uint64_t *time = &context->m_startup.m_phases[phase];
+
+	if (__atomic_load_n(time, __ATOMIC_RELAXED) == 0)
+		__atomic_store_n(time, sNowNs(), __ATOMIC_RELAXED);
+}
+
+//-----------------------------------------------------------------------------
+//	Trace ring
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Record an event in the trace ring
+
+ * Any thread may record. The slot is claimed with one atomic add and
+ * marked incomplete until its fields are written, nothing is formatted.
+
+ * @param code	Message id (4 bytes) or NULL
+ * @param data	Start of the message body, up to 8 bytes are kept
+ */
+static void sTraceEvent(uSynergyContext *context, int event, uint64_t time,
+	const uint8_t *code, uint32_t value, const uint8_t *data, uint32_t size,
+	int result)
+{
+	uint32_t index = __atomic_fetch_add(&context->m_traceWrite, 1,
+		__ATOMIC_RELAXED);
+	uSynergyTraceRecord *record =
+		&context->m_traceRecords[index & context->m_traceMask];
+
+	__atomic_store_n(&record->m_sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	record->m_time = time;
+	record->m_event = (uint16_t)event;
+	record->m_result = (int16_t)result;
+	record->m_value = value;
+	if (code != NULL)
+		memcpy(record->m_code, code, sizeof(record->m_code));
+	else
+		memset(record->m_code, 0, sizeof(record->m_code));
+	if (size > sizeof(record->m_data))
+		size = sizeof(record->m_data);
+	memset(record->m_data, 0, sizeof(record->m_data));
+	if (size > 0)
+		memcpy(record->m_data, data, size);
+	__atomic_store_n(&record->m_sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * @brief Record an event that carries no message
+ */
+static void sTraceState(uSynergyContext *context, int event, uint32_t value,
+	int result)
+{
+	sTraceEvent(context, event, sNowNs(), NULL, value, NULL, 0, result);
+}
+
+/*
+ * @brief Copy record @a index if the ring still holds it complete
+ */
+static uSynergyBool sTraceRead(uSynergyContext *context, uint32_t index,
+	uSynergyTraceRecord *record)
+{
+	const uSynergyTraceRecord *slot =
+		&context->m_traceRecords[index & context->m_traceMask];
+
+	if (__atomic_load_n(&slot->m_sequence, __ATOMIC_ACQUIRE) != index + 1)
+		return USYNERGY_FALSE;
+	*record = *slot;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->m_sequence, __ATOMIC_RELAXED) == index + 1;
+}
+
+/*
+ * @brief Index of the oldest record the ring still holds
+ */
+static uint32_t sTraceOldest(uSynergyContext *context, uint32_t end)
+{
+	uint32_t size = context->m_traceMask + 1;
+
+	return end > size ? end - size : 0;
+}
+
+/*
+ * @brief Format records [@a from, @a to) and pass them to @a func
+ */
+static void sDumpTrace(uSynergyContext *context, uint32_t from, uint32_t to,
+	void (*func)(uSynergyCookie cookie, const char *line))
+{
+	uSynergyTraceRecord record;
+	char line[128];
+
+	for (; from != to; from++) {
+		if (!sTraceRead(context, from, &record))
+			continue;
+		uSynergyFormatTraceRecord(&record, line, sizeof(line));
+		func(context->m_cookie, line);
+	}
 }
 
 /*
- * @brief Add uint8 to reply packet
+ * @brief Add string to reply packet
  */
-static void sAddUInt8(uSynergyContext *context, uint8_t value)
+static void sAddString(uSynergyContext *context, const char *string)
 {
-	*context->m_replyCur++ = value;
+	size_t len = strlen(string);
+	memcpy(context->m_replyCur, string, len);
+	context->m_replyCur += len;
 }
 
 /*
@@ -121,10 +236,176 @@ static void sSetDisconnected(uSynergyContext *context)
 {
 	context->m_connected		= USYNERGY_FALSE;
 	context->m_hasReceivedHello	= USYNERGY_FALSE;
+	context->m_serverMajor		= 0;
+	context->m_serverMinor		= 0;
 	context->m_isCaptured		= USYNERGY_FALSE;
 	context->m_replyCur			= context->m_replyBuffer + 4;
 	context->m_sequenceNumber	= 0;
-	context->m_disconnectDevice(context->m_cookie);
+}
+
+/*
+ * @brief Ask the session to end, from any thread
+
+ * Shuts the socket down so a blocked receive returns, and wakes the
+ * dispatcher. The socket itself is closed by the thread running
+ * uSynergyStart(), after the receive thread is joined.
+ */
+static void sHangUp(uSynergyContext *context)
+{
+	/* Only the caller that clears the flag shuts the socket down */
+	uSynergyBool connected = __sync_lock_test_and_set(&context->m_connected,
+		USYNERGY_FALSE);
+
+	if (connected && context->m_transport->m_shutdownFunc != NULL)
+		context->m_transport->m_shutdownFunc(context->m_cookie);
+	sem_post(&context->reciveOfsSem);
+}
+
+//-----------------------------------------------------------------------------
+//	Devices
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Bring the devices up, on m_deviceThread
+ */
+static void *sConnectDevices(void *arg)
+{
+	uSynergyContext *context = arg;
+	int result = context->m_connectDevice(context->m_cookie) ? 1 : -1;
+
+	if (result > 0)
+		sStartupPhase(context, USYNERGY_STARTUP_DEVICES);
+	__atomic_store_n(&context->m_deviceResult, result, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ * @brief Wait for the device thread, release whatever it brought up
+ */
+static void sReleaseDevices(uSynergyContext *context)
+{
+	if (context->m_deviceThreadJoinable) {
+		pthread_join(context->m_deviceThread, NULL);
+		context->m_deviceThreadJoinable = USYNERGY_FALSE;
+	}
+	/* Also after a failure, one of the devices may be up */
+	if (context->m_deviceResult != 0 && context->m_disconnectDevice != NULL)
+		context->m_disconnectDevice(context->m_cookie);
+	context->m_deviceResult = 0;
+	context->m_devicesAttached = USYNERGY_FALSE;
+}
+
+/*
+ * @brief Start bringing the devices up, unless they are up or on their way
+ * from a run whose connect failed
+ */
+static void sStartDevices(uSynergyContext *context)
+{
+	int result = __atomic_load_n(&context->m_deviceResult, __ATOMIC_ACQUIRE);
+
+	if (result > 0) {
+		sStartupPhase(context, USYNERGY_STARTUP_DEVICES);
+		return;
+	}
+	if (result == 0 && context->m_deviceThreadJoinable)
+		return;
+	sReleaseDevices(context);
+
+	if (pthread_create(&context->m_deviceThread, NULL, sConnectDevices,
+		context) == 0)
+		context->m_deviceThreadJoinable = USYNERGY_TRUE;
+	else
+		sConnectDevices(context);
+}
+
+/*
+ * @brief Take the devices over on the dispatch thread, waiting for them if
+ * they are still coming up
+
+ * @returns USYNERGY_FALSE if they failed
+ */
+static uSynergyBool sAttachDevices(uSynergyContext *context)
+{
+	if (context->m_deviceThreadJoinable) {
+		pthread_join(context->m_deviceThread, NULL);
+		context->m_deviceThreadJoinable = USYNERGY_FALSE;
+	}
+	if (context->m_deviceResult <= 0)
+		return USYNERGY_FALSE;
+	if (context->m_attachDevice != NULL)
+		context->m_attachDevice(context->m_cookie);
+	context->m_devicesAttached = USYNERGY_TRUE;
+	return USYNERGY_TRUE;
+}
+
+/*
+ * @brief Whether a message is input for the devices: mouse, keys, joystick
+ */
+static uSynergyBool sNeedsDevices(const uint8_t *message)
+{
+	const uint8_t *id = message + 4;
+
+	return id[0] == 'D' && (id[1] == 'M' || id[1] == 'K' || id[1] == 'G');
+}
+
+/*
+ * @brief Shortest frame, length header included, that holds every field
+ * sProcessMessage() reads for @a message
+
+ * Key and wheel messages take their protocol 1.0 form, the shortest one.
+ */
+static uint32_t sMinMessageLength(const uint8_t *message)
+{
+	static const struct {
+		char code[5];
+		uint32_t length;
+	} minimum[] = {
+		{ "Syne", 15 },		/* "Synergy%2i%2i" */
+		{ "CINN", 18 },		/* "CINN%2i%2i%4i%2i" */
+		{ "DMDN", 9 },		/* "DMDN%1i" */
+		{ "DMUP", 9 },		/* "DMUP%1i" */
+		{ "DMMV", 12 },		/* "DMMV%2i%2i" */
+		{ "DMWM", 10 },		/* "DMWM%2i" */
+		{ "DKDN", 12 },		/* "DKDN%2i%2i" */
+		{ "DKRP", 14 },		/* "DKRP%2i%2i%2i" */
+		{ "DKUP", 12 },		/* "DKUP%2i%2i" */
+		{ "DGBT", 11 },		/* "DGBT%1i%2i" */
+		{ "DGST", 13 },		/* "DGST%1i%1i%1i%1i%1i" */
+		{ "DCLP", 17 },		/* "DCLP%1i%4i%s" */
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(minimum) / sizeof(minimum[0]); i++) {
+		if (memcmp(message + 4, minimum[i].code, 4) == 0)
+			return minimum[i].length;
+	}
+	return 8;
+}
+
+/*
+ * @brief Translate a Synergy key id, ids beyond the key table are unmapped
+ */
+static uint16_t sTranslateKey(uint16_t id)
+{
+	if (id >= sizeof(keyTranslation) / sizeof(keyTranslation[0]))
+		return (uint16_t)-1;
+	return (uint16_t)keyTranslation[id];
+}
+
+/*
+ * @brief Send through the transport and count it, m_sendMutex must be held
+ */
+static uSynergyBool sSend(uSynergyContext *context, const uint8_t *buffer,
+	uint32_t length)
+{
+	uSynergyCounters *counters = &context->m_counters;
+
+	if (!context->m_transport->m_sendFunc(context->m_cookie, buffer, length)) {
+		uSynergyCount(&counters->m_sendErrors, 1);
+		return USYNERGY_FALSE;
+	}
+	uSynergyCount(&counters->m_bytesSent, length);
+	return USYNERGY_TRUE;
 }
 
 /*
@@ -146,14 +427,33 @@ static uSynergyBool sSendReply(uSynergyContext *context)
 	reply_buf[3] = (uint8_t)body_len;
 
 	// Send reply
-	ret = context->m_sendFunc(context->m_cookie,
-		context->m_replyBuffer, reply_len);
+	pthread_mutex_lock(&context->m_sendMutex);
+	ret = sSend(context, context->m_replyBuffer, reply_len);
+	uSynergyCount(&context->m_counters.m_messagesSent, 1);
+	pthread_mutex_unlock(&context->m_sendMutex);
+	if (!ret)
+		sTraceEvent(context, USYNERGY_TRACE_SEND_FAILED, sNowNs(),
+			reply_buf + 4, reply_len, NULL, 0, 0);
 
 	// Reset reply buffer write pointer
 	context->m_replyCur = context->m_replyBuffer+4;
 	return ret;
 }
 
+/*
+ * @brief Push out replies and device writes queued by the transport
+ */
+static uSynergyBool sFlush(uSynergyContext *context)
+{
+	if (context->m_transport->m_flushFunc == NULL)
+		return USYNERGY_TRUE;
+	if (!context->m_transport->m_flushFunc(context->m_cookie)) {
+		uSynergyCount(&context->m_counters.m_sendErrors, 1);
+		return USYNERGY_FALSE;
+	}
+	return USYNERGY_TRUE;
+}
+
 /*
  * @brief Call mouse callback after a mouse event
  */
@@ -169,6 +469,7 @@ static void sSendMouseMoveCallback(uSynergyContext *context,
 	uSynergyBool ret;
 	ret = context->m_mouseMoveCallback(context->m_cookie,
 		x - context->m_mouseX, y - context->m_mouseY);
+	context->m_callbackResult = ret;
 	if (!ret) {
 		//LOGI("%d:%d -> %d:%d\n", context->m_mouseX_old,
 		//	context->m_mouseY_old, context->m_mouseX, context->m_mouseY);
@@ -192,6 +493,7 @@ static void sSendMouseUpCallback(uSynergyContext *context)
 	ret = context->m_mouseUpCallback(context->m_cookie,
 		context->m_mouseButtonLeft, context->m_mouseButtonRight,
 		context->m_mouseButtonMiddle);
+	context->m_callbackResult = ret;
 }
 
 static void sSendMouseDownCallback(uSynergyContext *context)
@@ -203,6 +505,7 @@ static void sSendMouseDownCallback(uSynergyContext *context)
 	ret = context->m_mouseDownCallback(context->m_cookie,
 		context->m_mouseButtonLeft, context->m_mouseButtonRight,
 		context->m_mouseButtonMiddle);
+	context->m_callbackResult = ret;
 }
 
 static void sSendMouseWheelCallback(uSynergyContext *context)
@@ -213,6 +516,7 @@ static void sSendMouseWheelCallback(uSynergyContext *context)
 	uSynergyBool ret;
 	ret = context->m_mouseWheelCallback(context->m_cookie,
 		context->m_mouseWheelX, context->m_mouseWheelY);
+	context->m_callbackResult = ret;
 }
 
 /*
@@ -249,133 +553,705 @@ static void sSendJoystickCallback(uSynergyContext *context, uint8_t joyNum)
 }
 
 /*
- * @brief Parse a single client message, update state, send callbacks
- *  and send replies
+ * @brief Reference counted clipboard storage
+
+ * Every cache entry pointing into a block holds one reference, every reader
+ * that acquired the clipboard holds another. The arena and a bitmap being
+ * decoded are never shared.
  */
-#define USYNERGY_IS_PACKET(pkt_id)	memcmp(message+4, pkt_id, 4)==0
-static void sProcessMessage(uSynergyContext *context, const uint8_t *message)
+struct uSynergyClipboardBlock {
+	int			refs;
+	uint32_t	capacity;
+	uint8_t		data[];
+};
+
+static void sReleaseClipboardBlock(struct uSynergyClipboardBlock *block)
 {
-	// We have a packet!
-	if (memcmp(message+4, "Synergy", 7)==0) {
-		// Welcome message
-		// kMsgHello = "Synergy%2i%2i"
-		// kMsgHelloBack = "Synergy%2i%2i%s"
-		sAddString(context, "Synergy");
-		sAddUInt16(context, USYNERGY_PROTOCOL_MAJOR);
-		sAddUInt16(context, USYNERGY_PROTOCOL_MINOR);
-		sAddUInt32(context, (uint32_t)strlen(context->m_clientName));
-		sAddString(context, context->m_clientName);
+	if (block != NULL && __sync_sub_and_fetch(&block->refs, 1) == 0)
+		free(block);
+}
 
-		if (!sSendReply(context)) {
-			// Send reply failed, let's try to reconnect
-			sTrace(context, "SendReply failed, trying to reconnect in a second");
-			context->m_connected = USYNERGY_FALSE;
-			context->m_sleepFunc(context->m_cookie, 1000);
-		} else {
-			// Let's assume we're connected
-			char buffer[256+1];
-			sprintf(buffer, "Connected as client \"%s\"", context->m_clientName);
-			sTrace(context, buffer);
-			context->m_hasReceivedHello = USYNERGY_TRUE;
-			context->m_lastMessageTime = context->m_getTimeFunc();
+/*
+ * @brief Content hash for the clipboard cache
+
+ * Four independent multiply-xor lanes over 32 byte blocks, so hashing runs
+ * close to memory speed. Not cryptographic, only used to spot resends.
+ */
+static uint64_t sHashClipboard(const uint8_t *data, uint32_t size)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15ull;
+	uint64_t lane[4] = { k, k ^ 1, k ^ 2, k ^ 3 };
+	uint64_t word, h;
+	int i;
+
+	for (; size >= 32; size -= 32, data += 32) {
+		for (i = 0; i < 4; i++) {
+			memcpy(&word, data + i * 8, 8);
+			lane[i] = (lane[i] ^ word) * 0xff51afd7ed558ccdull;
+			lane[i] ^= lane[i] >> 32;
 		}
-		return;
+	}
+	h = (uint64_t)size * k;
+	for (i = 0; i < 4; i++)
+		h = (h ^ lane[i]) * 0xc4ceb9fe1a85ec53ull;
+	for (; size >= 8; size -= 8, data += 8) {
+		memcpy(&word, data, 8);
+		h = (h ^ word) * 0xff51afd7ed558ccdull;
+		h ^= h >> 29;
+	}
+	word = 0;
+	memcpy(&word, data, size);
+	h = (h ^ word) * 0xc4ceb9fe1a85ec53ull;
+	return h ^ (h >> 32);
+}
 
-	} else if (USYNERGY_IS_PACKET("QINF")) {
-		// Screen info. Reply with DINF
-		// kMsgQInfo = "QINF"
-		// kMsgDInfo = "DINF%2i%2i%2i%2i%2i%2i%2i"
-		uint16_t x = 0, y = 0, warp = 0;
-		sAddString(context, "DINF");
-		sAddUInt16(context, x);
-		sAddUInt16(context, y);
-		sAddUInt16(context, context->m_clientWidth);
-		sAddUInt16(context, context->m_clientHeight);
-		sAddUInt16(context, warp);
-		sAddUInt16(context, 0); // mx?
-		sAddUInt16(context, 0); // my?
-		sSendReply(context);
-		return;
+static void sStartClipboardSender(uSynergyContext *context);
+static void sJoinClipboardSender(uSynergyContext *context);
 
-	} else if (USYNERGY_IS_PACKET("CIAK")) {
-		// Do nothing?
-		// kMsgCInfoAck = "CIAK"
-		return;
+/*
+ * @brief Bring clipboard text into protocol form in place
 
-	} else if (USYNERGY_IS_PACKET("CROP")) {
-		// Do nothing?
-		// kMsgCResetOptions = "CROP"
-		return;
+ * Some servers send CRLF and some applications put broken UTF-8 on the
+ * clipboard, which Java's decoder does not survive. Returns the new size.
+ */
+static uint32_t sNormalizeText(uSynergyContext *context, uint8_t *text,
+	uint32_t size)
+{
+	if (uSynergyTextSanitize(text, size) != 0)
+		sTrace(context, "Clipboard text is not valid UTF-8, repaired");
+	return uSynergyText->m_crlfToLf(text, size, text);
+}
 
-	} else if (USYNERGY_IS_PACKET("CINN")) {
-		// Screen enter. Reply with CNOP
-		// kMsgCEnter = "CINN%2i%2i%4i%2i"
-		context->m_mouseX_old = sNetToNative16(message + 8);
-		context->m_mouseY_old = sNetToNative16(message + 10);
+/* Receive stages of the marshalled clipboard */
+#define USYNERGY_CLIPBOARD_STAGE_COUNT	0	/* Number of formats */
+#define USYNERGY_CLIPBOARD_STAGE_HEADER	1	/* Format and size */
+#define USYNERGY_CLIPBOARD_STAGE_DATA	2	/* Format data */
+#define USYNERGY_CLIPBOARD_STAGE_DONE	3	/* Extra bytes are ignored */
 
-		// Obtain the Synergy sequence number
-		context->m_sequenceNumber = sNetToNative32(message + 12);
-		context->m_isCaptured = USYNERGY_TRUE;
+/*
+ * @brief Allocate a clipboard block with one reference
+ */
+static struct uSynergyClipboardBlock *sAllocClipboardBlock(uint32_t capacity)
+{
+	struct uSynergyClipboardBlock *block;
+
+	block = malloc(sizeof(*block) + capacity);
+	if (block == NULL)
+		return NULL;
+	block->refs = 1;
+	block->capacity = capacity;
+	return block;
+}
 
-		// Call callback
-		if (context->m_screenActiveCallback != NULL)
-			context->m_screenActiveCallback(context->m_cookie, USYNERGY_TRUE);
+/*
+ * @brief Bitmap decoder output, a block of uSynergyBitmapHeader and pixels
+ */
+static uint8_t *sAllocBitmap(void *arg, uint32_t width, uint32_t height)
+{
+	uSynergyContext *context = arg;
+	uSynergyBitmapHeader header;
+	uint64_t size = sizeof(header) + (uint64_t)width * height * 4;
 
-	} else if (USYNERGY_IS_PACKET("COUT")) {
-		// Screen leave
-		// kMsgCLeave = "COUT"
-		context->m_isCaptured = USYNERGY_FALSE;
+	if (size > context->m_clipboardMaxSize) {
+		sTrace(context, "Clipboard bitmap too large, ignoring it");
+		return NULL;
+	}
+	context->m_clipboardBitmap = sAllocClipboardBlock((uint32_t)size);
+	if (context->m_clipboardBitmap == NULL)
+		return NULL;
+	header.width = width;
+	header.height = height;
+	memcpy(context->m_clipboardBitmap->data, &header, sizeof(header));
+	return context->m_clipboardBitmap->data + sizeof(header);
+}
 
-		// Call callback
-		if (context->m_screenActiveCallback != NULL)
-			context->m_screenActiveCallback(context->m_cookie, USYNERGY_FALSE);
+/*
+ * @brief Drop everything a transfer collected so far
+ */
+static void sResetClipboardTransfer(uSynergyContext *context)
+{
+	if (context->m_clipboardBitmap != NULL) {
+		uSynergyBmpEnd(&context->m_bmpDecoder);
+		sReleaseClipboardBlock(context->m_clipboardBitmap);
+		context->m_clipboardBitmap = NULL;
+	}
+	/* A decoded bitmap owns its block, text formats point into the arena */
+	sReleaseClipboardBlock(
+		context->m_clipboardIncoming[USYNERGY_CLIPBOARD_FORMAT_BITMAP].block);
+	memset(context->m_clipboardIncoming, 0,
+		sizeof(context->m_clipboardIncoming));
+	context->m_clipboardArenaUsed = 0;
+	context->m_clipboardStage = USYNERGY_CLIPBOARD_STAGE_COUNT;
+	context->m_clipboardFieldLen = 0;
+	context->m_clipboardReceiving = USYNERGY_FALSE;
+}
 
-	} else if (USYNERGY_IS_PACKET("DMDN")) {
-		// Mouse down
-		// kMsgDMouseDown = "DMDN%1i"
-		char btn = message[8]-1;
-		if (btn==2)
-			context->m_mouseButtonRight		= USYNERGY_TRUE;
-		else if (btn==1)
-			context->m_mouseButtonMiddle	= USYNERGY_TRUE;
-		else
-			context->m_mouseButtonLeft		= USYNERGY_TRUE;
-		sSendMouseDownCallback(context);
+/*
+ * @brief A format header was received, prepare to store its data
+ */
+static void sBeginClipboardFormat(uSynergyContext *context)
+{
+	uint32_t format = context->m_clipboardFormat;
+	uint32_t size = context->m_clipboardFormatLeft;
+	uSynergyClipboardEntry *entry;
+	struct uSynergyClipboardBlock *arena;
 
-	} else if (USYNERGY_IS_PACKET("DMUP")) {
-		// Mouse up
-		// kMsgDMouseUp = "DMUP%1i"
-		char btn = message[8]-1;
-		if (btn==2)
-			context->m_mouseButtonRight		= USYNERGY_FALSE;
-		else if (btn==1)
-			context->m_mouseButtonMiddle	= USYNERGY_FALSE;
-		else
-			context->m_mouseButtonLeft		= USYNERGY_FALSE;
-		sSendMouseUpCallback(context);
+	if (format >= USYNERGY_NUM_CLIPBOARD_FORMATS)
+		return;
+	entry = &context->m_clipboardIncoming[format];
+
+	if (format == USYNERGY_CLIPBOARD_FORMAT_BITMAP) {
+		if (context->m_clipboardBitmap != NULL) {
+			/* A second bitmap replaces the first */
+			uSynergyBmpEnd(&context->m_bmpDecoder);
+			sReleaseClipboardBlock(context->m_clipboardBitmap);
+			context->m_clipboardBitmap = NULL;
+		}
+		memset(entry, 0, sizeof(*entry));
+		context->m_clipboardBitmapFailed = USYNERGY_FALSE;
+		uSynergyBmpBegin(&context->m_bmpDecoder, sAllocBitmap, context);
+		return;
+	}
 
-	} else if (USYNERGY_IS_PACKET("DMMV")) {
-		// Mouse move. Reply with CNOP
-		// kMsgDMouseMove = "DMMV%2i%2i"
-		sSendMouseMoveCallback(context, sNetToNative16(message+8), sNetToNative16(message+10));
+	/* Text formats are appended to the arena, which only ever grows */
+	arena = context->m_clipboardArena;
+	if (arena == NULL
+		|| arena->capacity - context->m_clipboardArenaUsed < size) {
+		uint32_t capacity = context->m_clipboardArenaUsed + size;
+		if (arena != NULL && capacity < arena->capacity * 2)
+			capacity = arena->capacity * 2;
+		if (capacity > context->m_clipboardMaxSize)
+			capacity = context->m_clipboardMaxSize;
+		arena = realloc(arena, sizeof(*arena) + capacity);
+		if (arena == NULL) {
+			sTrace(context, "Out of memory, ignoring clipboard");
+			free(context->m_clipboardArena);
+			context->m_clipboardArena = NULL;
+			sResetClipboardTransfer(context);
+			return;
+		}
+		arena->refs = 1;
+		arena->capacity = capacity;
+		context->m_clipboardArena = arena;
+	}
+	entry->present	= USYNERGY_TRUE;
+	entry->offset	= context->m_clipboardArenaUsed;
+	entry->size		= size;
+	context->m_clipboardArenaUsed += size;
+}
 
-	} else if (USYNERGY_IS_PACKET("DMWM")) {
-		// Mouse wheel
-		// kMsgDMouseWheel = "DMWM%2i%2i"
-		// kMsgDMouseWheel1_0 = "DMWM%2i"
-		context->m_mouseWheelX += sNetToNative16(message+8);
-		context->m_mouseWheelY += sNetToNative16(message+10);
-		sSendMouseWheelCallback(context);
+/*
+ * @brief Store the next bytes of the current format
+ */
+static void sClipboardFormatData(uSynergyContext *context,
+	const uint8_t *data, uint32_t size)
+{
+	uint32_t format = context->m_clipboardFormat;
+	uSynergyClipboardEntry *entry;
 
-	} else if (USYNERGY_IS_PACKET("DKDN")) {
-		// Key down
-		// kMsgDKeyDown	= "DKDN%2i%2i%2i"
-		// kMsgDKeyDown1_0 = "DKDN%2i%2i"
-		uint16_t id = sNetToNative16(message+8);
-		uint16_t mod = sNetToNative16(message+10);
-		uint16_t key = sNetToNative16(message+12);
-		//LOGI("id:%d key:%d mod:%d\n", id, key, mod);
-		sSendKeyboardCallback(context, keyTranslation[id], mod, USYNERGY_TRUE, USYNERGY_FALSE);
+	if (format >= USYNERGY_NUM_CLIPBOARD_FORMATS)
+		return;
+	entry = &context->m_clipboardIncoming[format];
+
+	if (format == USYNERGY_CLIPBOARD_FORMAT_BITMAP) {
+		if (!context->m_clipboardBitmapFailed &&
+			uSynergyBmpFeed(&context->m_bmpDecoder, data, size) != 0) {
+			sTrace(context, "Unsupported clipboard bitmap, ignoring it");
+			context->m_clipboardBitmapFailed = USYNERGY_TRUE;
+		}
+		return;
+	}
+
+	memcpy(context->m_clipboardArena->data + entry->offset + entry->size
+		- context->m_clipboardFormatLeft, data, size);
+}
+
+/*
+ * @brief The current format is complete
+ */
+static void sEndClipboardFormat(uSynergyContext *context)
+{
+	uSynergyClipboardEntry *entry;
+
+	if (context->m_clipboardFormat != USYNERGY_CLIPBOARD_FORMAT_BITMAP)
+		return;
+	entry = &context->m_clipboardIncoming[USYNERGY_CLIPBOARD_FORMAT_BITMAP];
+	if (uSynergyBmpEnd(&context->m_bmpDecoder) != 0
+		|| context->m_clipboardBitmapFailed) {
+		sReleaseClipboardBlock(context->m_clipboardBitmap);
+		context->m_clipboardBitmap = NULL;
+		return;
+	}
+	entry->present	= USYNERGY_TRUE;
+	entry->block	= context->m_clipboardBitmap;
+	entry->offset	= 0;
+	entry->size		= context->m_clipboardBitmap->capacity;
+	context->m_clipboardBitmap = NULL;
+}
+
+/*
+ * @brief Collect a fixed size field that may straddle chunks
+ * Returns USYNERGY_TRUE once m_clipboardField holds @a length bytes.
+ */
+static uSynergyBool sCollectClipboardField(uSynergyContext *context,
+	const uint8_t **data, uint32_t *size, uint32_t length)
+{
+	uint32_t n = length - context->m_clipboardFieldLen;
+
+	if (n > *size)
+		n = *size;
+	memcpy(context->m_clipboardField + context->m_clipboardFieldLen, *data, n);
+	context->m_clipboardFieldLen += n;
+	context->m_clipboardReceived += n;
+	*data += n;
+	*size -= n;
+	if (context->m_clipboardFieldLen < length)
+		return USYNERGY_FALSE;
+	context->m_clipboardFieldLen = 0;
+	return USYNERGY_TRUE;
+}
+
+/*
+ * @brief Demultiplex the marshalled clipboard as its chunks arrive
+
+ * The data contains:
+ *	1 uint32:	The number of formats present in the message
+ * And then 'number of formats' times the following:
+ *	1 uint32:	The format of the clipboard data
+ *	1 uint32:	The size n of the clipboard data
+ *	n uint8:	The clipboard data
+ */
+static void sFeedClipboard(uSynergyContext *context, const uint8_t *data,
+	uint32_t size)
+{
+	uint32_t n;
+
+	while (context->m_clipboardReceiving) {
+		switch (context->m_clipboardStage) {
+		case USYNERGY_CLIPBOARD_STAGE_COUNT:
+			if (!sCollectClipboardField(context, &data, &size, 4))
+				return;
+			context->m_clipboardFormatsLeft =
+				sNetToNative32(context->m_clipboardField);
+			context->m_clipboardStage = context->m_clipboardFormatsLeft
+				? USYNERGY_CLIPBOARD_STAGE_HEADER
+				: USYNERGY_CLIPBOARD_STAGE_DONE;
+			break;
+
+		case USYNERGY_CLIPBOARD_STAGE_HEADER:
+			if (!sCollectClipboardField(context, &data, &size, 8))
+				return;
+			context->m_clipboardFormat =
+				sNetToNative32(context->m_clipboardField);
+			context->m_clipboardFormatLeft =
+				sNetToNative32(context->m_clipboardField+4);
+			if (context->m_clipboardFormatLeft > context->m_clipboardExpected
+				- context->m_clipboardReceived) {
+				sTrace(context, "Truncated clipboard data");
+				sResetClipboardTransfer(context);
+				return;
+			}
+			sBeginClipboardFormat(context);
+			context->m_clipboardStage = USYNERGY_CLIPBOARD_STAGE_DATA;
+			break;
+
+		case USYNERGY_CLIPBOARD_STAGE_DATA:
+			n = context->m_clipboardFormatLeft;
+			if (n > size)
+				n = size;
+			if (n > 0) {
+				sClipboardFormatData(context, data, n);
+				context->m_clipboardFormatLeft -= n;
+				context->m_clipboardReceived += n;
+				data += n;
+				size -= n;
+			}
+			if (context->m_clipboardFormatLeft > 0)
+				return;
+			sEndClipboardFormat(context);
+			context->m_clipboardStage = --context->m_clipboardFormatsLeft
+				? USYNERGY_CLIPBOARD_STAGE_HEADER
+				: USYNERGY_CLIPBOARD_STAGE_DONE;
+			break;
+
+		default:
+			/* Trailing bytes */
+			context->m_clipboardReceived += size;
+			return;
+		}
+	}
+}
+
+/*
+ * @brief Merge the received clipboard into the clipboard cache
+
+ * Servers resend the whole clipboard on every screen switch. Each format is
+ * hashed where it was received; if nothing changed the arena is kept for
+ * the next transfer. Otherwise the received blocks become the cached
+ * clipboard, without copying, and callbacks are sent for the formats that
+ * changed.
+ */
+static void sCommitClipboard(uSynergyContext *context)
+{
+	uSynergyClipboardEntry *entries = context->m_clipboardIncoming;
+	uSynergyClipboardEntry	old[USYNERGY_NUM_CLIPBOARD_FORMATS];
+	uSynergyBool			changed[USYNERGY_NUM_CLIPBOARD_FORMATS];
+	uSynergyBool			any_changed = USYNERGY_FALSE;
+	int						arena_refs = 0;
+	int						i;
+
+	for (i = 0; i < USYNERGY_NUM_CLIPBOARD_FORMATS; i++) {
+		uSynergyClipboardEntry *entry = &entries[i];
+		const uSynergyClipboardEntry *cached = &context->m_clipboardEntries[i];
+		if (entry->present && entry->block == NULL) {
+			/* Text formats live in the arena */
+			entry->block = context->m_clipboardArena;
+			arena_refs++;
+			if (i == USYNERGY_CLIPBOARD_FORMAT_TEXT)
+				entry->size = sNormalizeText(context,
+					entry->block->data + entry->offset, entry->size);
+		}
+		if (entry->present)
+			entry->hash = sHashClipboard(entry->block->data + entry->offset,
+				entry->size);
+		changed[i] = entry->present != cached->present ||
+			entry->hash != cached->hash || entry->size != cached->size;
+		any_changed |= changed[i];
+	}
+	if (!any_changed) {
+		sResetClipboardTransfer(context);
+		return;
+	}
+
+	/* The arena is handed over to the cache entries that point into it */
+	if (arena_refs > 0) {
+		context->m_clipboardArena->refs = arena_refs;
+		context->m_clipboardArena = NULL;
+	}
+
+	pthread_mutex_lock(&context->m_clipboardMutex);
+	memcpy(old, context->m_clipboardEntries, sizeof(old));
+	memcpy(context->m_clipboardEntries, entries, sizeof(old));
+	pthread_mutex_unlock(&context->m_clipboardMutex);
+	memset(entries, 0, sizeof(old));
+	sResetClipboardTransfer(context);
+	for (i = 0; i < USYNERGY_NUM_CLIPBOARD_FORMATS; i++) {
+		if (old[i].present)
+			sReleaseClipboardBlock(old[i].block);
+	}
+
+	// Call callback
+	if (context->m_clipboardCallback == NULL)
+		return;
+	for (i = 0; i < USYNERGY_NUM_CLIPBOARD_FORMATS; i++) {
+		const uSynergyClipboardEntry *entry = &context->m_clipboardEntries[i];
+		if (!changed[i] || !entry->present)
+			continue;
+		context->m_clipboardCallback(context->m_cookie,
+			(enum uSynergyClipboardFormat)i,
+			entry->block->data + entry->offset, entry->size);
+	}
+}
+
+/*
+ * @brief Whether the server sends and expects chunked clipboard transfers
+ */
+static uSynergyBool sServerChunksClipboard(const uSynergyContext *context)
+{
+	return context->m_serverMajor > USYNERGY_PROTOCOL_MAJOR
+		|| (context->m_serverMajor == USYNERGY_PROTOCOL_MAJOR
+		&& context->m_serverMinor >= USYNERGY_CLIPBOARD_CHUNKED_MINOR);
+}
+
+/*
+ * @brief Start receiving a clipboard of @a total marshalled bytes
+
+ * @returns USYNERGY_FALSE if it is larger than m_clipboardMaxSize and dropped
+ */
+static uSynergyBool sStartClipboardTransfer(uSynergyContext *context,
+	uint32_t total)
+{
+	sResetClipboardTransfer(context);
+	context->m_clipboardExpected = total;
+	context->m_clipboardReceived = 0;
+	if (total > context->m_clipboardMaxSize) {
+		uSynergyCount(&context->m_counters.m_clipboardsDropped, 1);
+		sTrace(context, "Clipboard too large, ignoring it");
+		return USYNERGY_FALSE;
+	}
+	context->m_clipboardReceiving = USYNERGY_TRUE;
+	return USYNERGY_TRUE;
+}
+
+/*
+ * @brief Collect one chunk of a clipboard transfer
+
+ * The start chunk announces the total size as a decimal string, data chunks
+ * are demultiplexed as they arrive and the end chunk commits the whole
+ * clipboard to the cache. Transfers larger than m_clipboardMaxSize are
+ * dropped.
+ */
+static void sReceiveClipboardChunk(uSynergyContext *context, uint8_t mark,
+	const uint8_t *data, uint32_t size)
+{
+	if (mark == USYNERGY_CLIPBOARD_MARK_START) {
+		char digits[16];
+
+		if (size >= sizeof(digits))
+			size = sizeof(digits) - 1;
+		memcpy(digits, data, size);
+		digits[size] = 0;
+		sStartClipboardTransfer(context, (uint32_t)strtoul(digits, NULL, 10));
+
+	} else if (mark == USYNERGY_CLIPBOARD_MARK_CHUNK) {
+		if (!context->m_clipboardReceiving)
+			return;
+		if (size > context->m_clipboardExpected - context->m_clipboardReceived) {
+			sTrace(context, "Clipboard overrun, ignoring it");
+			sResetClipboardTransfer(context);
+			return;
+		}
+		sFeedClipboard(context, data, size);
+
+	} else if (mark == USYNERGY_CLIPBOARD_MARK_END) {
+		if (context->m_clipboardReceiving &&
+			context->m_clipboardReceived == context->m_clipboardExpected &&
+			context->m_clipboardStage == USYNERGY_CLIPBOARD_STAGE_DONE) {
+			uSynergyCount(&context->m_counters.m_clipboardsReceived, 1);
+			uSynergyCount(&context->m_counters.m_clipboardBytesReceived,
+				context->m_clipboardReceived);
+			sCommitClipboard(context);
+		} else {
+			sResetClipboardTransfer(context);
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	Round trip time
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Send screen info reporting the cursor at @a x, @a y and time it
+
+ * Flushed right away. The time is taken before the send, the receive thread
+ * may read the server's CIAK before the send returns.
+ */
+static uSynergyBool sSendInfo(uSynergyContext *context, uint16_t x,
+	uint16_t y)
+{
+	uint64_t now = sNowNs();
+
+	sAddString(context, "DINF");
+	sAddUInt16(context, 0);
+	sAddUInt16(context, 0);
+	sAddUInt16(context, context->m_clientWidth);
+	sAddUInt16(context, context->m_clientHeight);
+	sAddUInt16(context, 0);
+	sAddUInt16(context, x);
+	sAddUInt16(context, y);
+	if (!sSendReply(context) || !sFlush(context))
+		return USYNERGY_FALSE;
+	context->m_rttSent = context->m_rttLastProbe = now;
+	return USYNERGY_TRUE;
+}
+
+/*
+ * @brief Take a round trip sample from a CIAK read at @a received
+ */
+static void sRttSample(uSynergyContext *context, uint64_t received)
+{
+	uSynergyRttStats *stats = &context->m_rttStats;
+	uint64_t sample, delta;
+
+	/* A CIAK read before the DINF went out answers an earlier one */
+	if (context->m_rttSent == 0 || received < context->m_rttSent)
+		return;
+	sample = received - context->m_rttSent;
+	context->m_rttSent = 0;
+
+	pthread_mutex_lock(&context->m_statsMutex);
+	if (stats->m_samples == 0) {
+		stats->m_smoothed = sample;
+		stats->m_variation = sample / 2;
+	} else {
+		delta = stats->m_smoothed > sample ? stats->m_smoothed - sample
+			: sample - stats->m_smoothed;
+		stats->m_variation = (3 * stats->m_variation + delta) / 4;
+		stats->m_smoothed = (7 * stats->m_smoothed + sample) / 8;
+	}
+	stats->m_last = sample;
+	stats->m_samples++;
+	uSynergyHistogramRecord(&stats->m_histogram, sample);
+	pthread_mutex_unlock(&context->m_statsMutex);
+}
+
+/*
+ * @brief Send a round trip probe along with a keepalive reply if one is due
+
+ * The server takes the cursor position in screen info for the client's, so
+ * while the screen is entered a probe only goes out once the input stopped
+ * and the position the client has is settled.
+ */
+static void sProbeRtt(uSynergyContext *context)
+{
+	uint64_t now = sNowNs();
+	uint64_t interval = (uint64_t)context->m_rttProbeInterval * 1000000;
+
+	if (interval == 0 || now - context->m_rttLastProbe < interval)
+		return;
+	if (context->m_rttSent != 0) {
+		if (now - context->m_rttSent < USYNERGY_RTT_TIMEOUT * 1000000ull)
+			return;
+		pthread_mutex_lock(&context->m_statsMutex);
+		context->m_rttStats.m_lost++;
+		pthread_mutex_unlock(&context->m_statsMutex);
+		context->m_rttSent = 0;
+	}
+	if (context->m_isCaptured
+		&& now - context->m_rttLastInput < USYNERGY_RTT_IDLE * 1000000ull)
+		return;
+	sSendInfo(context, context->m_mouseX, context->m_mouseY);
+}
+
+static uint64_t sDispatchReceived(uSynergyContext *context);
+
+/*
+ * @brief Parse a single client message, update state, send callbacks
+ *  and send replies
+
+ * @a length is the size of the whole frame, including the length header.
+ */
+#define USYNERGY_IS_PACKET(pkt_id)	memcmp(message+4, pkt_id, 4)==0
+static void sProcessMessage(uSynergyContext *context, const uint8_t *message,
+	uint32_t length)
+{
+	// We have a packet!
+	if (length >= 15 && memcmp(message+4, "Synergy", 7)==0) {
+		// Welcome message
+		// kMsgHello = "Synergy%2i%2i"
+		// kMsgHelloBack = "Synergy%2i%2i%s"
+		context->m_serverMajor = sNetToNative16(message+11);
+		context->m_serverMinor = sNetToNative16(message+13);
+		sAddString(context, "Synergy");
+		sAddUInt16(context, USYNERGY_PROTOCOL_MAJOR);
+		sAddUInt16(context, USYNERGY_PROTOCOL_MINOR);
+		sAddUInt32(context, (uint32_t)strlen(context->m_clientName));
+		sAddString(context, context->m_clientName);
+
+		if (!sSendReply(context)) {
+			// Send reply failed, let's try to reconnect
+			sTrace(context, "SendReply failed, trying to reconnect in a second");
+			context->m_connected = USYNERGY_FALSE;
+			context->m_sleepFunc(context->m_cookie, 1000);
+		} else {
+			// Let's assume we're connected
+			char buffer[256+1];
+			snprintf(buffer, sizeof(buffer), "Connected as client \"%s\"",
+				context->m_clientName);
+			sTrace(context, buffer);
+			context->m_hasReceivedHello = USYNERGY_TRUE;
+			context->m_lastMessageTime = context->m_getTimeFunc();
+			sStartupPhase(context, USYNERGY_STARTUP_HELLO);
+		}
+		return;
+
+	} else if (USYNERGY_IS_PACKET("QINF")) {
+		// Screen info. Reply with DINF
+		// kMsgQInfo = "QINF"
+		// kMsgDInfo = "DINF%2i%2i%2i%2i%2i%2i%2i"
+		if (sSendInfo(context, 0, 0))
+			sStartupPhase(context, USYNERGY_STARTUP_INFO);
+		return;
+
+	} else if (USYNERGY_IS_PACKET("CIAK")) {
+		// Screen info acknowledged, ends a round trip
+		// kMsgCInfoAck = "CIAK"
+		sRttSample(context, sDispatchReceived(context));
+		return;
+
+	} else if (USYNERGY_IS_PACKET("CROP")) {
+		// Do nothing?
+		// kMsgCResetOptions = "CROP"
+		return;
+
+	} else if (USYNERGY_IS_PACKET("CINN")) {
+		// Screen enter. Reply with CNOP
+		// kMsgCEnter = "CINN%2i%2i%4i%2i"
+		context->m_mouseX_old = sNetToNative16(message + 8);
+		context->m_mouseY_old = sNetToNative16(message + 10);
+
+		// Obtain the Synergy sequence number
+		context->m_sequenceNumber = sNetToNative32(message + 12);
+		context->m_isCaptured = USYNERGY_TRUE;
+		sStartupPhase(context, USYNERGY_STARTUP_ENTER);
+
+		// Call callback
+		if (context->m_screenActiveCallback != NULL)
+			context->m_screenActiveCallback(context->m_cookie, USYNERGY_TRUE);
+
+	} else if (USYNERGY_IS_PACKET("COUT")) {
+		// Screen leave
+		// kMsgCLeave = "COUT"
+		context->m_isCaptured = USYNERGY_FALSE;
+
+		// Ship the clipboard if we grabbed it while we were active
+		sStartClipboardSender(context);
+
+		// Call callback
+		if (context->m_screenActiveCallback != NULL)
+			context->m_screenActiveCallback(context->m_cookie, USYNERGY_FALSE);
+
+	} else if (USYNERGY_IS_PACKET("DMDN")) {
+		// Mouse down
+		// kMsgDMouseDown = "DMDN%1i"
+		char btn = message[8]-1;
+		if (btn==2)
+			context->m_mouseButtonRight		= USYNERGY_TRUE;
+		else if (btn==1)
+			context->m_mouseButtonMiddle	= USYNERGY_TRUE;
+		else
+			context->m_mouseButtonLeft		= USYNERGY_TRUE;
+		sSendMouseDownCallback(context);
+
+	} else if (USYNERGY_IS_PACKET("DMUP")) {
+		// Mouse up
+		// kMsgDMouseUp = "DMUP%1i"
+		char btn = message[8]-1;
+		if (btn==2)
+			context->m_mouseButtonRight		= USYNERGY_FALSE;
+		else if (btn==1)
+			context->m_mouseButtonMiddle	= USYNERGY_FALSE;
+		else
+			context->m_mouseButtonLeft		= USYNERGY_FALSE;
+		sSendMouseUpCallback(context);
+
+	} else if (USYNERGY_IS_PACKET("DMMV")) {
+		// Mouse move. Reply with CNOP
+		// kMsgDMouseMove = "DMMV%2i%2i"
+		sSendMouseMoveCallback(context, sNetToNative16(message+8), sNetToNative16(message+10));
+
+	} else if (USYNERGY_IS_PACKET("DMWM")) {
+		// Mouse wheel
+		// kMsgDMouseWheel = "DMWM%2i%2i"
+		// kMsgDMouseWheel1_0 = "DMWM%2i"
+		if (length < 12) {
+			context->m_mouseWheelY += sNetToNative16(message+8);
+		} else {
+			context->m_mouseWheelX += sNetToNative16(message+8);
+			context->m_mouseWheelY += sNetToNative16(message+10);
+		}
+		sSendMouseWheelCallback(context);
+
+	} else if (USYNERGY_IS_PACKET("DKDN")) {
+		// Key down
+		// kMsgDKeyDown	= "DKDN%2i%2i%2i"
+		// kMsgDKeyDown1_0 = "DKDN%2i%2i"
+		uint16_t id = sNetToNative16(message+8);
+		uint16_t mod = sNetToNative16(message+10);
+//		uint16_t key = sNetToNative16(message+12);
+		//LOGI("id:%d key:%d mod:%d\n", id, key, mod);
+		sSendKeyboardCallback(context, sTranslateKey(id), mod, USYNERGY_TRUE, USYNERGY_FALSE);
 
 	} else if (USYNERGY_IS_PACKET("DKRP")) {
 		// Key repeat
@@ -384,8 +1260,8 @@ static void sProcessMessage(uSynergyContext *context, const uint8_t *message)
 		uint16_t id = sNetToNative16(message+8);
 		uint16_t mod = sNetToNative16(message+10);
 //		uint16_t count = sNetToNative16(message+12);
-		uint16_t key = sNetToNative16(message+14);
-		sSendKeyboardCallback(context, keyTranslation[id], mod, USYNERGY_TRUE, USYNERGY_TRUE);
+//		uint16_t key = sNetToNative16(message+14);
+		sSendKeyboardCallback(context, sTranslateKey(id), mod, USYNERGY_TRUE, USYNERGY_TRUE);
 
 	} else if (USYNERGY_IS_PACKET("DKUP")) {
 		// Key up
@@ -393,8 +1269,8 @@ static void sProcessMessage(uSynergyContext *context, const uint8_t *message)
 		// kMsgDKeyUp1_0 = "DKUP%2i%2i"
 		uint16_t id = sNetToNative16(message+8);
 		uint16_t mod = sNetToNative16(message+10);
-		uint16_t key = sNetToNative16(message+12);
-		sSendKeyboardCallback(context, keyTranslation[id], mod, USYNERGY_FALSE, USYNERGY_FALSE);
+//		uint16_t key = sNetToNative16(message+12);
+		sSendKeyboardCallback(context, sTranslateKey(id), mod, USYNERGY_FALSE, USYNERGY_FALSE);
 
 	} else if (USYNERGY_IS_PACKET("DGBT")) {
 		// Joystick buttons
@@ -425,72 +1301,88 @@ static void sProcessMessage(uSynergyContext *context, const uint8_t *message)
 		// kMsgCKeepAlive = "CALV"
 		sAddString(context, "CALV");
 		sSendReply(context);
+		sProbeRtt(context);
 		// now reply with CNOP
 
 		// Update timer
 		context->m_lastMessageTime = context->m_getTimeFunc();
 
-	} else if (USYNERGY_IS_PACKET("DCLP")) {
-		/* Clipboard message
+	} else if (USYNERGY_IS_PACKET("CCLP")) {
+		// Clipboard grabbed by the server or another client
+		// kMsgCClipboard = "CCLP%1i%4i"
+		pthread_mutex_lock(&context->m_clipboardMutex);
+		context->m_clipboardOwned = USYNERGY_FALSE;
+		context->m_clipboardDirty = USYNERGY_FALSE;
+		pthread_mutex_unlock(&context->m_clipboardMutex);
+		return;
+
+	} else if (USYNERGY_IS_PACKET("DCLP") && !sServerChunksClipboard(context)) {
+		/* Clipboard message, protocol 1.5 and before
 		 * kMsgDClipboard = "DCLP%1i%4i%s"
 
+		 * The whole marshalled clipboard in one message, after the clipboard
+		 * index and the sequence number.
+		 */
+		uint32_t size = sNetToNative32(message+13);
+		if (size > length - 17) {
+			sTrace(context, "Truncated clipboard message");
+			return;
+		}
+		if (sStartClipboardTransfer(context, size)) {
+			sReceiveClipboardChunk(context, USYNERGY_CLIPBOARD_MARK_CHUNK,
+				message+17, size);
+			sReceiveClipboardChunk(context, USYNERGY_CLIPBOARD_MARK_END,
+				NULL, 0);
+		}
+
+	} else if (USYNERGY_IS_PACKET("DCLP")) {
+		/* Clipboard message, protocol 1.6
+		 * kMsgDClipboard = "DCLP%1i%4i%1i%s"
+
 		 * The clipboard message contains:
 		 *	1 uint32:	The size of the message
 		 *	4 chars: 	The identifier ("DCLP")
 		 *	1 uint8: 	The clipboard index
 		 *	1 uint32:	The sequence number. It's zero, because this message is
 		 *              always coming from the server?
-		 *	1 uint32:	The total size of the remaining 'string' (as per the
-		 *				Synergy %s string format (which is 1 uint32 for size 
-		 *				followed by a char buffer (not necessarily null terminated)).
-		 *	1 uint32:	The number of formats present in the message
-		 * And then 'number of formats' times the following:
-		 *	1 uint32:	The format of the clipboard data
-		 *	1 uint32:	The size n of the clipboard data
-		 *	n uint8:	The clipboard data
+		 *	1 uint8:	The chunk mark (start, chunk or end)
+		 *	1 uint32:	The size n of the chunk data
+		 *	n uint8:	The chunk data
 		 */
-		const uint8_t *	parse_msg	= message+17;
-		uint32_t		num_formats = sNetToNative32(parse_msg);
-		parse_msg += 4;
-		for (; num_formats; num_formats--) {
-			// Parse clipboard format header
-			uint32_t format	= sNetToNative32(parse_msg);
-			uint32_t size	= sNetToNative32(parse_msg+4);
-			parse_msg += 8;
-
-			// Call callback
-			if (context->m_clipboardCallback)
-				context->m_clipboardCallback(context->m_cookie, format,
-					parse_msg, size);
-
-			parse_msg += size;
+		uint32_t size;
+		if (length < 18) {
+			sTrace(context, "Truncated clipboard message");
+			return;
+		}
+		size = sNetToNative32(message+14);
+		if (size > length - 18) {
+			sTrace(context, "Truncated clipboard message");
+			return;
 		}
+		sReceiveClipboardChunk(context, message[13], message+18, size);
+
 	} else if (USYNERGY_IS_PACKET("EUNK") || USYNERGY_IS_PACKET("EBAD")) {
 		/* kMsgEUnknown = "EUNK" kMsgEBad = "EBAD" */
-		char buffer[64];
-		sprintf(buffer, "Unknow client, please add a client \"%s\" on your \
-			synergy server.\n", context->m_clientName);
+		char buffer[256+64];
+		snprintf(buffer, sizeof(buffer), "Unknown client, please add a client "
+			"\"%s\" on your synergy server.", context->m_clientName);
 		sTrace(context, buffer);
-		sSetDisconnected(context);
+		sHangUp(context);
 		return;
 	} else {
 		/* Unknown packet, could be any of these
 		 *		kMsgCNoop 			= "CNOP"
 		 *		kMsgCClose 			= "CBYE"
-		 *		kMsgCClipboard 		= "CCLP%1i%4i"
 		 *		kMsgCScreenSaver 	= "CSEC%1i"
 		 *		kMsgDKeyRepeat		= "DKRP%2i%2i%2i%2i"
 		 *		kMsgDKeyRepeat1_0	= "DKRP%2i%2i%2i"
 		 *		kMsgDMouseRelMove	= "DMRM%2i%2i"
 		 *		kMsgEIncompatible	= "EICV%2i%2i"
 		 *		kMsgEBusy 			= "EBSY"
+
+		 * The trace ring has its id, nothing is formatted here.
 		 */
-		char buffer[64];
-		sprintf(buffer, "Unknown packet '%c%c%c%c'", message[4], message[5],
-			message[6], message[7]);
-		LOGI("Unknown packet '%c%c%c%c'\n", message[4], message[5],
-			message[6], message[7]);
-		sTrace(context, buffer);
+		uSynergyCount(&context->m_counters.m_unknownMessages, 1);
 		return;
 	}
 
@@ -500,66 +1392,380 @@ static void sProcessMessage(uSynergyContext *context, const uint8_t *message)
 }
 #undef USYNERGY_IS_PACKET
 
-void *sRecvData(void *arg)
+//-----------------------------------------------------------------------------
+//	Latency
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Latency state of a context
+ */
+typedef struct uSynergyLatency {
+	/* Messages dispatched since the last flush, dispatch thread only */
+	struct {
+		uint64_t received;
+		uint64_t started;
+		int type;
+	} pending[USYNERGY_LATENCY_BATCH];
+	int numPending;
+
+	/* Guarded by m_statsMutex */
+	uSynergyLatencyStats stats;
+} uSynergyLatency;
+
+/*
+ * @brief When the message being dispatched was received, now outside of
+ * sDispatch()
+ */
+static uint64_t sDispatchReceived(uSynergyContext *context)
 {
-	/* Receive data (blocking) */
-	int receive_size;
-	int num_received = 0;
-	uint8_t *packhead = NULL;
-	uint8_t netRecvBuffer[USYNERGY_NETRECV_BUFFER_SIZE];
-	int packlen, recvSumLen, netrecvOfs = 0;
-	uSynergyContext *context = arg;
+	uSynergyLatency *latency = context->m_latency;
 
-	while (context->m_connected) {
-		receive_size = USYNERGY_NETRECV_BUFFER_SIZE - netrecvOfs;
-		memset(netRecvBuffer + netrecvOfs, 0, receive_size);
-
-		if (context->m_receiveFunc(context->m_cookie, netRecvBuffer + netrecvOfs,
-			receive_size, &num_received) == USYNERGY_FALSE) {
-			/* Receive failed, let's try to reconnect */
-			char buffer[128];
-			sprintf(buffer, "Receive failed (%d bytes asked, %d bytes received), \
-				trying to reconnect in a second", receive_size, num_received);
-			sTrace(context, buffer);
-			sSetDisconnected(context);
-			sem_post(&context->reciveOfsSem);
-			context->m_sleepFunc(context->m_cookie, 100);
-			return;
-		}
+	if (latency->numPending == 0)
+		return sNowNs();
+	return latency->pending[latency->numPending - 1].received;
+}
 
-		pthread_mutex_lock(&context->m_receiveMutex);
-		packhead = netRecvBuffer;
-		packlen = sNetToNative32(packhead);
-		recvSumLen = packlen + 4;
-
-		while (1) {
-//LOGI("packlen::%d %c%c%c%c\n", packlen, *(packhead+4), *(packhead+5), *(packhead+6), *(packhead+7));
-			if (recvSumLen < num_received + netrecvOfs) {
-				memcpy(context->m_receiveBuffer + context->m_receiveOfs,
-					packhead, packlen + 4);
-				context->m_receiveOfs += (packlen + 4);
-				sem_post(&context->reciveOfsSem);
-
-				packhead = packhead + packlen + 4;
-				packlen = sNetToNative32(packhead);
-				recvSumLen = recvSumLen + packlen + 4;
-			} else if (recvSumLen > num_received + netrecvOfs) {
-				/* Incomplete package */
-				netrecvOfs = (packlen + 4) - (recvSumLen - num_received);
-				if (packhead != netRecvBuffer)
-					memmove(netRecvBuffer, packhead, netrecvOfs);
-				break;
-			} else {
-				memcpy(context->m_receiveBuffer + context->m_receiveOfs,
-					packhead, packlen + 4);
-				context->m_receiveOfs += (packlen + 4);
-				sem_post(&context->reciveOfsSem);
-				netrecvOfs = 0;
-				break;
+/*
+ * @brief Class of a message for the latency histograms
+ */
+static int sLatencyType(const uint8_t *message)
+{
+	const uint8_t *id = message + 4;
+
+	if (id[0] == 'D' && id[1] == 'M') {
+		if (id[2] == 'M' && id[3] == 'V')
+			return USYNERGY_LATENCY_MOUSE_MOVE;
+		if (id[2] == 'W' && id[3] == 'M')
+			return USYNERGY_LATENCY_MOUSE_WHEEL;
+		if ((id[2] == 'D' && id[3] == 'N') || (id[2] == 'U' && id[3] == 'P'))
+			return USYNERGY_LATENCY_MOUSE_BUTTON;
+	} else if (id[0] == 'D' && id[1] == 'K') {
+		return USYNERGY_LATENCY_KEY;
+	} else if (memcmp(id, "DCLP", 4) == 0) {
+		return USYNERGY_LATENCY_CLIPBOARD;
+	} else if (memcmp(id, "CALV", 4) == 0) {
+		return USYNERGY_LATENCY_KEEPALIVE;
+	}
+	return USYNERGY_LATENCY_OTHER;
+}
+
+/*
+ * @brief Flush replies and device writes of the dispatch thread
+
+ * Completes the latency of every message dispatched since the last flush.
+ * Threads sending the clipboard flush with sFlush().
+ */
+static uSynergyBool sFlushInput(uSynergyContext *context)
+{
+	uSynergyLatency *latency = context->m_latency;
+	uSynergyBool ret = sFlush(context);
+	uint64_t injected;
+	int i;
+
+	if (latency->numPending == 0)
+		return ret;
+	injected = sNowNs();
+	pthread_mutex_lock(&context->m_statsMutex);
+	for (i = 0; i < latency->numPending; i++) {
+		uSynergyHistogram *histograms =
+			latency->stats.m_histograms[latency->pending[i].type];
+		uint64_t received = latency->pending[i].received;
+		uint64_t started = latency->pending[i].started;
+
+		uSynergyHistogramRecord(&histograms[USYNERGY_LATENCY_QUEUE],
+			started - received);
+		uSynergyHistogramRecord(&histograms[USYNERGY_LATENCY_PROCESS],
+			injected - started);
+		uSynergyHistogramRecord(&histograms[USYNERGY_LATENCY_TOTAL],
+			injected - received);
+	}
+	pthread_mutex_unlock(&context->m_statsMutex);
+
+	/* Moves, buttons, wheel and keys are the classes below the clipboard */
+	if (context->m_startup.m_phases[USYNERGY_STARTUP_FIRST_EVENT] == 0) {
+		for (i = 0; i < latency->numPending; i++) {
+			if (latency->pending[i].type < USYNERGY_LATENCY_CLIPBOARD) {
+				__atomic_store_n(
+					&context->m_startup.m_phases[USYNERGY_STARTUP_FIRST_EVENT],
+					injected, __ATOMIC_RELAXED);
+				break;
 			}
 		}
+	}
+	latency->numPending = 0;
+	return ret;
+}
+
+/*
+ * @brief Dispatch a message received at @a received
+
+ * Flushes once USYNERGY_LATENCY_BATCH messages wait for it, so a long
+ * burst does not hold back device writes until its end.
+ */
+static void sDispatch(uSynergyContext *context, const uint8_t *message,
+	uint32_t length, uint64_t received)
+{
+	uSynergyLatency *latency = context->m_latency;
+	int n = latency->numPending;
+
+	/* A frame too short for its type would be read past its end */
+	if (length < sMinMessageLength(message)) {
+		uSynergyCount(&context->m_counters.m_skippedMessages, 1);
+		sTraceEvent(context, USYNERGY_TRACE_SKIPPED, sNowNs(), message + 4,
+			length, NULL, 0, 0);
+		return;
+	}
+
+	/* Input waits for the devices, other messages pick them up once ready */
+	if (!context->m_devicesAttached && (sNeedsDevices(message)
+		|| __atomic_load_n(&context->m_deviceResult, __ATOMIC_ACQUIRE) != 0)
+		&& !sAttachDevices(context)) {
+		sTraceState(context, USYNERGY_TRACE_CONNECT, 0, -2);
+		sTrace(context, "Input devices did not come up");
+		sHangUp(context);
+		return;
+	}
+
+	latency->pending[n].received = received;
+	latency->pending[n].started = sNowNs();
+	latency->pending[n].type = sLatencyType(message);
+	latency->numPending = n + 1;
+	uSynergyCount(&context->m_counters.m_messages[latency->pending[n].type], 1);
+	/* Moves, buttons, wheel and keys hold off round trip probes */
+	if (latency->pending[n].type < USYNERGY_LATENCY_CLIPBOARD)
+		context->m_rttLastInput = received;
+
+	context->m_callbackResult = 0;
+	sProcessMessage(context, message, length);
+	sTraceEvent(context, USYNERGY_TRACE_MESSAGE, latency->pending[n].started,
+		message + 4, length, message + 8, length - 8,
+		context->m_callbackResult);
+
+	if (latency->numPending == USYNERGY_LATENCY_BATCH
+		&& !sFlushInput(context))
+		sTrace(context, "Flushing replies failed");
+}
+
+/*
+ * @brief Hand a complete frame to the dispatcher
+
+ * Frames are copied into the receive queue, waiting for the dispatcher to
+ * drain it if there is no room. A NULL @a frame queues a zero length record,
+ * which stands for the message held in the sink buffer.
+ */
+static uSynergyBool sQueueFrame(uSynergyContext *context,
+	const uint8_t *frame, uint32_t length)
+{
+	uint32_t need = frame != NULL ? length : 4;
+
+	pthread_mutex_lock(&context->m_receiveMutex);
+	while (context->m_connected &&
+		context->m_receiveOfs + need > context->m_sizes.m_receiveSize)
+		pthread_cond_wait(&context->m_receiveCond, &context->m_receiveMutex);
+
+	if (!context->m_connected) {
+		pthread_mutex_unlock(&context->m_receiveMutex);
+		return USYNERGY_FALSE;
+	}
+
+	if (frame != NULL)
+		memcpy(context->m_receiveBuffer + context->m_receiveOfs, frame, length);
+	else
+		memset(context->m_receiveBuffer + context->m_receiveOfs, 0, 4);
+	context->m_receiveOfs += need;
+	context->m_frameStamps[context->m_frameStampWrite++
+		& context->m_frameStampMask] = context->m_readStamp;
+	pthread_mutex_unlock(&context->m_receiveMutex);
+
+	sem_post(&context->reciveOfsSem);
+	return USYNERGY_TRUE;
+}
+
+/*
+ * @brief Pass a complete frame on
+
+ * Threaded, it goes to the receive queue. Polled, it is dispatched right
+ * away on the caller's thread, straight from the read buffer when it came
+ * in whole; input that is not parsed yet takes the place of the queue.
+ */
+static uSynergyBool sDeliverFrame(uSynergyContext *context,
+	const uint8_t *frame, uint32_t length)
+{
+	if (!context->m_pollMode)
+		return sQueueFrame(context, frame, length);
+
+	context->m_processBudget--;
+	if (frame != NULL)
+		sDispatch(context, frame, length, context->m_readStamp);
+	else
+		sDispatch(context, context->m_sinkBuffer,
+			(uint32_t)sNetToNative32(context->m_sinkBuffer) + 4,
+			context->m_readStamp);
+	return context->m_connected;
+}
+
+/*
+ * @brief Pick a destination for the frame whose header was just completed
+
+ * Frames that fit the receive queue are assembled in the staging buffer,
+ * larger ones in the separately allocated sink so they never touch the hot
+ * buffers. Frames that are malformed or exceed m_maxMessageSize are skipped.
+ */
+static uSynergyBool sBeginFrame(uSynergyContext *context)
+{
+	uint32_t packlen = (uint32_t)sNetToNative32(context->m_frameHeader);
+
+	context->m_frameLength = packlen;
+	context->m_frameOfs = 0;
+	context->m_frameBuffer = NULL;
+
+	if (packlen < 4 || packlen > context->m_maxMessageSize) {
+		uSynergyCount(&context->m_counters.m_skippedMessages, 1);
+		sTraceState(context, USYNERGY_TRACE_SKIPPED, packlen, 0);
+		sTrace(context, "Skipping malformed or oversized message");
+	} else if (packlen + 4 <= context->m_sizes.m_receiveSize) {
+		context->m_frameBuffer = context->m_frameStage;
+	} else {
+		/* Wait for the dispatcher to finish with the previous large message */
+		pthread_mutex_lock(&context->m_receiveMutex);
+		while (context->m_connected && context->m_sinkBusy)
+			pthread_cond_wait(&context->m_receiveCond,
+				&context->m_receiveMutex);
 		pthread_mutex_unlock(&context->m_receiveMutex);
+		if (!context->m_connected)
+			return USYNERGY_FALSE;
+
+		if (context->m_sinkCapacity < packlen + 4) {
+			/* Outgrew the arena part, the heap takes over for this connection */
+			uint8_t *sink = realloc(context->m_sinkHeap, packlen + 4);
+			if (sink != NULL) {
+				context->m_sinkHeap = context->m_sinkBuffer = sink;
+				context->m_sinkCapacity = packlen + 4;
+			}
+		}
+		if (context->m_sinkCapacity >= packlen + 4)
+			context->m_frameBuffer = context->m_sinkBuffer;
+		else
+			sTrace(context, "Out of memory, skipping large message");
+	}
+
+	if (context->m_frameBuffer != NULL)
+		memcpy(context->m_frameBuffer, context->m_frameHeader, 4);
+	if (packlen == 0)
+		context->m_frameHeaderLen = 0;
+	return USYNERGY_TRUE;
+}
+
+/*
+ * @brief Queue the frame that was just completed and reset the parser
+ */
+static uSynergyBool sEndFrame(uSynergyContext *context)
+{
+	uSynergyBool ret = USYNERGY_TRUE;
+
+	if (context->m_frameBuffer == context->m_frameStage) {
+		ret = sDeliverFrame(context, context->m_frameStage,
+			context->m_frameLength + 4);
+	} else if (context->m_frameBuffer != NULL) {
+		if (!context->m_pollMode) {
+			pthread_mutex_lock(&context->m_receiveMutex);
+			context->m_sinkBusy = USYNERGY_TRUE;
+			pthread_mutex_unlock(&context->m_receiveMutex);
+		}
+		ret = sDeliverFrame(context, NULL, 0);
+	}
+
+	context->m_frameHeaderLen = 0;
+	context->m_frameBuffer = NULL;
+	return ret;
+}
+
+/*
+ * @brief Feed received bytes to the frame parser
+
+ * Frames may be split anywhere, including inside the length header. Frames
+ * that arrive whole in one read are queued straight from @a data. Polled,
+ * parsing stops once the budget of uSynergyProcess() is spent.
+
+ * @returns Number of bytes consumed, -1 on disconnect
+ */
+static int sParseStream(uSynergyContext *context,
+	const uint8_t *data, int length)
+{
+	const int total = length;
+
+	while (length > 0
+		&& (!context->m_pollMode || context->m_processBudget > 0)) {
+		if (context->m_frameHeaderLen < 4) {
+			if (context->m_frameHeaderLen == 0 && length >= 4) {
+				uint32_t packlen = (uint32_t)sNetToNative32(data);
+				if (packlen >= 4 && packlen <= context->m_maxMessageSize &&
+					packlen + 4 <= (uint32_t)length &&
+					packlen + 4 <= context->m_sizes.m_receiveSize) {
+					if (!sDeliverFrame(context, data, packlen + 4))
+						return -1;
+					data += packlen + 4;
+					length -= packlen + 4;
+					continue;
+				}
+			}
+
+			context->m_frameHeader[context->m_frameHeaderLen++] = *data++;
+			length--;
+			if (context->m_frameHeaderLen == 4 && !sBeginFrame(context))
+				return -1;
+		} else {
+			uint32_t n = context->m_frameLength - context->m_frameOfs;
+			if (n > (uint32_t)length)
+				n = length;
+			if (context->m_frameBuffer != NULL)
+				memcpy(context->m_frameBuffer + 4 + context->m_frameOfs,
+					data, n);
+			context->m_frameOfs += n;
+			data += n;
+			length -= n;
+
+			if (context->m_frameOfs == context->m_frameLength &&
+				!sEndFrame(context))
+				return -1;
+		}
+	}
+	return total - length;
+}
+
+void *sRecvData(void *arg)
+{
+	/* Receive data (blocking) */
+	int num_received = 0;
+	uSynergyContext *context = arg;
+	uint8_t *netRecvBuffer = context->m_readBuffer;
+
+	uSynergyApplyThreadConfig(context, &context->m_receiveThreadConfig);
+
+	while (context->m_connected) {
+		if (context->m_transport->m_receiveFunc(context->m_cookie,
+			netRecvBuffer, (int)context->m_sizes.m_readSize,
+			&num_received) == USYNERGY_FALSE) {
+			/* Receive failed, or the socket was shut down to stop us */
+			context->m_connected = USYNERGY_FALSE;
+			if (!context->m_stopRequested) {
+				sTraceState(context, USYNERGY_TRACE_RECEIVE_FAILED, 0, 0);
+				sTrace(context, "Receive failed, trying to reconnect in a second");
+				context->m_sleepFunc(context->m_cookie, 100);
+			}
+			break;
+		}
+
+		context->m_readStamp = sNowNs();
+		uSynergyCount(&context->m_counters.m_reads, 1);
+		uSynergyCount(&context->m_counters.m_bytesReceived, num_received);
+		if (sParseStream(context, netRecvBuffer, num_received) < 0)
+			break;
 	}
+
+	/* Wake the dispatcher so it notices the disconnect */
+	sem_post(&context->reciveOfsSem);
+	return NULL;
 }
 
 /*
@@ -567,107 +1773,588 @@ void *sRecvData(void *arg)
  */
 static void sUpdateContext(uSynergyContext *context)
 {
-	int packlen = 0;
-	int ret;
+	uint32_t packlen = 0;
+	int pending;
+	const uint8_t *message;
+	uint64_t received;
 	pthread_t receiveThread;
 
-	if (pthread_create(&receiveThread, NULL, sRecvData, (void *)context))
-		goto pthread_err;
+	/* Forget wakeups left over from the previous session */
+	while (sem_trywait(&context->reciveOfsSem) == 0)
+		;
 
-	if (sem_init(&context->reciveOfsSem, 0, 0))
-		goto semaphore_err;
+	if (pthread_create(&receiveThread, NULL, sRecvData, (void *)context)) {
+		perror("thread create error");
+		return;
+	}
 
 	/* Eat packets */
-	while (context->m_connected) {
+	while (context->m_connected && !context->m_stopRequested) {
 		sem_wait(&context->reciveOfsSem);
-		packlen = sNetToNative32(context->m_receiveBuffer);
-//		if (packlen+4 <= context->m_receiveOfs) {
-		if (packlen > 0) {
-//printf("%c%c%c%c offset:%d packlen:%d\n", context->m_receiveBuffer[4],
-//context->m_receiveBuffer[5], context->m_receiveBuffer[6],
-//context->m_receiveBuffer[7], context->m_receiveOfs,packlen);
-//			LOGI("%c%c%c%c offset:%d packlen:%d\n", context->m_receiveBuffer[4],
-//				context->m_receiveBuffer[5], context->m_receiveBuffer[6],
-//				context->m_receiveBuffer[7], context->m_receiveOfs,packlen);
-
-			/* Process message */
-			sProcessMessage(context, context->m_receiveBuffer);
 
-			pthread_mutex_lock(&context->m_receiveMutex);
-			/* Move packet to front of buffer */
-			packlen = sNetToNative32(context->m_receiveBuffer);
-			memmove(context->m_receiveBuffer, context->m_receiveBuffer +
-				packlen + 4, context->m_receiveOfs - packlen - 4);
-			context->m_receiveOfs -= packlen+4;
-
-			memset(context->m_receiveBuffer + context->m_receiveOfs, 0,
-				USYNERGY_RECEIVE_BUFFER_SIZE - context->m_receiveOfs);
+		pthread_mutex_lock(&context->m_receiveMutex);
+		if (context->m_receiveReadOfs == context->m_receiveOfs) {
+			/* Woken up without a message, e.g. on disconnect */
 			pthread_mutex_unlock(&context->m_receiveMutex);
+			continue;
 		}
-//		else if (context->m_hasReceivedHello) {
-			/* Check for timeouts */
-//			uint32_t cur_time = context->m_getTimeFunc();
-			/* Timeout after 2 secs of inactivity (we received no CALV) */
-//			if ((cur_time - context->m_lastMessageTime) > USYNERGY_IDLE_TIMEOUT)
-//				sSetDisconnected(context);
-//		}
+		message = context->m_receiveBuffer + context->m_receiveReadOfs;
+		packlen = (uint32_t)sNetToNative32(message);
+		received = context->m_frameStamps[context->m_frameStampRead++
+			& context->m_frameStampMask];
+		pthread_mutex_unlock(&context->m_receiveMutex);
+
+		/* Process message, a zero length record refers to the sink */
+		if (packlen == 0)
+			sDispatch(context, context->m_sinkBuffer,
+				(uint32_t)sNetToNative32(context->m_sinkBuffer) + 4, received);
+		else
+			sDispatch(context, message, packlen + 4, received);
+
+		pthread_mutex_lock(&context->m_receiveMutex);
+		context->m_receiveReadOfs += packlen + 4;
+		if (packlen == 0)
+			context->m_sinkBusy = USYNERGY_FALSE;
+		/* Queue drained, start over at the front */
+		if (context->m_receiveReadOfs == context->m_receiveOfs)
+			context->m_receiveReadOfs = context->m_receiveOfs = 0;
+		pthread_cond_broadcast(&context->m_receiveCond);
+		pthread_mutex_unlock(&context->m_receiveMutex);
+
+		/* Burst drained, issue its replies and device writes together */
+		if (sem_getvalue(&context->reciveOfsSem, &pending) == 0 && pending <= 0
+			&& !sFlushInput(context))
+			sTrace(context, "Flushing replies failed");
 	}
-	pthread_join(receiveThread, NULL);
-	return;
 
-semaphore_err:
-	sem_destroy(&context->reciveOfsSem);
-pthread_err:
-	perror("thread create error");
+	/*
+	 * Release the receive thread, whether it waits for queue space or sits
+	 * in the socket. A stop that came in while connecting could not shut the
+	 * socket down yet, so do it here.
+	 */
+	pthread_mutex_lock(&context->m_receiveMutex);
+	context->m_connected = USYNERGY_FALSE;
+	pthread_cond_broadcast(&context->m_receiveCond);
+	pthread_mutex_unlock(&context->m_receiveMutex);
+	if (context->m_transport->m_shutdownFunc != NULL)
+		context->m_transport->m_shutdownFunc(context->m_cookie);
+	pthread_join(receiveThread, NULL);
 }
 
 //-----------------------------------------------------------------------------
 //	Public interface
 //-----------------------------------------------------------------------------
 
+/* The hot state must not spill into the next cache line */
+typedef char sHotStateFitsCacheLine[(offsetof(uSynergyContext, m_receiveBuffer)
+	- offsetof(uSynergyContext, m_connected) <= USYNERGY_CACHE_LINE) ? 1 : -1];
+
+/* The key table is shared by all contexts */
+static pthread_once_t sKeyTranslationOnce = PTHREAD_ONCE_INIT;
+
 /*
  * @brief Initialize uSynergy context
  */
 void uSynergyInit(uSynergyContext *context, char *ClientName,
 	int width, int height)
 {
-	char *tempStr;
-	/* Zero memory */
-	CookieType *cookie;
-	cookie = malloc(sizeof(CookieType));
-	memset(cookie, 0, sizeof(CookieType));
+	uSynergyBufferSizes *sizes = &context->m_sizes;
+	CookieType *cookie = NULL;
+	char *name = NULL;
+	uint8_t *buffers = NULL;
+	size_t receive, reply, read, stamps, latency, trace, total;
+	uint32_t numStamps = 1, numRecords = 64;
+	pthread_mutexattr_t attr;
+
+	if (sizes->m_receiveSize == 0)
+		sizes->m_receiveSize = USYNERGY_RECEIVE_BUFFER_SIZE;
+	if (sizes->m_replySize == 0)
+		sizes->m_replySize = USYNERGY_REPLY_BUFFER_SIZE;
+	if (sizes->m_readSize == 0)
+		sizes->m_readSize = USYNERGY_NETRECV_BUFFER_SIZE;
+	if (sizes->m_arenaSize == 0)
+		sizes->m_arenaSize = USYNERGY_ARENA_SIZE;
+	if (sizes->m_traceRecords == 0)
+		sizes->m_traceRecords = USYNERGY_TRACE_RECORDS;
+	if (sizes->m_receiveSize < USYNERGY_MIN_BUFFER_SIZE)
+		sizes->m_receiveSize = USYNERGY_MIN_BUFFER_SIZE;
+	if (sizes->m_readSize < USYNERGY_MIN_BUFFER_SIZE)
+		sizes->m_readSize = USYNERGY_MIN_BUFFER_SIZE;
+	/* The hello reply carries the client name */
+	if (sizes->m_replySize < USYNERGY_MIN_BUFFER_SIZE + strlen(ClientName))
+		sizes->m_replySize = USYNERGY_MIN_BUFFER_SIZE + strlen(ClientName);
+
+	/* Each buffer starts on a cache line */
+	receive = USYNERGY_ALIGN(sizes->m_receiveSize, USYNERGY_CACHE_LINE);
+	reply = USYNERGY_ALIGN(sizes->m_replySize, USYNERGY_CACHE_LINE);
+	read = USYNERGY_ALIGN(sizes->m_readSize, USYNERGY_CACHE_LINE);
+	/* A queue record takes at least 4 bytes, so does its stamp slot */
+	while (numStamps <= sizes->m_receiveSize / 4)
+		numStamps <<= 1;
+	stamps = USYNERGY_ALIGN(numStamps * sizeof(uint64_t),
+		USYNERGY_ARENA_ALIGN);
+	latency = USYNERGY_ALIGN(sizeof(uSynergyLatency), USYNERGY_ARENA_ALIGN);
+	while (numRecords < sizes->m_traceRecords && numRecords < (1u << 24))
+		numRecords <<= 1;
+	sizes->m_traceRecords = numRecords;
+	trace = USYNERGY_ALIGN(numRecords * sizeof(uSynergyTraceRecord),
+		USYNERGY_ARENA_ALIGN);
+	total = USYNERGY_ALIGN(sizeof(CookieType), USYNERGY_ARENA_ALIGN)
+		+ USYNERGY_ALIGN(strlen(ClientName) + 1, USYNERGY_ARENA_ALIGN)
+		+ 2 * receive + reply + read + stamps + latency + trace
+		+ sizes->m_arenaSize;
+
+	/* Everything the context needs comes out of one allocation */
+	context->m_arena = uSynergyArenaCreate(total);
+	if (context->m_arena != NULL) {
+		buffers = uSynergyArenaAlloc(context->m_arena,
+			2 * receive + reply + read);
+		cookie = uSynergyArenaAlloc(context->m_arena, sizeof(CookieType));
+		name = uSynergyArenaStrdup(context->m_arena, ClientName);
+		context->m_frameStamps = uSynergyArenaAlloc(context->m_arena,
+			numStamps * sizeof(uint64_t));
+		context->m_latency = uSynergyArenaAlloc(context->m_arena,
+			sizeof(uSynergyLatency));
+		context->m_traceRecords = uSynergyArenaAlloc(context->m_arena,
+			numRecords * sizeof(uSynergyTraceRecord));
+	}
+	if (buffers == NULL || cookie == NULL || name == NULL
+		|| context->m_frameStamps == NULL || context->m_latency == NULL
+		|| context->m_traceRecords == NULL) {
+		uSynergyArenaDestroy(context->m_arena);
+		context->m_arena = NULL;
+		context->m_cookie = NULL;
+		return;
+	}
+	context->m_receiveBuffer = buffers;
+	context->m_frameStage = buffers + receive;
+	context->m_replyBuffer = buffers + 2 * receive;
+	context->m_readBuffer = buffers + 2 * receive + reply;
+	context->m_frameStampMask = numStamps - 1;
+	context->m_traceMask = numRecords - 1;
+
+	cookie->sockfd = -1;
+	cookie->peer_sockfd = -1;
+	cookie->uinput_keyboard = -1;
+	cookie->uinput_mouse = -1;
+	cookie->uinput_joystick = -1;
+	cookie->arena = context->m_arena;
+	cookie->counters = &context->m_counters;
 	context->m_cookie = cookie;
 
 	/* Initialize to default state */
-	tempStr = malloc(strlen(ClientName) + 1);
-	context->m_clientName = strcpy(tempStr, ClientName);
+	context->m_clientName = name;
+	context->m_arenaConnection = uSynergyArenaMark(context->m_arena);
 
 	context->m_clientWidth	= width;
 	context->m_clientHeight	= height;
+	context->m_maxMessageSize = USYNERGY_MAX_MESSAGE_SIZE;
+	context->m_clipboardMaxSize = USYNERGY_CLIPBOARD_MAX_SIZE;
+	context->m_rttProbeInterval = USYNERGY_RTT_PROBE_INTERVAL;
+	context->m_receiveThreadConfig.m_name = "usynergy-recv";
+	context->m_dispatchThreadConfig.m_name = "usynergy-disp";
+	pthread_mutex_init(&context->m_sendMutex, NULL);
+	pthread_mutex_init(&context->m_clipboardMutex, NULL);
+	pthread_mutex_init(&context->m_stateMutex, NULL);
+	pthread_cond_init(&context->m_stateCond, NULL);
+	pthread_mutex_init(&context->m_statsMutex, NULL);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&context->m_receiveMutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_cond_init(&context->m_receiveCond, NULL);
+	sem_init(&context->reciveOfsSem, 0, 0);
 
 	sSetDisconnected(context);
-	build_key_translation_table();
+	pthread_once(&sKeyTranslationOnce, build_key_translation_table);
 }
 
 /*
- * @brief Update uSynergy
+ * @brief Create a context from a platform template
  */
-void uSynergyUpdate(uSynergyContext *context)
+uSynergyContext *uSynergyCreate(const uSynergyContext *platform,
+	const char *clientName, int width, int height,
+	const uSynergyBufferSizes *sizes)
+{
+	uSynergyContext *context;
+
+	/* calloc() only guarantees 16 bytes, the hot state and the counters
+	 * want their own cache lines. free() releases this as well */
+	if (posix_memalign((void **)&context, USYNERGY_CACHE_LINE,
+			sizeof(uSynergyContext)) != 0)
+		return NULL;
+	memset(context, 0, sizeof(uSynergyContext));
+	context->m_startup.m_created = sNowNs();
+
+	/* Configuration only, the template's state is never touched */
+	context->m_transport			= platform->m_transport;
+	context->m_connectDevice		= platform->m_connectDevice;
+	context->m_disconnectDevice		= platform->m_disconnectDevice;
+	context->m_attachDevice			= platform->m_attachDevice;
+	context->m_sleepFunc			= platform->m_sleepFunc;
+	context->m_getTimeFunc			= platform->m_getTimeFunc;
+	context->m_traceFunc			= platform->m_traceFunc;
+	context->m_traceDumpFunc		= platform->m_traceDumpFunc;
+	context->m_screenActiveCallback	= platform->m_screenActiveCallback;
+	context->m_mouseMoveCallback	= platform->m_mouseMoveCallback;
+	context->m_mouseUpCallback		= platform->m_mouseUpCallback;
+	context->m_mouseDownCallback	= platform->m_mouseDownCallback;
+	context->m_mouseWheelCallback	= platform->m_mouseWheelCallback;
+	context->m_keyboardCallback		= platform->m_keyboardCallback;
+	context->m_joystickCallback		= platform->m_joystickCallback;
+	context->m_clipboardCallback	= platform->m_clipboardCallback;
+	if (sizes != NULL)
+		context->m_sizes			= *sizes;
+
+	uSynergyInit(context, (char *)clientName, width, height);
+	if (context->m_arena == NULL) {
+		free(context);
+		return NULL;
+	}
+	context->m_startup.m_initialized = sNowNs();
+	return context;
+}
+
+/*
+ * @brief Connect the transport, reset the session state
+
+ * The devices are on their way already, see sStartDevices().
+
+ * @returns USYNERGY_FALSE if the transport did not connect. If a stop came
+ * in meanwhile m_connected stays unset, sCloseSession() is still due.
+ */
+static uSynergyBool sOpenSession(uSynergyContext *context)
 {
+	/*
+	 * Drop what the previous connection took from the arena. The transport
+	 * still holds its engines there, but the connect below tears them down
+	 * before allocating anything new.
+	 */
+	uSynergyArenaRelease(context->m_arena, context->m_arenaConnection);
+	free(context->m_sinkHeap);
+	context->m_sinkHeap = NULL;
+	context->m_sinkBuffer = NULL;
+	context->m_sinkCapacity = 0;
+
 	/* Try to connect */
-	if (context->m_connectFunc(context->m_cookie) &&
-		context->m_connectDevice(context->m_cookie)) {
-			context->m_connected = USYNERGY_TRUE;
+	if (!context->m_transport->m_connectFunc(context->m_cookie)) {
+		uSynergyCount(&context->m_counters.m_connectFailures, 1);
+		sTraceState(context, USYNERGY_TRACE_CONNECT, 0, -1);
+		return USYNERGY_FALSE;
 	}
+	uSynergyCount(&context->m_counters.m_connects, 1);
+	sStartupPhase(context, USYNERGY_STARTUP_CONNECT);
+	sTraceState(context, USYNERGY_TRACE_CONNECT, 0, 0);
+
+	/* The devices may still be coming up, sDispatch() waits for them */
+	context->m_connected = USYNERGY_TRUE;
+	/* A stop during the connect may have missed the flag above */
+	__sync_synchronize();
+	if (context->m_stopRequested)
+		context->m_connected = USYNERGY_FALSE;
 
 	if (context->m_connected) {
-		/* Update context, receive data, call callbacks */
-		pthread_mutexattr_t attr;
-		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-		pthread_mutex_init(&context->m_receiveMutex, &attr);
+		/* Sink for clipboard chunks, reserved before any data arrives */
+		context->m_sinkBuffer = uSynergyArenaAlloc(context->m_arena,
+			USYNERGY_SINK_RESERVE);
+		if (context->m_sinkBuffer != NULL)
+			context->m_sinkCapacity = USYNERGY_SINK_RESERVE;
+
+		context->m_receiveOfs = 0;
+		context->m_receiveReadOfs = 0;
+		context->m_frameHeaderLen = 0;
+		context->m_frameBuffer = NULL;
+		context->m_sinkBusy = USYNERGY_FALSE;
+		context->m_frameStampWrite = 0;
+		context->m_frameStampRead = 0;
+		context->m_latency->numPending = 0;
+		context->m_lastMessageTime = context->m_getTimeFunc();
+		context->m_rttSent = 0;
+		context->m_rttLastProbe = 0;
+		context->m_rttLastInput = 0;
+	}
+	return USYNERGY_TRUE;
+}
+
+/*
+ * @brief Release the devices of a session
+ */
+static void sCloseSession(uSynergyContext *context)
+{
+	uint32_t end;
+
+	sSetDisconnected(context);
+	sJoinClipboardSender(context);
+	sReleaseDevices(context);
+
+	/* Hand the events of the session out while they are still fresh */
+	sTraceState(context, USYNERGY_TRACE_DISCONNECT,
+		context->m_stopRequested ? 1 : 0, 0);
+	end = __atomic_load_n(&context->m_traceWrite, __ATOMIC_ACQUIRE);
+	if (context->m_traceDumpFunc != NULL) {
+		uint32_t from = sTraceOldest(context, end);
+		if (end - context->m_traceDumped < end - from)
+			from = context->m_traceDumped;
+		sDumpTrace(context, from, end, context->m_traceDumpFunc);
+	}
+	context->m_traceDumped = end;
+}
+
+/*
+ * @brief Update uSynergy
+ */
+void uSynergyUpdate(uSynergyContext *context)
+{
+	if (!sOpenSession(context))
+		return;
+
+	/* Update context, receive data, call callbacks */
+	if (context->m_connected)
 		sUpdateContext(context);
-		pthread_mutex_destroy(&context->m_receiveMutex);
+
+	/* Both threads are done with the devices, release them here only */
+	sCloseSession(context);
+}
+
+/*
+ * @brief Send one DCLP chunk message
+
+ * The chunk is sent straight from @a data, only the header goes through a
+ * small local buffer, so the reply buffer used by the dispatch thread is not
+ * touched. The send mutex is held per chunk so replies to input events can
+ * go out between chunks.
+ */
+static uSynergyBool sSendClipboardChunk(uSynergyContext *context,
+	uint8_t mark, const uint8_t *data, uint32_t size)
+{
+	uint8_t header[4+4+1+4+1+4];
+	uint8_t *cur = header;
+	uint32_t body_len = sizeof(header) - 4 + size;
+	uSynergyBool ret;
+
+	*cur++ = (uint8_t)(body_len >> 24);
+	*cur++ = (uint8_t)(body_len >> 16);
+	*cur++ = (uint8_t)(body_len >> 8);
+	*cur++ = (uint8_t)body_len;
+	memcpy(cur, "DCLP", 4);
+	cur += 4;
+	/* Clipboard index */
+	*cur++ = 0;
+	*cur++ = (uint8_t)(context->m_sequenceNumber >> 24);
+	*cur++ = (uint8_t)(context->m_sequenceNumber >> 16);
+	*cur++ = (uint8_t)(context->m_sequenceNumber >> 8);
+	*cur++ = (uint8_t)context->m_sequenceNumber;
+	*cur++ = mark;
+	*cur++ = (uint8_t)(size >> 24);
+	*cur++ = (uint8_t)(size >> 16);
+	*cur++ = (uint8_t)(size >> 8);
+	*cur++ = (uint8_t)size;
+
+	pthread_mutex_lock(&context->m_sendMutex);
+	ret = sSend(context, header, sizeof(header));
+	if (ret && size > 0)
+		ret = sSend(context, data, size);
+	uSynergyCount(&context->m_counters.m_messagesSent, 1);
+	pthread_mutex_unlock(&context->m_sendMutex);
+	if (!ret)
+		sTraceEvent(context, USYNERGY_TRACE_SEND_FAILED, sNowNs(),
+			header + 4, sizeof(header) + size, NULL, 0, 0);
+	return ret;
+}
+
+/*
+ * @brief Send marshalled clipboard data in a single DCLP message, for
+ * servers before protocol 1.6
+ */
+static uSynergyBool sSendClipboardWhole(uSynergyContext *context,
+	const uint8_t *data, uint32_t size)
+{
+	// kMsgDClipboard = "DCLP%1i%4i%s"
+	uint8_t header[4+4+1+4+4];
+	uint8_t *cur = header;
+	uint32_t body_len = sizeof(header) - 4 + size;
+	uSynergyBool ret;
+
+	*cur++ = (uint8_t)(body_len >> 24);
+	*cur++ = (uint8_t)(body_len >> 16);
+	*cur++ = (uint8_t)(body_len >> 8);
+	*cur++ = (uint8_t)body_len;
+	memcpy(cur, "DCLP", 4);
+	cur += 4;
+	/* Clipboard index */
+	*cur++ = 0;
+	*cur++ = (uint8_t)(context->m_sequenceNumber >> 24);
+	*cur++ = (uint8_t)(context->m_sequenceNumber >> 16);
+	*cur++ = (uint8_t)(context->m_sequenceNumber >> 8);
+	*cur++ = (uint8_t)context->m_sequenceNumber;
+	*cur++ = (uint8_t)(size >> 24);
+	*cur++ = (uint8_t)(size >> 16);
+	*cur++ = (uint8_t)(size >> 8);
+	*cur++ = (uint8_t)size;
+
+	pthread_mutex_lock(&context->m_sendMutex);
+	ret = sSend(context, header, sizeof(header));
+	if (ret && size > 0)
+		ret = sSend(context, data, size);
+	uSynergyCount(&context->m_counters.m_messagesSent, 1);
+	pthread_mutex_unlock(&context->m_sendMutex);
+	if (!ret)
+		sTraceEvent(context, USYNERGY_TRACE_SEND_FAILED, sNowNs(),
+			header + 4, sizeof(header) + size, NULL, 0, 0);
+	return ret;
+}
+
+/*
+ * @brief Send marshalled clipboard data, as a chunked transfer if the
+ * server speaks protocol 1.6
+ */
+static uSynergyBool sSendClipboardData(uSynergyContext *context,
+	const uint8_t *data, uint32_t size)
+{
+	char digits[16];
+	uint32_t ofs, chunk;
+
+	if (!sServerChunksClipboard(context))
+		return sSendClipboardWhole(context, data, size);
+
+	snprintf(digits, sizeof(digits), "%u", size);
+	if (!sSendClipboardChunk(context, USYNERGY_CLIPBOARD_MARK_START,
+		(const uint8_t *)digits, (uint32_t)strlen(digits)))
+		return USYNERGY_FALSE;
+
+	for (ofs = 0; ofs < size; ofs += chunk) {
+		/* The session is closing, sCloseSession() waits for us */
+		if (!context->m_connected)
+			return USYNERGY_FALSE;
+		chunk = size - ofs;
+		if (chunk > USYNERGY_CLIPBOARD_CHUNK_SIZE)
+			chunk = USYNERGY_CLIPBOARD_CHUNK_SIZE;
+		if (!sSendClipboardChunk(context, USYNERGY_CLIPBOARD_MARK_CHUNK,
+			data + ofs, chunk))
+			return USYNERGY_FALSE;
 	}
+
+	return sSendClipboardChunk(context, USYNERGY_CLIPBOARD_MARK_END, NULL, 0);
+}
+
+/*
+ * @brief Send the local clipboard while we own it and it changed, on
+ * m_clipboardThread
+
+ * Each pass takes a reference to the current block and sends it without
+ * the clipboard mutex, so neither the dispatcher nor a caller replacing the
+ * clipboard waits for a transfer. A clipboard replaced meanwhile goes out
+ * in the next pass.
+ */
+static void *sSendLocalClipboard(void *arg)
+{
+	uSynergyContext *context = arg;
+
+	pthread_mutex_lock(&context->m_clipboardMutex);
+	while (context->m_clipboardOwned && context->m_clipboardDirty
+		&& context->m_connected) {
+		struct uSynergyClipboardBlock *block = context->m_clipboardLocal;
+		uint32_t size = context->m_clipboardLocalSize;
+		uSynergyBool sent;
+
+		__sync_add_and_fetch(&block->refs, 1);
+		context->m_clipboardDirty = USYNERGY_FALSE;
+		pthread_mutex_unlock(&context->m_clipboardMutex);
+
+		sent = sSendClipboardData(context, block->data, size);
+		pthread_mutex_lock(&context->m_sendMutex);
+		sent = sFlush(context) && sent;
+		pthread_mutex_unlock(&context->m_sendMutex);
+		if (sent) {
+			uSynergyCount(&context->m_counters.m_clipboardsSent, 1);
+			uSynergyCount(&context->m_counters.m_clipboardBytesSent, size);
+		} else {
+			sTrace(context, "Sending clipboard failed");
+		}
+
+		pthread_mutex_lock(&context->m_clipboardMutex);
+		sReleaseClipboardBlock(block);
+		if (!sent) {
+			/* Left for the next leave, unless it was replaced already */
+			if (context->m_clipboardLocal == block)
+				context->m_clipboardDirty = USYNERGY_TRUE;
+			break;
+		}
+	}
+	context->m_clipboardSending = USYNERGY_FALSE;
+	pthread_mutex_unlock(&context->m_clipboardMutex);
+	return NULL;
+}
+
+/*
+ * @brief Start sending the local clipboard if we own it and it changed,
+ * unless the sender is already running and picks it up
+ */
+static void sStartClipboardSender(uSynergyContext *context)
+{
+	pthread_mutex_lock(&context->m_clipboardMutex);
+	if (!context->m_clipboardOwned || !context->m_clipboardDirty
+		|| !context->m_connected || context->m_clipboardSending) {
+		pthread_mutex_unlock(&context->m_clipboardMutex);
+		return;
+	}
+	/* A previous sender is done, it no longer takes the mutex */
+	if (context->m_clipboardThreadJoinable) {
+		pthread_join(context->m_clipboardThread, NULL);
+		context->m_clipboardThreadJoinable = USYNERGY_FALSE;
+	}
+	context->m_clipboardSending = USYNERGY_TRUE;
+	if (pthread_create(&context->m_clipboardThread, NULL,
+		sSendLocalClipboard, context) == 0) {
+		context->m_clipboardThreadJoinable = USYNERGY_TRUE;
+		pthread_mutex_unlock(&context->m_clipboardMutex);
+		return;
+	}
+	pthread_mutex_unlock(&context->m_clipboardMutex);
+	sSendLocalClipboard(context);
+}
+
+/*
+ * @brief Wait for the clipboard sender, shutting the transport down if it
+ * is still in the middle of a transfer
+ */
+static void sJoinClipboardSender(uSynergyContext *context)
+{
+	uSynergyBool joinable;
+
+	pthread_mutex_lock(&context->m_clipboardMutex);
+	joinable = context->m_clipboardThreadJoinable;
+	context->m_clipboardThreadJoinable = USYNERGY_FALSE;
+	if (context->m_clipboardSending
+		&& context->m_transport->m_shutdownFunc != NULL)
+		context->m_transport->m_shutdownFunc(context->m_cookie);
+	pthread_mutex_unlock(&context->m_clipboardMutex);
+	if (joinable)
+		pthread_join(context->m_clipboardThread, NULL);
+}
+
+/*
+ * @brief Tell the server we grabbed the clipboard
+ */
+static uSynergyBool sSendClipboardGrab(uSynergyContext *context)
+{
+	// kMsgCClipboard = "CCLP%1i%4i"
+	uint8_t message[4+4+1+4] = { 0, 0, 0, 9, 'C', 'C', 'L', 'P', 0 };
+	uSynergyBool ret;
+
+	message[9]	= (uint8_t)(context->m_sequenceNumber >> 24);
+	message[10]	= (uint8_t)(context->m_sequenceNumber >> 16);
+	message[11]	= (uint8_t)(context->m_sequenceNumber >> 8);
+	message[12]	= (uint8_t)context->m_sequenceNumber;
+
+	pthread_mutex_lock(&context->m_sendMutex);
+	ret = sSend(context, message, sizeof(message));
+	uSynergyCount(&context->m_counters.m_messagesSent, 1);
+	pthread_mutex_unlock(&context->m_sendMutex);
+	if (!ret)
+		sTraceEvent(context, USYNERGY_TRACE_SEND_FAILED, sNowNs(),
+			message + 4, sizeof(message), NULL, 0, 0);
+	return ret;
 }
 
 /*
@@ -675,56 +2362,649 @@ void uSynergyUpdate(uSynergyContext *context)
  */
 void uSynergySendClipboard(uSynergyContext *context, const char *text)
 {
-	// Calculate maximum size that will fit in a reply packet
-	uint32_t overhead_size =	4 +	/* Message size */
-								4 +	/* Message ID */
-								1 +	/* Clipboard index */
-								4 +	/* Sequence number */
-								4 +	/* Rest of message size (because it's a
-									   Synergy string from here on) */
-								4 +	/* Number of clipboard formats */
-								4 +	/* Clipboard format */
-								4;	/* Clipboard data length */
-	uint32_t max_length = USYNERGY_REPLY_BUFFER_SIZE - overhead_size;
-
-	// Clip text to max length
-	uint32_t text_length = (uint32_t)strlen(text);
-	if (text_length > max_length) {
-		char buffer[128];
-		sprintf(buffer, "Clipboard buffer too small, clipboard truncated at %d \
-			characters", max_length);
-		sTrace(context, buffer);
-		text_length = max_length;
+	uSynergySendClipboardData(context, USYNERGY_CLIPBOARD_FORMAT_TEXT,
+		(const uint8_t *)text, (uint32_t)strlen(text));
+}
+
+void uSynergySendClipboardData(uSynergyContext *context,
+	enum uSynergyClipboardFormat format, const uint8_t *data, uint32_t size)
+{
+	uSynergyClipboardItem item;
+
+	item.format	= format;
+	item.data	= data;
+	item.size	= size;
+	uSynergySendClipboardFormats(context, &item, 1);
+}
+
+/*
+ * @brief Size of an item once marshalled, 0 if it cannot be sent
+ */
+static uint32_t sClipboardItemSize(const uSynergyClipboardItem *item)
+{
+	uSynergyBitmapHeader header;
+
+	if ((unsigned)item->format >= USYNERGY_NUM_CLIPBOARD_FORMATS)
+		return 0;
+	if (item->size > UINT32_MAX - 8 - 40)
+		return 0;
+	if (item->format != USYNERGY_CLIPBOARD_FORMAT_BITMAP)
+		return 8 + item->size;
+	if (item->size < sizeof(header))
+		return 0;
+	memcpy(&header, item->data, sizeof(header));
+	if (header.width == 0 || header.height == 0 || (uint64_t)header.width
+		* header.height * 4 != item->size - sizeof(header))
+		return 0;
+	return 8 + uSynergyBmpEncodedSize(header.width, header.height);
+}
+
+void uSynergySendClipboardFormats(uSynergyContext *context,
+	const uSynergyClipboardItem *items, int count)
+{
+	uint64_t	total = 4;
+	uint32_t	num_formats = 0;
+	uSynergyBool echo = USYNERGY_TRUE;
+	/* Per format, compared with the cache once it is locked */
+	uSynergyBool sent[USYNERGY_NUM_CLIPBOARD_FORMATS];
+	uint64_t	sent_hash[USYNERGY_NUM_CLIPBOARD_FORMATS];
+	uint32_t	sent_size[USYNERGY_NUM_CLIPBOARD_FORMATS];
+	uint64_t	hash;
+	struct uSynergyClipboardBlock *block;
+	uint8_t *	local;
+	uint8_t *	cur;
+	int			i;
+
+	for (i = 0; i < count; i++)
+		total += sClipboardItemSize(&items[i]);
+	if (total > context->m_clipboardMaxSize) {
+		sTrace(context, "Clipboard too large, not sent");
+		return;
+	}
+	block = sAllocClipboardBlock((uint32_t)total);
+	if (block == NULL) {
+		sTrace(context, "Out of memory, clipboard not sent");
+		return;
+	}
+	local = block->data;
+
+	/* Number of formats, then format, length, data for each */
+	memset(sent, 0, sizeof(sent));
+	cur = local + 4;
+	for (i = 0; i < count; i++) {
+		const uSynergyClipboardItem *item = &items[i];
+		uint32_t size;
+		uint64_t item_hash;
+
+		if (sClipboardItemSize(item) == 0)
+			continue;
+		cur[0] = 0; cur[1] = 0; cur[2] = 0; cur[3] = (uint8_t)item->format;
+		cur += 8;
+		if (item->format == USYNERGY_CLIPBOARD_FORMAT_BITMAP) {
+			uSynergyBitmapHeader header;
+			memcpy(&header, item->data, sizeof(header));
+			size = uSynergyBmpEncode(item->data + sizeof(header), header.width,
+				header.height, cur);
+			/* Hashed in the form the cache keeps received bitmaps in */
+			item_hash = sHashClipboard(item->data, item->size);
+		} else {
+			size = item->size;
+			memcpy(cur, item->data, size);
+			if (item->format == USYNERGY_CLIPBOARD_FORMAT_TEXT)
+				size = sNormalizeText(context, cur, size);
+			item_hash = sHashClipboard(cur, size);
+		}
+		cur[-4] = (uint8_t)(size >> 24);
+		cur[-3] = (uint8_t)(size >> 16);
+		cur[-2] = (uint8_t)(size >> 8);
+		cur[-1] = (uint8_t)size;
+		cur += size;
+		num_formats++;
+
+		sent[item->format] = USYNERGY_TRUE;
+		sent_hash[item->format] = item_hash;
+		sent_size[item->format] =
+			item->format == USYNERGY_CLIPBOARD_FORMAT_BITMAP ? item->size : size;
+	}
+	local[0] = (uint8_t)(num_formats >> 24);
+	local[1] = (uint8_t)(num_formats >> 16);
+	local[2] = (uint8_t)(num_formats >> 8);
+	local[3] = (uint8_t)num_formats;
+	total = (uint64_t)(cur - local);
+	hash = sHashClipboard(local, (uint32_t)total);
+
+	pthread_mutex_lock(&context->m_clipboardMutex);
+	for (i = 0; i < USYNERGY_NUM_CLIPBOARD_FORMATS; i++) {
+		const uSynergyClipboardEntry *cached = &context->m_clipboardEntries[i];
+		if (cached->present != sent[i] || (sent[i]
+			&& (cached->hash != sent_hash[i] || cached->size != sent_size[i])))
+			echo = USYNERGY_FALSE;
+	}
+	/* Our own copy of the server clipboard coming back, or no change */
+	if (echo || (context->m_clipboardOwned && context->m_clipboardLocal != NULL
+		&& context->m_clipboardLocalHash == hash
+		&& context->m_clipboardLocalSize == total)) {
+		pthread_mutex_unlock(&context->m_clipboardMutex);
+		sReleaseClipboardBlock(block);
+		return;
+	}
+	sReleaseClipboardBlock(context->m_clipboardLocal);
+	context->m_clipboardLocal		= block;
+	context->m_clipboardLocalSize	= (uint32_t)total;
+	context->m_clipboardLocalHash	= hash;
+	context->m_clipboardOwned		= USYNERGY_TRUE;
+	context->m_clipboardDirty		= USYNERGY_TRUE;
+	pthread_mutex_unlock(&context->m_clipboardMutex);
+
+	if (!context->m_connected)
+		return;
+	if (!sSendClipboardGrab(context))
+		sTrace(context, "Grabbing clipboard failed");
+
+	pthread_mutex_lock(&context->m_sendMutex);
+	sFlush(context);
+	pthread_mutex_unlock(&context->m_sendMutex);
+
+	/* The server only asks on leave, an inactive screen sends right away */
+	if (!context->m_isCaptured)
+		sStartClipboardSender(context);
+}
+
+uint32_t uSynergyCopyClipboard(uSynergyContext *context,
+	enum uSynergyClipboardFormat format, uint8_t *buffer, uint32_t maxSize)
+{
+	const uSynergyClipboardEntry *entry;
+	uint32_t size = 0;
+
+	if ((unsigned)format >= USYNERGY_NUM_CLIPBOARD_FORMATS)
+		return 0;
+	pthread_mutex_lock(&context->m_clipboardMutex);
+	entry = &context->m_clipboardEntries[format];
+	if (entry->present) {
+		size = entry->size;
+		if (buffer != NULL && size <= maxSize)
+			memcpy(buffer, entry->block->data + entry->offset, size);
 	}
+	pthread_mutex_unlock(&context->m_clipboardMutex);
+	return size;
+}
 
-	// Assemble packet
-	sAddString(context, "DCLP");
-	/* Clipboard index */
-	sAddUInt8(context, 0);
-	sAddUInt32(context, context->m_sequenceNumber);
-	/* Rest of message size: numFormats, format, length, data */
-	sAddUInt32(context, 4+4+4+text_length);
-	/* Number of formats (only text for now) */
-	sAddUInt32(context, 1);
-	sAddUInt32(context, USYNERGY_CLIPBOARD_FORMAT_TEXT);
-	sAddUInt32(context, text_length);
-	sAddString(context, text);
-	sSendReply(context);
+const uint8_t *uSynergyAcquireClipboard(uSynergyContext *context,
+	enum uSynergyClipboardFormat format, uint32_t *size, void **handle)
+{
+	const uSynergyClipboardEntry *entry;
+	const uint8_t *data = NULL;
+
+	*size = 0;
+	*handle = NULL;
+	if ((unsigned)format >= USYNERGY_NUM_CLIPBOARD_FORMATS)
+		return NULL;
+	pthread_mutex_lock(&context->m_clipboardMutex);
+	entry = &context->m_clipboardEntries[format];
+	if (entry->present) {
+		__sync_add_and_fetch(&entry->block->refs, 1);
+		data	= entry->block->data + entry->offset;
+		*size	= entry->size;
+		*handle	= entry->block;
+	}
+	pthread_mutex_unlock(&context->m_clipboardMutex);
+	return data;
+}
+
+void uSynergyReleaseClipboard(void *handle)
+{
+	sReleaseClipboardBlock(handle);
+}
+
+/*
+ * @brief Claim the context for a run dispatched on the calling thread
+ */
+static uSynergyBool sBeginRun(uSynergyContext *context, uSynergyBool poll)
+{
+	int i;
+
+	pthread_mutex_lock(&context->m_stateMutex);
+	if (context->m_running) {
+		pthread_mutex_unlock(&context->m_stateMutex);
+		return USYNERGY_FALSE;
+	}
+	context->m_running = USYNERGY_TRUE;
+	context->m_stopRequested = USYNERGY_FALSE;
+	context->m_dispatchThread = pthread_self();
+	context->m_pollMode = poll;
+	pthread_mutex_unlock(&context->m_stateMutex);
+
+	/* A new run, the phases now describe it */
+	for (i = 0; i < USYNERGY_NUM_STARTUP_PHASES; i++)
+		__atomic_store_n(&context->m_startup.m_phases[i], 0, __ATOMIC_RELAXED);
+	uSynergyCount(&context->m_startup.m_runs, 1);
+	sStartupPhase(context, USYNERGY_STARTUP_RUN);
+
+	/* Devices come up while the address is resolved and connected */
+	sStartDevices(context);
+
+	if (context->m_transport->m_updateServerAddr != NULL)
+		context->m_transport->m_updateServerAddr(context->m_cookie);
+	sStartupPhase(context, USYNERGY_STARTUP_RESOLVE);
+	return USYNERGY_TRUE;
+}
+
+/*
+ * @brief End the run, releasing uSynergyStop()
+ */
+static void sEndRun(uSynergyContext *context)
+{
+	pthread_mutex_lock(&context->m_stateMutex);
+	context->m_running = USYNERGY_FALSE;
+	context->m_pollMode = USYNERGY_FALSE;
+	pthread_cond_broadcast(&context->m_stateCond);
+	pthread_mutex_unlock(&context->m_stateMutex);
 }
 
 int uSynergyStart(uSynergyContext *context)
 {
-	context->m_updateServerAddr(context->m_cookie);
+	if (!sBeginRun(context, USYNERGY_FALSE))
+		return -1;
+	uSynergyApplyThreadConfig(context, &context->m_dispatchThreadConfig);
 	uSynergyUpdate(context);
+	sEndRun(context);
+	return 0;
 }
 
 void uSynergyStop(uSynergyContext *context)
 {
-	sSetDisconnected(context);
+	pthread_mutex_lock(&context->m_stateMutex);
+	if (!context->m_running) {
+		pthread_mutex_unlock(&context->m_stateMutex);
+		return;
+	}
+	context->m_stopRequested = USYNERGY_TRUE;
+	pthread_mutex_unlock(&context->m_stateMutex);
+
+	sHangUp(context);
+
+	/* From a callback uSynergyStart() can only return once we did */
+	if (pthread_equal(pthread_self(), context->m_dispatchThread))
+		return;
+
+	pthread_mutex_lock(&context->m_stateMutex);
+	while (context->m_running)
+		pthread_cond_wait(&context->m_stateCond, &context->m_stateMutex);
+	pthread_mutex_unlock(&context->m_stateMutex);
+}
+
+uSynergyBool uSynergyIsRunning(uSynergyContext *context)
+{
+	uSynergyBool running;
+
+	pthread_mutex_lock(&context->m_stateMutex);
+	running = context->m_running;
+	pthread_mutex_unlock(&context->m_stateMutex);
+	return running;
+}
+
+void uSynergyGetLatencyStats(uSynergyContext *context,
+	uSynergyLatencyStats *stats)
+{
+	pthread_mutex_lock(&context->m_statsMutex);
+	*stats = context->m_latency->stats;
+	pthread_mutex_unlock(&context->m_statsMutex);
+}
+
+void uSynergyResetLatencyStats(uSynergyContext *context)
+{
+	pthread_mutex_lock(&context->m_statsMutex);
+	memset(&context->m_latency->stats, 0, sizeof(uSynergyLatencyStats));
+	memset(&context->m_rttStats, 0, sizeof(uSynergyRttStats));
+	pthread_mutex_unlock(&context->m_statsMutex);
+}
+
+void uSynergyGetRttStats(uSynergyContext *context, uSynergyRttStats *stats)
+{
+	pthread_mutex_lock(&context->m_statsMutex);
+	*stats = context->m_rttStats;
+	pthread_mutex_unlock(&context->m_statsMutex);
+}
+
+void uSynergyGetCounters(uSynergyContext *context,
+	uSynergyCounters *counters)
+{
+	const uint64_t *from = (const uint64_t *)&context->m_counters;
+	uint64_t *to = (uint64_t *)counters;
+	size_t i;
+
+	for (i = 0; i < sizeof(uSynergyCounters) / sizeof(uint64_t); i++)
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+void uSynergyGetStartupTimes(uSynergyContext *context,
+	uSynergyStartupTimes *times)
+{
+	const uint64_t *from = (const uint64_t *)&context->m_startup;
+	uint64_t *to = (uint64_t *)times;
+	size_t i;
+
+	for (i = 0; i < sizeof(uSynergyStartupTimes) / sizeof(uint64_t); i++)
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+const char *uSynergyStartupPhaseName(int phase)
+{
+	static const char *const names[USYNERGY_NUM_STARTUP_PHASES] = {
+		"run", "resolve", "connect", "devices", "hello", "info", "enter",
+		"first_event",
+	};
+
+	if (phase < 0 || phase >= USYNERGY_NUM_STARTUP_PHASES)
+		return "?";
+	return names[phase];
+}
+
+int uSynergyGetTrace(uSynergyContext *context,
+	uSynergyTraceRecord *records, int max)
+{
+	uint32_t end = __atomic_load_n(&context->m_traceWrite, __ATOMIC_ACQUIRE);
+	uint32_t index = sTraceOldest(context, end);
+	int count = 0;
+
+	if (max <= 0)
+		return 0;
+	if (end - index > (uint32_t)max)
+		index = end - (uint32_t)max;
+	for (; index != end; index++) {
+		if (sTraceRead(context, index, &records[count]))
+			count++;
+	}
+	return count;
+}
+
+int uSynergyFormatTraceRecord(const uSynergyTraceRecord *record,
+	char *buffer, size_t size)
+{
+	const uint8_t *data = record->m_data;
+	uint64_t us = record->m_time / 1000;
+	/* The first fields of the body, most messages are made of 16 bit ones */
+	uint16_t a = (uint16_t)sNetToNative16(data);
+	uint16_t b = (uint16_t)sNetToNative16(data + 2);
+	uint16_t c = (uint16_t)sNetToNative16(data + 4);
+	uint16_t d = (uint16_t)sNetToNative16(data + 6);
+	int result = record->m_result;
+	char code[5];
+	int i, len;
+
+	for (i = 0; i < 4; i++) {
+		code[i] = record->m_code[i] >= ' ' && record->m_code[i] < 127
+			? (char)record->m_code[i] : '?';
+	}
+	code[4] = '\0';
+
+	len = snprintf(buffer, size, "%llu.%06llu ",
+		(unsigned long long)(us / 1000000), (unsigned long long)(us % 1000000));
+	if (len < 0 || (size_t)len >= size)
+		return len;
+	buffer += len;
+	size -= len;
+
+	switch (record->m_event) {
+	case USYNERGY_TRACE_MESSAGE:
+		if (memcmp(code, "DMMV", 4) == 0 || memcmp(code, "DMWM", 4) == 0)
+			return len + snprintf(buffer, size, "%s x=%d y=%d ret=%d", code,
+				(int16_t)a, (int16_t)b, result);
+		if (memcmp(code, "DMDN", 4) == 0 || memcmp(code, "DMUP", 4) == 0)
+			return len + snprintf(buffer, size, "%s button=%d ret=%d", code,
+				data[0], result);
+		if (memcmp(code, "DKDN", 4) == 0 || memcmp(code, "DKUP", 4) == 0)
+			return len + snprintf(buffer, size,
+				"%s id=%#x mods=%#x button=%u", code, a, b, c);
+		if (memcmp(code, "DKRP", 4) == 0)
+			return len + snprintf(buffer, size,
+				"%s id=%#x mods=%#x count=%u button=%u", code, a, b, c, d);
+		if (memcmp(code, "CINN", 4) == 0)
+			return len + snprintf(buffer, size, "%s x=%u y=%u seq=%u", code,
+				a, b, (uint32_t)sNetToNative32(data + 4));
+		if (memcmp(code, "DCLP", 4) == 0)
+			return len + snprintf(buffer, size, "%s mark=%d len=%u", code,
+				data[5], record->m_value);
+		return len + snprintf(buffer, size, "%s len=%u", code,
+			record->m_value);
+	case USYNERGY_TRACE_CONNECT:
+		return len + snprintf(buffer, size, "connect %s", result == 0 ? "ok"
+			: result == -1 ? "failed" : "devices failed");
+	case USYNERGY_TRACE_DISCONNECT:
+		return len + snprintf(buffer, size, "disconnect%s",
+			record->m_value ? " (stop)" : "");
+	case USYNERGY_TRACE_SKIPPED:
+		return len + snprintf(buffer, size, "skipped frame len=%u",
+			record->m_value);
+	case USYNERGY_TRACE_RECEIVE_FAILED:
+		return len + snprintf(buffer, size, "receive failed");
+	case USYNERGY_TRACE_SEND_FAILED:
+		return len + snprintf(buffer, size, "send %s failed len=%u", code,
+			record->m_value);
+	case USYNERGY_TRACE_TIMEOUT:
+		return len + snprintf(buffer, size, "timeout after %u ms",
+			record->m_value);
+	}
+	return len + snprintf(buffer, size, "event %u", record->m_event);
+}
+
+void uSynergyDumpTrace(uSynergyContext *context,
+	void (*func)(uSynergyCookie cookie, const char *line))
+{
+	uint32_t end = __atomic_load_n(&context->m_traceWrite, __ATOMIC_ACQUIRE);
+
+	if (func == NULL)
+		func = context->m_traceDumpFunc;
+	if (func == NULL)
+		func = context->m_traceFunc;
+	if (func != NULL)
+		sDumpTrace(context, sTraceOldest(context, end), end, func);
+}
+
+void uSynergyApplyThreadConfig(uSynergyContext *context,
+	const uSynergyThreadConfig *config)
+{
+	char buffer[96];
+	int nice = config->m_nice;
+
+	if (config->m_name != NULL) {
+		char name[16];
+		strncpy(name, config->m_name, sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+		pthread_setname_np(pthread_self(), name);
+	}
+
+	if (config->m_policy == SCHED_FIFO || config->m_policy == SCHED_RR) {
+		struct sched_param param;
+		int ret;
+
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = config->m_priority;
+		ret = pthread_setschedparam(pthread_self(), config->m_policy, &param);
+		if (ret == 0) {
+			nice = 0;
+		} else {
+			snprintf(buffer, sizeof(buffer),
+				"Real-time priority %d refused (%s), using nice %d",
+				config->m_priority, strerror(ret), nice);
+			sTrace(context, buffer);
+		}
+	}
+
+	/* Linux applies the nice level of a thread id to that thread only */
+	if (nice != 0 && setpriority(PRIO_PROCESS, (id_t)syscall(__NR_gettid),
+		nice) != 0) {
+		snprintf(buffer, sizeof(buffer), "Nice level %d refused (%s)", nice,
+			strerror(errno));
+		sTrace(context, buffer);
+	}
+
+	if (config->m_cpuMask != 0) {
+		cpu_set_t set;
+		int cpu;
+
+		CPU_ZERO(&set);
+		for (cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; cpu++) {
+			if (config->m_cpuMask & ((uint64_t)1 << cpu))
+				CPU_SET(cpu, &set);
+		}
+		if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+			snprintf(buffer, sizeof(buffer), "CPU affinity %#llx refused (%s)",
+				(unsigned long long)config->m_cpuMask, strerror(errno));
+			sTrace(context, buffer);
+		}
+	}
+}
+
+int uSynergyConnect(uSynergyContext *context)
+{
+	const uSynergyTransport *transport = context->m_transport;
+	uSynergyBool opened;
+
+	if (transport->m_pollFdFunc == NULL || transport->m_receiveNowFunc == NULL)
+		return -1;
+	if (!sBeginRun(context, USYNERGY_TRUE))
+		return -1;
+
+	context->m_readOfs = 0;
+	context->m_readLength = 0;
+	opened = sOpenSession(context);
+	if (opened && context->m_connected)
+		return transport->m_pollFdFunc(context->m_cookie);
+
+	if (opened)
+		sCloseSession(context);
+	sEndRun(context);
+	return -1;
+}
+
+int uSynergyGetFd(uSynergyContext *context)
+{
+	if (!context->m_pollMode)
+		return -1;
+	return context->m_transport->m_pollFdFunc(context->m_cookie);
+}
+
+int uSynergyProcess(uSynergyContext *context, int budget)
+{
+	uint32_t idle;
+	int length;
+
+	if (!context->m_pollMode || !context->m_connected)
+		return -1;
+
+	context->m_processBudget = budget > 0 ? budget : INT_MAX;
+	while (context->m_processBudget > 0 && context->m_connected) {
+		if (context->m_readOfs == context->m_readLength) {
+			if (!context->m_transport->m_receiveNowFunc(context->m_cookie,
+				context->m_readBuffer, (int)context->m_sizes.m_readSize,
+				&length)) {
+				sTraceState(context, USYNERGY_TRACE_RECEIVE_FAILED, 0, 0);
+				context->m_connected = USYNERGY_FALSE;
+				break;
+			}
+			if (length == 0)
+				break;
+			context->m_readOfs = 0;
+			context->m_readLength = length;
+			uSynergyCount(&context->m_counters.m_reads, 1);
+			uSynergyCount(&context->m_counters.m_bytesReceived, length);
+			context->m_lastMessageTime = context->m_getTimeFunc();
+		}
+
+		length = sParseStream(context,
+			context->m_readBuffer + context->m_readOfs,
+			context->m_readLength - context->m_readOfs);
+		if (length < 0)
+			break;
+		context->m_readOfs += length;
+	}
+
+	/* Issue the replies and device writes of everything dispatched */
+	if (context->m_connected && !sFlushInput(context))
+		sTrace(context, "Flushing replies failed");
+	if (!context->m_connected)
+		return -1;
+	if (context->m_processBudget == 0)
+		return 0;
+
+	/* The server sends keepalives, silence means it is gone */
+	idle = context->m_getTimeFunc() - context->m_lastMessageTime;
+	if (idle >= USYNERGY_IDLE_TIMEOUT) {
+		sTraceState(context, USYNERGY_TRACE_TIMEOUT, idle, 0);
+		sTrace(context, "Server timed out");
+		context->m_connected = USYNERGY_FALSE;
+		return -1;
+	}
+	return (int)(USYNERGY_IDLE_TIMEOUT - idle);
+}
+
+void uSynergyDisconnect(uSynergyContext *context)
+{
+	if (!context->m_pollMode)
+		return;
+	sCloseSession(context);
+	sEndRun(context);
 }
 
 void uSynergCleanUP(uSynergyContext *context)
 {
-	free((void *)context->m_clientName);
-	free((void *)context->m_cookie);
+	int i;
+
+	/* Devices left up by a run whose connect failed */
+	sReleaseDevices(context);
+	sJoinClipboardSender(context);
+	context->m_transport->m_closeFunc(context->m_cookie);
+	free(context->m_sinkHeap);
+	context->m_sinkHeap = NULL;
+	context->m_sinkBuffer = NULL;
+	context->m_sinkCapacity = 0;
+	sResetClipboardTransfer(context);
+	free(context->m_clipboardArena);
+	context->m_clipboardArena = NULL;
+	for (i = 0; i < USYNERGY_NUM_CLIPBOARD_FORMATS; i++) {
+		if (context->m_clipboardEntries[i].present)
+			sReleaseClipboardBlock(context->m_clipboardEntries[i].block);
+	}
+	memset(context->m_clipboardEntries, 0, sizeof(context->m_clipboardEntries));
+	sReleaseClipboardBlock(context->m_clipboardLocal);
+	context->m_clipboardLocal = NULL;
+	context->m_clipboardOwned = USYNERGY_FALSE;
+	context->m_clipboardDirty = USYNERGY_FALSE;
+	pthread_mutex_destroy(&context->m_clipboardMutex);
+	pthread_mutex_destroy(&context->m_sendMutex);
+	pthread_mutex_destroy(&context->m_stateMutex);
+	pthread_cond_destroy(&context->m_stateCond);
+	pthread_mutex_destroy(&context->m_statsMutex);
+	pthread_mutex_destroy(&context->m_receiveMutex);
+	pthread_cond_destroy(&context->m_receiveCond);
+	sem_destroy(&context->reciveOfsSem);
+
+	/* Cookie and client name go with the arena */
+	uSynergyArenaDestroy(context->m_arena);
+	context->m_arena = NULL;
+	context->m_cookie = NULL;
+	context->m_clientName = NULL;
+}
+
+char *uSynergyStrdup(uSynergyContext *context, const char *str)
+{
+	char *copy;
+
+	/* Moving the mark past a connection's memory would leak it for good */
+	if (uSynergyArenaMark(context->m_arena) != context->m_arenaConnection)
+		return NULL;
+	copy = uSynergyArenaStrdup(context->m_arena, str);
+	/* Keep it out of the per-connection part */
+	if (copy != NULL)
+		context->m_arenaConnection = uSynergyArenaMark(context->m_arena);
+	return copy;
+}
+
+void uSynergyDestroy(uSynergyContext *context)
+{
+	if (context == NULL)
+		return;
+	uSynergCleanUP(context);
+	free(context);
 }
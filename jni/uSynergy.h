@@ -24,13 +24,21 @@
  *  distribution.
  */
 
+#ifndef USYNERGY_H
+#define USYNERGY_H
+
 #include <stdint.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
 
 #include "uinput.h"
+#include "bmp.h"
+#include "arena.h"
+#include "histogram.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -73,6 +81,9 @@ typedef int uSynergyBool;
 #define USYNERGY_FALSE	0	/* False value */
 #define USYNERGY_TRUE	1	/* True value */
 
+/* Room for the server address kept in the cookie, terminator included */
+#define USYNERGY_ADDRESS_SIZE			256
+
 /*
  * @brief User context type
  * The uSynergyCookie type is an opaque type that is used by uSynergy to
@@ -85,15 +96,64 @@ typedef struct {
 	struct sockaddr_in server_addr;
 	char* ipAddr;
 	int port;
+	// ipAddr points here when the address comes from the Java side, the
+	// copy is replaced on every start instead of growing the arena
+	char addr_buffer[USYNERGY_ADDRESS_SIZE];
+
+	// unix domain transport, a leading '@' selects the abstract namespace
+	struct sockaddr_un unix_addr;
+	socklen_t unix_addr_len;
+	char* unix_path;
+
+	// socketpair transport, the server end of the pair is handed to
+	// peer_ready (or kept in peer_sockfd if no handler is installed)
+	int peer_sockfd;
+	void (*peer_ready)(void *arg, int peer_fd);
+	void *peer_arg;
+
+	// memory of the owning context, per-connection allocations such as the
+	// I/O engines come from here
+	struct uSynergyArena *arena;
+
+	// runtime counters of the owning context, the devices count their
+	// writes here
+	struct uSynergyCounters *counters;
+
+	// batched I/O, io_uring is only tried when io_uring is set
+	int io_uring;
+	struct uSynergyIoEngine *rx_io;
+	struct uSynergyIoEngine *tx_io;
+
+	// tls transport, the fingerprint (hex SHA-256 of the server
+	// certificate) is optional
+	const char *tls_fingerprint;
+	struct uSynergyTlsState *tls;
+
+	// session capture, capture_transport does the real work and the
+	// traffic is written to capture_path (see uSynergyCaptureTransport)
+	const char *capture_path;
+	const struct uSynergyTransport *capture_transport;
+	struct uSynergyCaptureState *capture;
+
+	// session replay from a capture file, at the recorded pace if
+	// replay_timing is set, comparing the replies if replay_verify is set
+	const char *replay_path;
+	int replay_timing;
+	int replay_verify;
+	struct uSynergyReplayState *replay;
 
 	// host info
 	char *device_name;
 
-	// Devices info
+	// Devices info, created through injection (NULL for the kernel's
+	// uinput, see suinput.h)
+	const struct suinput_backend *injection;
 	struct input_id device_id;
 	int uinput_keyboard;
 	int uinput_mouse;
 	int uinput_joystick;
+	// buttons down on uinput_mouse, bit 0 left, 1 right, 2 middle
+	int mouse_buttons;
 } CookieType, *uSynergyCookie;
 
 /*
@@ -103,13 +163,59 @@ enum uSynergyClipboardFormat {
 	/* Text format, UTF-8, newline is LF */
 	USYNERGY_CLIPBOARD_FORMAT_TEXT	= 0,
 
-	/* Bitmap format, BMP 24/32bpp, BI_RGB */
+	/* Bitmap format, BMP 24/32bpp, BI_RGB. Received bitmaps are handed out
+	 * decoded, see uSynergyBitmapHeader; bitmaps to send use the same form */
 	USYNERGY_CLIPBOARD_FORMAT_BITMAP= 1,
 
 	/* HTML format, HTML fragment, UTF-8, newline is LF */
 	USYNERGY_CLIPBOARD_FORMAT_HTML	= 2,
 };
 
+/* Number of clipboard formats */
+#define USYNERGY_NUM_CLIPBOARD_FORMATS	3
+
+/*
+ * @brief Layout of decoded clipboard bitmaps
+
+ * The header is followed by width * height RGBA pixels, 4 bytes each, top
+ * row first, which is what Android's Bitmap.copyPixelsFromBuffer() takes
+ * for ARGB_8888.
+ */
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+} uSynergyBitmapHeader;
+
+/*
+ * @brief One clipboard format handed to uSynergySendClipboardFormats()
+ */
+typedef struct {
+	enum uSynergyClipboardFormat format;
+	const uint8_t *data;
+	uint32_t size;
+} uSynergyClipboardItem;
+
+/*
+ * @brief Reference counted clipboard storage, opaque
+ */
+struct uSynergyClipboardBlock;
+
+/*
+ * @brief One format of the cached or incoming server clipboard
+ */
+typedef struct {
+	/* Format is part of the clipboard */
+	uSynergyBool present;
+
+	/* Content hash, compared before anything is copied or called back */
+	uint64_t hash;
+
+	/* Location of the data, the entry holds a reference to the block */
+	struct uSynergyClipboardBlock *block;
+	uint32_t offset;
+	uint32_t size;
+} uSynergyClipboardEntry;
+
 /*
  * @brief Constants and limits
  */
@@ -119,19 +225,46 @@ enum uSynergyClipboardFormat {
 /* Major protocol version */
 #define USYNERGY_PROTOCOL_MAJOR			1
 /* Minor protocol version */
-#define USYNERGY_PROTOCOL_MINOR			4
+#define USYNERGY_PROTOCOL_MINOR			6
 
 /* Timeout in milliseconds before reconnecting */
 #define USYNERGY_IDLE_TIMEOUT			5000
 
 /* Maximum length of traced message */
 #define USYNERGY_TRACE_BUFFER_SIZE		1024
-/* Maximum size of a reply packet */
+/* Default number of events kept by the trace ring */
+#define USYNERGY_TRACE_RECORDS			4096
+/* Default size of the reply buffer, always grown to fit the hello reply */
 #define USYNERGY_REPLY_BUFFER_SIZE		1024
-/* Maximum size of an incoming packet */
+/* Default size of the receive queue, larger packets go through the sink */
 #define USYNERGY_RECEIVE_BUFFER_SIZE	4096
-/* Maximum size of a receive packet*/
+/* Default size of a single socket read */
 #define USYNERGY_NETRECV_BUFFER_SIZE	1024
+/* Smallest accepted size of any of the buffers above */
+#define USYNERGY_MIN_BUFFER_SIZE		64
+/* Cache line size assumed for the context layout */
+#define USYNERGY_CACHE_LINE				64
+/* Default maximum size of an incoming packet, larger ones are skipped */
+#define USYNERGY_MAX_MESSAGE_SIZE		(4*1024*1024)
+/* Default maximum size of a received clipboard, larger ones are dropped.
+ * Also caps decoded bitmaps, 64 MB fits a 4K screenshot. */
+#define USYNERGY_CLIPBOARD_MAX_SIZE		(64*1024*1024)
+/* Size of the data chunks a clipboard is sent in */
+#define USYNERGY_CLIPBOARD_CHUNK_SIZE	(32*1024)
+/* Default room in the arena of a context for per-connection allocations
+ * (I/O engines, sink buffer), on top of the context buffers */
+#define USYNERGY_ARENA_SIZE				(128*1024)
+/* Part of the sink buffer taken from the arena, enough for a clipboard
+ * chunk. Larger packets (unchunked clipboards) go to the heap. */
+#define USYNERGY_SINK_RESERVE			(USYNERGY_CLIPBOARD_CHUNK_SIZE + 256)
+
+/* Protocol version that introduced chunked clipboard transfers */
+#define USYNERGY_CLIPBOARD_CHUNKED_MINOR	6
+
+/* Clipboard chunk marks (protocol 1.6) */
+#define USYNERGY_CLIPBOARD_MARK_START	1	/* Data is the total size */
+#define USYNERGY_CLIPBOARD_MARK_CHUNK	2	/* Data is the next chunk */
+#define USYNERGY_CLIPBOARD_MARK_END		3	/* Transfer complete */
 
 
 /*
@@ -149,20 +282,26 @@ enum uSynergyClipboardFormat {
 #define USYNERGY_MODIFIER_SCROLLOCK		0x4000	/* ScrollLock key modifier */
 
 //-----------------------------------------------------------------------------
-//	Context
+//	Transport
 //-----------------------------------------------------------------------------
 
 /*
- * @brief uSynergy context
+ * @brief Transport backend
+ * A transport carries the raw Synergy byte stream between client and server.
+ * The platform layer provides TCP, Unix domain socket and in-process
+ * socketpair backends (see transport.h), the client picks one by pointing
+ * uSynergyContext::m_transport at it before calling uSynergyStart().
  */
-typedef struct {
-	/* Mandatory configuration data, filled in by client */
+typedef struct uSynergyTransport {
+	/* Backend name, used for selection and tracing */
+	const char *m_name;
+
+	/* Resolve the configured address into the cookie (can be NULL) */
+	void (*m_updateServerAddr)(uSynergyCookie cookie);
 
 	/* Connect function */
 	uSynergyBool (*m_connectFunc)(uSynergyCookie cookie);
 
-	void (*m_updateServerAddr)(uSynergyCookie cookie);
-
 	/* Send data function */
 	uSynergyBool (*m_sendFunc)(uSynergyCookie cookie, const uint8_t *buffer,
 		int length);
@@ -171,11 +310,328 @@ typedef struct {
 	uSynergyBool (*m_receiveFunc)(uSynergyCookie cookie, uint8_t *buffer,
 		int maxLength, int* outLength);
 
+	/* Close the connection and release its resources */
+	void (*m_closeFunc)(uSynergyCookie cookie);
+
+	/* Make a receive blocked in another thread return, without closing
+	 * anything (can be NULL) */
+	void (*m_shutdownFunc)(uSynergyCookie cookie);
+
+	/* Push out data queued by m_sendFunc and the devices (can be NULL) */
+	uSynergyBool (*m_flushFunc)(uSynergyCookie cookie);
+
+	/* Descriptor that turns readable when there is data to receive, for
+	 * running the client in an external event loop (can be NULL) */
+	int (*m_pollFdFunc)(uSynergyCookie cookie);
+
+	/* Receive data without blocking, *outLength is 0 when nothing is
+	 * pending. Needed by uSynergyProcess() (can be NULL) */
+	uSynergyBool (*m_receiveNowFunc)(uSynergyCookie cookie, uint8_t *buffer,
+		int maxLength, int* outLength);
+} uSynergyTransport;
+
+//-----------------------------------------------------------------------------
+//	Latency statistics
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Message classes latency is kept for
+ */
+enum uSynergyLatencyType {
+	USYNERGY_LATENCY_MOUSE_MOVE		= 0,	/* DMMV */
+	USYNERGY_LATENCY_MOUSE_BUTTON	= 1,	/* DMDN, DMUP */
+	USYNERGY_LATENCY_MOUSE_WHEEL	= 2,	/* DMWM */
+	USYNERGY_LATENCY_KEY			= 3,	/* DKDN, DKUP, DKRP */
+	USYNERGY_LATENCY_CLIPBOARD		= 4,	/* DCLP */
+	USYNERGY_LATENCY_KEEPALIVE		= 5,	/* CALV */
+	USYNERGY_LATENCY_OTHER			= 6,	/* Everything else */
+};
+
+/* Number of message classes */
+#define USYNERGY_NUM_LATENCY_TYPES		7
+
+/*
+ * @brief Parts of the time between receipt and injection
+
+ * A message is received when the socket read that completed it returns.
+ * It is injected when the replies and device writes of its burst have been
+ * flushed, at most USYNERGY_LATENCY_BATCH messages after it was dispatched.
+ */
+enum uSynergyLatencyStage {
+	/* Received until dispatch starts */
+	USYNERGY_LATENCY_QUEUE			= 0,
+	/* Dispatch start until injected */
+	USYNERGY_LATENCY_PROCESS		= 1,
+	/* Received until injected */
+	USYNERGY_LATENCY_TOTAL			= 2,
+};
+
+/* Number of latency stages */
+#define USYNERGY_NUM_LATENCY_STAGES		3
+
+/* Most messages dispatched before device writes are flushed */
+#define USYNERGY_LATENCY_BATCH			64
+
+/* Default milliseconds between round trip probes */
+#define USYNERGY_RTT_PROBE_INTERVAL		2000
+/* Milliseconds without input before a probe is sent while entered */
+#define USYNERGY_RTT_IDLE				1000
+/* Milliseconds after which an unanswered probe counts as lost */
+#define USYNERGY_RTT_TIMEOUT			10000
+
+/*
+ * @brief Latency of every message class and stage, in nanoseconds
+ */
+typedef struct {
+	uSynergyHistogram m_histograms[USYNERGY_NUM_LATENCY_TYPES]
+		[USYNERGY_NUM_LATENCY_STAGES];
+} uSynergyLatencyStats;
+
+/*
+ * @brief Round trip times to the server, in nanoseconds
+
+ * The server acknowledges screen info (DINF) with CIAK. A sample is the
+ * time from sending DINF to the read that brought the CIAK in, so it
+ * leaves out the client's own queueing: once in the handshake, then for
+ * probes sent with keepalive replies (see m_rttProbeInterval).
+ */
+typedef struct uSynergyRttStats {
+	/* Samples taken, and probes not answered within USYNERGY_RTT_TIMEOUT */
+	uint64_t m_samples;
+	uint64_t m_lost;
+	/* Latest sample, smoothed round trip time and its mean deviation (the
+	 * jitter), estimated as TCP does (RFC 6298) */
+	uint64_t m_last;
+	uint64_t m_smoothed;
+	uint64_t m_variation;
+	uSynergyHistogram m_histogram;
+} uSynergyRttStats;
+
+//-----------------------------------------------------------------------------
+//	Counters
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Runtime counters of a context, totals since it was created
+
+ * Every counter has a single writer at a time (the receive thread, the
+ * dispatcher, or a sender holding the send mutex), so it is bumped with
+ * relaxed loads and stores that compile to plain moves. Readers on other
+ * threads see each counter whole but not the set as one atomic snapshot.
+ */
+typedef struct uSynergyCounters {
+	/* Messages dispatched, by class (enum uSynergyLatencyType) */
+	uint64_t m_messages[USYNERGY_NUM_LATENCY_TYPES];
+	/* Messages the client does not handle */
+	uint64_t m_unknownMessages;
+	/* Frames skipped as malformed, too short for their type or larger than
+	 * m_maxMessageSize */
+	uint64_t m_skippedMessages;
+
+	/* Transport reads that returned data, and their bytes */
+	uint64_t m_reads;
+	uint64_t m_bytesReceived;
+	/* Messages sent (replies, clipboard chunks), their bytes, and sends or
+	 * flushes that failed */
+	uint64_t m_messagesSent;
+	uint64_t m_bytesSent;
+	uint64_t m_sendErrors;
+
+	/* Sessions connected, and connect attempts that failed */
+	uint64_t m_connects;
+	uint64_t m_connectFailures;
+
+	/* Device writes issued by the injection layer, and those that failed */
+	uint64_t m_deviceWrites;
+	uint64_t m_deviceErrors;
+
+	/* Clipboards received from the server, their bytes, and those dropped
+	 * for exceeding m_clipboardMaxSize */
+	uint64_t m_clipboardsReceived;
+	uint64_t m_clipboardBytesReceived;
+	uint64_t m_clipboardsDropped;
+	/* Clipboards sent to the server and their bytes */
+	uint64_t m_clipboardsSent;
+	uint64_t m_clipboardBytesSent;
+} uSynergyCounters;
+
+/*
+ * @brief Add @a n to a counter, only from the counter's writer
+ */
+static inline void uSynergyCount(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+		__ATOMIC_RELAXED);
+}
+
+//-----------------------------------------------------------------------------
+//	Startup phases
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Steps from uSynergyStart() or uSynergyConnect() to the first
+ * event reaching the devices, in the order a session passes them
+ */
+enum uSynergyStartupPhase {
+	/* uSynergyStart() or uSynergyConnect() called */
+	USYNERGY_STARTUP_RUN			= 0,
+	/* Server address resolved (m_updateServerAddr) */
+	USYNERGY_STARTUP_RESOLVE		= 1,
+	/* Transport connected */
+	USYNERGY_STARTUP_CONNECT		= 2,
+	/* Devices ready (m_connectDevice returned) */
+	USYNERGY_STARTUP_DEVICES		= 3,
+	/* Hello answered */
+	USYNERGY_STARTUP_HELLO			= 4,
+	/* Screen info (DINF) sent */
+	USYNERGY_STARTUP_INFO			= 5,
+	/* Screen entered (first CINN) */
+	USYNERGY_STARTUP_ENTER			= 6,
+	/* First input event flushed to the devices */
+	USYNERGY_STARTUP_FIRST_EVENT	= 7,
+};
+
+/* Number of startup phases */
+#define USYNERGY_NUM_STARTUP_PHASES		8
+
+/*
+ * @brief When a context was set up and its latest run reached each phase
+
+ * CLOCK_MONOTONIC nanoseconds, 0 for a phase not reached (yet). The phases
+ * are cleared when a run starts, so after a reconnect they describe the new
+ * session; time to first event is m_phases[USYNERGY_STARTUP_FIRST_EVENT]
+ * minus m_phases[USYNERGY_STARTUP_RUN], or minus m_created for the first
+ * run after the service started.
+ */
+typedef struct uSynergyStartupTimes {
+	/* uSynergyCreate() called, and the context ready (buffers, key table) */
+	uint64_t m_created;
+	uint64_t m_initialized;
+	/* Runs started so far */
+	uint64_t m_runs;
+	uint64_t m_phases[USYNERGY_NUM_STARTUP_PHASES];
+} uSynergyStartupTimes;
+
+//-----------------------------------------------------------------------------
+//	Trace ring
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Kinds of trace records
+ */
+enum uSynergyTraceEvent {
+	/* Message dispatched: m_code, m_value is its length, m_data the start
+	 * of its body, m_result what the input callback returned */
+	USYNERGY_TRACE_MESSAGE			= 0,
+	/* Session opened: m_result 0, -1 if the transport did not connect;
+	 * -2 if the devices did not come up, after the 0 of the connect as
+	 * they come up alongside */
+	USYNERGY_TRACE_CONNECT			= 1,
+	/* Session closed: m_value 1 if uSynergyStop() asked for it */
+	USYNERGY_TRACE_DISCONNECT		= 2,
+	/* Frame skipped: m_value is the length it claimed */
+	USYNERGY_TRACE_SKIPPED			= 3,
+	/* Receive failed or the server hung up */
+	USYNERGY_TRACE_RECEIVE_FAILED	= 4,
+	/* Sending m_code failed */
+	USYNERGY_TRACE_SEND_FAILED		= 5,
+	/* Server silent for m_value milliseconds */
+	USYNERGY_TRACE_TIMEOUT			= 6,
+};
+
+/*
+ * @brief One event of the trace ring, formatted only when dumped
+ */
+typedef struct {
+	/* CLOCK_MONOTONIC nanoseconds */
+	uint64_t m_time;
+	/* Position in the ring plus one, 0 while the record is written */
+	uint32_t m_sequence;
+	/* enum uSynergyTraceEvent */
+	uint16_t m_event;
+	int16_t m_result;
+	/* Message id */
+	uint8_t m_code[4];
+	uint32_t m_value;
+	/* Key, button, coordinates... as they came off the wire */
+	uint8_t m_data[8];
+} uSynergyTraceRecord;
+
+//-----------------------------------------------------------------------------
+//	Context
+//-----------------------------------------------------------------------------
+
+/*
+ * @brief Buffer sizes of a context
+
+ * Fixed when the context is created, zero selects the default. Small
+ * devices can trade throughput for footprint, large ones can raise the
+ * receive queue so more packets skip the sink.
+ */
+typedef struct {
+	/* Receive queue, also the largest packet that is not sent through the
+	 * sink (USYNERGY_RECEIVE_BUFFER_SIZE) */
+	uint32_t m_receiveSize;
+
+	/* Reply buffer (USYNERGY_REPLY_BUFFER_SIZE) */
+	uint32_t m_replySize;
+
+	/* Single socket read (USYNERGY_NETRECV_BUFFER_SIZE) */
+	uint32_t m_readSize;
+
+	/* Arena room for per-connection allocations (USYNERGY_ARENA_SIZE) */
+	uint32_t m_arenaSize;
+
+	/* Events kept by the trace ring (USYNERGY_TRACE_RECORDS), rounded up
+	 * to a power of two */
+	uint32_t m_traceRecords;
+} uSynergyBufferSizes;
+
+/*
+ * @brief Scheduling of a thread run by a context
+
+ * Applied by the thread itself when it starts. Settings the system refuses
+ * are traced and skipped, a refused real-time policy falls back to
+ * m_nice. uSynergyStart() applies the dispatch settings to the calling
+ * thread, which keeps them; uSynergyConnect() leaves the caller's event
+ * loop thread alone (see uSynergyApplyThreadConfig()).
+ */
+typedef struct {
+	/* Thread name, cut to 15 characters (can be NULL) */
+	const char *m_name;
+
+	/* SCHED_FIFO or SCHED_RR run at m_priority, SCHED_OTHER keeps the
+	 * inherited policy */
+	int m_policy;
+	int m_priority;
+
+	/* Nice level under SCHED_OTHER or when real-time is refused, 0 keeps
+	 * the inherited one */
+	int m_nice;
+
+	/* Bit n allows CPU n, 0 keeps the inherited affinity */
+	uint64_t m_cpuMask;
+} uSynergyThreadConfig;
+
+/*
+ * @brief uSynergy context
+ */
+typedef struct {
+	/* Mandatory configuration data, filled in by client */
+
+	/* Transport used to reach the server */
+	const uSynergyTransport *m_transport;
+
 	/* connetct input device */
 	uSynergyBool (*m_connectDevice)(uSynergyCookie cookie);
 
 	void (*m_disconnectDevice)(uSynergyCookie cookie);
 
+	/* Devices come up on a thread of their own while the transport
+	 * connects. Called on the dispatch thread once they are up, before the
+	 * first input callback, to set up per-thread device state. Optional. */
+	void (*m_attachDevice)(uSynergyCookie cookie);
+
 	/* Thread sleep function */
 	void (*m_sleepFunc)(uSynergyCookie cookie, int timeMs);
 
@@ -195,9 +651,18 @@ typedef struct {
 	/* Cookie pointer passed to callback functions (can be NULL) */
 	uSynergyCookie m_cookie;
 
+	/* Memory of this context, created by uSynergyInit(). Everything after
+	 * m_arenaConnection belongs to the current connection. */
+	uSynergyArena *m_arena;
+	size_t m_arenaConnection;
+
 	/* Function for tracing status (can be NULL) */
 	void (*m_traceFunc)(uSynergyCookie cookie, const char *text);
 
+	/* Receives the trace ring events of a session line by line when it
+	 * ends (can be NULL) */
+	void (*m_traceDumpFunc)(uSynergyCookie cookie, const char *line);
+
 	/* Callback for entering and leaving screen */
 	void (*m_screenActiveCallback)(uSynergyCookie cookie, uSynergyBool active);
 
@@ -230,62 +695,254 @@ typedef struct {
 		enum uSynergyClipboardFormat format, const uint8_t *data,
 		uint32_t size);
 
+	/* Buffer sizes, zero fields are set to the defaults by uSynergyInit() */
+	uSynergyBufferSizes m_sizes;
+
+	/* Scheduling of the receive and dispatch threads, named by
+	 * uSynergyInit() and can be changed before uSynergyStart() */
+	uSynergyThreadConfig m_receiveThreadConfig;
+	uSynergyThreadConfig m_dispatchThreadConfig;
+
 	/* State data, used internall by client, initialized by uSynergyInit() */
-	/* Is our socket connected? */
-	uSynergyBool m_connected;
 
-	/* Have we received a 'Hello' from the server? */
-	uSynergyBool m_hasReceivedHello;
+	/*
+	 * Hot state, touched for nearly every message by the dispatcher and
+	 * the receive thread. Kept together in a cache line of its own, away
+	 * from the configuration above and the bulk buffers.
+	 */
+	struct {
+		/* Is our socket connected? */
+		uSynergyBool m_connected;
 
-	/* Is Synergy active (i.e. this client is receiving input messages?) */
-	uSynergyBool m_isCaptured;
+		/* Is Synergy active (i.e. this client is receiving input messages?) */
+		uSynergyBool m_isCaptured;
 
-	/* Time at which last message was received */
-	uint32_t m_lastMessageTime;
+		/* Time at which last message was received */
+		uint32_t m_lastMessageTime;
 
-	/* Packet sequence number */
-	uint32_t m_sequenceNumber;
+		/* Packet sequence number */
+		uint32_t m_sequenceNumber;
 
-	/* Receive buffer */
-	uint8_t m_receiveBuffer[USYNERGY_RECEIVE_BUFFER_SIZE];
+		/* Receive queue write and read offsets */
+		int	m_receiveOfs;
+		int	m_receiveReadOfs;
 
-	/* Receive buffer offset */
-	int	m_receiveOfs;
+		/* Write offset into reply buffer */
+		uint8_t* m_replyCur;
 
-	pthread_mutex_t m_receiveMutex;
+		uint16_t m_mouseX_old;
+		uint16_t m_mouseY_old;
 
-	/* semaphore of package number in receive Buffer*/
-	sem_t reciveOfsSem;
+		/* Mouse position */
+		uint16_t m_mouseX;
+		uint16_t m_mouseY;
+
+		/* Mouse wheel position */
+		int16_t	m_mouseWheelX;
+		int16_t	m_mouseWheelY;
+
+		/* Mouse buttons */
+		uSynergyBool m_mouseButtonLeft;
+		uSynergyBool m_mouseButtonRight;
+		uSynergyBool m_mouseButtonMiddle;
+
+		/* What the input callback of the current message returned */
+		int m_callbackResult;
+	} __attribute__((aligned(USYNERGY_CACHE_LINE)));
+
+	/* Bulk buffers, one cache line aligned block in the arena laid out in
+	 * this order, sized by m_sizes */
+
+	/* Receive queue, complete packets waiting to be dispatched */
+	uint8_t *m_receiveBuffer;
+
+	/* Staging buffer for packets split across reads */
+	uint8_t *m_frameStage;
 
 	/* Reply buffer */
-	uint8_t	m_replyBuffer[USYNERGY_REPLY_BUFFER_SIZE];
+	uint8_t *m_replyBuffer;
 
-	/* Write offset into reply buffer */
-	uint8_t* m_replyCur;
+	/* Buffer of a single socket read, used by the receive thread */
+	uint8_t *m_readBuffer;
 
-	uint16_t m_mouseX_old;
-	uint16_t m_mouseY_old;
+	/* Connected by uSynergyConnect(), messages are dispatched by
+	 * uSynergyProcess() on the caller's thread */
+	uSynergyBool m_pollMode;
 
-	/* Mouse X position */
-	uint16_t m_mouseX;
+	/* Polled: messages uSynergyProcess() may still dispatch this call */
+	int m_processBudget;
 
-	/* Mouse Y position */
-	uint16_t m_mouseY;
+	/* Polled: part of m_readBuffer that is not parsed yet */
+	int m_readOfs;
+	int m_readLength;
 
-	/* Mouse wheel X position */
-	int16_t	m_mouseWheelX;
+	/* Have we received a 'Hello' from the server? */
+	uSynergyBool m_hasReceivedHello;
+
+	/* Protocol version of the server's hello, 0 before it. Servers before
+	 * 1.6 send and expect the clipboard in a single DCLP message. */
+	uint16_t m_serverMajor;
+	uint16_t m_serverMinor;
 
-	/* Mouse wheel Y position */
-	int16_t	m_mouseWheelY;
+	pthread_mutex_t m_receiveMutex;
 
-	/* Mouse left button */
-	uSynergyBool m_mouseButtonLeft;
+	/* Signalled when queue space or the sink buffer is released */
+	pthread_cond_t m_receiveCond;
 
-	/* Mouse right button */
-	uSynergyBool m_mouseButtonRight;
+	/* semaphore of package number in receive Buffer*/
+	sem_t reciveOfsSem;
 
-	/* Mouse middle button */
-	uSynergyBool m_mouseButtonMiddle;
+	/* Largest accepted packet, set to USYNERGY_MAX_MESSAGE_SIZE by
+	 * uSynergyInit() and can be changed before uSynergyStart() */
+	uint32_t m_maxMessageSize;
+
+	/* Frame parser: length header collected so far */
+	uint8_t m_frameHeader[4];
+	int m_frameHeaderLen;
+
+	/* Frame parser: body size and bytes received of the current packet */
+	uint32_t m_frameLength;
+	uint32_t m_frameOfs;
+
+	/* Frame parser: destination of the current packet, NULL to skip it */
+	uint8_t *m_frameBuffer;
+
+	/* Sink for packets too large for the receive queue (e.g. clipboard),
+	 * taken from the arena unless a packet outgrew it and m_sinkHeap
+	 * holds it */
+	uint8_t *m_sinkBuffer;
+	uint32_t m_sinkCapacity;
+	uint8_t *m_sinkHeap;
+
+	/* Sink holds a packet the dispatcher has not processed yet */
+	uSynergyBool m_sinkBusy;
+
+	/* When the last read returned, CLOCK_MONOTONIC nanoseconds */
+	uint64_t m_readStamp;
+
+	/* Receipt time of every queued packet, a ring that moves in step with
+	 * the receive queue and has room for as many packets as fit in it */
+	uint64_t *m_frameStamps;
+	uint32_t m_frameStampMask;
+	uint32_t m_frameStampWrite;
+	uint32_t m_frameStampRead;
+
+	/* Latency histograms and the packets dispatched since the last flush,
+	 * in the arena. m_statsMutex guards the histograms. */
+	struct uSynergyLatency *m_latency;
+	pthread_mutex_t m_statsMutex;
+
+	/* Runtime counters, a cache line of their own so readers polling them
+	 * do not disturb the hot state */
+	uSynergyCounters m_counters __attribute__((aligned(USYNERGY_CACHE_LINE)));
+
+	/* Startup phase times, written by the dispatch thread */
+	uSynergyStartupTimes m_startup;
+
+	/* Trace ring in the arena. m_traceWrite counts the records ever
+	 * claimed, m_traceDumped those already dumped at a session end. */
+	uSynergyTraceRecord *m_traceRecords;
+	uint32_t m_traceMask;
+	uint32_t m_traceWrite;
+	uint32_t m_traceDumped;
+
+	/* Serializes whole messages on the wire (replies, clipboard chunks) */
+	pthread_mutex_t m_sendMutex;
+
+	/* Guards m_running and m_stopRequested, m_stateCond signals the end of
+	 * uSynergyStart() */
+	pthread_mutex_t m_stateMutex;
+	pthread_cond_t m_stateCond;
+
+	/* uSynergyStart() is running on m_dispatchThread */
+	uSynergyBool m_running;
+	pthread_t m_dispatchThread;
+
+	/* uSynergyStop() was called for the current run */
+	volatile uSynergyBool m_stopRequested;
+
+	/* Devices being brought up by m_deviceThread, started with a run so
+	 * they come up while the transport connects. m_deviceResult is 0 while
+	 * the thread works or if none was started, 1 once the devices are up
+	 * and -1 if they failed. The dispatcher joins the thread and attaches
+	 * the devices (m_devicesAttached) before the first input event. */
+	pthread_t m_deviceThread;
+	uSynergyBool m_deviceThreadJoinable;
+	int m_deviceResult;
+	uSynergyBool m_devicesAttached;
+
+	/* Largest accepted clipboard, set to USYNERGY_CLIPBOARD_MAX_SIZE by
+	 * uSynergyInit() and can be changed before uSynergyStart() */
+	uint32_t m_clipboardMaxSize;
+
+	/* Milliseconds between round trip probes, 0 for none. Probes go out
+	 * with keepalive replies while no input arrives, as the server takes
+	 * the cursor position in them for the client's. Set to
+	 * USYNERGY_RTT_PROBE_INTERVAL by uSynergyInit() and can be changed
+	 * before uSynergyStart(). */
+	uint32_t m_rttProbeInterval;
+
+	/* Dispatch thread only, nanoseconds: the unanswered DINF went out (0
+	 * if none), the last one went out, and input last arrived */
+	uint64_t m_rttSent;
+	uint64_t m_rttLastProbe;
+	uint64_t m_rttLastInput;
+	/* Guarded by m_statsMutex */
+	uSynergyRttStats m_rttStats;
+
+	/* Text formats of the clipboard being received; grows as needed,
+	 * bitmaps never pass through it */
+	struct uSynergyClipboardBlock *m_clipboardArena;
+	uint32_t m_clipboardArenaUsed;
+
+	/* Size announced by the start chunk and bytes received so far */
+	uint32_t m_clipboardExpected;
+	uint32_t m_clipboardReceived;
+
+	/* A clipboard transfer is in progress and being kept */
+	uSynergyBool m_clipboardReceiving;
+
+	/* Position in the marshalled clipboard being received */
+	int m_clipboardStage;
+	uint8_t m_clipboardField[8];
+	uint32_t m_clipboardFieldLen;
+	uint32_t m_clipboardFormatsLeft;
+	uint32_t m_clipboardFormat;
+	uint32_t m_clipboardFormatLeft;
+
+	/* Formats received so far; bitmaps are decoded into their own block
+	 * while the chunks arrive */
+	uSynergyClipboardEntry m_clipboardIncoming[USYNERGY_NUM_CLIPBOARD_FORMATS];
+	uSynergyBmpDecoder m_bmpDecoder;
+	struct uSynergyClipboardBlock *m_clipboardBitmap;
+	uSynergyBool m_clipboardBitmapFailed;
+
+	/* Guards the clipboard cache and the local clipboard below, which are
+	 * shared with threads calling uSynergySendClipboard() and the clipboard
+	 * sender. Never held while a clipboard is sent. */
+	pthread_mutex_t m_clipboardMutex;
+
+	/* Last server clipboard, replaced when content changes. Readers holding
+	 * a reference keep a block alive, see uSynergyAcquireClipboard() */
+	uSynergyClipboardEntry m_clipboardEntries[USYNERGY_NUM_CLIPBOARD_FORMATS];
+
+	/* Local clipboard, marshalled, shipped to the server when it asks. The
+	 * sender holds a reference while the block goes out. */
+	struct uSynergyClipboardBlock *m_clipboardLocal;
+	uint32_t m_clipboardLocalSize;
+	uint64_t m_clipboardLocalHash;
+
+	/* Sends the local clipboard off the dispatch thread; m_clipboardSending
+	 * is set while it runs. Both guarded by m_clipboardMutex. */
+	pthread_t m_clipboardThread;
+	uSynergyBool m_clipboardThreadJoinable;
+	uSynergyBool m_clipboardSending;
+
+	/* We grabbed the clipboard (CCLP) and the server did not take it back */
+	uSynergyBool m_clipboardOwned;
+
+	/* Local clipboard changed since it was last sent */
+	uSynergyBool m_clipboardDirty;
 
 	/* Joystick stick position in 2 axes for 2 sticks */
 	int8_t m_joystickSticks[USYNERGY_NUM_JOYSTICKS][4];
@@ -308,6 +965,52 @@ typedef struct {
  */
 extern void uSynergyInit(uSynergyContext *context, char *ClientName, int width, int height);
 
+/*
+ * @brief Create a uSynergy context
+
+ * Allocates and initializes a context with a cookie of its own. Every
+ * context runs its own connection, devices and receive thread, so several
+ * of them can be started side by side in one process, one uSynergyStart()
+ * caller thread each.
+
+ * Transport and callbacks are copied from @a platform, a context that only
+ * serves as a template and is never initialized or started itself (e.g.
+ * uSynergyAndroidPlatform). They can be changed on the returned context
+ * before uSynergyStart().
+
+ * All buffers of the context are allocated here, in one block, and keep
+ * their size for the life of the context.
+
+ * @param platform		Template providing transport and callbacks
+ * @param clientName	Name of the screen, copied
+ * @param width			Width of screen
+ * @param height		Height of screen
+ * @param sizes			Buffer sizes, NULL for the defaults
+ * @returns New context, NULL when out of memory
+ */
+extern uSynergyContext *uSynergyCreate(const uSynergyContext *platform,
+	const char *clientName, int width, int height,
+	const uSynergyBufferSizes *sizes);
+
+/*
+ * @brief Destroy a context made by uSynergyCreate()
+
+ * Closes the connection and frees the context. uSynergyStart() must have
+ * returned. Clipboard references taken by uSynergyAcquireClipboard() stay
+ * valid until they are released.
+ */
+extern void uSynergyDestroy(uSynergyContext *context);
+
+/*
+ * @brief Copy a configuration string (e.g. the server address for the
+ * cookie) into the memory of @a context
+
+ * The copy lives as long as the context. Only allowed before the first
+ * uSynergyStart(), per-connection memory may not be pinned by it.
+ * @returns Copy, NULL when the arena is full or the context has connected
+ */
+extern char *uSynergyStrdup(uSynergyContext *context, const char *str);
+
 /*
  * @brief Update uSynergy
 
@@ -320,8 +1023,12 @@ extern void uSynergyInit(uSynergyContext *context, char *ClientName, int width,
  * Because uSynergy relies mostly on blocking calls it will mostly stay in
  * thread sleep state waiting for system mutexes and won't eat much memory.
 
- * uSynergyUpdate doesn't do any memory allocations or have any side effects
- * beyond those of the callbacks it calls.
+ * uSynergyUpdate doesn't have any side effects beyond those of the callbacks
+ * it calls. Input, keepalives and replies run without memory allocations, only
+ * clipboards allocate: messages larger than the arena part of the sink buffer
+ * (unchunked clipboards from servers before protocol 1.6) grow it on the
+ * heap, and received clipboard text and bitmaps are collected in heap blocks
+ * that the clipboard cache then keeps.
 
  * @param context	Context to be updated
  */
@@ -330,23 +1037,260 @@ extern void uSynergyUpdate(uSynergyContext *context);
 /*
  * @brief Send clipboard data
 
- * This function sets new clipboard data and sends it to the server. Use this
- * function if your client cuts or copies data onto the clipboard that it needs
- * to share with the server.
+ * This function sets new clipboard data and grabs the clipboard on the server.
+ * Use this function if your client cuts or copies data onto the clipboard that
+ * it needs to share with the server.
+
+ * The data itself is only sent when the server leaves this screen, or right
+ * away when the screen is not active. Text that is unchanged, or that matches
+ * what the server last put on the clipboard, is ignored.
 
- * Currently there is only support for plaintext, but HTML and image data could
- * be supported with some effort.
+ * The data goes out on a sender thread, so neither the caller nor input
+ * dispatch waits for the transfer. Servers speaking protocol 1.6 get it in
+ * chunks, interleaved with replies to input events, older ones in a single
+ * message.
+
+ * This sends plain text only, use uSynergySendClipboardFormats() for HTML and
+ * bitmaps or several formats at once.
 
  * @param context	Context to send clipboard data to
  * @param text		Text to set to the clipboard
  */
 extern void uSynergySendClipboard(uSynergyContext *context, const char *text);
 
+/*
+ * @brief Send a clipboard made of several formats
+
+ * Like uSynergySendClipboard(), with one item per format. Text is
+ * normalized, bitmaps are given as uSynergyBitmapHeader plus RGBA pixels
+ * and encoded to BMP straight into the local clipboard.
+
+ * @param context	Context to send clipboard data to
+ * @param items		Formats to put on the clipboard
+ * @param count		Number of items
+ */
+extern void uSynergySendClipboardFormats(uSynergyContext *context,
+	const uSynergyClipboardItem *items, int count);
+
+/*
+ * @brief Send clipboard data of any format
+
+ * Same as uSynergySendClipboard() for a buffer that need not be NUL
+ * terminated. The data is copied once into the local clipboard, which is
+ * kept until the server asks for it.
+
+ * @param context	Context to send clipboard data to
+ * @param format	Format of @a data
+ * @param data		Clipboard data
+ * @param size		Size of @a data in bytes
+ */
+extern void uSynergySendClipboardData(uSynergyContext *context,
+	enum uSynergyClipboardFormat format, const uint8_t *data, uint32_t size);
+
+/*
+ * @brief Copy a format out of the cached server clipboard
+
+ * m_clipboardCallback only fires for formats whose content changed. Formats
+ * that are not wanted right away stay in the cache and can be fetched later.
+ * Safe to call from any thread.
+
+ * @param context	Context to read the clipboard from
+ * @param format	Format to copy
+ * @param buffer	Destination, may be NULL to query the size
+ * @param maxSize	Size of @a buffer
+ * @returns Size of the format, 0 if it is not present. Nothing is copied if
+ *	this is larger than @a maxSize.
+ */
+extern uint32_t uSynergyCopyClipboard(uSynergyContext *context,
+	enum uSynergyClipboardFormat format, uint8_t *buffer, uint32_t maxSize);
+
+/*
+ * @brief Reference a format of the cached server clipboard without copying
+
+ * The returned data stays valid and unchanged until the handle is passed to
+ * uSynergyReleaseClipboard(), even if a newer clipboard arrives meanwhile or
+ * the context is cleaned up. Safe to call from any thread.
+
+ * @param context	Context to read the clipboard from
+ * @param format	Format to reference
+ * @param size		Receives the size of the data
+ * @param handle	Receives the handle to release
+ * @returns Data or NULL if the format is not present
+ */
+extern const uint8_t *uSynergyAcquireClipboard(uSynergyContext *context,
+	enum uSynergyClipboardFormat format, uint32_t *size, void **handle);
+
+/*
+ * @brief Release a reference taken by uSynergyAcquireClipboard()
+ */
+extern void uSynergyReleaseClipboard(void *handle);
+
+/*
+ * @brief Connect and run a session
+
+ * Connects, brings up the devices and dispatches messages on the calling
+ * thread until the connection ends or uSynergyStop() is called. The devices
+ * come up on another thread while the transport connects, the handshake is
+ * answered right away and input waits in the receive queue until they are
+ * ready. They are released before this returns, unless the connect failed:
+ * then the next call uses them. May be called again afterwards.
+
+ * @returns 0, or -1 if the context is already running
+ */
 extern int uSynergyStart(uSynergyContext *context);
 
+/*
+ * @brief Stop a running session
+
+ * Shuts the socket down and wakes the dispatcher, then waits until
+ * uSynergyStart() has joined the receive thread and released the devices.
+ * Called from a callback it returns right away and uSynergyStart() returns
+ * once the callback is done. Does nothing if the context is not running.
+ */
 extern void uSynergyStop(uSynergyContext *context);
 
+/*
+ * @brief Whether a run started by uSynergyStart() or uSynergyConnect() is
+ * still going on
+
+ * A context that is not running may be destroyed or reconfigured, as long
+ * as no other thread is about to start it.
+ */
+extern uSynergyBool uSynergyIsRunning(uSynergyContext *context);
+
+/*
+ * @brief Connect for use in an external event loop
+
+ * Connects and brings up the devices like uSynergyStart(), but starts no
+ * thread and returns right away. The caller waits for the returned
+ * descriptor to turn readable (epoll, poll, ALooper...) and then calls
+ * uSynergyProcess(). The connect itself blocks; the devices come up
+ * alongside it, and the first input event uSynergyProcess() dispatches
+ * blocks until they are ready. uSynergyStop() works as usual, it returns
+ * once uSynergyDisconnect() was called.
+
+ * @returns Descriptor to poll for input, or -1 if connecting failed, the
+ *	context is already running or the transport cannot be polled
+ */
+extern int uSynergyConnect(uSynergyContext *context);
+
+/*
+ * @brief Descriptor of a context connected with uSynergyConnect()
+
+ * @returns Descriptor to poll for input, -1 if not connected
+ */
+extern int uSynergyGetFd(uSynergyContext *context);
+
+/*
+ * @brief Read and dispatch without blocking
+
+ * Reads what the socket has, dispatches at most @a budget messages and
+ * flushes their replies and device writes. Input that is left over stays
+ * buffered in the context for the next call.
+
+ * @param context	Context connected with uSynergyConnect()
+ * @param budget	Maximum number of messages to dispatch, <= 0 for no limit
+ * @returns Milliseconds until uSynergyProcess() must be called again even
+ *	if the descriptor stays quiet, 0 if the budget ran out and more input is
+ *	waiting, or -1 when the connection is gone and uSynergyDisconnect() is
+ *	due
+ */
+extern int uSynergyProcess(uSynergyContext *context, int budget);
+
+/*
+ * @brief Copy the latency histograms
+
+ * Safe to call from any thread while the context runs. The histograms
+ * cover all sessions since the context was created or last reset.
+ */
+extern void uSynergyGetLatencyStats(uSynergyContext *context,
+	uSynergyLatencyStats *stats);
+
+/*
+ * @brief Clear the latency histograms and round trip times, safe to call
+ * from any thread
+ */
+extern void uSynergyResetLatencyStats(uSynergyContext *context);
+
+/*
+ * @brief Copy the round trip times, safe to call from any thread while the
+ * context runs
+ */
+extern void uSynergyGetRttStats(uSynergyContext *context,
+	uSynergyRttStats *stats);
+
+/*
+ * @brief Copy the runtime counters
+
+ * Safe to call from any thread while the context runs, each counter is read
+ * with a relaxed atomic load.
+ */
+extern void uSynergyGetCounters(uSynergyContext *context,
+	uSynergyCounters *counters);
+
+/*
+ * @brief Copy the startup phase times
+
+ * Safe to call from any thread while the context runs. A run starting
+ * during the copy may leave phases of the previous run in it.
+ */
+extern void uSynergyGetStartupTimes(uSynergyContext *context,
+	uSynergyStartupTimes *times);
+
+/*
+ * @brief Name of a startup phase (enum uSynergyStartupPhase), "?" if unknown
+ */
+extern const char *uSynergyStartupPhaseName(int phase);
+
+/*
+ * @brief Copy the trace ring, oldest record first
+
+ * Safe to call from any thread while the context runs. Records being
+ * written at the time are left out.
+
+ * @returns Number of records copied, at most @a max
+ */
+extern int uSynergyGetTrace(uSynergyContext *context,
+	uSynergyTraceRecord *records, int max);
+
+/*
+ * @brief Format a trace record as one line of text
+
+ * @returns Length of the line, like snprintf()
+ */
+extern int uSynergyFormatTraceRecord(const uSynergyTraceRecord *record,
+	char *buffer, size_t size);
+
+/*
+ * @brief Pass every event in the trace ring to @a func as text
+
+ * Oldest first, from the calling thread. A NULL @a func selects
+ * m_traceDumpFunc, or m_traceFunc if that is not set.
+ */
+extern void uSynergyDumpTrace(uSynergyContext *context,
+	void (*func)(uSynergyCookie cookie, const char *line));
+
+/*
+ * @brief Apply a thread configuration to the calling thread
+
+ * For event loop threads running uSynergyProcess(). Refused settings are
+ * traced through the context and skipped.
+ */
+extern void uSynergyApplyThreadConfig(uSynergyContext *context,
+	const uSynergyThreadConfig *config);
+
+/*
+ * @brief End a session started with uSynergyConnect()
+
+ * Releases the devices and lets uSynergyConnect() or uSynergyStart() be
+ * called again. Remove the descriptor from the event loop first, the socket
+ * is only closed by the next connect or when the context is destroyed.
+ */
+extern void uSynergyDisconnect(uSynergyContext *context);
+
 extern void uSynergCleanUP(uSynergyContext *context);
 #ifdef __cplusplus
 };
 #endif
+
+#endif /* USYNERGY_H */
@@ -24,19 +24,344 @@
  *  distribution.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
 #include "uSynergy.h"
+#include "transport.h"
+#include "android.h"
+#include "stats.h"
+
+/*
+ * @brief Point a context at "host", "unix:path", "replay:path" or
+ * "tls:host"
+ */
+static void sSetAddress(uSynergyContext *context, char *addrStr)
+{
+	if (strncmp(addrStr, "unix:", 5) == 0) {
+		context->m_transport = &uSynergyUnixTransport;
+		context->m_cookie->unix_path = addrStr + 5;
+	} else if (strncmp(addrStr, "replay:", 7) == 0) {
+		context->m_transport = &uSynergyReplayTransport;
+		context->m_cookie->replay_path = addrStr + 7;
+		/* Probes go by the clock, a replay sends only what was recorded */
+		context->m_rttProbeInterval = 0;
+#ifdef USYNERGY_WITH_TLS
+	} else if (strncmp(addrStr, "tls:", 4) == 0) {
+		context->m_transport = &uSynergyTlsTransport;
+		context->m_cookie->ipAddr = addrStr + 4;
+		context->m_cookie->port = 24800;
+#endif
+	} else {
+		context->m_cookie->ipAddr = addrStr;
+		context->m_cookie->port = 24800;
+	}
+}
+
+static void *sRunClient(void *arg)
+{
+	uSynergyStart(arg);
+	return NULL;
+}
+
+/* Messages a client may dispatch before the loop turns to the others */
+#define USYNERGY_LOOP_BUDGET	64
+
+static int64_t sNowMs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * @brief Run every client on the calling thread, driven by epoll
+
+ * A client is processed when its socket turns readable or its deadline
+ * passes, and dropped from the loop when its connection ends.
+ */
+static void sRunEventLoop(uSynergyContext **contexts, int count)
+{
+	struct epoll_event event, events[16];
+	int64_t *due, now;
+	int epfd, live = 0, timeout, ready, ret, i;
+
+	due = calloc(count, sizeof(int64_t));
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (due == NULL || epfd < 0) {
+		perror("event loop");
+		free(due);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		int fd = uSynergyConnect(contexts[i]);
+		due[i] = -1;
+		if (fd < 0)
+			continue;
+		event.events = EPOLLIN;
+		event.data.u32 = i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+			uSynergyDisconnect(contexts[i]);
+			continue;
+		}
+		/* Handshake data may already be waiting */
+		due[i] = 0;
+		live++;
+	}
+
+	while (live > 0) {
+		now = sNowMs();
+		timeout = -1;
+		for (i = 0; i < count; i++) {
+			if (due[i] < 0)
+				continue;
+			if (due[i] <= now) {
+				timeout = 0;
+				break;
+			}
+			if (timeout < 0 || due[i] - now < timeout)
+				timeout = (int)(due[i] - now);
+		}
 
-extern uSynergyContext uSynergyLinuxContext;
+		ready = epoll_wait(epfd, events, 16, timeout);
+		now = sNowMs();
+		for (i = 0; i < ready; i++) {
+			if (due[events[i].data.u32] >= 0)
+				due[events[i].data.u32] = now;
+		}
 
+		for (i = 0; i < count; i++) {
+			if (due[i] < 0 || due[i] > now)
+				continue;
+			ret = uSynergyProcess(contexts[i], USYNERGY_LOOP_BUDGET);
+			if (ret >= 0) {
+				due[i] = now + ret;
+				continue;
+			}
+			epoll_ctl(epfd, EPOLL_CTL_DEL, uSynergyGetFd(contexts[i]), NULL);
+			uSynergyDisconnect(contexts[i]);
+			due[i] = -1;
+			live--;
+		}
+	}
+
+	close(epfd);
+	free(due);
+}
+
+static uSynergyContext **sContexts;
+static int sNumContexts;
+
+static void sPrintTrace(uSynergyCookie cookie, const char *line)
+{
+	fprintf(stderr, "%s\n", line);
+}
+
+/*
+ * @brief Dump the trace rings on SIGUSR1. Stop every client on SIGINT or
+ * SIGTERM, so the devices are released instead of being left behind by a
+ * killed process.
+ */
+static void *sWaitSignal(void *arg)
+{
+	sigset_t *set = arg;
+	int sig, i;
+
+	while (sigwait(set, &sig) == 0) {
+		if (sig != SIGUSR1)
+			break;
+		for (i = 0; i < sNumContexts; i++) {
+			fprintf(stderr, "trace of %s:\n", sContexts[i]->m_clientName);
+			uSynergyDumpTrace(sContexts[i], sPrintTrace);
+		}
+	}
+	for (i = 0; i < sNumContexts; i++)
+		uSynergyStop(sContexts[i]);
+	return NULL;
+}
+
+static void sPrintReplay(uSynergyContext *context)
+{
+	uSynergyReplayStats replay;
+
+	uSynergyReplayGetStats(context->m_cookie, &replay);
+	fprintf(stderr, "%s: replayed %llu bytes, verified %llu, "
+		"%llu mismatches", context->m_clientName,
+		(unsigned long long)replay.m_bytesReplayed,
+		(unsigned long long)replay.m_bytesVerified,
+		(unsigned long long)replay.m_mismatches);
+	if (replay.m_firstMismatch >= 0)
+		fprintf(stderr, ", first at reply byte %lld",
+			(long long)replay.m_firstMismatch);
+	fprintf(stderr, "\n");
+}
+
+/*
+ * Usage: usynergy [-u] [-e] <address>...
+ *	address is "host", "unix:/path/to/socket", "unix:@abstract-name",
+ *	"replay:/path/to/capture" or, with TLS support, "tls:host"
+ *	-u tries to use io_uring for socket and uinput I/O
+ *	-e runs all clients on the main thread in one epoll loop instead of
+ *	two threads per client
+ *	-r prio runs the input threads SCHED_FIFO at prio, nice -10 if refused
+ *	-c mask pins the input threads to the CPUs in the hex mask
+ *	-s path serves the counters and latency of every client as text on a
+ *	Unix socket ("@name" for the abstract namespace)
+ *	-t prints the trace ring events of a session to stderr when it ends,
+ *	SIGUSR1 prints the whole rings at any time
+ *	-w path captures the sessions to path, "path-1", "path-2", ... with
+ *	several clients
+ *	-p replays at the recorded pace instead of as fast as possible
+ *	-v compares the replies of a replay against the recorded ones
+ *	Every address gets a client of its own, named "android" when there is
+ *	just one and "android-1", "android-2", ... otherwise.
+ */
 int main(int argc, char **argv)
 {
-	char* ipStr;
-	ipStr = malloc(strlen(argv[1]) + 1);
+	uSynergyContext **contexts;
+	pthread_t *threads, signalThread;
+	sigset_t signals;
+	char name[32];
+	uSynergyThreadConfig thread;
+	uSynergyStatsServer *stats = NULL;
+	const char *statsPath = NULL;
+	const char *capturePath = NULL;
+	int useRing = 0, useLoop = 0, dumpTrace = 0;
+	int replayTiming = 0, replayVerify = 0;
+	int count, i;
+
+	memset(&thread, 0, sizeof(thread));
+	while (argc > 1 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-u") == 0) {
+			useRing = 1;
+		} else if (strcmp(argv[1], "-e") == 0) {
+			useLoop = 1;
+		} else if (strcmp(argv[1], "-t") == 0) {
+			dumpTrace = 1;
+		} else if (strcmp(argv[1], "-p") == 0) {
+			replayTiming = 1;
+		} else if (strcmp(argv[1], "-v") == 0) {
+			replayVerify = 1;
+		} else if (strcmp(argv[1], "-r") == 0 && argc > 2) {
+			thread.m_policy = SCHED_FIFO;
+			thread.m_priority = atoi(argv[2]);
+			thread.m_nice = -10;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-c") == 0 && argc > 2) {
+			thread.m_cpuMask = strtoull(argv[2], NULL, 16);
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-s") == 0 && argc > 2) {
+			statsPath = argv[2];
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "-w") == 0 && argc > 2) {
+			capturePath = argv[2];
+			argc--;
+			argv++;
+		} else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
+	if (argc < 2) {
+		fprintf(stderr, "usage: usynergy [-u] [-e] [-t] [-p] [-v] [-r prio] "
+			"[-c cpumask] [-s statspath] [-w capturepath] "
+			"<host|unix:path|replay:path|tls:host>...\n");
+		return 1;
+	}
+	count = argc - 1;
+	contexts = calloc(count, sizeof(uSynergyContext *));
+	threads = calloc(count, sizeof(pthread_t));
+	if (contexts == NULL || threads == NULL)
+		return 1;
+
+	for (i = 0; i < count; i++) {
+		if (count == 1)
+			strcpy(name, "android");
+		else
+			snprintf(name, sizeof(name), "android-%d", i + 1);
+		contexts[i] = uSynergyCreate(&uSynergyAndroidPlatform, name, 1024, 600,
+			NULL);
+		if (contexts[i] == NULL)
+			return 1;
+		contexts[i]->m_cookie->io_uring = useRing;
+		if (dumpTrace)
+			contexts[i]->m_traceDumpFunc = sPrintTrace;
+		thread.m_name = contexts[i]->m_receiveThreadConfig.m_name;
+		contexts[i]->m_receiveThreadConfig = thread;
+		thread.m_name = contexts[i]->m_dispatchThreadConfig.m_name;
+		contexts[i]->m_dispatchThreadConfig = thread;
+		sSetAddress(contexts[i], argv[i + 1]);
+		contexts[i]->m_cookie->replay_timing = replayTiming;
+		contexts[i]->m_cookie->replay_verify = replayVerify;
+		if (capturePath != NULL) {
+			size_t size = strlen(capturePath) + 16;
+			char *path = malloc(size);
+
+			if (path == NULL)
+				return 1;
+			if (count == 1)
+				snprintf(path, size, "%s", capturePath);
+			else
+				snprintf(path, size, "%s-%d", capturePath, i + 1);
+			contexts[i]->m_cookie->capture_path = path;
+			contexts[i]->m_cookie->capture_transport = contexts[i]->m_transport;
+			contexts[i]->m_transport = &uSynergyCaptureTransport;
+		}
+	}
 
-	uSynergyInit(&uSynergyLinuxContext, "android", 1024, 600);
+	/* Every thread inherits the mask, only sWaitSignal takes the signals */
+	sContexts = contexts;
+	sNumContexts = count;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	if (pthread_create(&signalThread, NULL, sWaitSignal, &signals) == 0)
+		pthread_detach(signalThread);
+	if (statsPath != NULL) {
+		stats = uSynergyStatsServe(statsPath, contexts, count);
+		if (stats == NULL)
+			fprintf(stderr, "cannot serve statistics on %s\n", statsPath);
+	}
 
-	uSynergyLinuxContext.m_cookie->ipAddr = strcpy(ipStr, argv[1]);
-	uSynergyLinuxContext.m_cookie->port = 24800;
+	if (useLoop) {
+		uSynergyApplyThreadConfig(contexts[0],
+			&contexts[0]->m_dispatchThreadConfig);
+		sRunEventLoop(contexts, count);
+	} else {
+		/* The last client runs on the main thread */
+		for (i = 0; i < count - 1; i++) {
+			if (pthread_create(&threads[i], NULL, sRunClient, contexts[i])) {
+				perror("thread create error");
+				return 1;
+			}
+		}
+		sRunClient(contexts[count - 1]);
+		for (i = 0; i < count - 1; i++)
+			pthread_join(threads[i], NULL);
+	}
 
-	uSynergyStart(&uSynergyLinuxContext);
+	uSynergyStatsStop(stats);
+	for (i = 0; i < count; i++) {
+		if (contexts[i]->m_transport == &uSynergyReplayTransport)
+			sPrintReplay(contexts[i]);
+		free((char *)contexts[i]->m_cookie->capture_path);
+		uSynergyDestroy(contexts[i]);
+	}
+	free(contexts);
+	free(threads);
+	return 0;
 }
@@ -13,6 +13,8 @@ import android.preference.PreferenceManager;
 import android.util.Log;
 import android.widget.Toast;
 
+import java.nio.ByteBuffer;
+
 public class UsynergyService extends Service {
 	private final String tag = "UsynergyService";
 	private SharedPreferences sharePre = null;
@@ -22,6 +24,8 @@ public class UsynergyService extends Service {
 	private int width = 0;
 	private int height = 0;
 	private ServerEntity obj = null;
+	/** Native client context owned by this service, set by init() */
+	private long nativeHandle = 0;
 
 	@Override
 	public void onCreate() {
@@ -52,6 +56,9 @@ public class UsynergyService extends Service {
 		public void run() {
 			Log.i(tag, "run");
 			init(screenName, height, width);
+			/* Keep pointer injection steady while the device is busy,
+			 * falls back to the nice level without real-time rights */
+			setThreadPolicy(SCHED_FIFO, INPUT_RT_PRIORITY, INPUT_NICE, 0);
 			int result = UsynergyService.this.start(obj.ipadd, Integer.parseInt(obj.port));
 			Log.e(tag, "result=" + result);
 			App.getInstance().notifiation();
@@ -79,12 +86,91 @@ public class UsynergyService extends Service {
 
 	public native int shutdown();
 
+	public static final int SCHED_OTHER = 0;
+	public static final int SCHED_FIFO = 1;
+	public static final int SCHED_RR = 2;
+
+	/** Real-time priority of the input threads, low enough not to starve
+	 * audio and display threads */
+	private static final int INPUT_RT_PRIORITY = 2;
+	/** Nice level of the input threads, THREAD_PRIORITY_URGENT_DISPLAY */
+	private static final int INPUT_NICE = -8;
+
+	/**
+	 * Scheduling of the receive and dispatch threads, taken on the next
+	 * start(). Settings the system refuses are skipped, a refused
+	 * real-time policy falls back to the nice level.
+	 *
+	 * @param cpuMask bit n allows CPU n, 0 keeps the inherited affinity
+	 */
+	public native int setThreadPolicy(int policy, int priority, int nice,
+			long cpuMask);
+
 	public native int setClientName(String clientName, int height, int width);
 
 	public native int exit();
 
 	public native String getClipBoardText();
 
+	public static final int CLIPBOARD_FORMAT_TEXT = 0;
+	public static final int CLIPBOARD_FORMAT_BITMAP = 1;
+	public static final int CLIPBOARD_FORMAT_HTML = 2;
+
+	/**
+	 * Read-only direct buffer over the native clipboard, no copy is made.
+	 * Must be passed to releaseClipboard() when done and not used
+	 * afterwards. Bitmaps start with width and height as native order ints,
+	 * followed by the RGBA pixels, top row first.
+	 *
+	 * @return null if the format is not on the clipboard
+	 */
+	public ByteBuffer getClipboard(int format) {
+		/* The memory is the shared clipboard cache, writes would corrupt it */
+		ByteBuffer buffer = nativeGetClipboard(format);
+		return buffer == null ? null : buffer.asReadOnlyBuffer();
+	}
+
+	private native ByteBuffer nativeGetClipboard(int format);
+
+	public native void releaseClipboard(ByteBuffer buffer);
+
+	/**
+	 * @param buffer direct buffer, the first length bytes are sent. Bitmaps
+	 *            use the same layout getClipboard() returns.
+	 */
+	public native int sendClipboard(ByteBuffer buffer, int length, int format);
+
+	public static final int LATENCY_MOUSE_MOVE = 0;
+	public static final int LATENCY_MOUSE_BUTTON = 1;
+	public static final int LATENCY_MOUSE_WHEEL = 2;
+	public static final int LATENCY_KEY = 3;
+	public static final int LATENCY_CLIPBOARD = 4;
+	public static final int LATENCY_KEEPALIVE = 5;
+	public static final int LATENCY_OTHER = 6;
+
+	/** Socket read until dispatch starts */
+	public static final int LATENCY_STAGE_QUEUE = 0;
+	/** Dispatch start until the device writes are flushed */
+	public static final int LATENCY_STAGE_PROCESS = 1;
+	/** Socket read until the device writes are flushed */
+	public static final int LATENCY_STAGE_TOTAL = 2;
+
+	/**
+	 * Latency of a message type since the last resetLatency().
+	 *
+	 * @param percentile 0 to 100, 50 gives the median
+	 * @return nanoseconds, 0 if nothing was recorded, -1 on bad arguments
+	 */
+	public native long getLatency(int type, int stage, double percentile);
+
+	public native void resetLatency();
+
+	/**
+	 * Log the last few thousand input events (keys, buttons, moves and
+	 * connection changes) as kept by the native trace ring.
+	 */
+	public native void dumpTrace();
+
 	public native int getX();
 
 	public native int getY();